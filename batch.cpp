@@ -0,0 +1,148 @@
+#include "batch.h"
+
+// Creates count instances run by the given number of threads, 0 meaning one per host core.
+Chip8Batch::Chip8Batch(int count, int threads) : count(count), slots(new Slot[count]) {
+    if (threads <= 0) {
+        threads = (int)std::thread::hardware_concurrency();
+    }
+    if (threads <= 0) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = count > 0 ? count : 1;
+    }
+
+    ranges.reset(new Range[threads]);
+    for (int i = 0; i < threads; i++) {
+        ranges[i].next = 0;
+        ranges[i].end = 0;
+    }
+
+    // Thread 0 is the caller of run_frames(), only the others get a thread of their own.
+    for (int i = 1; i < threads; i++) {
+        workers.emplace_back(&Chip8Batch::worker_loop, this, i);
+    }
+}
+
+Chip8Batch::~Chip8Batch() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+// Loads the same ROM into every instance, to be run as the given variant.
+bool Chip8Batch::load_rom(const uint8_t *rom, size_t size, Chip8Variant variant) {
+    for (int i = 0; i < count; i++) {
+        if (not slots[i].chip8.load_rom(rom, size, variant)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Loads the ROM of an analysis into every instance with its decoded instructions, see romcache.h.
+bool Chip8Batch::load_rom(const Chip8RomAnalysis &analysis, Chip8Variant variant) {
+    for (int i = 0; i < count; i++) {
+        if (not slots[i].chip8.load_rom(analysis, variant)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs every instance for the given number of frames of ipf instructions each,
+// returns once all of them are done.
+void Chip8Batch::run_frames(int frames, int ipf) {
+    int threads = thread_count();
+
+    // Hand out equal contiguous ranges, the first ones taking the remainder.
+    int begin = 0;
+    for (int i = 0; i < threads; i++) {
+        int length = count / threads + (i < count % threads ? 1 : 0);
+        ranges[i].next.store(begin, std::memory_order_relaxed);
+        ranges[i].end = begin + length;
+        begin += length;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quantum_frames = frames;
+        quantum_ipf = ipf;
+        busy = threads - 1;
+        generation++;
+    }
+    start.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return busy == 0; });
+}
+
+int Chip8Batch::size() {
+    return count;
+}
+
+int Chip8Batch::thread_count() {
+    return (int)workers.size() + 1;
+}
+
+Chip8 &Chip8Batch::instance(int index) {
+    return slots[index].chip8;
+}
+
+void Chip8Batch::set_keypad_value(int index, int key, int val) {
+    slots[index].chip8.set_keypad_value(key, val);
+}
+
+const uint64_t *Chip8Batch::get_display_rows(int index) {
+    return slots[index].chip8.get_display_rows();
+}
+
+// Waits for a quantum to be published, works on it and reports back, until the batch is destroyed.
+void Chip8Batch::worker_loop(int self) {
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+
+        work(self);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy--;
+        }
+        done.notify_one();
+    }
+}
+
+// Runs the instances of the own range, then steals from the other ranges until all are empty.
+void Chip8Batch::work(int self) {
+    int threads = thread_count();
+    int frames = quantum_frames;
+    int ipf = quantum_ipf;
+    for (int r = 0; r < threads; r++) {
+        Range &range = ranges[(self + r) % threads];
+        for (;;) {
+            int index = range.next.fetch_add(1, std::memory_order_relaxed);
+            if (index >= range.end) {
+                break;
+            }
+            Chip8 &chip8 = slots[index].chip8;
+            for (int frame = 0; frame < frames; frame++) {
+                chip8.run_frame(ipf);
+            }
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef CHIP8_BATCH_H
+#define CHIP8_BATCH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "chip8.h"
+
+/**
+ * Runs many independent Chip8 instances in parallel, in frame-sized quanta.
+ * - Instances: Stored contiguously, each one aligned to its own cache lines so threads working on
+ *              neighbouring instances never share a line.
+ * - Threads: A pool sized to the host cores by default. The calling thread takes part in every
+ *            quantum, so a batch with one thread runs without any synchronisation.
+ * - Work stealing: Every thread owns a contiguous range of instances and takes work from its front.
+ *                  Once its range is exhausted it takes work from the other ranges, so threads
+ *                  hitting cheap instances help out the ones hitting expensive instances.
+ * Between calls to run_frames() no thread touches the instances, so input can be injected and
+ * framebuffers read back without locking.
+ */
+class Chip8Batch {
+public:
+    explicit Chip8Batch(int, int = 0);
+    ~Chip8Batch();
+    bool load_rom(const uint8_t *, size_t, Chip8Variant = Chip8Variant::Classic);
+    bool load_rom(const Chip8RomAnalysis &, Chip8Variant);
+    void run_frames(int, int);
+    int size();
+    int thread_count();
+    Chip8 &instance(int);
+    void set_keypad_value(int, int, int);
+    const uint64_t *get_display_rows(int);
+private:
+    struct alignas(64) Slot {
+        Chip8 chip8;
+    };
+
+    // Range of instances owned by one thread. next is advanced by the owner and by thieves alike.
+    struct alignas(64) Range {
+        std::atomic<int> next;
+        int end;
+    };
+
+    int count;
+    std::unique_ptr<Slot[]> slots;
+    std::unique_ptr<Range[]> ranges;
+    std::vector<std::thread> workers;
+
+    // Current quantum, published to the workers under mutex.
+    int quantum_frames = 0;
+    int quantum_ipf = 0;
+    uint64_t generation = 0;
+    int busy = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+
+    void worker_loop(int);
+    void work(int);
+};
+
+#endif //CHIP8_BATCH_H
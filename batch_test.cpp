@@ -0,0 +1,94 @@
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "batch.h"
+#include "chip8.h"
+#include "test_util.h"
+
+/**
+ * Tests of Chip8Batch against the same machines run one after another.
+ * A batch of instances, each with its own random seed and key presses, runs a ROM in quanta of
+ * several frames, with 1, 3 and 8 threads. Alongside, a plain Chip8 per instance runs the same
+ * frames sequentially. After every quantum each instance must be in exactly the state of its
+ * sequential twin, and get_display_rows() must return its display.
+ *
+ * Usage: chip8_batch_test [rom]...
+ * Without a ROM only the embedded program runs. Prints one line per failed check and a summary,
+ * exits with 1 if any check failed.
+ */
+
+static const int INSTANCES = 37;
+
+static void test_batch(const std::string &name, const Rom &rom, int threads) {
+    std::string run = name + " (" + std::to_string(threads) + " threads)";
+    Chip8Batch batch(INSTANCES, threads);
+    std::unique_ptr<Chip8[]> sequential(new Chip8[INSTANCES]);
+    check(batch.size() == INSTANCES && batch.thread_count() == threads, run + ": batch has its instances and threads");
+    check(batch.load_rom(rom.data(), rom.size()), run + ": ROM is loaded");
+    for (int i = 0; i < INSTANCES; i++) {
+        sequential[i].load_rom(rom.data(), rom.size());
+        batch.instance(i).seed_random(100 + i);
+        sequential[i].seed_random(100 + i);
+    }
+
+    std::mt19937 random(threads);
+    for (int quantum = 0; quantum < 40; quantum++) {
+        for (int i = 0; i < INSTANCES; i++) {
+            if (random() % 3 == 0) {
+                int key = random() % 16;
+                int value = random() % 2;
+                batch.set_keypad_value(i, key, value);
+                sequential[i].set_keypad_value(key, value);
+            }
+        }
+        // Quanta of varying length, so threads finish their ranges at different times.
+        int frames = 1 + quantum % 7;
+        int ipf = 5 + quantum % 13;
+        batch.run_frames(frames, ipf);
+        for (int i = 0; i < INSTANCES; i++) {
+            for (int frame = 0; frame < frames; frame++) {
+                sequential[i].run_frame(ipf);
+            }
+        }
+
+        bool same = true;
+        bool same_display = true;
+        for (int i = 0; i < INSTANCES; i++) {
+            same = same && same_state(batch.instance(i), sequential[i]);
+            const uint64_t *rows = batch.get_display_rows(i);
+            same_display = same_display && memcmp(rows, sequential[i].get_display_rows(), sizeof(Chip8State::display)) == 0;
+        }
+        check(same, run + ": instances match their sequential runs after quantum " + std::to_string(quantum));
+        check(same_display, run + ": display rows match after quantum " + std::to_string(quantum));
+        if (not same) {
+            return;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // Draws random glyphs at random places, waits on keys and the delay timer, so instances with
+    // other seeds and keys go their own ways.
+    const Rom embedded = assemble({0xC0FF, 0xC11F, 0xC20F, 0xF229, 0xD015, 0xE29E, 0x1200, 0x6305,
+                                   0xF315, 0xF307, 0x3300, 0x1212, 0x1200});
+    std::vector<std::pair<std::string, Rom>> roms = {{"embedded", embedded}};
+    for (int i = 1; i < argc; i++) {
+        Rom rom;
+        if (not chip8_read_file(argv[i], rom)) {
+            std::cerr << "ROM could not be loaded: " << argv[i] << "\n";
+            return 1;
+        }
+        roms.emplace_back(argv[i], rom);
+    }
+    for (const auto &rom : roms) {
+        for (int threads : {1, 3, 8}) {
+            test_batch(rom.first, rom.second, threads);
+        }
+    }
+
+    return report();
+}
@@ -0,0 +1,53 @@
+#ifndef CHIP8_BEEPER_H
+#define CHIP8_BEEPER_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Square wave beeper switched on and off by the emulation thread and rendered by the audio callback.
+ * - on: Whether the tone should sound, the only state shared between the threads. The emulation
+ *       thread stores it once per frame, the callback loads it once per buffer, neither side ever
+ *       waits or allocates.
+ * - phase, gain: Callback side only. phase advances by step per sample, a full period being 2^32,
+ *                so the pitch does not drift from buffer to buffer. gain moves towards the target
+ *                volume by a small amount per sample, so switching on and off does not click.
+ * A change reaches the speaker with the next buffer the callback renders, so the latency is at most
+ * one buffer plus whatever the driver queues after it.
+ */
+class Beeper {
+public:
+    Beeper(int sample_rate, int frequency = 440, int16_t volume = 3000)
+            : step((uint32_t)(((uint64_t)frequency << 32) / (uint64_t)sample_rate)),
+              volume(volume), ramp((int16_t)(volume / 64 > 0 ? volume / 64 : 1)) {}
+
+    // Emulation side, switches the tone on or off from the next rendered buffer on.
+    void set_on(bool value) {
+        on.store(value, std::memory_order_relaxed);
+    }
+
+    // Audio callback side, renders count mono samples.
+    void render(int16_t *samples, int count) {
+        int16_t target = on.load(std::memory_order_relaxed) ? volume : 0;
+        for (int i = 0; i < count; i++) {
+            if (gain < target) {
+                gain = (int16_t)(gain + ramp < target ? gain + ramp : target);
+            } else if (gain > target) {
+                gain = (int16_t)(gain - ramp > target ? gain - ramp : target);
+            }
+            samples[i] = (int16_t)((phase & 0x80000000u) ? -gain : gain);
+            phase += step;
+        }
+    }
+private:
+    std::atomic<bool> on{false};
+
+    // Callback side
+    uint32_t phase = 0;
+    const uint32_t step;
+    const int16_t volume;
+    const int16_t ramp;
+    int16_t gain = 0;
+};
+
+#endif //CHIP8_BEEPER_H
@@ -0,0 +1,545 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <string>
+#include <vector>
+#include "batch.h"
+#include "capture.h"
+#include "chip8.h"
+#include "file_util.h"
+#include "lockstep.h"
+#include "profiler.h"
+#include "quirks.h"
+#include "recording.h"
+#include "romcache.h"
+
+/**
+ * Headless throughput benchmark for the Chip8 core.
+ * Runs each ROM unthrottled (no SDL, no sleeps, no event polling) and prints one
+ * JSON object per ROM on stdout, so results can be collected by scripts.
+ *
+ * Usage: chip8_bench [--cycles N | --frames N] [--ipf N] [--repeat N] [--engine E] [--quirks Q] [--batch N [--rom-cache D]] [--lockstep] [--profile F] <rom>...
+ *        chip8_bench --replay [--repeat N] [--engine E] <recording>...
+ *        chip8_bench --capture F [--capture-scale N] [--frames N --ipf N | --replay] <rom or recording>
+ * - --cycles: Number of instructions to execute per run.
+ * - --frames: Number of frames to execute per run, each frame being --ipf instructions.
+ * - --ipf:    Instructions per frame, only used together with --frames (default 10). The timers tick
+ *             once per frame.
+ * - --repeat: Number of runs per ROM, the fastest one is reported (default 3).
+ * - --engine: Either interpreter (default) or jit.
+ * - --quirks: Variant to run the ROMs as, classic (default), chip8, schip, xochip, schip-quirks or
+ *             xochip-quirks, see Chip8Variant in chip8.h. Lockstep runs only take the 64x32 ones.
+ * - --batch:  Run N instances of each ROM with Chip8Batch instead, once per thread count from 1 up
+ *             to the number of host cores, and report the aggregate frames/sec of each, and the
+ *             startup time of the batch: loading every instance and running their first frame.
+ * - --rom-cache: With --batch, load ROMs through a Chip8RomCache on directory D, from their cached
+ *                analysis, written there on first use (see romcache.h).
+ * - --lockstep: Run Chip8Lockstep::LANES copies of each ROM in lockstep, and the same number of
+ *               separate Chip8 instances, and report machine-steps/sec of both.
+ * - --profile: After the timed runs, run each ROM once more with profiling and append the JSON report
+ *              to the given file, printing the hot-spot listing on stderr. Needs a CHIP8_PROFILER build.
+ * - --replay: Arguments are input recordings (see recording.h) instead of ROMs. Each one is replayed
+ *             unthrottled and reported together with hashes of the final framebuffer and of the
+ *             framebuffers of all frames, to compare results across builds and engines.
+ * - --capture: Instead of benchmarking, run one ROM for --frames frames or replay one recording
+ *              and write every frame to F, a .y4m file, "-" for a Y4M stream on stdout, or a
+ *              .png pattern such as "pong_%06d.png" (see capture.h). A summary goes to stderr.
+ * - --capture-scale: Output pixels per Chip8 pixel along each axis (default 4).
+ */
+
+struct BenchResult {
+    std::string rom;
+    std::string engine;
+    Chip8Variant variant;
+    long long cycles;
+    double seconds;
+};
+
+static void usage() {
+    std::cerr << "Usage: chip8_bench [--cycles N | --frames N] [--ipf N] [--repeat N] [--engine E] [--quirks Q] [--batch N [--rom-cache D]] [--lockstep] [--profile F] <rom>...\n"
+              << "       chip8_bench --replay [--repeat N] [--engine E] <recording>...\n"
+              << "       chip8_bench --capture F [--capture-scale N] [--frames N --ipf N | --replay] <rom or recording>\n";
+}
+
+// Returns the value following a flag, or exits if it is missing or not a positive number.
+static long long parse_count(int argc, char *argv[], int &i) {
+    if (i + 1 >= argc) {
+        usage();
+        exit(1);
+    }
+    long long n = atoll(argv[++i]);
+    if (n <= 0) {
+        std::cerr << "Expected a positive number after " << argv[i - 1] << "\n";
+        exit(1);
+    }
+    return n;
+}
+
+// Runs a freshly loaded machine for the given amount of cycles, returns elapsed seconds.
+// With frames given, the cycles are run as that many frames of ipf cycles, ticking the timers
+// after each one.
+static double run_once(const std::string &rom, Chip8Variant variant, Chip8Engine engine, long long cycles, long long frames, long long ipf) {
+    Chip8 chip8;
+    if (not chip8.load_rom(rom, variant)) {
+        std::cerr << "ROM could not be loaded: " << rom << "\n";
+        exit(1);
+    }
+    if (not chip8.set_engine(engine)) {
+        std::cerr << "Selected engine is not supported on this platform\n";
+        exit(1);
+    }
+
+    // run() takes an int, so very long runs are split into chunks.
+    auto start = std::chrono::steady_clock::now();
+    for (long long frame = 0; frame < frames; frame++) {
+        chip8.run_frame((int)ipf);
+    }
+    for (long long done = frames * ipf; done < cycles;) {
+        int chunk = (int)std::min<long long>(cycles - done, 1 << 30);
+        chip8.run(chunk);
+        done += chunk;
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// Runs a ROM like run_once() does, with profiling, and writes the reports. Exits if the build
+// has no profiler.
+static void profile_rom(const std::string &rom, Chip8Variant variant, long long cycles, long long frames, long long ipf, std::ostream &json) {
+    Chip8 chip8;
+    if (not chip8.load_rom(rom, variant)) {
+        std::cerr << "ROM could not be loaded: " << rom << "\n";
+        exit(1);
+    }
+    if (not chip8.set_profiling(true)) {
+        std::cerr << "Profiling needs a build with CHIP8_PROFILER enabled\n";
+        exit(1);
+    }
+    for (long long frame = 0; frame < frames; frame++) {
+        chip8.run_frame((int)ipf);
+    }
+    for (long long done = frames * ipf; done < cycles;) {
+        int chunk = (int)std::min<long long>(cycles - done, 1 << 30);
+        chip8.run(chunk);
+        done += chunk;
+    }
+
+    const Chip8Profile *profile = chip8.get_profile();
+    profile->write_json(json, chip8);
+    std::cerr << rom << ":\n";
+    profile->write_hotspots(std::cerr, chip8);
+}
+
+// Quotes a string for JSON, ROM paths only need quotes and backslashes escaped.
+static std::string json_string(const std::string &value) {
+    std::string escaped = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+// Prints a result as a single line of JSON.
+static void print_result(const BenchResult &result) {
+    double ips = result.cycles / result.seconds;
+    double ns = result.seconds * 1e9 / result.cycles;
+
+    std::cout << "{\"rom\": " << json_string(result.rom)
+              << ", \"engine\": \"" << result.engine << "\""
+              << ", \"quirks\": \"" << variant_name(result.variant) << "\""
+              << ", \"cycles\": " << result.cycles
+              << ", \"seconds\": " << result.seconds
+              << ", \"instructions_per_second\": " << ips
+              << ", \"ns_per_instruction\": " << ns
+              << "}" << std::endl;
+}
+
+// Runs `instances` copies of a ROM for `frames` frames with 1, 2, 4, ... threads up to the
+// number of host cores, printing one JSON line per thread count. With a cache, the instances are
+// loaded from the analysis of the ROM.
+static void run_batch(const std::string &path, Chip8Variant variant, int instances, long long frames, long long ipf,
+                      Chip8RomCache *cache) {
+    std::vector<uint8_t> rom;
+    const Chip8RomAnalysis *analysis = nullptr;
+    if (cache != nullptr) {
+        analysis = cache->lookup(path);
+    }
+    if (analysis == nullptr && not chip8_read_file(path, rom)) {
+        std::cerr << "ROM could not be loaded: " << path << "\n";
+        exit(1);
+    }
+
+    int cores = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < cores; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(cores);
+
+    double single_thread_fps = 0.0;
+    for (int threads : thread_counts) {
+        Chip8Batch batch(instances, threads);
+        auto load_start = std::chrono::steady_clock::now();
+        bool loaded = analysis != nullptr ? batch.load_rom(*analysis, variant)
+                                          : batch.load_rom(rom.data(), rom.size(), variant);
+        if (not loaded) {
+            std::cerr << "ROM could not be loaded: " << path << "\n";
+            exit(1);
+        }
+        batch.run_frames(1, (int)ipf);
+
+        auto start = std::chrono::steady_clock::now();
+        for (long long frame = 0; frame < frames; frame++) {
+            batch.run_frames(1, (int)ipf);
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        double fps = instances * frames / seconds;
+        if (threads == 1) {
+            single_thread_fps = fps;
+        }
+        std::cout << "{\"rom\": " << json_string(path)
+                  << ", \"instances\": " << instances
+                  << ", \"threads\": " << batch.thread_count()
+                  << ", \"frames\": " << frames
+                  << ", \"seconds\": " << seconds
+                  << ", \"frames_per_second\": " << fps
+                  << ", \"speedup\": " << fps / single_thread_fps
+                  << ", \"startup_us\": " << std::chrono::duration<double, std::micro>(start - load_start).count()
+                  << "}" << std::endl;
+    }
+}
+
+// Runs LANES copies of a ROM for the given number of frames, once in lockstep and once as
+// separate machines, printing one JSON line with the machine-steps/sec of both.
+static void run_lockstep(const std::string &path, Chip8Variant variant, long long frames, long long ipf) {
+    std::vector<uint8_t> rom;
+    if (not chip8_read_file(path, rom)) {
+        std::cerr << "ROM could not be loaded: " << path << "\n";
+        exit(1);
+    }
+    const int lanes = Chip8Lockstep::LANES;
+
+    std::unique_ptr<Chip8Lockstep> lockstep(new Chip8Lockstep());
+    if (is_extended_variant(variant)) {
+        std::cerr << "Lockstep only runs the 64x32 CHIP-8 variants, not " << variant_name(variant) << "\n";
+        exit(1);
+    }
+    if (not lockstep->load_rom(rom.data(), rom.size(), variant)) {
+        std::cerr << "ROM could not be loaded: " << path << "\n";
+        exit(1);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (long long frame = 0; frame < frames; frame++) {
+        lockstep->run_frame((int)ipf);
+    }
+    auto end = std::chrono::steady_clock::now();
+    double lockstep_seconds = std::chrono::duration<double>(end - start).count();
+
+    std::unique_ptr<Chip8[]> machines(new Chip8[lanes]);
+    for (int lane = 0; lane < lanes; lane++) {
+        machines[lane].load_rom(rom.data(), rom.size(), variant);
+    }
+    start = std::chrono::steady_clock::now();
+    for (int lane = 0; lane < lanes; lane++) {
+        for (long long frame = 0; frame < frames; frame++) {
+            machines[lane].run_frame((int)ipf);
+        }
+    }
+    end = std::chrono::steady_clock::now();
+    double scalar_seconds = std::chrono::duration<double>(end - start).count();
+
+    double steps = (double)lanes * frames * ipf;
+    std::cout << "{\"rom\": " << json_string(path)
+              << ", \"lanes\": " << lanes
+              << ", \"frames\": " << frames
+              << ", \"ipf\": " << ipf
+              << ", \"lockstep_steps_per_second\": " << steps / lockstep_seconds
+              << ", \"scalar_steps_per_second\": " << steps / scalar_seconds
+              << ", \"speedup\": " << scalar_seconds / lockstep_seconds
+              << ", \"vector_fraction\": " << (double)lockstep->get_vector_steps() / steps
+              << "}" << std::endl;
+}
+
+// Runs a ROM or replays a recording once, unthrottled, writing every frame to path. The capture
+// waits for the writer rather than dropping frames, a headless run has no deadline to keep. It is
+// opened on the first frame, once the variant and with it the size of the display is known, and
+// gets the pixels set on either plane.
+static void run_capture(const std::string &input, bool replay, Chip8Variant variant, Chip8Engine engine,
+                        long long frames, long long ipf, const std::string &path, int scale) {
+    Chip8Capture capture;
+    bool opened = false;
+    uint64_t rows[128];
+    auto push = [&](Chip8 &frame) {
+        if (not opened) {
+            if (not capture.open(path, scale, false, frame.get_display_width(), frame.get_display_height())) {
+                std::cerr << "Capture could not be opened: " << path << "\n";
+                exit(1);
+            }
+            opened = true;
+        }
+        frame.copy_display_rows(rows);
+        capture.push(rows);
+    };
+    Chip8 chip8;
+    if (not chip8.set_engine(engine)) {
+        std::cerr << "Selected engine is not supported on this platform\n";
+        exit(1);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (replay) {
+        Chip8Recording recording;
+        if (not recording.load(input) || not recording.replay(chip8, push)) {
+            std::cerr << "Recording could not be replayed: " << input << "\n";
+            exit(1);
+        }
+    } else {
+        if (not chip8.load_rom(input, variant)) {
+            std::cerr << "ROM could not be loaded: " << input << "\n";
+            exit(1);
+        }
+        for (long long frame = 0; frame < frames; frame++) {
+            chip8.run_frame((int)ipf);
+            push(chip8);
+        }
+    }
+    if (not capture.close()) {
+        std::cerr << "Capture could not be written: " << path << "\n";
+        exit(1);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::cerr << "{\"capture\": " << json_string(path)
+              << ", \"input\": " << json_string(input)
+              << ", \"frames\": " << capture.get_frame_count()
+              << ", \"unique_frames\": " << capture.get_unique_frame_count()
+              << ", \"seconds\": " << std::chrono::duration<double>(end - start).count()
+              << "}" << std::endl;
+}
+
+// Formats a hash as a JSON string of 16 hex digits.
+static std::string json_hex(uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex = "\"";
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        hex += digits[(value >> shift) & 0xF];
+    }
+    return hex + "\"";
+}
+
+// FNV-1a over the display rows, of every plane on the extended machines. The hashes of the
+// 64x32 machines are the ones they always had.
+static uint64_t hash_display(Chip8 &chip8, uint64_t hash = 0xCBF29CE484222325ULL) {
+    int words = chip8.get_display_width() / 64 * chip8.get_display_height();
+    for (int plane = 0; plane < 2; plane++) {
+        const uint64_t *rows = chip8.get_display_plane(plane);
+        for (int i = 0; rows != nullptr && i < words; i++) {
+            for (int b = 0; b < 8; b++) {
+                hash ^= (rows[i] >> (8 * b)) & 0xFF;
+                hash *= 0x100000001B3ULL;
+            }
+        }
+    }
+    return hash;
+}
+
+// Replays a recording repeat times, printing one JSON line with the fastest run and the hashes.
+// Exits if the runs disagree, as replays must be deterministic.
+static void run_replay(const std::string &path, Chip8Engine engine, const std::string &engine_name, long long repeat) {
+    Chip8Recording recording;
+    if (not recording.load(path)) {
+        std::cerr << "Recording could not be loaded: " << path << "\n";
+        exit(1);
+    }
+
+    double best = 0.0;
+    uint64_t framebuffer_hash = 0;
+    uint64_t frames_hash = 0;
+    long long frames = 0;
+    for (long long r = 0; r < repeat; ++r) {
+        Chip8 chip8;
+        if (not chip8.set_engine(engine)) {
+            std::cerr << "Selected engine is not supported on this platform\n";
+            exit(1);
+        }
+        uint64_t chain = 0xCBF29CE484222325ULL;
+        long long count = 0;
+        auto start = std::chrono::steady_clock::now();
+        bool ok = recording.replay(chip8, [&chain, &count](Chip8 &frame) {
+            chain = hash_display(frame, chain);
+            count++;
+        });
+        auto end = std::chrono::steady_clock::now();
+        if (not ok) {
+            std::cerr << "Recording could not be replayed: " << path << "\n";
+            exit(1);
+        }
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        uint64_t final_hash = hash_display(chip8);
+        if (r > 0 && (final_hash != framebuffer_hash || chain != frames_hash)) {
+            std::cerr << "Replays of " << path << " diverged\n";
+            exit(1);
+        }
+        if (r == 0 || seconds < best) {
+            best = seconds;
+        }
+        framebuffer_hash = final_hash;
+        frames_hash = chain;
+        frames = count;
+    }
+
+    long long cycles = (long long)recording.get_cycle_count();
+    std::cout << "{\"recording\": " << json_string(path)
+              << ", \"engine\": \"" << engine_name << "\""
+              << ", \"cycles\": " << cycles
+              << ", \"frames\": " << frames
+              << ", \"seconds\": " << best
+              << ", \"instructions_per_second\": " << cycles / best
+              << ", \"framebuffer_hash\": " << json_hex(framebuffer_hash)
+              << ", \"frames_hash\": " << json_hex(frames_hash)
+              << "}" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    long long cycles = 10000000;
+    long long frames = 0;
+    long long ipf = 10;
+    long long repeat = 3;
+    std::string engine_name = "interpreter";
+    std::string quirks;
+    long long batch = 0;
+    bool lockstep = false;
+    bool replay = false;
+    std::string profile_path;
+    std::string capture_path;
+    std::string rom_cache_path;
+    long long capture_scale = 4;
+    std::vector<std::string> roms;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--cycles") == 0) {
+            cycles = parse_count(argc, argv, i);
+        } else if (strcmp(argv[i], "--frames") == 0) {
+            frames = parse_count(argc, argv, i);
+        } else if (strcmp(argv[i], "--ipf") == 0) {
+            ipf = parse_count(argc, argv, i);
+        } else if (strcmp(argv[i], "--repeat") == 0) {
+            repeat = parse_count(argc, argv, i);
+        } else if (strcmp(argv[i], "--lockstep") == 0) {
+            lockstep = true;
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            replay = true;
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--capture-scale") == 0) {
+            capture_scale = parse_count(argc, argv, i);
+        } else if (strcmp(argv[i], "--rom-cache") == 0 && i + 1 < argc) {
+            rom_cache_path = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = parse_count(argc, argv, i);
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            engine_name = argv[++i];
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = argv[++i];
+        } else if (strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage();
+            return 0;
+        } else {
+            roms.push_back(argv[i]);
+        }
+    }
+
+    if (roms.empty()) {
+        usage();
+        return 1;
+    }
+    if (frames > 0) {
+        cycles = frames * ipf;
+    }
+
+    Chip8Variant variant = Chip8Variant::Classic;
+    if (not quirks.empty() && not parse_variant(quirks, variant)) {
+        std::cerr << "Unknown quirk profile: " << quirks << "\n";
+        return 1;
+    }
+
+    if (lockstep) {
+        for (const std::string &rom : roms) {
+            run_lockstep(rom, variant, cycles / ipf, ipf);
+        }
+        return 0;
+    }
+    if (batch > 0) {
+        std::unique_ptr<Chip8RomCache> cache;
+        if (not rom_cache_path.empty()) {
+            cache.reset(new Chip8RomCache(rom_cache_path));
+        }
+        for (const std::string &rom : roms) {
+            run_batch(rom, variant, (int)batch, cycles / ipf, ipf, cache.get());
+        }
+        return 0;
+    }
+
+    Chip8Engine engine;
+    if (engine_name == "interpreter") {
+        engine = Chip8Engine::Interpreter;
+    } else if (engine_name == "jit") {
+        engine = Chip8Engine::Jit;
+    } else {
+        std::cerr << "Unknown engine: " << engine_name << "\n";
+        return 1;
+    }
+
+    if (not capture_path.empty()) {
+        if (roms.size() != 1 || (not replay && frames == 0) || capture_scale > 16) {
+            std::cerr << "--capture takes one ROM with --frames, or one recording with --replay, and a scale up to 16\n";
+            return 1;
+        }
+        run_capture(roms[0], replay, variant, engine, frames, ipf, capture_path, (int)capture_scale);
+        return 0;
+    }
+
+    if (replay) {
+        for (const std::string &path : roms) {
+            run_replay(path, engine, engine_name, repeat);
+        }
+        return 0;
+    }
+
+    for (const std::string &rom : roms) {
+        BenchResult best = {rom, engine_name, variant, cycles, 0.0};
+        for (long long r = 0; r < repeat; ++r) {
+            double seconds = run_once(rom, best.variant, engine, cycles, frames, ipf);
+            if (r == 0 || seconds < best.seconds) {
+                best.seconds = seconds;
+            }
+        }
+        print_result(best);
+    }
+
+    if (not profile_path.empty()) {
+        std::ofstream json(profile_path, std::ios::out | std::ios::app);
+        if (!json.is_open()) {
+            std::cerr << "Profile could not be written to " << profile_path << "\n";
+            return 1;
+        }
+        for (const std::string &rom : roms) {
+            profile_rom(rom, variant, cycles, frames, ipf, json);
+        }
+    }
+
+    return 0;
+}
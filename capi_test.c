@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include "libchip8.h"
+
+/**
+ * Test of the C API in libchip8.h, built as C and linked against the shared library.
+ * Runs a ROM (the given one, PONG under ctest) on both engines through the API with the same
+ * key presses and checks that the framebuffer is drawn, the frame counter moves, the keypad mask
+ * reads back, faults are reported and both engines end on the same picture. A SUPER-CHIP program
+ * gets the 128x64 display, which it draws on in hi-res.
+ *
+ * Usage: chip8_capi_test <rom>
+ * Prints the failed checks and exits with 1 if there were any.
+ */
+
+static int failures = 0;
+
+static void check(int condition, const char *what) {
+    if (!condition) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// Runs 600 frames, pressing key 1 for a second at the start. Returns the machine, NULL if the
+// engine is not supported.
+static chip8_machine *run_rom(const uint8_t *rom, size_t size, int engine) {
+    chip8_machine *machine = chip8_create();
+    check(machine != NULL, "chip8_create");
+    if (!chip8_set_engine(machine, engine)) {
+        chip8_destroy(machine);
+        return NULL;
+    }
+    check(chip8_load_rom(machine, rom, size, CHIP8_VARIANT_CHIP8), "chip8_load_rom");
+    chip8_seed(machine, 42);
+
+    const uint64_t *framebuffer = chip8_framebuffer(machine);
+    uint64_t counter = chip8_frame_counter(machine);
+    int moved = 0;
+    for (int frame = 0; frame < 600; frame++) {
+        chip8_set_keypad(machine, frame < 60 ? 0x0002 : 0x0000);
+        chip8_run_frame(machine, 10);
+        moved += chip8_frame_counter(machine) != counter;
+        counter = chip8_frame_counter(machine);
+    }
+    check(chip8_framebuffer(machine) == framebuffer, "framebuffer pointer stays the same");
+    check(moved > 0, "frame counter advances");
+    check(chip8_cycle_count(machine) == 6000, "cycle count");
+
+    int lit = 0;
+    for (int y = 0; y < 32; y++) {
+        for (uint64_t row = framebuffer[y]; row != 0; row &= row - 1) {
+            lit++;
+        }
+    }
+    check(lit > 0, "framebuffer has pixels set");
+    return machine;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: chip8_capi_test <rom>\n");
+        return 1;
+    }
+    uint8_t rom[4096];
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ROM could not be loaded: %s\n", argv[1]);
+        return 1;
+    }
+    size_t size = fread(rom, 1, sizeof(rom), f);
+    fclose(f);
+
+    check(chip8_api_version() == CHIP8_API_VERSION, "chip8_api_version");
+    chip8_machine *machine = chip8_create();
+    check(!chip8_load_rom(machine, rom, size, 7), "unknown variant is rejected");
+    check(!chip8_set_engine(machine, 7), "unknown engine is rejected");
+    chip8_set_keypad(machine, 0xA005);
+    check(chip8_get_keypad(machine) == 0xA005, "keypad mask reads back");
+    static const uint8_t too_large[4096 - 0x200 + 1] = {0};
+    check(!chip8_load_rom(machine, too_large, sizeof(too_large), CHIP8_VARIANT_CHIP8) &&
+          chip8_fault(machine) == CHIP8_FAULT_ROM_TOO_LARGE, "oversized ROM is rejected with a fault");
+    static const uint8_t bare_return[] = {0x00, 0xEE};
+    check(chip8_load_rom(machine, bare_return, sizeof(bare_return), CHIP8_VARIANT_CHIP8) &&
+          chip8_fault(machine) == CHIP8_FAULT_NONE, "loading a ROM clears the fault");
+    chip8_run(machine, 100);
+    check(chip8_fault(machine) == CHIP8_FAULT_STACK_UNDERFLOW && chip8_cycle_count(machine) == 100,
+          "return on an empty stack faults");
+    check(chip8_display_width(machine) == 64 && chip8_display_height(machine) == 32 &&
+          chip8_framebuffer_plane(machine, 1) == NULL, "64x32 display of one plane");
+
+    // Hi-res, then the big 0 at (120, 60), its bottom right corner landing on the last pixel.
+    static const uint8_t superchip[] = {0x00, 0xFF, 0x60, 0x78, 0x61, 0x36, 0x62, 0x00, 0xF2, 0x30,
+                                        0xD0, 0x1A, 0x00, 0xFD};
+    uint64_t counter = chip8_frame_counter(machine);
+    check(chip8_load_rom(machine, superchip, sizeof(superchip), CHIP8_VARIANT_SCHIP), "SUPER-CHIP ROM loads");
+    chip8_run(machine, 100);
+    const uint64_t *framebuffer = chip8_framebuffer(machine);
+    check(chip8_display_width(machine) == 128 && chip8_display_height(machine) == 64, "128x64 display");
+    check(framebuffer == chip8_framebuffer_plane(machine, 0) && (framebuffer[2 * 63 + 1] & 1) == 1 &&
+          (framebuffer[2 * 54 + 1] >> 7 & 1) == 1, "hi-res sprite is drawn");
+    check(chip8_frame_counter(machine) == counter + 1 && chip8_fault(machine) == CHIP8_FAULT_EXITED,
+          "SUPER-CHIP program draws one frame and exits");
+    chip8_destroy(machine);
+
+    chip8_machine *interpreter = run_rom(rom, size, CHIP8_ENGINE_INTERPRETER);
+    chip8_machine *jit = run_rom(rom, size, CHIP8_ENGINE_JIT);
+    if (jit != NULL) {
+        check(memcmp(chip8_framebuffer(interpreter), chip8_framebuffer(jit), 32 * sizeof(uint64_t)) == 0,
+              "engines end on the same picture");
+        check(chip8_frame_counter(interpreter) == chip8_frame_counter(jit), "engines count the same frames");
+        chip8_destroy(jit);
+    } else {
+        printf("JIT not supported, testing the interpreter only\n");
+    }
+    chip8_destroy(interpreter);
+
+    printf("%d failed checks\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include "capture.h"
+
+// Returns whether a PNG path is a safe printf pattern for the frame number: exactly one int
+// conversion (%d or %i, with optional flags, width and precision) and no % other than %%.
+static bool is_frame_pattern(const std::string &path) {
+    int conversions = 0;
+    for (size_t i = 0; i < path.size(); i++) {
+        if (path[i] != '%') {
+            continue;
+        }
+        i++;
+        if (i < path.size() && path[i] == '%') {
+            continue;
+        }
+        while (i < path.size() && strchr("-+ #0", path[i]) != nullptr) {
+            i++;
+        }
+        while (i < path.size() && isdigit((unsigned char)path[i])) {
+            i++;
+        }
+        if (i < path.size() && path[i] == '.') {
+            i++;
+            while (i < path.size() && isdigit((unsigned char)path[i])) {
+                i++;
+            }
+        }
+        if (i >= path.size() || (path[i] != 'd' && path[i] != 'i')) {
+            return false;
+        }
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+Chip8Capture::~Chip8Capture() {
+    close();
+}
+
+// Opens the output and starts the writer thread. scale is the size of a Chip8 pixel in output
+// pixels, drop_when_full picks what push() does when the writer falls behind, see capture.h.
+// columns and lines are the size of the display, 64x32 or 128x64.
+// Returns false if the path has no known extension, is not a valid PNG pattern or cannot be written.
+bool Chip8Capture::open(const std::string &path, int scale, bool drop_when_full, int columns, int lines) {
+    close();
+    if (scale < 1 || scale > 16 || (columns != 64 && columns != 128) || lines < 1 || lines > 64) {
+        return false;
+    }
+    auto ends_with = [&path](const char *suffix) {
+        size_t length = strlen(suffix);
+        return path.size() >= length && path.compare(path.size() - length, length, suffix) == 0;
+    };
+    if (path == "-" || ends_with(".y4m")) {
+        format = Format::Y4m;
+        out = path == "-" ? stdout : fopen(path.c_str(), "wb");
+        if (out == nullptr) {
+            return false;
+        }
+        // 4:2:0 with full-range luma. The chroma planes are constant grey.
+        fprintf(out, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n", columns * scale, lines * scale);
+    } else if (ends_with(".png") && is_frame_pattern(path)) {
+        format = Format::Png;
+    } else {
+        return false;
+    }
+
+    this->path = path;
+    this->scale = scale;
+    this->words = columns / 64;
+    this->lines = lines;
+    this->drop_when_full = drop_when_full;
+    has_pending = false;
+    frames = 0;
+    unique_frames = 0;
+    dropped_frames = 0;
+    closing.store(false, std::memory_order_relaxed);
+    failed.store(false, std::memory_order_relaxed);
+    writer = std::thread(&Chip8Capture::write_frames, this);
+    return true;
+}
+
+// Adds the current display rows as the next frame.
+void Chip8Capture::push(const uint64_t *rows) {
+    if (not writer.joinable()) {
+        return;
+    }
+    size_t count = (size_t)words * lines;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ rows[i]) * 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+    frames++;
+    if (has_pending && hash == pending_hash && memcmp(rows, pending.rows, count * sizeof(uint64_t)) == 0) {
+        pending.repeats++;
+        return;
+    }
+
+    if (has_pending) {
+        if (drop_when_full && not queue.push(pending)) {
+            // Keep showing the previous picture for this frame.
+            pending.repeats++;
+            dropped_frames++;
+            return;
+        }
+        if (not drop_when_full) {
+            submit();
+        }
+    }
+    memcpy(pending.rows, rows, count * sizeof(uint64_t));
+    pending.first = frames - 1;
+    pending.repeats = 1;
+    pending_hash = hash;
+    has_pending = true;
+    unique_frames++;
+}
+
+// Hands the pending picture to the writer, waiting for a free buffer if the pool is full.
+void Chip8Capture::submit() {
+    while (not queue.push(pending)) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    has_pending = false;
+}
+
+// Writes out the last picture, waits for the writer to finish and closes the output.
+// Returns whether every frame was written.
+bool Chip8Capture::close() {
+    if (not writer.joinable()) {
+        return not failed.load(std::memory_order_relaxed);
+    }
+    if (has_pending) {
+        submit();
+    }
+    closing.store(true, std::memory_order_release);
+    writer.join();
+    if (out != nullptr) {
+        if (fflush(out) != 0) {
+            failed.store(true, std::memory_order_relaxed);
+        }
+        if (out != stdout) {
+            fclose(out);
+        }
+        out = nullptr;
+    }
+    return not failed.load(std::memory_order_relaxed);
+}
+
+uint64_t Chip8Capture::get_frame_count() {
+    return frames;
+}
+
+uint64_t Chip8Capture::get_unique_frame_count() {
+    return unique_frames;
+}
+
+uint64_t Chip8Capture::get_dropped_frame_count() {
+    return dropped_frames;
+}
+
+// Writer thread. Polls the queue, sleeping briefly while it is empty, until close() was called
+// and everything queued before has been written. After a failed write it only drains the queue.
+void Chip8Capture::write_frames() {
+    std::string buffer;
+    Item item;
+    for (;;) {
+        if (queue.pop(item)) {
+            if (failed.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            bool ok = format == Format::Y4m ? write_y4m(item, buffer) : write_png(item, buffer);
+            if (not ok) {
+                failed.store(true, std::memory_order_relaxed);
+            }
+        } else if (closing.load(std::memory_order_acquire)) {
+            // Everything pushed before closing was set is visible now, one more look empties it.
+            if (not queue.pop(item)) {
+                return;
+            }
+            if (not failed.load(std::memory_order_relaxed)) {
+                bool ok = format == Format::Y4m ? write_y4m(item, buffer) : write_png(item, buffer);
+                if (not ok) {
+                    failed.store(true, std::memory_order_relaxed);
+                }
+            }
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+// Converts a picture to one Y4M frame in buffer and writes it once per repeat.
+bool Chip8Capture::write_y4m(const Item &item, std::string &buffer) {
+    int width = 64 * words * scale;
+    int height = lines * scale;
+    size_t luma = (size_t)width * height;
+    size_t chroma = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    const char header[] = "FRAME\n";
+    buffer.assign(sizeof(header) - 1 + luma + 2 * chroma, (char)128);
+    memcpy(&buffer[0], header, sizeof(header) - 1);
+
+    char *row = &buffer[sizeof(header) - 1];
+    for (int y = 0; y < lines; y++) {
+        for (int x = 0; x < 64 * words; x++) {
+            char value = (item.rows[y * words + x / 64] >> (63 - x % 64)) & 1 ? (char)255 : (char)0;
+            memset(row + x * scale, value, scale);
+        }
+        for (int copy = 1; copy < scale; copy++) {
+            memcpy(row + copy * width, row, width);
+        }
+        row += (size_t)width * scale;
+    }
+
+    for (uint64_t i = 0; i < item.repeats; i++) {
+        if (fwrite(buffer.data(), 1, buffer.size(), out) != buffer.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0) {
+    struct Table {
+        uint32_t entries[256];
+        Table() {
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++) {
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                entries[n] = c;
+            }
+        }
+    };
+    static const Table table;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void put_u32(std::string &buffer, uint32_t value) {
+    buffer += (char)(value >> 24);
+    buffer += (char)(value >> 16);
+    buffer += (char)(value >> 8);
+    buffer += (char)value;
+}
+
+// Appends a PNG chunk: length, type, data and the CRC of type and data.
+static void put_chunk(std::string &buffer, const char *type, const std::string &data) {
+    put_u32(buffer, (uint32_t)data.size());
+    size_t start = buffer.size();
+    buffer += type;
+    buffer += data;
+    put_u32(buffer, crc32(reinterpret_cast<const uint8_t *>(buffer.data()) + start, buffer.size() - start));
+}
+
+// Encodes a picture as a 1-bit greyscale PNG and writes it to the file of its first frame. The
+// image data goes into stored deflate blocks: at one bit per pixel a frame is a few KB anyway,
+// and skipping compression keeps the writer far ahead of the emulation.
+bool Chip8Capture::write_png(const Item &item, std::string &buffer) {
+    int width = 64 * words * scale;
+    int height = lines * scale;
+    size_t stride = (size_t)width / 8 + 1;
+
+    std::string raw(stride * height, '\0');
+    for (int y = 0; y < lines; y++) {
+        char *row = &raw[(size_t)y * scale * stride];
+        for (int x = 0; x < width; x++) {
+            int column = x / scale;
+            if ((item.rows[y * words + column / 64] >> (63 - column % 64)) & 1) {
+                row[1 + x / 8] |= (char)(0x80 >> (x % 8));
+            }
+        }
+        for (int copy = 1; copy < scale; copy++) {
+            memcpy(row + copy * stride, row, stride);
+        }
+    }
+
+    std::string zlib = "\x78\x01";
+    uint32_t a = 1, b = 0;
+    for (unsigned char c : raw) {
+        a = (a + c) % 65521;
+        b = (b + a) % 65521;
+    }
+    for (size_t offset = 0; offset < raw.size(); offset += 65535) {
+        size_t length = std::min<size_t>(65535, raw.size() - offset);
+        zlib += (char)(offset + length == raw.size() ? 1 : 0);
+        zlib += (char)(length & 0xFF);
+        zlib += (char)(length >> 8);
+        zlib += (char)(~length & 0xFF);
+        zlib += (char)((~length >> 8) & 0xFF);
+        zlib.append(raw, offset, length);
+    }
+    put_u32(zlib, (b << 16) | a);
+
+    std::string header;
+    put_u32(header, (uint32_t)width);
+    put_u32(header, (uint32_t)height);
+    header += '\x01'; // Bit depth
+    header += '\x00'; // Greyscale
+    header += std::string(3, '\0'); // Deflate, adaptive filtering, no interlace
+
+    buffer.assign("\x89PNG\r\n\x1A\n", 8);
+    put_chunk(buffer, "IHDR", header);
+    put_chunk(buffer, "IDAT", zlib);
+    put_chunk(buffer, "IEND", std::string());
+
+    char name[4096];
+    snprintf(name, sizeof(name), path.c_str(), (int)item.first);
+    FILE *f = fopen(name, "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size();
+    return fclose(f) == 0 && ok;
+}
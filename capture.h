@@ -0,0 +1,86 @@
+#ifndef CHIP8_CAPTURE_H
+#define CHIP8_CAPTURE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include "spsc_queue.h"
+
+/**
+ * Capture of the display, one frame per 60 Hz tick, into a raw video stream or a PNG sequence.
+ * - Formats: A path ending in .y4m, or "-" for stdout, gets a YUV4MPEG2 stream at 60 fps which
+ *            any video tool can read from a file or a pipe. A path ending in .png is a printf
+ *            pattern taking the frame number as an int, e.g. "shots/pong_%06d.png", and gets
+ *            1-bit PNGs. It must hold exactly one %d or %i, flags, width and precision allowed,
+ *            and no other % but %%.
+ *            Frames are scaled up by an integer factor, so players do not blur the pixels. The
+ *            display is 64x32 unless opened for another size, like the 128x64 of the extended
+ *            machines, rows being laid out as Chip8::get_display_rows().
+ * - Deduplication: push() hashes the packed rows and only counts a repeat while they stay the
+ *                  same, comparing the rows in full when the hashes match so that a collision
+ *                  cannot swallow a change. An unchanged frame costs the hash and compare of 256
+ *                  bytes, 1 KB at 128x64. Y4M has a fixed frame rate, so repeats are written again
+ *                  from the one converted image; a PNG sequence skips them, the frame numbers in
+ *                  the file names keep the timing.
+ * - Pool: Frames go to the writer thread through a bounded queue of POOL_SIZE buffers, converting,
+ *         encoding and writing all happen there. When the writer falls behind, push() either
+ *         drops the new frame, repeating the previous one in its place (for live sessions, which
+ *         must never wait on I/O), or waits for a free buffer (for headless runs, which are
+ *         unthrottled anyway and should not lose frames).
+ */
+class Chip8Capture {
+public:
+    static const int POOL_SIZE = 64;
+
+    Chip8Capture() = default;
+    ~Chip8Capture();
+    bool open(const std::string &, int = 4, bool = false, int = 64, int = 32);
+    void push(const uint64_t *);
+    bool close();
+    uint64_t get_frame_count();
+    uint64_t get_unique_frame_count();
+    uint64_t get_dropped_frame_count();
+private:
+    enum class Format {
+        Y4m,
+        Png
+    };
+
+    // A distinct picture, shown from frame first on for repeats frames.
+    struct Item {
+        uint64_t rows[128];
+        uint64_t first;
+        uint64_t repeats;
+    };
+
+    Format format = Format::Y4m;
+    std::string path;
+    FILE *out = nullptr;
+    int scale = 4;
+    // Size of the display, in 64-bit words per row and rows.
+    int words = 1;
+    int lines = 32;
+    bool drop_when_full = false;
+
+    // Producer side
+    Item pending = {};
+    uint64_t pending_hash = 0;
+    bool has_pending = false;
+    uint64_t frames = 0;
+    uint64_t unique_frames = 0;
+    uint64_t dropped_frames = 0;
+
+    SpscQueue<Item, POOL_SIZE> queue;
+    std::thread writer;
+    std::atomic<bool> closing{false};
+    std::atomic<bool> failed{false};
+
+    void submit();
+    void write_frames();
+    bool write_y4m(const Item &, std::string &);
+    bool write_png(const Item &, std::string &);
+};
+
+#endif //CHIP8_CAPTURE_H
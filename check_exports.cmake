@@ -0,0 +1,34 @@
+# Checks that a shared libchip8 exports exactly the functions libchip8.h declares.
+# Usage: cmake -DNM=<nm> -DLIBRARY=<libchip8.so> -DHEADER=<libchip8.h> -P check_exports.cmake
+
+execute_process(COMMAND ${NM} -D --defined-only ${LIBRARY} OUTPUT_VARIABLE symbols RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "${NM} failed on ${LIBRARY}")
+endif()
+string(REGEX MATCHALL "[^\n]+" lines "${symbols}")
+set(exported "")
+foreach(line ${lines})
+    # "<address> <type> <name>", versioned names carry "@..." after the name.
+    string(REGEX REPLACE "^[0-9a-fA-F]* *[A-Za-z] ([^@ ]+).*$" "\\1" name "${line}")
+    list(APPEND exported ${name})
+endforeach()
+
+file(READ ${HEADER} header)
+string(REGEX MATCHALL "CHIP8_API [^;(]*[ *](chip8_[a-z0-9_]+)\\(" declarations "${header}")
+set(declared "")
+foreach(declaration ${declarations})
+    string(REGEX REPLACE ".*[ *](chip8_[a-z0-9_]+)\\($" "\\1" name "${declaration}")
+    list(APPEND declared ${name})
+endforeach()
+
+list(SORT exported)
+list(SORT declared)
+if (NOT exported STREQUAL declared)
+    set(extra ${exported})
+    list(REMOVE_ITEM extra ${declared})
+    set(missing ${declared})
+    list(REMOVE_ITEM missing ${exported})
+    message(FATAL_ERROR "Exports of ${LIBRARY} differ from ${HEADER}\nNot declared: ${extra}\nNot exported: ${missing}")
+endif()
+list(LENGTH exported count)
+message(STATUS "${count} symbols exported, all declared in the header")
@@ -0,0 +1,54 @@
+#include <atomic>
+#include "checkpoint.h"
+
+// Source of save generations, shared by all checkpoints so that no two saves get the same one.
+static std::atomic<uint64_t> generations(0);
+
+// Takes a snapshot of the machine and starts tracking what it writes from here on.
+void Chip8Checkpoint::save(Chip8 &chip8) {
+    if (not state) {
+        state.reset(new Chip8State());
+    }
+    chip8.save_state(*state);
+    generation = generations.fetch_add(1, std::memory_order_relaxed) + 1;
+    chip8.dirty_pages = 0;
+    chip8.dirty_rows = 0;
+    chip8.checkpoint_generation = generation;
+}
+
+// Puts the machine back into the saved state. Fails if nothing was saved yet.
+bool Chip8Checkpoint::reset(Chip8 &chip8) {
+    if (not state) {
+        return false;
+    }
+    // The dirty bits only describe the way back to this save if the machine was saved or reset by it
+    // last. Another machine saved since, or another checkpoint, means a full restore. So does an
+    // extended machine on either side, whose planes and high memory are not tracked.
+    if (chip8.checkpoint_generation != generation || is_extended_variant(chip8.variant) ||
+        is_extended_variant((Chip8Variant)state->variant)) {
+        chip8.load_state(*state);
+        reset_bytes = sizeof(Chip8State);
+    } else {
+        chip8.load_registers(*state);
+        reset_bytes = 0;
+        for (uint32_t rows = chip8.dirty_rows; rows != 0; rows &= rows - 1) {
+            int y = __builtin_ctz(rows);
+            chip8.display[y] = state->display[y];
+            reset_bytes += sizeof(uint64_t);
+        }
+        for (uint32_t pages = chip8.dirty_pages; pages != 0; pages &= pages - 1) {
+            int page = __builtin_ctz(pages);
+            chip8.write_memory((uint16_t)(page * 256), state->memory + page * 256, 256);
+            reset_bytes += 256;
+        }
+    }
+    chip8.dirty_pages = 0;
+    chip8.dirty_rows = 0;
+    chip8.checkpoint_generation = generation;
+    return true;
+}
+
+// Bytes of memory and display the last reset() copied back.
+size_t Chip8Checkpoint::get_reset_bytes() {
+    return reset_bytes;
+}
@@ -0,0 +1,35 @@
+#ifndef CHIP8_CHECKPOINT_H
+#define CHIP8_CHECKPOINT_H
+
+#include <cstddef>
+#include <memory>
+#include "chip8.h"
+
+/**
+ * A saved Chip8 state to reset the machine to over and over, as fuzzing and search need.
+ * - state: The full snapshot taken by save().
+ * - Dirty tracking: save() clears the dirty_pages and dirty_rows of the machine, which its memory
+ *                   writes, CLS and DXYN set again. reset() restores the registers and only the
+ *                   pages and rows marked, so it costs in proportion to what the run touched:
+ *                   a run which drew a few sprites and stored nothing is reset with under 100 bytes.
+ *                   Restored bytes go through Chip8::write_memory(), so instructions decoded and
+ *                   translated from unchanged code survive the reset.
+ *                   The SUPER-CHIP and XO-CHIP machines are not tracked and always fully restored,
+ *                   whether the machine or the saved state is one of them.
+ * - generation: Number of the last save(), unique across all checkpoints. The machine keeps the
+ *               generation it was saved or reset with last, its dirty bits are relative to that.
+ *               Reset with any other generation, it gets its full state restored instead, so saving
+ *               from another machine or a new checkpoint at the same address cannot mix states.
+ */
+class Chip8Checkpoint {
+public:
+    void save(Chip8 &);
+    bool reset(Chip8 &);
+    size_t get_reset_bytes();
+private:
+    std::unique_ptr<Chip8State> state;
+    size_t reset_bytes = 0;
+    uint64_t generation = 0;
+};
+
+#endif //CHIP8_CHECKPOINT_H
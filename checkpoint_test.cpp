@@ -0,0 +1,256 @@
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "checkpoint.h"
+#include "chip8.h"
+#include "quirks.h"
+#include "test_util.h"
+
+/**
+ * Tests of Chip8Checkpoint resets against fresh snapshots.
+ * - Partial resets: A machine saved to a checkpoint runs a while with random key presses, then is
+ *                   reset, over and over. Each reset must copy back less than a full snapshot and
+ *                   leave the machine byte for byte in the state save_state() took at the
+ *                   checkpoint. The reset machine then runs on beside one restored from that state
+ *                   with load_state(), so code decoded or translated before the reset must not
+ *                   outlive the memory it came from. Both engines.
+ * - Full resets: Whenever the dirty bits of the machine do not lead back to the checkpoint, it is
+ *                restored whole: after the checkpoint was saved from another machine, after another
+ *                checkpoint saved or reset it, and for a new checkpoint where a destroyed one was.
+ * - Variant changes: A machine which loaded a ROM under another quirk profile since the save is
+ *                    reset to the saved state and profile, and runs on like a machine restored
+ *                    from it, with code decoded or translated under the other profile dropped.
+ *                    Both engines.
+ * - Extended machines: A checkpoint saved on a SUPER-CHIP or XO-CHIP machine gets its planes and
+ *                      high memory back after the machine loaded a classic ROM.
+ *
+ * Usage: chip8_checkpoint_test [rom]...
+ * Without a ROM only the embedded program runs. Prints one line per failed check and a summary,
+ * exits with 1 if any check failed.
+ */
+
+// Random sprites on the display, BCD digits written into a page picked at random, registers
+// stored in the last page of memory and a CLS whenever a random key is held.
+static const Rom scribbler = assemble({
+    0xC0FF,         // 0x200: V0 = random
+    0xC13F,         // 0x202: V1 = random x
+    0xC21F,         // 0x204: V2 = random y
+    0xF029,         // 0x206: I = glyph of V0
+    0xD125,         // 0x208: draw it
+    0xC3BF,         // 0x20A: V3 = random
+    0xA300,         // 0x20C: I = 0x300
+    0xF31E,         // 0x20E: I += V3 * 16, in 16 additions, up to 0xEF0
+    0x7401,         // 0x210: V4 += 1
+    0x3410,         // 0x212: skip once V4 = 16
+    0x120E,         // 0x214: add again
+    0x6400,         // 0x216: V4 = 0
+    0xF033,         // 0x218: BCD of V0 at I
+    0xAE80,         // 0x21A: I = 0xE80
+    0xF255,         // 0x21C: store V0..V2
+    0xE0A1,         // 0x21E: skip if key V0 is up
+    0x00E0,         // 0x220: CLS
+    0x1200,         // 0x222: again
+});
+
+// Returns whether the machine is byte for byte in the given state.
+static bool in_state(Chip8 &chip8, const Chip8State &expected) {
+    std::unique_ptr<Chip8State> actual(new Chip8State());
+    chip8.save_state(*actual);
+    return memcmp(actual.get(), &expected, sizeof(Chip8State)) == 0;
+}
+
+// Runs a few frames of random length with random keys.
+static void run_some(Chip8 &chip8, std::mt19937 &random) {
+    for (int frame = 0; frame < 1 + (int)(random() % 4); frame++) {
+        chip8.set_keypad_value(random() % 16, random() % 2);
+        chip8.run(1 + random() % 200);
+        chip8.tick_timers();
+    }
+}
+
+static void test_partial(const std::string &name, const Rom &rom, Chip8Engine engine) {
+    std::string run = name + (engine == Chip8Engine::Jit ? " (jit)" : " (interpreter)");
+    Chip8 chip8;
+    if (not chip8.set_engine(engine)) {
+        std::cout << run << ": engine not supported, skipped\n";
+        return;
+    }
+    chip8.load_rom(rom.data(), rom.size());
+    std::mt19937 random(7);
+    run_some(chip8, random);
+
+    Chip8Checkpoint checkpoint;
+    check(not checkpoint.reset(chip8), run + ": reset fails before a save");
+    checkpoint.save(chip8);
+    std::unique_ptr<Chip8State> saved(new Chip8State());
+    chip8.save_state(*saved);
+
+    bool partial = true;
+    bool restored = true;
+    bool alike = true;
+    for (int round = 0; round < 300; round++) {
+        run_some(chip8, random);
+        checkpoint.reset(chip8);
+        partial = partial && checkpoint.get_reset_bytes() < sizeof(Chip8State);
+        restored = restored && in_state(chip8, *saved);
+        if (round % 30 == 0) {
+            // The reset machine goes on exactly as one loaded from the checkpoint state.
+            Chip8 loaded;
+            loaded.set_engine(engine);
+            loaded.load_state(*saved);
+            std::mt19937 keys(round);
+            std::mt19937 same_keys(round);
+            run_some(chip8, keys);
+            run_some(loaded, same_keys);
+            alike = alike && same_state(chip8, loaded);
+            checkpoint.reset(chip8);
+        }
+    }
+    check(partial, run + ": resets copy back less than a snapshot");
+    check(restored, run + ": resets restore the saved state");
+    check(alike, run + ": reset machines run like restored ones");
+}
+
+static void test_full(const Rom &rom) {
+    const Rom other = assemble({0x6077, 0x6122, 0xA300, 0xF155, 0x00E0, 0x1208});
+    std::mt19937 random(11);
+    std::unique_ptr<Chip8State> saved(new Chip8State());
+
+    // Saved from another machine in between.
+    Chip8 first;
+    Chip8 second;
+    first.load_rom(rom.data(), rom.size());
+    second.load_rom(other.data(), other.size());
+    Chip8Checkpoint checkpoint;
+    checkpoint.save(first);
+    first.run(10);
+    second.run(5);
+    checkpoint.save(second);
+    second.save_state(*saved);
+    checkpoint.reset(first);
+    check(checkpoint.get_reset_bytes() == sizeof(Chip8State), "a machine saved by an older save is restored whole");
+    check(in_state(first, *saved), "the machine gets the state of the other machine");
+    run_some(second, random);
+    checkpoint.reset(second);
+    check(in_state(second, *saved), "the other machine is reset as well");
+
+    // Two checkpoints taking turns on one machine.
+    Chip8 chip8;
+    chip8.load_rom(rom.data(), rom.size());
+    Chip8Checkpoint a;
+    Chip8Checkpoint b;
+    std::unique_ptr<Chip8State> saved_b(new Chip8State());
+    a.save(chip8);
+    chip8.save_state(*saved);
+    run_some(chip8, random);
+    b.save(chip8);
+    chip8.save_state(*saved_b);
+    run_some(chip8, random);
+    a.reset(chip8);
+    check(a.get_reset_bytes() == sizeof(Chip8State) && in_state(chip8, *saved), "reset to the older of two checkpoints");
+    run_some(chip8, random);
+    b.reset(chip8);
+    check(b.get_reset_bytes() == sizeof(Chip8State) && in_state(chip8, *saved_b), "reset back to the newer one");
+
+    // A checkpoint in the place of a destroyed one, which the machine was reset with last.
+    std::unique_ptr<Chip8Checkpoint> old_checkpoint(new Chip8Checkpoint());
+    old_checkpoint->save(first);
+    old_checkpoint.reset();
+    std::unique_ptr<Chip8Checkpoint> new_checkpoint(new Chip8Checkpoint());
+    new_checkpoint->save(second);
+    second.save_state(*saved);
+    run_some(first, random);
+    new_checkpoint->reset(first);
+    check(new_checkpoint->get_reset_bytes() == sizeof(Chip8State) && in_state(first, *saved),
+          "a new checkpoint restores machines saved by a destroyed one whole");
+}
+
+static void test_variant_change(Chip8Engine engine) {
+    std::string run = engine == Chip8Engine::Jit ? "variant change (jit)" : "variant change (interpreter)";
+    // BNNN jumps through V0 on the classic profile and through V2 under the SUPER-CHIP quirks, so
+    // code decoded or translated under the wrong profile goes somewhere else.
+    const Rom jumps = assemble({0x6004, 0x6208, 0xC3FF, 0xF329, 0xD345, 0xB208, 0x7501, 0x1204,
+                                0x7601, 0x1204});
+    Chip8 chip8;
+    if (not chip8.set_engine(engine)) {
+        std::cout << run << ": engine not supported, skipped\n";
+        return;
+    }
+    chip8.load_rom(jumps.data(), jumps.size(), Chip8Variant::Classic);
+    std::mt19937 random(17);
+    run_some(chip8, random);
+    Chip8Checkpoint checkpoint;
+    checkpoint.save(chip8);
+    std::unique_ptr<Chip8State> saved(new Chip8State());
+    chip8.save_state(*saved);
+
+    const Chip8Variant others[] = {Chip8Variant::Cosmac, Chip8Variant::SuperChipQuirks, Chip8Variant::XoChipQuirks};
+    for (Chip8Variant other : others) {
+        std::string name = run + ", " + variant_name(other);
+        chip8.load_rom(jumps.data(), jumps.size(), other);
+        run_some(chip8, random);
+        checkpoint.reset(chip8);
+        check(chip8.get_variant() == Chip8Variant::Classic, name + ": reset goes back to the saved profile");
+        check(in_state(chip8, *saved), name + ": reset restores the saved state");
+
+        Chip8 loaded;
+        loaded.set_engine(engine);
+        loaded.load_state(*saved);
+        std::mt19937 keys((int)other);
+        std::mt19937 same_keys((int)other);
+        run_some(chip8, keys);
+        run_some(loaded, same_keys);
+        check(same_state(chip8, loaded), name + ": reset machine runs like a restored one");
+        checkpoint.reset(chip8);
+    }
+}
+
+// Hi-res sprites on SUPER-CHIP; on XO-CHIP a byte stored in high memory and a sprite on both planes.
+static void test_extended() {
+    const Rom hires = assemble({0x00FF, 0x6010, 0x6120, 0xF029, 0xD015, 0x120A});
+    const Rom xo = assemble({0x00FF, 0xF000, 0x2000, 0x6042, 0xF055, 0xF301, 0xA000, 0xD015, 0x1210});
+    const std::pair<Chip8Variant, const Rom *> machines[] = {{Chip8Variant::SuperChip, &hires},
+                                                             {Chip8Variant::XoChip, &xo}};
+    std::mt19937 random(13);
+    std::unique_ptr<Chip8State> saved(new Chip8State());
+    for (const auto &machine : machines) {
+        std::string name = variant_name(machine.first);
+        Chip8 chip8;
+        chip8.load_rom(machine.second->data(), machine.second->size(), machine.first);
+        chip8.run(20);
+        Chip8Checkpoint checkpoint;
+        checkpoint.save(chip8);
+        chip8.save_state(*saved);
+        chip8.load_rom(scribbler.data(), scribbler.size(), Chip8Variant::Classic);
+        run_some(chip8, random);
+        checkpoint.reset(chip8);
+        check(checkpoint.get_reset_bytes() == sizeof(Chip8State), name + ": reset after a classic ROM is full");
+        check(in_state(chip8, *saved), name + ": reset after a classic ROM restores the saved state");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::pair<std::string, Rom>> roms = {{"embedded", scribbler}};
+    for (int i = 1; i < argc; i++) {
+        Rom rom;
+        if (not chip8_read_file(argv[i], rom)) {
+            std::cerr << "ROM could not be loaded: " << argv[i] << "\n";
+            return 1;
+        }
+        roms.emplace_back(argv[i], rom);
+    }
+    for (const auto &rom : roms) {
+        test_partial(rom.first, rom.second, Chip8Engine::Interpreter);
+        test_partial(rom.first, rom.second, Chip8Engine::Jit);
+    }
+    test_full(scribbler);
+    test_variant_change(Chip8Engine::Interpreter);
+    test_variant_change(Chip8Engine::Jit);
+    test_extended();
+
+    return report();
+}
@@ -1,7 +1,25 @@
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <vector>
 #include "chip8.h"
+#include "jit.h"
+#include "profiler.h"
+#include "quirks.h"
+#include "recording.h"
+#include "romcache.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8_FILE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define CHIP8_FILE_MMAP 0
+#endif
 
 // Constructor
 Chip8::Chip8() {
@@ -13,6 +31,14 @@ Chip8::Chip8() {
     // Resetting display and keypad
     memset(display, 0, sizeof(display));
     memset(keypad, 0, sizeof(keypad));
+    reset_extended();
+    memset(flags, 0, sizeof(flags));
+
+    // Nothing decoded yet, every entry decodes itself on first execution.
+    clear_decoded();
+
+    seed_random(0);
+    select_variant(Chip8Variant::Classic);
 
     // No built-in character rendering for CHIP-8, we need to specify this to show the display.
     // Loaded in the first 80 bytes of memory.
@@ -41,23 +67,309 @@ Chip8::Chip8() {
     }
 }
 
-// Loads ROM, with path to ROM given as argument
+// The 8x10 font of FX30 on the extended machines, loaded right after the small one from 0x50.
+static const uint8_t BIG_FONT_ADDRESS = 0x50;
+static const uint8_t big_fontset[160] = {
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+// Largest ROM a variant can load: everything from 0x200 to the end of its memory.
+size_t Chip8::get_max_rom_size(Chip8Variant rom_variant) {
+    return (rom_variant == Chip8Variant::XoChip ? 0x10000 : 4096) - 0x0200;
+}
+
+// Puts the state only the extended machines use back to how it is at power on, but for the
+// RPL flags which outlive the ROM.
+void Chip8::reset_extended() {
+    memset(planes, 0, sizeof(planes));
+    hires = false;
+    plane_mask = 1;
+    pitch = 64;
+    memset(audio_pattern, 0, sizeof(audio_pattern));
+}
+
+// Loads ROM, with path to ROM given as argument, to be run with the default quirk profile.
 bool Chip8::load_rom(std::string rom_path) {
+    return load_rom(rom_path, Chip8Variant::Classic);
+}
+
+// Loads ROM from a file, to be run as the given variant. Regular files are mapped and copied
+// straight into memory, anything else is read at once.
+bool Chip8::load_rom(std::string rom_path, Chip8Variant rom_variant) {
+#if CHIP8_FILE_MMAP
+    int fd = open(rom_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        size_t size = (size_t)info.st_size;
+        if (size > get_max_rom_size(rom_variant)) {
+            close(fd);
+            fault = Chip8Fault::RomTooLarge;
+            return false;
+        }
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        bool loaded = load_rom(static_cast<const uint8_t *>(mapped), size, rom_variant);
+        munmap(mapped, size);
+        return loaded;
+    }
+    close(fd);
+#endif
     std::ifstream f(rom_path, std::ios::binary | std::ios::in);
     if (!f.is_open()) {
         return false;
     }
 
-    // Load in memory from 0x200 (512) onwards
-    char c;
-    int j = 512;
-    for (int i = 0x0200; f.get(c); ++i) {
-        memory[i] = (uint8_t)c;
-        j++;
+    // One byte more than fits is enough to refuse the ROM.
+    std::vector<uint8_t> rom(get_max_rom_size(rom_variant) + 1);
+    f.read(reinterpret_cast<char *>(rom.data()), rom.size());
+    rom.resize((size_t)f.gcount());
+    return load_rom(rom.data(), rom.size(), rom_variant);
+}
+
+// Loads ROM from a buffer, to be run as the given variant. Fails with the RomTooLarge fault if
+// it does not fit between 0x200 and the end of memory, 64 KB on XO-CHIP, leaving everything else
+// as it was.
+bool Chip8::load_rom(const uint8_t *rom, size_t size, Chip8Variant rom_variant) {
+    return load_program(rom, size, rom_variant, nullptr);
+}
+
+// Loads the ROM of an analysis, to be run as the given variant, together with its decoded
+// instructions, so nothing it reaches needs decoding at run time.
+bool Chip8::load_rom(const Chip8RomAnalysis &analysis, Chip8Variant rom_variant) {
+    return load_program(analysis.rom, analysis.size, rom_variant, analysis.decoded);
+}
+
+// Loads a ROM with the decode cache either cleared or, given predecoded entries for all of
+// memory, set to those. The CPU starts over at 0x200 with a clear display, so a machine which
+// ran or faulted before runs the ROM as a fresh one would. Predecoded entries only hold the
+// shared opcodes and are not used for the extended machines.
+bool Chip8::load_program(const uint8_t *rom, size_t size, Chip8Variant rom_variant, const Instruction *predecoded) {
+    if (size > get_max_rom_size(rom_variant)) {
+        fault = Chip8Fault::RomTooLarge;
+        return false;
+    }
+    select_variant(rom_variant);
+    fault = Chip8Fault::None;
+    memset(V, 0, sizeof(V));
+    I = 0;
+    pc = 0x0200;
+    sp = 0;
+    memset(stack, 0, sizeof(stack));
+    delay_timer = 0;
+    sound_timer = 0;
+    memset(display, 0, sizeof(display));
+    dirty_rows = 0xFFFFFFFF;
+    draw_flag = false;
+    reset_extended();
+
+    // Load in memory from 0x200 (512) onwards, what does not fit in the first 4 KB of an XO-CHIP
+    // machine goes to its high memory.
+    size_t low_size = std::min(size, sizeof(memory) - 0x0200);
+    memcpy(memory + 0x0200, rom, low_size);
+    for (size_t page = 2; page < 2 + (low_size + 255) / 256; page++) {
+        dirty_pages |= 1 << page;
+    }
+    if (rom_variant == Chip8Variant::XoChip) {
+        memset(high_memory.get(), 0, 0x10000 - sizeof(memory));
+        memcpy(high_memory.get(), rom + low_size, size - low_size);
+    }
+    if (is_extended_variant(rom_variant)) {
+        memcpy(memory + BIG_FONT_ADDRESS, big_fontset, sizeof(big_fontset));
+        dirty_pages |= 1;
+    }
+
+    // Any previously decoded or translated instruction may have been overwritten.
+    if (predecoded != nullptr && not is_extended_variant(rom_variant)) {
+        memcpy(decoded, predecoded, 4096 * sizeof(Instruction));
+    } else {
+        clear_decoded();
+    }
+    if (jit) {
+        jit->flush();
+    }
+    return true;
+}
+
+// Takes a snapshot of the complete machine state.
+void Chip8::save_state(Chip8State &state) {
+    memcpy(state.magic, "C8ST", sizeof(state.magic));
+    state.version = Chip8State::VERSION;
+    memcpy(state.V, V, sizeof(V));
+    state.I = I;
+    state.pc = pc;
+    state.sp = sp;
+    state.delay_timer = delay_timer;
+    state.sound_timer = sound_timer;
+    state.draw_flag = draw_flag ? 1 : 0;
+    memcpy(state.stack, stack, sizeof(stack));
+    for (int i = 0; i < 16; i++) {
+        state.keypad[i] = keypad[i] != 0 ? 1 : 0;
+    }
+    state.variant = (uint8_t)variant;
+    state.fault = (uint8_t)fault;
+    memset(state.reserved, 0, sizeof(state.reserved));
+    state.cycle_count = cycle_count;
+    state.random_state = random_state;
+    memcpy(state.display, display, sizeof(display));
+    memcpy(state.memory, memory, sizeof(memory));
+    state.hires = hires ? 1 : 0;
+    state.plane_mask = plane_mask;
+    state.pitch = pitch;
+    memset(state.reserved_extended, 0, sizeof(state.reserved_extended));
+    memcpy(state.flags, flags, sizeof(flags));
+    memcpy(state.audio_pattern, audio_pattern, sizeof(audio_pattern));
+    memcpy(state.planes, planes, sizeof(planes));
+    if (variant == Chip8Variant::XoChip) {
+        memcpy(state.high_memory, high_memory.get(), sizeof(state.high_memory));
+    } else {
+        memset(state.high_memory, 0, sizeof(state.high_memory));
+    }
+}
+
+// Restores a snapshot taken by save_state(). Fails without touching anything if it is not a
+// snapshot of the current version, or holds an address, stack pointer or fault no machine can have.
+bool Chip8::load_state(const Chip8State &state) {
+    if (memcmp(state.magic, "C8ST", sizeof(state.magic)) != 0 || state.version != Chip8State::VERSION ||
+        state.variant > (uint8_t)Chip8Variant::XoChip || state.pc > 0xFFF || state.sp > 16 ||
+        state.fault > (uint8_t)Chip8Fault::Exited || state.hires > 1 || state.plane_mask > 3) {
+        return false;
+    }
+    for (uint16_t address : state.stack) {
+        if (address > 0xFFF) {
+            return false;
+        }
+    }
+    load_registers(state);
+    for (int y = 0; y < 32; y++) {
+        if (display[y] != state.display[y]) {
+            display[y] = state.display[y];
+            dirty_rows |= 1u << y;
+        }
+    }
+    write_memory(0, state.memory, sizeof(memory));
+    memcpy(planes, state.planes, sizeof(planes));
+    if (variant == Chip8Variant::XoChip) {
+        memcpy(high_memory.get(), state.high_memory, sizeof(state.high_memory));
     }
     return true;
 }
 
+// Restores everything of a snapshot but memory and display (planes included), which are the bulk of it.
+void Chip8::load_registers(const Chip8State &state) {
+    select_variant((Chip8Variant)state.variant);
+    memcpy(V, state.V, sizeof(V));
+    I = state.I;
+    pc = state.pc;
+    sp = state.sp;
+    delay_timer = state.delay_timer;
+    sound_timer = state.sound_timer;
+    draw_flag = state.draw_flag != 0;
+    memcpy(stack, state.stack, sizeof(stack));
+    fault = (Chip8Fault)state.fault;
+    for (int i = 0; i < 16; i++) {
+        keypad[i] = state.keypad[i];
+    }
+    cycle_count = state.cycle_count;
+    random_state = state.random_state;
+    hires = state.hires != 0;
+    plane_mask = state.plane_mask;
+    pitch = state.pitch;
+    memcpy(flags, state.flags, sizeof(flags));
+    memcpy(audio_pattern, state.audio_pattern, sizeof(audio_pattern));
+}
+
+// Copies size bytes to memory at addr, clipped to the end of memory. Only bytes which actually
+// differ are written and invalidated, so rewriting the same program keeps its decoded
+// instructions and translated blocks.
+void Chip8::write_memory(uint16_t addr, const uint8_t *data, size_t size) {
+    size_t end = std::min(sizeof(memory), (size_t)addr + size);
+    size_t i = addr;
+    for (; i < end && i % 8 != 0; i++) {
+        if (memory[i] != data[i - addr]) {
+            memory[i] = data[i - addr];
+            invalidate((uint16_t)i);
+        }
+    }
+    for (; i < end; i += 8) {
+        size_t length = std::min<size_t>(8, end - i);
+        if (memcmp(memory + i, data + (i - addr), length) == 0) {
+            continue;
+        }
+        for (size_t j = i; j < i + length; j++) {
+            if (memory[j] != data[j - addr]) {
+                memory[j] = data[j - addr];
+                invalidate((uint16_t)j);
+            }
+        }
+    }
+}
+
+// Writes a snapshot to a file in a single write.
+bool Chip8::save_state(const std::string &path) {
+    std::unique_ptr<Chip8State> state(new Chip8State);
+    save_state(*state);
+    std::ofstream f(path, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!f.is_open()) {
+        return false;
+    }
+    f.write(reinterpret_cast<const char *>(state.get()), sizeof(Chip8State));
+    return f.good();
+}
+
+// Restores a snapshot written by save_state(). The file is mapped and used in place where possible.
+bool Chip8::load_state(const std::string &path) {
+#if CHIP8_FILE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size != (off_t)sizeof(Chip8State)) {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(nullptr, sizeof(Chip8State), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    bool loaded = load_state(*static_cast<const Chip8State *>(mapped));
+    munmap(mapped, sizeof(Chip8State));
+    return loaded;
+#else
+    std::ifstream f(path, std::ios::binary | std::ios::in);
+    if (!f.is_open()) {
+        return false;
+    }
+    std::unique_ptr<Chip8State> state(new Chip8State);
+    if (!f.read(reinterpret_cast<char *>(state.get()), sizeof(Chip8State)) || f.peek() != EOF) {
+        return false;
+    }
+    return load_state(*state);
+#endif
+}
+
 // Getters and Setters
 bool Chip8::get_draw_flag() {
     return draw_flag;
@@ -67,368 +379,1236 @@ void Chip8::set_draw_flag(bool flag) {
     draw_flag = flag;
 }
 
+// Returns pixel i of the display (row-major, i = y * get_display_width() + x) as 0 or 1, on the
+// extended machines as the color of both planes, bit 0 from the first one.
 int Chip8::get_display_value(int i) {
-    return display[i];
+    if (not is_extended_variant(variant)) {
+        return (display[i / 64] >> (63 - i % 64)) & 1;
+    }
+    int word = i / 64;
+    int shift = 63 - i % 64;
+    return (int)((planes[0][word] >> shift) & 1) | (int)(((planes[1][word] >> shift) & 1) << 1);
+}
+
+// Width of the display in pixels, 64 or 128 on the extended machines, whether in hi-res or not.
+int Chip8::get_display_width() {
+    return is_extended_variant(variant) ? 128 : 64;
+}
+
+// Height of the display in pixels, 32 or 64 on the extended machines.
+int Chip8::get_display_height() {
+    return is_extended_variant(variant) ? 64 : 32;
+}
+
+// Returns the display rows without copying, the leftmost pixel is the most significant bit.
+// These are the 32 rows of 64 pixels, or on the extended machines their first plane, with
+// two words per row.
+const uint64_t *Chip8::get_display_rows() {
+    return is_extended_variant(variant) ? planes[0] : display;
+}
+
+// Returns a plane of the display without copying, laid out as get_display_rows(). The CHIP-8
+// machines have their display as plane 0 and no plane 1, which is nullptr.
+const uint64_t *Chip8::get_display_plane(int plane) {
+    if (not is_extended_variant(variant)) {
+        return plane == 0 ? display : nullptr;
+    }
+    return planes[plane & 1];
+}
+
+// Copies the display rows laid out as get_display_rows() to rows, every pixel which is set on
+// either plane set. That is get_display_width() / 64 * get_display_height() words.
+void Chip8::copy_display_rows(uint64_t *rows) {
+    if (not is_extended_variant(variant)) {
+        memcpy(rows, display, sizeof(display));
+        return;
+    }
+    for (int i = 0; i < 128; i++) {
+        rows[i] = planes[0][i] | planes[1][i];
+    }
+}
+
+// Whether an extended machine is in its 128x64 hi-res mode.
+bool Chip8::get_hires() {
+    return hires;
+}
+
+// The 16 bytes of the XO-CHIP audio pattern, most significant bit first.
+const uint8_t *Chip8::get_audio_pattern() {
+    return audio_pattern;
+}
+
+// The XO-CHIP pitch the audio pattern plays at, 64 for 4000 Hz.
+uint8_t Chip8::get_pitch() {
+    return pitch;
 }
 
 void Chip8::set_keypad_value(int index, int val) {
+    if (recording && (keypad[index] != 0) != (val != 0)) {
+        recording->on_key(cycle_count, index, val != 0);
+    }
     keypad[index] = val;
 }
 
-// Emulates one cycle
-void Chip8::single_cycle() {
+uint8_t Chip8::get_register(int index) {
+    return V[index];
+}
+
+uint16_t Chip8::get_index() {
+    return I;
+}
+
+uint16_t Chip8::get_pc() {
+    return pc;
+}
+
+uint8_t Chip8::get_stack_pointer() {
+    return sp;
+}
+
+uint8_t Chip8::get_delay_timer() {
+    return delay_timer;
+}
+
+uint8_t Chip8::get_sound_timer() {
+    return sound_timer;
+}
+
+uint64_t Chip8::get_cycle_count() {
+    return cycle_count;
+}
+
+// Reads memory, the address wrapping around like accesses at I do.
+uint8_t Chip8::get_memory_value(int addr) {
+    if (variant == Chip8Variant::XoChip) {
+        return load_byte<Chip8Variant::XoChip>((uint32_t)addr);
+    }
+    return memory[addr & 0xFFF];
+}
+
+Chip8Fault Chip8::get_fault() {
+    return fault;
+}
+
+// Decodes the opcode stored at addr into its handler and operand fields.
+Instruction Chip8::decode(uint16_t addr) {
+    Instruction in = decode_opcode(addr);
+    if (in.op == OP_JP) {
+        in.idle_loop = is_idle_loop(addr, in.nnn);
+    }
+    return in;
+}
+
+// Decodes the opcode at addr on its own, without looking at the code around it.
+Instruction Chip8::decode_opcode(uint16_t addr) {
     // Combine two bytes into a 2-byte opcode.
     // E.g., if memory[pc] = 0x12 and memory[pc+1] = 0x34, then
     // opcode = (0x12 << 8) | 0x34 = 0x1234.
-    int opcode = (memory[pc] << 8) | (memory[pc + 1]);
+    // The second byte of an opcode at 0xFFF is the one at 0x000.
+    int opcode = (memory[addr] << 8) | (memory[(addr + 1) & 0xFFF]);
 
-    int opcode_msb_nibble = get_nibble(opcode, 12, 0xF000);
-    int val, reg, reg1, reg2;
+    // The extended machines decode their additional opcodes, which are invalid on the others.
+    bool extended = is_extended_variant(variant);
+    bool xo = variant == Chip8Variant::XoChip;
 
-    switch (opcode_msb_nibble) {
-        // Opcodes starting with 0.
-        // 0x00E0: Clears the entire display.
-        // 0x00EE: Returns control after a subroutine call (pops the return address from stack).
+    Instruction in;
+    in.op = OP_INVALID;
+    in.idle_loop = false;
+    in.x = get_nibble(opcode, 8, 0x0F00);
+    in.y = get_nibble(opcode, 4, 0x00F0);
+    in.n = get_nibble(opcode, 0, 0x000F);
+    in.nn = get_nibble(opcode, 0, 0x00FF);
+    in.nnn = get_nibble(opcode, 0, 0x0FFF);
+
+    switch (get_nibble(opcode, 12, 0xF000)) {
         case 0:
-            switch (opcode) {
-                case 0x00E0:
-                    memset(display, 0, sizeof(display));
-                    draw_flag = true;
-                    pc += 2;
-                    break;
-                case 0x00EE:
-                    sp--;
-                    pc = stack[sp];
-                    pc += 2;
-                    break;
-                default:
-                    std::cerr << "Invalid opcode: " << std::hex << opcode << std::endl;
-                    break;
+            if (opcode == 0x00E0) {
+                in.op = OP_CLS;
+            } else if (opcode == 0x00EE) {
+                in.op = OP_RET;
+            } else if (extended && (opcode & 0xFFF0) == 0x00C0) {
+                in.op = OP_SCD;
+            } else if (xo && (opcode & 0xFFF0) == 0x00D0) {
+                in.op = OP_SCU;
+            } else if (extended) {
+                switch (opcode) {
+                    case 0x00FB: in.op = OP_SCR; break;
+                    case 0x00FC: in.op = OP_SCL; break;
+                    case 0x00FD: in.op = OP_EXIT; break;
+                    case 0x00FE: in.op = OP_LOW; break;
+                    case 0x00FF: in.op = OP_HIGH; break;
+                }
             }
             break;
-        // Opcode 1NNN: Jump to address NNN.
-        case 1:
-            pc = opcode & 0x0FFF;
+        case 1: in.op = OP_JP; break;
+        case 2: in.op = OP_CALL; break;
+        case 3: in.op = OP_SE_IMM; break;
+        case 4: in.op = OP_SNE_IMM; break;
+        case 5:
+            if (xo && in.n == 0x2) {
+                in.op = OP_SAVE;
+            } else if (xo && in.n == 0x3) {
+                in.op = OP_LOAD;
+            } else {
+                in.op = OP_SE_REG;
+            }
             break;
-        // Opcode 2NNN: Call subroutine at NNN.
-        //          Push current pc onto the stack, then set pc to NNN.
-        case 2:
-            stack[sp] = pc;
-            sp++;
-            pc = opcode & 0x0FFF;
+        case 6: in.op = OP_LD_IMM; break;
+        case 7: in.op = OP_ADD_IMM; break;
+        case 8:
+            switch (in.n) {
+                case 0x0: in.op = OP_LD_REG; break;
+                case 0x1: in.op = OP_OR; break;
+                case 0x2: in.op = OP_AND; break;
+                case 0x3: in.op = OP_XOR; break;
+                case 0x4: in.op = OP_ADD_REG; break;
+                case 0x5: in.op = OP_SUB; break;
+                case 0x6: in.op = OP_SHR; break;
+                case 0x7: in.op = OP_SUBN; break;
+                case 0xE: in.op = OP_SHL; break;
+            }
             break;
-        // Opcode 3XNN: Skip next instruction if V[X] == NN.
-        case 3:
-            val = get_nibble(opcode, 0, 0x00FF); // Extract NN.
-            reg = get_nibble(opcode, 8, 0x0F00); // Extract register index X.
-            pc += 2;
-            if (V[reg] == val) {
-                pc += 2;
+        case 9: in.op = OP_SNE_REG; break;
+        case 10: in.op = OP_LD_I; break;
+        case 11: in.op = OP_JP_V0; break;
+        case 12: in.op = OP_RND; break;
+        case 13: in.op = OP_DRW; break;
+        case 14:
+            if (in.nn == 0x9E) {
+                in.op = OP_SKP;
+            } else if (in.nn == 0xA1) {
+                in.op = OP_SKNP;
             }
             break;
-        // Opcode 4XNN: Skip next instruction if V[X] != NN.
-        case 4:
-            val = get_nibble(opcode, 0, 0x00FF);
-            reg = get_nibble(opcode, 8, 0x0F00);
-            pc += 2;
-            if (V[reg] != val) {
-                pc += 2;
+        case 15:
+            switch (in.nn) {
+                case 0x07: in.op = OP_LD_VX_DT; break;
+                case 0x0A: in.op = OP_LD_KEY; break;
+                case 0x15: in.op = OP_LD_DT; break;
+                case 0x18: in.op = OP_LD_ST; break;
+                case 0x1E: in.op = OP_ADD_I; break;
+                case 0x29: in.op = OP_LD_F; break;
+                case 0x33: in.op = OP_LD_B; break;
+                case 0x55: in.op = OP_LD_MEM; break;
+                case 0x65: in.op = OP_LD_REGS; break;
+                case 0x30: in.op = extended ? OP_LD_HF : OP_INVALID; break;
+                case 0x75: in.op = extended ? OP_LD_R : OP_INVALID; break;
+                case 0x85: in.op = extended ? OP_LD_VX_R : OP_INVALID; break;
+                case 0x00: in.op = xo && in.x == 0 ? OP_LD_I_LONG : OP_INVALID; break;
+                case 0x01: in.op = xo ? OP_PLANE : OP_INVALID; break;
+                case 0x02: in.op = xo && in.x == 0 ? OP_AUDIO : OP_INVALID; break;
+                case 0x3A: in.op = xo ? OP_PITCH : OP_INVALID; break;
             }
             break;
-        // Opcode 5XY0: Skip next instruction if V[X] == V[Y].
-        case 5:
-            reg1 = get_nibble(opcode, 8, 0x0F00);
-            reg2 = get_nibble(opcode, 4, 0x00F0);
-            pc += 2;
-            if (V[reg1] == V[reg2]) {
-                pc += 2;
+    }
+    return in;
+}
+
+// Whether an instruction reads only CPU registers, memory, the delay timer and keypad and writes
+// nothing but V, I and pc. Jumps are left out, a loop body must run straight through.
+static bool is_pure(uint8_t op) {
+    switch (op) {
+        case OP_SE_IMM: case OP_SNE_IMM: case OP_SE_REG: case OP_SNE_REG:
+        case OP_LD_IMM: case OP_ADD_IMM: case OP_LD_REG: case OP_OR: case OP_AND: case OP_XOR:
+        case OP_ADD_REG: case OP_SUB: case OP_SHR: case OP_SUBN: case OP_SHL:
+        case OP_LD_I: case OP_ADD_I: case OP_LD_F: case OP_SKP: case OP_SKNP:
+        case OP_LD_VX_DT: case OP_LD_REGS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the jump at addr to target closes a loop which might only be waiting: it jumps back
+// over at most MAX_IDLE_BODY instructions which are all pure. Whether it actually waits is
+// only known at run time, see skip_idle().
+bool Chip8::is_idle_loop(uint16_t addr, uint16_t target) {
+    if (target > addr || addr - target > 2 * MAX_IDLE_BODY) {
+        return false;
+    }
+    for (uint16_t body = target; body < addr; body += 2) {
+        if (not is_pure(decode_opcode(body).op)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Called with pc at the target of the idle_loop jump at addr, runs iterations of the loop.
+// Once one ends back at the loop head with V and I unchanged, every further iteration within
+// this run() is identical, as the loop only reads state which does not change before the next
+// timer tick or keypad change. Those iterations are skipped, the rest of the budget which does
+// not make up a whole iteration is left to the caller. The first iteration may still pick up a
+// new timer value, loops which change V or I on the second one too, or no longer consist of
+// pure instructions, get the idle_loop flag of their jump cleared.
+// Returns the number of instructions executed or skipped, at most budget.
+int Chip8::skip_idle(int budget, uint16_t addr) {
+    uint16_t head = pc;
+    int steps = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint8_t head_V[16];
+        memcpy(head_V, V, sizeof(V));
+        uint16_t head_I = I;
+
+        int length = 0;
+        do {
+            if (steps == budget) {
+                return steps;
+            }
+            // Leaving the loop is what it waits for, nothing to skip then.
+            if (pc < head || pc > addr) {
+                return steps;
+            }
+            if (decoded[pc].op == OP_DECODE) {
+                decoded[pc] = decode(pc);
+            }
+            uint8_t op = decoded[pc].op;
+            if (length > MAX_IDLE_BODY || (op != OP_JP && not is_pure(op))) {
+                decoded[addr].idle_loop = false;
+                return steps;
             }
+            interpret(1);
+            steps++;
+            length++;
+        } while (pc != head);
+
+        if (I == head_I && memcmp(V, head_V, sizeof(V)) == 0) {
+            return steps + (budget - steps) / length * length;
+        }
+    }
+    decoded[addr].idle_loop = false;
+    return steps;
+}
+
+// Forgets every predecoded instruction. The entries past the end of memory only ever wrap pc.
+void Chip8::clear_decoded() {
+    memset(decoded, 0, sizeof(decoded));
+    for (int i = 4096; i < 4096 + WRAP_ENTRIES; i++) {
+        decoded[i].op = OP_WRAP;
+    }
+}
+
+// Drops the predecoded entries which were decoded from the byte at addr.
+// An opcode spans two bytes, so both the entry at addr and the one before it are affected,
+// the one before 0x000 being 0xFFF.
+void Chip8::invalidate(uint16_t addr) {
+    dirty_pages |= 1 << (addr >> 8);
+    decoded[addr].op = OP_DECODE;
+    decoded[(addr - 1) & 0xFFF].op = OP_DECODE;
+    if (jit) {
+        jit->on_write(addr);
+    }
+}
+
+// Switches to the interpreter instantiated for a variant. Translated code has the quirks of the
+// previous one baked in and is dropped, as are decoded instructions when the instruction set
+// changes. The high memory of XO-CHIP is allocated on first use.
+void Chip8::select_variant(Chip8Variant selected) {
+    if (jit && selected != variant) {
+        jit->flush();
+    }
+    if (selected != variant && (is_extended_variant(selected) || is_extended_variant(variant))) {
+        clear_decoded();
+    }
+    if (selected == Chip8Variant::XoChip && not high_memory) {
+        high_memory.reset(new uint8_t[0x10000 - sizeof(memory)]());
+    }
+    variant = selected;
+    switch (selected) {
+        case Chip8Variant::Cosmac:
+            interpreter = &Chip8::interpret_as<Chip8Variant::Cosmac, false>;
             break;
-        // Opcode 6XNN: Sets V[X] to NN.
-        case 6:
-            val = get_nibble(opcode, 0, 0x00FF);
-            reg = get_nibble(opcode, 8, 0x0F00);
-            V[reg] = val;
-            pc += 2;
+        case Chip8Variant::SuperChipQuirks:
+            interpreter = &Chip8::interpret_as<Chip8Variant::SuperChipQuirks, false>;
             break;
-        // Opcode 7XNN: Adds NN to V[X].
-        case 7:
-            val = get_nibble(opcode, 0, 0x00FF);
-            reg = get_nibble(opcode, 8, 0x0F00);
-            V[reg] += val;
-            pc += 2;
+        case Chip8Variant::XoChipQuirks:
+            interpreter = &Chip8::interpret_as<Chip8Variant::XoChipQuirks, false>;
             break;
-        // Arithmetic and Bitwise Operations (Opcodes starting with 8).
-        case 8:
-            val = get_nibble(opcode, 0, 0x000F);
-            switch (val) {
-                case 0:
-                    // 8XY0: Sets V[X] = V[Y].
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    V[reg1] = V[reg2];
-                    pc += 2;
-                    break;
-                case 1:
-                    // 8XY1: Sets V[X] = V[X] OR V[Y].
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    V[reg1] |= V[reg2];
-                    V[0xF] = 0;
-                    pc += 2;
-                    break;
-                case 2:
-                    // 8XY2: Sets V[X] = V[X] AND V[Y].
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    V[reg1] &= V[reg2];
-                    V[0xF] = 0;
-                    pc += 2;
-                    break;
-                case 3:
-                    // 8XY3: Sets V[X] = V[X] XOR V[Y].
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    V[reg1] ^= V[reg2];
-                    V[0xF] = 0;
-                    pc += 2;
-                    break;
-                case 4:
-                    // 8XY4: Adds V[Y] to V[X]. Sets V[F] to 1 if there is a carry.
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    if (V[reg1] + V[reg2] > 0xFF) {
-                        V[0xF] = 1;
-                    } else {
-                        V[0xF] = 0;
-                    }
-                    V[reg1] += V[reg2];
-                    V[reg1] = static_cast<int8_t>(V[reg1]);
-                    pc += 2;
-                    break;
-                case 5:
-                    // 8XY5: Subtracts V[Y] from V[X]. Sets V[F] to 0 if there is a borrow.
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    if (V[reg1] < V[reg2]) {
-                        V[0xF] = 0;
-                    } else {
-                        V[0xF] = 1;
-                    }
-                    V[reg1] = static_cast<uint8_t>(V[reg1]) - static_cast<uint8_t>(V[reg2]);
-                    pc += 2;
-                    break;
-                case 6:
-                    // 8XY6: Shifts V[X] right by one. Stores the least significant bit of V[X] in V[F].
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    V[0xF] = V[reg] & 0x1;
-                    V[reg] >>= 1;
-                    V[reg] = static_cast<uint8_t>(V[reg]);
-                    pc += 2;
-                    break;
-                case 7:
-                    // 8XY7: Sets V[X] = V[Y] - V[X]. Sets V[F] to 0 if there is a borrow.
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    if (V[reg1] > V[reg2]) {
-                        V[0xF] = 0;
-                    } else {
-                        V[0xF] = 1;
-                    }
-                    V[reg1] = static_cast<uint8_t>(V[reg2]) - static_cast<uint8_t>(V[reg1]);
-                    pc += 2;
-                    break;
-                case 0xE:
-                    // 8XYE: Shifts V[X] left by one. Stores the most significant bit of V[X] in V[F].
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    V[0xF] = V[reg] >> 7;
-                    V[0xF] = static_cast<uint8_t>(V[0xF]);
-                    V[reg] <<= 1;
-                    V[reg] = static_cast<uint8_t>(V[reg]);
-                    pc += 2;
-                    break;
-                default:
-                    std::cerr << "Invalid opcode: " << std::hex << opcode << std::endl;
-                    break;
-            }
+        case Chip8Variant::Classic:
+            interpreter = &Chip8::interpret_as<Chip8Variant::Classic, false>;
             break;
-        // Opcode 9XY0: Skip next instruction if V[X] != V[Y].
-        case 9:
-            reg1 = get_nibble(opcode, 8, 0x0F00);
-            reg2 = get_nibble(opcode, 4, 0x00F0);
-            pc += 2;
-            if (V[reg1] != V[reg2]) {
-                pc += 2;
-            }
+        case Chip8Variant::SuperChip:
+            interpreter = &Chip8::interpret_as<Chip8Variant::SuperChip, false>;
             break;
-        // Opcode ANNN: Sets I to the address NNN.
-        case 10:
-            I = opcode & 0x0FFF;
-            pc += 2;
+        case Chip8Variant::XoChip:
+            interpreter = &Chip8::interpret_as<Chip8Variant::XoChip, false>;
+            break;
+    }
+#if CHIP8_PROFILER
+    switch (selected) {
+        case Chip8Variant::Cosmac:
+            profiling_interpreter = &Chip8::interpret_as<Chip8Variant::Cosmac, true>;
             break;
-        // Opcode BNNN: Jumps to the address computed by adding NNN to V[0].
-        case 11:
-            pc = (opcode & 0x0FFF);
-            pc += V[0];
+        case Chip8Variant::SuperChipQuirks:
+            profiling_interpreter = &Chip8::interpret_as<Chip8Variant::SuperChipQuirks, true>;
             break;
-        // Opcode CXNN: Generates a random number, ANDs it with NN, and stores the result in V[X].
-        case 12: {
-            val = get_nibble(opcode, 0, 0x00FF);
-            reg = get_nibble(opcode, 8, 0x0F00);
-            int random_number = rand() % 256;
-            V[reg] = random_number & val;
-            pc += 2;
+        case Chip8Variant::XoChipQuirks:
+            profiling_interpreter = &Chip8::interpret_as<Chip8Variant::XoChipQuirks, true>;
+            break;
+        case Chip8Variant::Classic:
+            profiling_interpreter = &Chip8::interpret_as<Chip8Variant::Classic, true>;
             break;
+        case Chip8Variant::SuperChip:
+            profiling_interpreter = &Chip8::interpret_as<Chip8Variant::SuperChip, true>;
+            break;
+        case Chip8Variant::XoChip:
+            profiling_interpreter = &Chip8::interpret_as<Chip8Variant::XoChip, true>;
+            break;
+    }
+#endif
+}
+
+// Interprets the given number of cycles with the interpreter of the selected variant.
+void Chip8::interpret(int cycles) {
+    (this->*interpreter)(cycles);
+}
+
+// Emulates one cycle
+void Chip8::single_cycle() {
+    run(1);
+}
+
+// Emulates the given number of cycles with the selected engine.
+void Chip8::run(int cycles) {
+    if (cycles <= 0) {
+        return;
+    }
+#if CHIP8_PROFILER
+    if (profile) {
+        (this->*profiling_interpreter)(cycles);
+        pc &= 0xFFF;
+        cycle_count += cycles;
+        return;
+    }
+#endif
+    if (jit && not is_extended_variant(variant)) {
+        jit->run(cycles);
+    } else {
+        interpret(cycles);
+    }
+    // Both engines execute exactly the given number of instructions. The last one may have left
+    // pc just past the end of memory, where the next one would have wrapped it.
+    pc &= 0xFFF;
+    cycle_count += cycles;
+}
+
+// Emulates one 60 Hz frame: ipf instructions followed by one timer tick.
+void Chip8::run_frame(int ipf) {
+    run(ipf);
+    tick_timers();
+}
+
+// Counts both timers down by one, to be called 60 times per second.
+void Chip8::tick_timers() {
+    if (recording) {
+        recording->on_tick(cycle_count);
+    }
+#if CHIP8_PROFILER
+    if (profile) {
+        profile->end_frame();
+    }
+#endif
+    if (delay_timer > 0) {
+        delay_timer--;
+    }
+    if (sound_timer > 0) {
+        sound_timer--;
+    }
+}
+
+// Seeds the generator behind CXNN. Equal seeds give equal sequences on every host.
+void Chip8::seed_random(uint64_t seed) {
+    // splitmix64, spreading similar seeds apart and never leaving the xorshift state at zero.
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    random_state = z != 0 ? z : 1;
+}
+
+// Attaches a recording which is told about every keypad change and timer tick, nullptr detaches.
+void Chip8::set_recording(Chip8Recording *target) {
+    recording = target;
+}
+
+// Starts collecting a fresh profile, or stops and drops it. Fails in builds without the profiler.
+bool Chip8::set_profiling(bool enabled) {
+#if CHIP8_PROFILER
+    if (enabled) {
+        profile.reset(new Chip8Profile());
+    } else {
+        profile.reset();
+    }
+    return true;
+#else
+    return not enabled;
+#endif
+}
+
+// Profile collected since profiling was enabled, nullptr while not profiling.
+const Chip8Profile *Chip8::get_profile() {
+    return profile.get();
+}
+
+// Returns the next byte of the xorshift64* sequence.
+uint8_t Chip8::next_random() {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (uint8_t)((random_state * 0x2545F4914F6CDD1DULL) >> 56);
+}
+
+// Selects the engine used by run(). Returns false if it is not available on this platform,
+// in which case the current engine is kept.
+bool Chip8::set_engine(Chip8Engine engine) {
+    if (engine == Chip8Engine::Interpreter) {
+        jit.reset();
+        return true;
+    }
+    if (not jit) {
+        if (not Chip8Jit::supported()) {
+            return false;
         }
-        // Opcode DXYN: Draws a sprite at coordinates (V[X], V[Y]) with a height of N pixels.
-        case 13: {
-            reg1 = get_nibble(opcode, 8, 0x0F00);
-            reg2 = get_nibble(opcode, 4, 0x00F0);
-            int height = opcode & 0x000F;
-            int width = 8;
-            V[0xF] = 0;
+        std::unique_ptr<Chip8Jit> recompiler(new Chip8Jit(*this));
+        if (not recompiler->ok()) {
+            return false;
+        }
+        jit = std::move(recompiler);
+    }
+    return true;
+}
+
+Chip8Engine Chip8::get_engine() {
+    return jit ? Chip8Engine::Jit : Chip8Engine::Interpreter;
+}
+
+Chip8Variant Chip8::get_variant() {
+    return variant;
+}
+
+// Interprets the given number of cycles.
+// Each instruction is decoded once into decoded[] and then executed straight from there.
+// With GCC/Clang, handlers jump directly to the next handler (computed goto) instead of
+// returning to a central switch, which keeps the dispatch branches predictable.
+#if defined(__GNUC__)
+#define CHIP8_THREADED_DISPATCH 1
+#else
+#define CHIP8_THREADED_DISPATCH 0
+#endif
+
+// Every variant has its own instantiation, with the quirks of the variant resolved at compile time.
+// The PROFILE instantiations additionally count every instruction into profile, the others
+// contain no trace of it.
+template <Chip8Variant VARIANT, bool PROFILE>
+void Chip8::interpret_as(int cycles) {
+    constexpr Chip8Quirks quirks = variant_quirks<VARIANT>;
+    constexpr bool extended = is_extended_variant(VARIANT);
+    int remaining = cycles;
+    const Instruction *in;
+
+// Counts the instruction about to run, entries still to be decoded are counted once they are.
+#define PROFILE_INSTRUCTION() \
+    if constexpr (PROFILE) { \
+        if (in->op != OP_DECODE && in->op != OP_WRAP) { \
+            profile->op_counts[in->op]++; \
+            profile->pc_counts[pc & 0xFFF]++; \
+            profile->instructions++; \
+        } \
+    }
+
+#if CHIP8_THREADED_DISPATCH
+    static const void *dispatch_table[] = {
+#define CHIP8_OP_LABEL(name) &&handler_##name,
+        CHIP8_OPS(CHIP8_OP_LABEL)
+#undef CHIP8_OP_LABEL
+    };
+#define HANDLER(name) handler_##name:
+#define DISPATCH() \
+    do { \
+        if (--remaining < 0) return; \
+        in = &decoded[pc]; \
+        PROFILE_INSTRUCTION(); \
+        goto *dispatch_table[in->op]; \
+    } while (0)
 
-            // X & Y coordinates.
-            int x = V[reg1];
-            int y = V[reg2];
-
-            for (int i = 0; i < height; i++) {
-                int pixel = memory[I + i];
-                for (int j = 0; j < width; j++) {
-                    if ((pixel & (0x80 >> j)) != 0) {
-                        int index = ((x + j) + ((y + i) * 64)) % 2048;
-                        if (display[index] == 1) {
-                            V[0xF] = 1;
-                        }
-                        display[index] ^= 1;
-                    }
+    DISPATCH();
+#else
+#define HANDLER(name) case OP_##name:
+#define DISPATCH() goto dispatch
+
+dispatch:
+    if (--remaining < 0) return;
+    in = &decoded[pc];
+    PROFILE_INSTRUCTION();
+    switch (in->op) {
+#endif
+
+// Finishes an instruction. Timers are not touched here, see tick_timers().
+#define NEXT() DISPATCH()
+
+// Distance a skip moves pc by when taken. XO-CHIP skips all 4 bytes of a long ANNN (F000 NNNN).
+#define SKIP() \
+    (VARIANT == Chip8Variant::XoChip && memory[(pc + 2) & 0xFFF] == 0xF0 && memory[(pc + 3) & 0xFFF] == 0x00 ? 6 : 4)
+
+// Stops on the current instruction with a fault, pc is left on it. Nothing can change before
+// run() returns, so like a blocked FX0A it spends the whole budget right away.
+#define FAULT(kind) \
+    do { \
+        fault = kind; \
+        if constexpr (not PROFILE) { \
+            remaining = 0; \
+        } \
+        NEXT(); \
+    } while (0)
+
+    // Entry not decoded yet (or invalidated), decode and run it without counting a cycle.
+    HANDLER(DECODE) {
+        decoded[pc] = decode(pc);
+        remaining++;
+        DISPATCH();
+    }
+    // pc went past the end of memory, continue at its start without counting a cycle.
+    HANDLER(WRAP) {
+        pc &= 0xFFF;
+        remaining++;
+        DISPATCH();
+    }
+    // Reported once, the machine stays on it.
+    HANDLER(INVALID) {
+        if (fault != Chip8Fault::InvalidOpcode) {
+            std::cerr << "Invalid opcode: " << std::hex << ((memory[pc] << 8) | memory[(pc + 1) & 0xFFF]) << std::endl;
+        }
+        FAULT(Chip8Fault::InvalidOpcode);
+    }
+    // 0x00E0: Clears the entire display, on the extended machines the selected planes.
+    HANDLER(CLS) {
+        if constexpr (extended) {
+            for (int plane = 0; plane < 2; plane++) {
+                if (plane_mask & (1 << plane)) {
+                    memset(planes[plane], 0, sizeof(planes[plane]));
                 }
             }
-
-            draw_flag = true;
-            pc += 2;
-            break;
+        } else {
+            memset(display, 0, sizeof(display));
         }
-        // Opcodes starting with E (Keypad operations).
-        // EX9E: Skip next instruction if key in V[X] is pressed.
-        // EXA1: Skip next instruction if key in V[X] isn't pressed.
-        case 14:
-            val = get_nibble(opcode, 0, 0x00FF);
-            switch (val) {
-                case 0x9E:
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    pc += 2;
-                    if (keypad[V[reg]] != 0) {
-                        pc += 2;
-                    }
-                    break;
-                case 0xA1:
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    pc += 2;
-                    if (keypad[V[reg]] == 0) {
-                        pc += 2;
-                    }
-                    break;
-                default:
-                    std::cerr << "Invalid opcode: " << std::hex << opcode;
-                    break;
+        dirty_rows = 0xFFFFFFFF;
+        draw_flag = true;
+        pc += 2;
+        NEXT();
+    }
+    // 0x00EE: Returns control after a subroutine call (pops the return address from stack).
+    HANDLER(RET) {
+        if (sp == 0) {
+            FAULT(Chip8Fault::StackUnderflow);
+        }
+        sp--;
+        pc = stack[sp];
+        pc += 2;
+        NEXT();
+    }
+    // Opcode 1NNN: Jump to address NNN.
+    //          Jumps closing an idle loop skip its remaining iterations, see skip_idle().
+    HANDLER(JP) {
+        if constexpr (not PROFILE) {
+            if (in->idle_loop && remaining > 0) {
+                uint16_t addr = pc;
+                pc = in->nnn;
+                remaining -= skip_idle(remaining, addr);
+                NEXT();
             }
-            break;
-        // Opcodes starting with F (Timer and Memory operations).
-        // FX07: Sets V[X] to the value of the delay timer.
-        // FX0A: Awaits a key press and stores it in V[X].
-        // FX15: Sets the delay timer to V[X].
-        // FX1E: Adds V[X] to I.
-        // FX18: Increment to next instruction.
-        // FX29: Sets I to the sprite location for the character in V[X].
-        // FX33: Stores the BCD representation of V[X] in memory.
-        // FX55: Stores registers V0 through V[X] in memory starting at I.
-        // FX65: Fills registers V0 through V[X] with values from memory starting at I.
-        case 15: {
-            val = get_nibble(opcode, 0, 0x00FF);
-            switch (val) {
-                case 0x07:
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    V[reg] = delay_timer;
-                    pc += 2;
-                    break;
-                case 0x0A: {
-                    bool key_pressed = false;
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    for (int i = 0; i < 16; i++) {
-                        if (keypad[i] != 0) {
-                            key_pressed = true;
-                            V[reg] = (uint8_t)i;
-                        }
-                    }
-                    if (key_pressed) {
-                        pc += 2;
-                    }
-                    break;
+        }
+        pc = in->nnn;
+        NEXT();
+    }
+    // Opcode 2NNN: Call subroutine at NNN.
+    //          Push current pc onto the stack, then set pc to NNN.
+    HANDLER(CALL) {
+        if (sp >= 16) {
+            FAULT(Chip8Fault::StackOverflow);
+        }
+        stack[sp] = pc;
+        sp++;
+        pc = in->nnn;
+        NEXT();
+    }
+    // Opcode 3XNN: Skip next instruction if V[X] == NN.
+    HANDLER(SE_IMM) {
+        pc += (V[in->x] == in->nn) ? SKIP() : 2;
+        NEXT();
+    }
+    // Opcode 4XNN: Skip next instruction if V[X] != NN.
+    HANDLER(SNE_IMM) {
+        pc += (V[in->x] != in->nn) ? SKIP() : 2;
+        NEXT();
+    }
+    // Opcode 5XY0: Skip next instruction if V[X] == V[Y].
+    HANDLER(SE_REG) {
+        pc += (V[in->x] == V[in->y]) ? SKIP() : 2;
+        NEXT();
+    }
+    // Opcode 6XNN: Sets V[X] to NN.
+    HANDLER(LD_IMM) {
+        V[in->x] = in->nn;
+        pc += 2;
+        NEXT();
+    }
+    // Opcode 7XNN: Adds NN to V[X].
+    HANDLER(ADD_IMM) {
+        V[in->x] += in->nn;
+        pc += 2;
+        NEXT();
+    }
+    // 8XY0: Sets V[X] = V[Y].
+    HANDLER(LD_REG) {
+        V[in->x] = V[in->y];
+        pc += 2;
+        NEXT();
+    }
+    // 8XY1: Sets V[X] = V[X] OR V[Y].
+    //       With the logic_resets_vf quirk, 8XY1 to 8XY3 clear V[F].
+    HANDLER(OR) {
+        V[in->x] |= V[in->y];
+        if constexpr (quirks.logic_resets_vf) {
+            V[0xF] = 0;
+        }
+        pc += 2;
+        NEXT();
+    }
+    // 8XY2: Sets V[X] = V[X] AND V[Y].
+    HANDLER(AND) {
+        V[in->x] &= V[in->y];
+        if constexpr (quirks.logic_resets_vf) {
+            V[0xF] = 0;
+        }
+        pc += 2;
+        NEXT();
+    }
+    // 8XY3: Sets V[X] = V[X] XOR V[Y].
+    HANDLER(XOR) {
+        V[in->x] ^= V[in->y];
+        if constexpr (quirks.logic_resets_vf) {
+            V[0xF] = 0;
+        }
+        pc += 2;
+        NEXT();
+    }
+    // 8XY4: Adds V[Y] to V[X]. Sets V[F] to 1 if there is a carry.
+    // V[F] is written last, here and in the other flag setting opcodes, so 8FY4 leaves the carry.
+    HANDLER(ADD_REG) {
+        int sum = V[in->x] + V[in->y];
+        V[in->x] = (uint8_t)sum;
+        V[0xF] = sum > 0xFF ? 1 : 0;
+        pc += 2;
+        NEXT();
+    }
+    // 8XY5: Subtracts V[Y] from V[X]. Sets V[F] to 0 if there is a borrow.
+    HANDLER(SUB) {
+        uint8_t flag = (V[in->x] < V[in->y]) ? 0 : 1;
+        V[in->x] = V[in->x] - V[in->y];
+        V[0xF] = flag;
+        pc += 2;
+        NEXT();
+    }
+    // 8XY6: Shifts V[X] (or V[Y], a quirk) right by one into V[X]. Stores the shifted out bit in V[F].
+    HANDLER(SHR) {
+        int source = quirks.shift_reads_vy ? in->y : in->x;
+        uint8_t value = V[source];
+        V[in->x] = value >> 1;
+        V[0xF] = value & 0x1;
+        pc += 2;
+        NEXT();
+    }
+    // 8XY7: Sets V[X] = V[Y] - V[X]. Sets V[F] to 0 if there is a borrow.
+    HANDLER(SUBN) {
+        uint8_t flag = (V[in->x] > V[in->y]) ? 0 : 1;
+        V[in->x] = V[in->y] - V[in->x];
+        V[0xF] = flag;
+        pc += 2;
+        NEXT();
+    }
+    // 8XYE: Shifts V[X] (or V[Y], a quirk) left by one into V[X]. Stores the shifted out bit in V[F].
+    HANDLER(SHL) {
+        int source = quirks.shift_reads_vy ? in->y : in->x;
+        uint8_t value = V[source];
+        V[in->x] = (uint8_t)(value << 1);
+        V[0xF] = value >> 7;
+        pc += 2;
+        NEXT();
+    }
+    // Opcode 9XY0: Skip next instruction if V[X] != V[Y].
+    HANDLER(SNE_REG) {
+        pc += (V[in->x] != V[in->y]) ? SKIP() : 2;
+        NEXT();
+    }
+    // Opcode ANNN: Sets I to the address NNN.
+    HANDLER(LD_I) {
+        I = in->nnn;
+        pc += 2;
+        NEXT();
+    }
+    // Opcode BNNN: Jumps to the address computed by adding NNN to V[0].
+    //             With the jump_adds_vx quirk it is BXNN, adding XNN to V[X].
+    HANDLER(JP_V0) {
+        pc = (in->nnn + V[quirks.jump_adds_vx ? in->x : 0]) & 0xFFF;
+        NEXT();
+    }
+    // Opcode CXNN: Generates a random number, ANDs it with NN, and stores the result in V[X].
+    HANDLER(RND) {
+        V[in->x] = next_random() & in->nn;
+        pc += 2;
+        NEXT();
+    }
+    // Opcode DXYN: Draws a sprite at coordinates (V[X], V[Y]) with a height of N pixels.
+    //             The extended machines draw on their planes, DXY0 drawing a 16x16 sprite.
+    HANDLER(DRW) {
+        if constexpr (extended) {
+            uint64_t flipped = 0;
+            V[0xF] = draw_planes<VARIANT, PROFILE>(V[in->x], V[in->y], in->n, flipped);
+            if constexpr (PROFILE) {
+                profile->draws++;
+                profile->frame_draws++;
+                profile->pixels += flipped;
+                profile->frame_pixels += flipped;
+            }
+        } else {
+            if constexpr (PROFILE) {
+                // Every set sprite bit landing on the screen flips a pixel, clipped ones do not.
+                uint64_t flipped = 0;
+                int x = V[in->x] % 64;
+                int height = quirks.sprites_wrap ? in->n : std::min<int>(in->n, 32 - V[in->y] % 32);
+                for (int i = 0; i < height; i++) {
+                    uint64_t sprite = (uint64_t)memory[(I + i) & 0xFFF] << 56;
+                    flipped += __builtin_popcountll(quirks.sprites_wrap ? sprite : sprite >> x);
                 }
-                case 0x15:
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    delay_timer = V[reg];
-                    pc += 2;
-                    break;
-                case 0x18:
-                    pc += 2;
-                    break;
-                case 0x1E:
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    if (I + V[reg] > 0xFFF) {
-                        V[0xF] = 1;
-                    } else {
-                        V[0xF] = 0;
-                    }
-                    I += V[reg];
-                    I = (uint16_t)I;
-                    pc += 2;
-                    break;
-                case 0x29:
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    I = V[reg] * 0x5;
-                    pc += 2;
-                    break;
-                case 0x33:
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    memory[I] = (uint8_t)(V[reg] / 100);
-                    memory[I + 1] = (uint8_t)((V[reg] / 10) % 10);
-                    memory[I + 2] = (uint8_t)(V[reg] % 10);
-                    pc += 2;
-                    break;
-                case 0x55:
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    for (int i = 0; i <= reg; i++) {
-                        memory[I + i] = V[i];
-                    }
-                    I = I + reg + 1;
-                    I = (uint16_t)I;
-                    pc += 2;
-                    break;
-                case 0x65:
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    for (int i = 0; i <= reg; i++) {
-                        V[i] = memory[I + i];
-                    }
-                    I = I + reg + 1;
-                    I = (uint16_t)I;
-                    pc += 2;
-                    break;
-                default:
-                    std::cerr << "Invalid opcode: " << std::hex << opcode << std::endl;
-                    break;
+                profile->draws++;
+                profile->frame_draws++;
+                profile->pixels += flipped;
+                profile->frame_pixels += flipped;
             }
-            break;
+            V[0xF] = draw_sprite<quirks.sprites_wrap>(V[in->x], V[in->y], in->n);
         }
-        default:
-            std::cerr << "Invalid opcode: " << std::hex << opcode << std::endl;
-            break;
+        pc += 2;
+        NEXT();
+    }
+    // EX9E: Skip next instruction if key in V[X] is pressed. Only the low nibble names the key.
+    HANDLER(SKP) {
+        pc += (keypad[V[in->x] & 0xF] != 0) ? SKIP() : 2;
+        NEXT();
+    }
+    // EXA1: Skip next instruction if key in V[X] isn't pressed.
+    HANDLER(SKNP) {
+        pc += (keypad[V[in->x] & 0xF] == 0) ? SKIP() : 2;
+        NEXT();
+    }
+    // FX07: Sets V[X] to the value of the delay timer.
+    HANDLER(LD_VX_DT) {
+        V[in->x] = delay_timer;
+        pc += 2;
+        NEXT();
+    }
+    // FX0A: Awaits a key press and stores it in V[X].
+    //       Without a key pressed, pc stays on this instruction so it is executed again.
+    HANDLER(LD_KEY) {
+        bool key_pressed = false;
+        for (int i = 0; i < 16; i++) {
+            if (keypad[i] != 0) {
+                key_pressed = true;
+                V[in->x] = (uint8_t)i;
+            }
+        }
+        if (key_pressed) {
+            pc += 2;
+        } else if constexpr (not PROFILE) {
+            // No key can go down before this run() returns, wait out the budget right away.
+            remaining = 0;
+        }
+        NEXT();
+    }
+    // FX15: Sets the delay timer to V[X].
+    HANDLER(LD_DT) {
+        delay_timer = V[in->x];
+        pc += 2;
+        NEXT();
+    }
+    // FX18: Sets the sound timer to V[X].
+    HANDLER(LD_ST) {
+        sound_timer = V[in->x];
+        pc += 2;
+        NEXT();
+    }
+    // FX1E: Adds V[X] to I. The extended machines leave V[F] alone.
+    HANDLER(ADD_I) {
+        int sum = I + V[in->x];
+        I = (uint16_t)sum;
+        if constexpr (not extended) {
+            V[0xF] = sum > 0xFFF ? 1 : 0;
+        }
+        pc += 2;
+        NEXT();
+    }
+    // FX29: Sets I to the sprite location for the character in V[X].
+    HANDLER(LD_F) {
+        I = V[in->x] * 0x5;
+        pc += 2;
+        NEXT();
+    }
+    // FX33: Stores the BCD representation of V[X] in memory.
+    //       Like every access at I, the addresses wrap around the end of memory.
+    HANDLER(LD_B) {
+        uint8_t value = V[in->x];
+        uint8_t digits[3] = {(uint8_t)(value / 100), (uint8_t)((value / 10) % 10), (uint8_t)(value % 10)};
+        for (int i = 0; i < 3; i++) {
+            store_byte<VARIANT>(I + i, digits[i]);
+        }
+        pc += 2;
+        NEXT();
+    }
+    // FX55: Stores registers V0 through V[X] in memory starting at I.
+    //       With the load_store_moves_i quirk, I is left pointing past V[X].
+    HANDLER(LD_MEM) {
+        int reg = in->x;
+        for (int i = 0; i <= reg; i++) {
+            store_byte<VARIANT>(I + i, V[i]);
+        }
+        if constexpr (quirks.load_store_moves_i) {
+            I = I + reg + 1;
+        }
+        pc += 2;
+        NEXT();
+    }
+    // FX65: Fills registers V0 through V[X] with values from memory starting at I.
+    //       With the load_store_moves_i quirk, I is left pointing past V[X].
+    HANDLER(LD_REGS) {
+        int reg = in->x;
+        for (int i = 0; i <= reg; i++) {
+            V[i] = load_byte<VARIANT>(I + i);
+        }
+        if constexpr (quirks.load_store_moves_i) {
+            I = I + reg + 1;
+        }
+        pc += 2;
+        NEXT();
+    }
+    // 00CN: Scrolls the display down by N pixels. In lo-res, like every scroll, by N lo-res pixels.
+    HANDLER(SCD) {
+        scroll_planes(in->n * (hires ? 1 : 2), 0);
+        pc += 2;
+        NEXT();
+    }
+    // 00DN: Scrolls the display up by N pixels (XO-CHIP).
+    HANDLER(SCU) {
+        scroll_planes(-in->n * (hires ? 1 : 2), 0);
+        pc += 2;
+        NEXT();
+    }
+    // 00FB: Scrolls the display right by 4 pixels.
+    HANDLER(SCR) {
+        scroll_planes(0, hires ? 4 : 8);
+        pc += 2;
+        NEXT();
+    }
+    // 00FC: Scrolls the display left by 4 pixels.
+    HANDLER(SCL) {
+        scroll_planes(0, hires ? -4 : -8);
+        pc += 2;
+        NEXT();
+    }
+    // 00FD: Exits the interpreter, the machine stops here like on a fault.
+    HANDLER(EXIT) {
+        FAULT(Chip8Fault::Exited);
+    }
+    // 00FE, 00FF: Switch to lo-res and hi-res. XO-CHIP clears the display on the switch, SUPER-CHIP
+    //             leaves it as it is.
+    HANDLER(LOW) {
+        hires = false;
+        if constexpr (VARIANT == Chip8Variant::XoChip) {
+            memset(planes, 0, sizeof(planes));
+        }
+        draw_flag = true;
+        pc += 2;
+        NEXT();
+    }
+    HANDLER(HIGH) {
+        hires = true;
+        if constexpr (VARIANT == Chip8Variant::XoChip) {
+            memset(planes, 0, sizeof(planes));
+        }
+        draw_flag = true;
+        pc += 2;
+        NEXT();
+    }
+    // FX30: Sets I to the 8x10 sprite of the hex digit in V[X].
+    HANDLER(LD_HF) {
+        I = BIG_FONT_ADDRESS + (V[in->x] & 0xF) * 10;
+        pc += 2;
+        NEXT();
+    }
+    // FX75: Stores registers V0 through V[X] in the RPL flags.
+    HANDLER(LD_R) {
+        memcpy(flags, V, in->x + 1);
+        pc += 2;
+        NEXT();
+    }
+    // FX85: Fills registers V0 through V[X] from the RPL flags.
+    HANDLER(LD_VX_R) {
+        memcpy(V, flags, in->x + 1);
+        pc += 2;
+        NEXT();
+    }
+    // 5XY2: Stores registers V[X] through V[Y] in memory starting at I, in reverse if X > Y.
+    //       I is left as it is (XO-CHIP).
+    HANDLER(SAVE) {
+        int step = in->x <= in->y ? 1 : -1;
+        int count = (in->x <= in->y ? in->y - in->x : in->x - in->y) + 1;
+        for (int i = 0; i < count; i++) {
+            store_byte<VARIANT>(I + i, V[in->x + i * step]);
+        }
+        pc += 2;
+        NEXT();
+    }
+    // 5XY3: Fills registers V[X] through V[Y] from memory starting at I, in reverse if X > Y.
+    HANDLER(LOAD) {
+        int step = in->x <= in->y ? 1 : -1;
+        int count = (in->x <= in->y ? in->y - in->x : in->x - in->y) + 1;
+        for (int i = 0; i < count; i++) {
+            V[in->x + i * step] = load_byte<VARIANT>(I + i);
+        }
+        pc += 2;
+        NEXT();
+    }
+    // F000 NNNN: Sets I to the 16-bit address in the following two bytes (XO-CHIP). They are read
+    //            here rather than decoded, so writing them takes effect like any other write.
+    HANDLER(LD_I_LONG) {
+        I = (uint16_t)((memory[(pc + 2) & 0xFFF] << 8) | memory[(pc + 3) & 0xFFF]);
+        pc += 4;
+        NEXT();
+    }
+    // FN01: Selects the planes N (0 to 3) later CLS, DXYN and scrolls act on (XO-CHIP).
+    HANDLER(PLANE) {
+        plane_mask = in->x & 0x3;
+        pc += 2;
+        NEXT();
+    }
+    // F002: Loads the 16 bytes at I into the audio pattern (XO-CHIP).
+    HANDLER(AUDIO) {
+        for (int i = 0; i < 16; i++) {
+            audio_pattern[i] = load_byte<VARIANT>(I + i);
+        }
+        pc += 2;
+        NEXT();
+    }
+    // FX3A: Sets the pitch of the audio pattern to V[X] (XO-CHIP).
+    HANDLER(PITCH) {
+        pitch = V[in->x];
+        pc += 2;
+        NEXT();
     }
 
-    if (delay_timer > 0) {
-        delay_timer--;
+#if !CHIP8_THREADED_DISPATCH
+    }
+#endif
+
+#undef FAULT
+#undef SKIP
+#undef NEXT
+#undef DISPATCH
+#undef HANDLER
+#undef PROFILE_INSTRUCTION
+}
+
+// The regular instantiations are also called by the JIT, the profiling ones only by run().
+template void Chip8::interpret_as<Chip8Variant::Cosmac, false>(int);
+template void Chip8::interpret_as<Chip8Variant::SuperChipQuirks, false>(int);
+template void Chip8::interpret_as<Chip8Variant::XoChipQuirks, false>(int);
+template void Chip8::interpret_as<Chip8Variant::Classic, false>(int);
+template void Chip8::interpret_as<Chip8Variant::SuperChip, false>(int);
+template void Chip8::interpret_as<Chip8Variant::XoChip, false>(int);
+#if CHIP8_PROFILER
+template void Chip8::interpret_as<Chip8Variant::Cosmac, true>(int);
+template void Chip8::interpret_as<Chip8Variant::SuperChipQuirks, true>(int);
+template void Chip8::interpret_as<Chip8Variant::XoChipQuirks, true>(int);
+template void Chip8::interpret_as<Chip8Variant::Classic, true>(int);
+template void Chip8::interpret_as<Chip8Variant::SuperChip, true>(int);
+template void Chip8::interpret_as<Chip8Variant::XoChip, true>(int);
+#endif
+
+// Draws the sprite of the given height stored at I, at coordinates (x, y).
+// Each sprite byte is shifted into place within its 64-bit row, so a whole row is tested for
+// collision with one AND and drawn with one XOR. The start position wraps around the screen.
+// With WRAP, sprites crossing an edge wrap around too (the byte is rotated rather than shifted),
+// otherwise they are clipped. Returns 1 if any set pixel got cleared, 0 otherwise.
+template <bool WRAP>
+uint8_t Chip8::draw_sprite(int x, int y, int height) {
+    x %= 64;
+    y %= 32;
+    uint64_t collision = 0;
+
+    if (not WRAP && height > 32 - y) {
+        height = 32 - y;
+    }
+    for (int i = 0; i < height; i++) {
+        uint64_t sprite = (uint64_t)memory[(I + i) & 0xFFF] << 56;
+        if constexpr (WRAP) {
+            sprite = (sprite >> x) | (sprite << ((64 - x) % 64));
+        } else {
+            sprite >>= x;
+        }
+        uint64_t &row = display[(y + i) % 32];
+        collision |= row & sprite;
+        row ^= sprite;
+        dirty_rows |= 1u << ((y + i) % 32);
+    }
+
+    draw_flag = true;
+    return collision != 0 ? 1 : 0;
+}
+
+// The lockstep engine picks one of them at run time.
+template uint8_t Chip8::draw_sprite<false>(int, int, int);
+template uint8_t Chip8::draw_sprite<true>(int, int, int);
+
+// Reads the byte at addr, wrapping around the end of memory: 4 KB, or 64 KB on XO-CHIP.
+template <Chip8Variant VARIANT>
+uint8_t Chip8::load_byte(uint32_t addr) {
+    if constexpr (VARIANT == Chip8Variant::XoChip) {
+        addr &= 0xFFFF;
+        return addr < sizeof(memory) ? memory[addr] : high_memory[addr - sizeof(memory)];
+    }
+    return memory[addr & 0xFFF];
+}
+
+// Writes the byte at addr, wrapping around like load_byte(). Only the first 4 KB hold code,
+// writes there invalidate what was decoded from them.
+template <Chip8Variant VARIANT>
+void Chip8::store_byte(uint32_t addr, uint8_t value) {
+    if constexpr (VARIANT == Chip8Variant::XoChip) {
+        addr &= 0xFFFF;
+        if (addr >= sizeof(memory)) {
+            high_memory[addr - sizeof(memory)] = value;
+            return;
+        }
+    }
+    addr &= 0xFFF;
+    memory[addr] = value;
+    invalidate((uint16_t)addr);
+}
+
+// Spreads the low 32 bits of value apart, each one doubled into two adjacent bits.
+static uint64_t double_bits(uint64_t value) {
+    uint64_t doubled = 0;
+    for (int i = 0; i < 32; i++) {
+        doubled |= ((value >> i) & 1) * (3ULL << (2 * i));
+    }
+    return doubled;
+}
+
+// Places a row of sprite pixels, left aligned in bits, at column x of a 128 pixel display row
+// of the words left and right. Pixels past the right edge wrap around to the left one, or are
+// dropped.
+static void place_row(uint64_t bits, int x, bool wrap, uint64_t &left, uint64_t &right) {
+    if (x < 64) {
+        left = bits >> x;
+        right = x == 0 ? 0 : bits << (64 - x);
+    } else {
+        right = bits >> (x - 64);
+        left = wrap && x > 64 ? bits << (128 - x) : 0;
+    }
+}
+
+// Draws the sprite stored at I on the planes selected by plane_mask of an extended machine, at
+// coordinates (x, y) of the current resolution. A height of 0 draws a 16x16 sprite of 2-byte
+// rows. XO-CHIP reads the sprite of each selected plane after the one of the previous plane.
+// In lo-res every sprite pixel covers 2x2 display pixels. Sprites crossing an edge wrap or are
+// clipped as the sprites_wrap quirk says, the start position always wraps.
+// Returns the new V[F]: 1 if any set pixel got cleared, 0 otherwise, but for SUPER-CHIP in
+// hi-res, which counts the sprite rows which collided or were clipped at the bottom.
+// With PROFILE, flipped is increased by the sprite pixels landing on the screen.
+template <Chip8Variant VARIANT, bool PROFILE>
+uint8_t Chip8::draw_planes(int x, int y, int n, uint64_t &flipped) {
+    constexpr bool WRAP = variant_quirks<VARIANT>.sprites_wrap;
+    int scale = hires ? 1 : 2;
+    int width = 128 / scale;
+    int height = 64 / scale;
+    x %= width;
+    y %= height;
+    int rows = n == 0 ? 16 : n;
+    int columns = n == 0 ? 16 : 8;
+
+    uint32_t addr = I;
+    bool collided = false;
+    int collided_rows = 0;
+    int clipped_rows = 0;
+    for (int plane = 0; plane < 2; plane++) {
+        if (not (plane_mask & (1 << plane))) {
+            continue;
+        }
+        for (int i = 0; i < rows; i++) {
+            int row = y + i;
+            if (row >= height) {
+                if (not WRAP) {
+                    clipped_rows++;
+                    continue;
+                }
+                row -= height;
+            }
+            uint64_t bits = n == 0 ? (load_byte<VARIANT>(addr + 2 * i) << 8) | load_byte<VARIANT>(addr + 2 * i + 1)
+                                   : load_byte<VARIANT>(addr + i);
+            if (scale == 2) {
+                bits = double_bits(bits);
+            }
+            uint64_t left, right;
+            place_row(bits << (64 - columns * scale), x * scale, WRAP, left, right);
+            if constexpr (PROFILE) {
+                flipped += (uint64_t)(__builtin_popcountll(left) + __builtin_popcountll(right)) / scale;
+            }
+            bool row_collided = false;
+            for (int line = row * scale; line < (row + 1) * scale; line++) {
+                uint64_t *display_row = &planes[plane][2 * line];
+                row_collided |= ((display_row[0] & left) | (display_row[1] & right)) != 0;
+                display_row[0] ^= left;
+                display_row[1] ^= right;
+            }
+            collided |= row_collided;
+            collided_rows += row_collided ? 1 : 0;
+        }
+        addr += rows * (columns / 8);
+    }
+
+    draw_flag = true;
+    if (VARIANT == Chip8Variant::SuperChip && hires) {
+        return (uint8_t)(collided_rows + clipped_rows);
+    }
+    return collided ? 1 : 0;
+}
+
+// Scrolls the planes selected by plane_mask down (up if negative) and right (left if negative)
+// by the given number of display pixels, filling in blank pixels.
+void Chip8::scroll_planes(int down, int right) {
+    for (int plane = 0; plane < 2; plane++) {
+        if (not (plane_mask & (1 << plane))) {
+            continue;
+        }
+        uint64_t *rows = planes[plane];
+        if (down > 0) {
+            memmove(rows + 2 * down, rows, (64 - down) * 2 * sizeof(uint64_t));
+            memset(rows, 0, down * 2 * sizeof(uint64_t));
+        } else if (down < 0) {
+            memmove(rows, rows - 2 * down, (64 + down) * 2 * sizeof(uint64_t));
+            memset(rows + 2 * (64 + down), 0, -down * 2 * sizeof(uint64_t));
+        }
+        for (int line = 0; line < 64 && right != 0; line++) {
+            uint64_t left_word = rows[2 * line];
+            uint64_t right_word = rows[2 * line + 1];
+            if (right > 0) {
+                rows[2 * line] = left_word >> right;
+                rows[2 * line + 1] = (right_word >> right) | (left_word << (64 - right));
+            } else {
+                rows[2 * line] = (left_word << -right) | (right_word >> (64 + right));
+                rows[2 * line + 1] = right_word << -right;
+            }
+        }
     }
+    draw_flag = true;
 }
 
 // Destructor
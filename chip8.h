@@ -1,13 +1,161 @@
 #ifndef CHIP8_CHIP8EMULATOR_H
 #define CHIP8_CHIP8EMULATOR_H
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
 
+class Chip8Jit;
+class Chip8Recording;
+class Chip8Checkpoint;
+class Chip8RomCache;
+struct Chip8RomAnalysis;
+struct Chip8Profile;
+
+// Builds with CHIP8_PROFILER set to 0 leave out the profiling interpreter altogether,
+// set_profiling() then always fails.
+#ifndef CHIP8_PROFILER
+#define CHIP8_PROFILER 0
+#endif
+
+// Handlers of the interpreter, in dispatch table order.
+// OP_DECODE must stay first so a zeroed Instruction means "not decoded yet".
+// The handlers from SCD on are only decoded for the SUPER-CHIP and XO-CHIP machines.
+#define CHIP8_OPS(X) \
+    X(DECODE) X(INVALID) X(WRAP) \
+    X(CLS) X(RET) X(JP) X(CALL) X(SE_IMM) X(SNE_IMM) X(SE_REG) X(LD_IMM) X(ADD_IMM) \
+    X(LD_REG) X(OR) X(AND) X(XOR) X(ADD_REG) X(SUB) X(SHR) X(SUBN) X(SHL) X(SNE_REG) \
+    X(LD_I) X(JP_V0) X(RND) X(DRW) X(SKP) X(SKNP) \
+    X(LD_VX_DT) X(LD_KEY) X(LD_DT) X(LD_ST) X(ADD_I) X(LD_F) X(LD_B) X(LD_MEM) X(LD_REGS) \
+    X(SCD) X(SCU) X(SCR) X(SCL) X(EXIT) X(LOW) X(HIGH) X(LD_HF) X(LD_R) X(LD_VX_R) \
+    X(SAVE) X(LOAD) X(LD_I_LONG) X(PLANE) X(AUDIO) X(PITCH)
+
+enum Op : uint8_t {
+#define CHIP8_OP_ENUM(name) OP_##name,
+    CHIP8_OPS(CHIP8_OP_ENUM)
+#undef CHIP8_OP_ENUM
+    OP_COUNT
+};
+
+// Execution engines, selected with Chip8::set_engine.
+// Both produce identical machine state, the JIT is only available on x86-64.
+enum class Chip8Engine {
+    Interpreter,
+    Jit
+};
+
+// Variants of the machine, selected when loading a ROM, each one running on its own instantiation
+// of the interpreter.
+// - Cosmac, SuperChipQuirks, XoChipQuirks, Classic: The 64x32 CHIP-8 machine with 4 KB of memory,
+//   differing in the quirks of its opcodes, see quirks.h. Classic, the default, is how this emulator
+//   always ran ROMs, Cosmac follows the COSMAC VIP. SuperChipQuirks and XoChipQuirks take over the
+//   quirks of SUPER-CHIP and XO-CHIP on the shared opcodes only, extension opcodes fault on them.
+// - SuperChip: The SUPER-CHIP 1.1 machine, with its quirks and extensions: a 128x64 hi-res mode,
+//   scrolling down, left and right, 16x16 sprites, a big font and the RPL flags.
+// - XoChip: The XO-CHIP machine as implemented by Octo, SUPER-CHIP's extensions plus scrolling up,
+//   64 KB of memory, a long form of ANNN, register range loads and stores, two bitplanes and an
+//   audio pattern with its pitch.
+// The values are part of save states and of the C API, new variants go at the end.
+enum class Chip8Variant : uint8_t {
+    Cosmac,
+    SuperChipQuirks,
+    XoChipQuirks,
+    Classic,
+    SuperChip,
+    XoChip
+};
+
+// Whether a variant is one of the extended machines, with the 128x64 display of two bitplanes.
+constexpr bool is_extended_variant(Chip8Variant variant) {
+    return variant == Chip8Variant::SuperChip || variant == Chip8Variant::XoChip;
+}
+
+// Why a machine stopped, see Chip8::get_fault(). A machine which faulted in run() stays on the
+// faulting instruction, running it again faults again, until a state or ROM is loaded.
+// RomTooLarge is only ever reported by load_rom(), which otherwise leaves the machine as it was.
+// Exited is the 00FD of the extended machines, which stop on it the same way.
+enum class Chip8Fault : uint8_t {
+    None,
+    StackOverflow,
+    StackUnderflow,
+    InvalidOpcode,
+    RomTooLarge,
+    Exited
+};
+
+/**
+ * A single predecoded opcode.
+ * - op: Index of the handler executing this instruction, 0 means the entry still needs decoding.
+ * - x, y, n, nn, nnn: Operand fields of the opcode (0x_X__, 0x__Y_, 0x___N, 0x__NN, 0x_NNN).
+ * - idle_loop: Set on a 1NNN jumping back over a short loop body which can only change V, I and pc,
+ *              such as a delay timer poll. Cleared again once the loop turns out to do real work.
+ */
+struct Instruction {
+    uint8_t op;
+    uint8_t x;
+    uint8_t y;
+    uint8_t n;
+    uint8_t nn;
+    bool idle_loop;
+    uint16_t nnn;
+};
+
+/**
+ * Complete state of a Chip8, in a fixed binary layout which is also the save-state file format.
+ * - magic, version: "C8ST" and VERSION, checked on restore. VERSION changes whenever the layout does.
+ * - variant: The Chip8Variant, restoring a state switches to its interpreter. reserved is zero.
+ * - fault: The Chip8Fault, zero in states of machines which never faulted.
+ * - hires, plane_mask, pitch, flags, audio_pattern, planes: The state only the extended machines use,
+ *   see Chip8. reserved_extended is zero.
+ * - high_memory: Memory from 0x1000 to 0xFFFF of the XO-CHIP machine, zero for every other variant.
+ * - Everything else mirrors the members of Chip8 of the same name, keypad being 0 or 1 per key.
+ *   random_state is part of it, so a restored machine draws the same CXNN numbers again.
+ * Fields are naturally aligned without any padding, in host byte order. A file can be mapped and
+ * used in place, and taking or restoring a snapshot is a handful of memcpys.
+ */
+struct Chip8State {
+    static const uint32_t VERSION = 4;
+
+    char magic[4];
+    uint32_t version;
+    uint8_t V[16];
+    uint16_t I;
+    uint16_t pc;
+    uint8_t sp;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t draw_flag;
+    uint16_t stack[16];
+    uint8_t keypad[16];
+    uint8_t variant;
+    uint8_t fault;
+    uint8_t reserved[6];
+    uint64_t cycle_count;
+    uint64_t random_state;
+    uint64_t display[32];
+    uint8_t memory[4096];
+    uint8_t hires;
+    uint8_t plane_mask;
+    uint8_t pitch;
+    uint8_t reserved_extended[5];
+    uint8_t flags[16];
+    uint8_t audio_pattern[16];
+    uint64_t planes[2][128];
+    uint8_t high_memory[0x10000 - 4096];
+};
+
+static_assert(sizeof(Chip8State) == 67984, "Chip8State must not contain padding");
+
 /**
  * Mimics a CPU, Memory, Display, and Input (Keypad) to run CHIP8 programs.
  * - Opcode Processing: Reads 2-byte instructions (aka Opcodes) from memory.
  * - Memory: A 4k (4096-byte) RAM, has reserved areas for system and program data.
+ *           Every guest address wraps around it: pc and each access at I are taken modulo 4096,
+ *           and a key number in V[X] modulo 16, so no ROM can reach outside of it.
+ *           The XO-CHIP machine has 64 KB, the first 4 KB in memory and the rest in high_memory,
+ *           allocated once a machine first runs as one. pc stays within the first 4 KB, as jumps
+ *           and calls only take 12-bit addresses, accesses at I wrap around at 64 KB instead.
  * - Registers: 
  *     -  V) 16 general-purpose 8-bit registers
  *     -  I) 16-bit index register
@@ -15,24 +163,101 @@
  *           0x0200 as 0x0000 ~ 0x1FF is saved for internal program data.
  *           0x0000 ~ 0x01FF is reserved for system use (for interpreter)
  *     - sp)  8-bit stack pointer
- * - stack[16]: 16-level stack, which is able to store 16 16-bit values.
- * - delay_timer, sound_timer: Both 8-bit
- * - Display: 64 x 32 display screen
+ * - stack[16]: 16-level stack, which is able to store 16 16-bit values. A call on a full stack
+ *              or a return on an empty one faults instead of touching it.
+ * - fault: The Chip8Fault the machine stopped on, None while it runs.
+ * - delay_timer, sound_timer: Both 8-bit, counting down at 60 Hz through tick_timers(), independent of
+ *                              how many instructions run per frame.
+ * - Display: 64 x 32 display screen, stored as 32 rows of 64 bits. The leftmost pixel of a row
+ *            is its most significant bit.
+ * - planes: The 128 x 64 display of the extended machines, one per bitplane, 64 rows of two
+ *           64-bit words each, the left word first. In lo-res mode (hires false) the machine works
+ *           on 64 x 32 pixels of 2 x 2 display pixels each, so the display keeps its size.
+ *           plane_mask selects the planes CLS, DXYN and the scrolls act on, bit 0 for the first
+ *           plane. Only XO-CHIP's FN01 changes it, SUPER-CHIP draws on the first plane alone.
+ * - flags: The RPL user flags of FX75 and FX85, kept when another ROM is loaded.
+ * - audio_pattern, pitch: The XO-CHIP sample pattern of F002, 128 1-bit samples, and the pitch
+ *                         of FX3A, the pattern playing at 4000 * 2^((pitch - 64) / 48) Hz.
  * - Keypad: Hexadecimal keypad (1 ~ F)
  * - draw_flag: Represents whether or not display should be re-drawn or not after executing an opcode.
+ * - decoded[4096]: Predecoded instruction for every address of memory, filled lazily on first execution,
+ *                  or up front from a Chip8RomAnalysis (see romcache.h) when loading a ROM from one.
+ *                  Entries are invalidated whenever the bytes they were decoded from are written to.
+ *                  It goes on for WRAP_ENTRIES past the end of memory, where pc can end up after a
+ *                  skip or return near the end, with entries taking pc back to the start of memory.
+ * - variant: Variant the loaded ROM runs as. interpreter points at the instantiation of
+ *            interpret() for it, profiling_interpreter at the counting one.
+ * - Idle loops: Within one run() nothing outside the CPU changes (timers tick and keys change between
+ *               runs), so a loop polling the delay timer or a blocked FX0A can only repeat until the
+ *               budget is spent. Both engines recognize them and skip those repetitions outright.
+ * - jit: Recompiler used by run() when the JIT engine is selected, see jit.h. The extended
+ *        machines are always interpreted.
+ * - cycle_count: Number of instructions executed since construction, the time base of recordings.
+ * - random_state: State of the xorshift64* generator behind CXNN. Every instance has its own,
+ *                 seeded with a fixed value unless seed_random() is called, so runs are reproducible.
+ * - recording: Receives keypad changes and timer ticks while attached, see recording.h.
+ * - dirty_pages, dirty_rows: 256-byte pages of memory and display rows written since checkpoint last
+ *                            saved or reset the machine, one bit each. Every memory write already
+ *                            goes through invalidate() and every display write through CLS or
+ *                            draw_sprite(), which set them. The state of the extended machines is
+ *                            not tracked, see checkpoint.h.
+ * - checkpoint_generation: Save generation of the checkpoint the dirty bits are relative to, 0 for none.
+ * - profile: Execution profile while profiling, see profiler.h. run() then always interprets, through
+ *            an instantiation of interpret() which counts, the regular one is left untouched.
  * - get_nibble: Helper function which extracts a specific set of 4 bits (aka nibble) from an int value.
  */
 class Chip8 {
 public:
     Chip8();
     bool load_rom(std::string);
+    bool load_rom(std::string, Chip8Variant);
+    bool load_rom(const uint8_t *, size_t, Chip8Variant = Chip8Variant::Classic);
+    bool load_rom(const Chip8RomAnalysis &, Chip8Variant);
+    void save_state(Chip8State &);
+    bool load_state(const Chip8State &);
+    bool save_state(const std::string &);
+    bool load_state(const std::string &);
+    void write_memory(uint16_t, const uint8_t *, size_t);
     bool get_draw_flag();
     void set_draw_flag(bool);
     void single_cycle();
+    void run(int);
+    void run_frame(int);
+    void tick_timers();
+    void seed_random(uint64_t);
+    void set_recording(Chip8Recording *);
+    bool set_profiling(bool);
+    const Chip8Profile *get_profile();
+    bool set_engine(Chip8Engine);
+    Chip8Engine get_engine();
+    Chip8Variant get_variant();
     int get_display_value(int);
+    int get_display_width();
+    int get_display_height();
+    const uint64_t *get_display_rows();
+    const uint64_t *get_display_plane(int);
+    void copy_display_rows(uint64_t *);
+    bool get_hires();
+    const uint8_t *get_audio_pattern();
+    uint8_t get_pitch();
     void set_keypad_value(int, int);
+    uint8_t get_register(int);
+    uint16_t get_index();
+    uint16_t get_pc();
+    uint8_t get_stack_pointer();
+    uint8_t get_delay_timer();
+    uint8_t get_sound_timer();
+    uint64_t get_cycle_count();
+    uint8_t get_memory_value(int);
+    Chip8Fault get_fault();
+    static size_t get_max_rom_size(Chip8Variant);
     ~Chip8();
 private:
+    friend class Chip8Jit;
+    friend class Chip8Lockstep;
+    friend class Chip8Checkpoint;
+    friend class Chip8RomCache;
+
     // CPU
     uint8_t V[16];
     uint16_t I = 0;
@@ -41,12 +266,66 @@ private:
     uint16_t stack[16];
     uint8_t delay_timer = 0;
     uint8_t sound_timer = 0;
+    Chip8Fault fault = Chip8Fault::None;
 
     uint8_t memory[4096];
-    int display[64 * 32];
+    uint64_t display[32];
     int keypad[16];
     bool draw_flag = false;
 
+    // SUPER-CHIP and XO-CHIP
+    uint64_t planes[2][128];
+    bool hires = false;
+    uint8_t plane_mask = 1;
+    uint8_t pitch = 64;
+    uint8_t flags[16];
+    uint8_t audio_pattern[16];
+    std::unique_ptr<uint8_t[]> high_memory;
+
+    // An XO-CHIP skip over a long ANNN at 0xFFF leaves pc at 0x1005, the furthest it can get.
+    static const int WRAP_ENTRIES = 6;
+    Instruction decoded[4096 + WRAP_ENTRIES];
+    std::unique_ptr<Chip8Jit> jit;
+
+    uint64_t cycle_count = 0;
+    uint64_t random_state = 0;
+    Chip8Recording *recording = nullptr;
+    // Nothing is known to be clean before a checkpoint was saved.
+    uint16_t dirty_pages = 0xFFFF;
+    uint32_t dirty_rows = 0xFFFFFFFF;
+    uint64_t checkpoint_generation = 0;
+    std::unique_ptr<Chip8Profile> profile;
+
+    // Longest loop body, in instructions, considered for idle loop detection.
+    static const int MAX_IDLE_BODY = 16;
+
+    Chip8Variant variant = Chip8Variant::Classic;
+    void (Chip8::*interpreter)(int) = nullptr;
+    void (Chip8::*profiling_interpreter)(int) = nullptr;
+
+    void select_variant(Chip8Variant);
+    bool load_program(const uint8_t *, size_t, Chip8Variant, const Instruction *);
+    void load_registers(const Chip8State &);
+    void clear_decoded();
+    void reset_extended();
+    void interpret(int);
+    template <Chip8Variant VARIANT, bool PROFILE>
+    void interpret_as(int);
+    Instruction decode(uint16_t);
+    Instruction decode_opcode(uint16_t);
+    bool is_idle_loop(uint16_t, uint16_t);
+    int skip_idle(int, uint16_t);
+    void invalidate(uint16_t);
+    uint8_t next_random();
+    template <bool WRAP>
+    uint8_t draw_sprite(int, int, int);
+    template <Chip8Variant VARIANT>
+    uint8_t load_byte(uint32_t);
+    template <Chip8Variant VARIANT>
+    void store_byte(uint32_t, uint8_t);
+    template <Chip8Variant VARIANT, bool PROFILE>
+    uint8_t draw_planes(int, int, int, uint64_t &);
+    void scroll_planes(int, int);
     int get_nibble(int, int, int);
 };
 
@@ -0,0 +1,607 @@
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "quirks.h"
+#include "test_util.h"
+
+/**
+ * Per-opcode conformance tests.
+ * Each case is a small embedded test ROM, run for a given number of instructions on a fresh
+ * machine, followed by checks of registers, memory and display. Every case runs on each
+ * quirk profile (checks consult its quirks where behavior differs) and on each engine,
+ * so an optimization of either engine is gated on the same expectations. Cases of the
+ * SUPER-CHIP and XO-CHIP extensions only run on the machines which have them.
+ *
+ * Usage: chip8_tests
+ * Prints one line per failed check and a summary, exits with 1 if any check failed.
+ */
+
+// Collects the results of the checks of one run.
+struct Checker {
+    std::string run;
+    int failures = 0;
+
+    void equal(const std::string &what, int actual, int expected) {
+        if (actual != expected) {
+            std::cerr << run << ": " << what << " is " << actual << ", expected " << expected << "\n";
+            failures++;
+        }
+    }
+};
+
+typedef std::function<void(Chip8 &)> Setup;
+typedef std::function<void(Chip8 &, const Chip8Quirks &, Checker &)> Check;
+
+struct Case {
+    std::string name;
+    std::vector<uint16_t> program;
+    int cycles;
+    Check check;
+    Setup setup;
+    // Variants the case runs on, all of them if empty.
+    std::vector<Chip8Variant> variants;
+};
+
+static std::vector<Case> cases;
+
+static void add(const std::string &name, std::vector<uint16_t> program, int cycles, Check check, Setup setup = nullptr) {
+    cases.push_back({name, std::move(program), cycles, std::move(check), std::move(setup), {}});
+}
+
+// Adds a case of opcodes only the given variants have.
+static void add_for(std::vector<Chip8Variant> variants, const std::string &name, std::vector<uint16_t> program,
+                    int cycles, Check check, Setup setup = nullptr) {
+    cases.push_back({name, std::move(program), cycles, std::move(check), std::move(setup), std::move(variants)});
+}
+
+// Pixel at (x, y) of the 64x32 display, or of the lo-res mode of the extended machines, whose
+// 128x64 display shows it doubled.
+static int pixel(Chip8 &chip8, int x, int y) {
+    if (is_extended_variant(chip8.get_variant())) {
+        return chip8.get_display_value(2 * y * 128 + 2 * x);
+    }
+    return chip8.get_display_value(y * 64 + x);
+}
+
+// Pixel at (x, y) of the 128x64 display of the extended machines, as the color of both planes.
+static int hires_pixel(Chip8 &chip8, int x, int y) {
+    return chip8.get_display_value(y * 128 + x);
+}
+
+// Address addr wrapped around the end of memory, 0xFFF or 0xFFFF on XO-CHIP.
+static int wrap(Chip8 &chip8, int addr) {
+    return addr & (chip8.get_variant() == Chip8Variant::XoChip ? 0xFFFF : 0xFFF);
+}
+
+static void add_extended_cases() {
+    const std::vector<Chip8Variant> extended = {Chip8Variant::SuperChip, Chip8Variant::XoChip};
+    const std::vector<Chip8Variant> xo = {Chip8Variant::XoChip};
+
+    // 00FF, 00FE: hi-res draws single pixels, the switch back clears the display on XO-CHIP only.
+    add_for(extended, "00FF", {0x00FF, 0x6000, 0xF029, 0xD005}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("hires", c.get_hires(), 1);
+        t.equal("pixel (0, 0)", hires_pixel(c, 0, 0), 1);
+        t.equal("pixel (3, 0)", hires_pixel(c, 3, 0), 1);
+        t.equal("pixel (4, 0)", hires_pixel(c, 4, 0), 0);
+        t.equal("pixel (0, 1)", hires_pixel(c, 0, 1), 1);
+        t.equal("pixel (1, 1)", hires_pixel(c, 1, 1), 0);
+    });
+    add_for(extended, "00FE", {0x00FF, 0x6000, 0xF029, 0xD005, 0x00FE}, 5,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("hires", c.get_hires(), 0);
+            t.equal("pixel (0, 0)", hires_pixel(c, 0, 0), c.get_variant() == Chip8Variant::XoChip ? 0 : 1);
+        });
+
+    // DXY0 draws 16x16 sprites of 2-byte rows. SUPER-CHIP counts the colliding rows in hi-res.
+    Setup sprite16 = [](Chip8 &c) {
+        uint8_t rows[32];
+        for (int i = 0; i < 16; i++) {
+            rows[2 * i] = 0x80;
+            rows[2 * i + 1] = 0x01;
+        }
+        c.write_memory(0x300, rows, sizeof(rows));
+    };
+    add_for(extended, "DXY0", {0x00FF, 0xA300, 0x6000, 0xD000}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pixel (0, 15)", hires_pixel(c, 0, 15), 1);
+        t.equal("pixel (15, 15)", hires_pixel(c, 15, 15), 1);
+        t.equal("pixel (1, 0)", hires_pixel(c, 1, 0), 0);
+        t.equal("pixel (16, 0)", hires_pixel(c, 16, 0), 0);
+        t.equal("pixel (0, 16)", hires_pixel(c, 0, 16), 0);
+        t.equal("VF", c.get_register(0xF), 0);
+    }, sprite16);
+    add_for(extended, "DXY0 collision", {0x00FF, 0xA300, 0x6000, 0xD000, 0xD000}, 5,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("pixel (0, 0)", hires_pixel(c, 0, 0), 0);
+            t.equal("VF", c.get_register(0xF), c.get_variant() == Chip8Variant::SuperChip ? 16 : 1);
+        }, sprite16);
+    add_for(extended, "DXYN hi-res edge", {0x00FF, 0xA300, 0x6000, 0x613C, 0xD018}, 5,
+        [](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+            t.equal("pixel (0, 62)", hires_pixel(c, 0, 62), 1);
+            t.equal("pixel (7, 63)", hires_pixel(c, 7, 63), 1);
+            t.equal("pixel (0, 0)", hires_pixel(c, 0, 0), q.sprites_wrap ? 1 : 0);
+            t.equal("VF", c.get_register(0xF), q.sprites_wrap ? 0 : 4);
+        }, sprite16);
+
+    // Scrolls move hi-res pixels, or lo-res pixels in lo-res.
+    add_for(extended, "00CN/00FB/00FC", {0x00FF, 0x6000, 0xF029, 0xD005, 0x00C2, 0x00FB, 0x00FB, 0x00FC}, 8,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("pixel (0, 0)", hires_pixel(c, 0, 0), 0);
+            t.equal("pixel (4, 1)", hires_pixel(c, 4, 1), 0);
+            t.equal("pixel (4, 2)", hires_pixel(c, 4, 2), 1);
+            t.equal("pixel (7, 2)", hires_pixel(c, 7, 2), 1);
+            t.equal("pixel (8, 2)", hires_pixel(c, 8, 2), 0);
+            t.equal("pixel (3, 2)", hires_pixel(c, 3, 2), 0);
+        });
+    add_for(extended, "00CN lo-res", {0x6000, 0xF029, 0xD005, 0x00C1}, 4,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("pixel (0, 0)", pixel(c, 0, 0), 0);
+            t.equal("pixel (0, 1)", pixel(c, 0, 1), 1);
+            t.equal("pixel (0, 5)", pixel(c, 0, 5), 1);
+        });
+    add_for(xo, "00DN", {0x00FF, 0x6000, 0xF029, 0xD005, 0x00D1}, 5, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pixel (0, 0)", hires_pixel(c, 0, 0), 1);
+        t.equal("pixel (1, 0)", hires_pixel(c, 1, 0), 0);
+        t.equal("pixel (1, 3)", hires_pixel(c, 1, 3), 1);
+        t.equal("pixel (0, 4)", hires_pixel(c, 0, 4), 0);
+    });
+
+    // 00FD stops the machine with a fault of its own.
+    add_for(extended, "00FD", {0x6001, 0x00FD, 0x6002}, 10, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("fault", (int)c.get_fault(), (int)Chip8Fault::Exited);
+        t.equal("pc", c.get_pc(), 0x202);
+        t.equal("V0", c.get_register(0), 1);
+    });
+
+    // FX30 points I at the big font, FX75 and FX85 keep registers in the RPL flags.
+    add_for(extended, "FX30", {0x6101, 0xF130}, 2, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("I", c.get_index(), 0x5A);
+        t.equal("glyph", c.get_memory_value(0x5B), 0x78);
+    });
+    add_for(extended, "FX75/FX85", {0x6011, 0x6122, 0x6233, 0xF275, 0x6000, 0x6100, 0x6200, 0xF185}, 8,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("V0", c.get_register(0), 0x11);
+            t.equal("V1", c.get_register(1), 0x22);
+            t.equal("V2", c.get_register(2), 0);
+        });
+
+    // 5XY2, 5XY3: register ranges, in reverse when X > Y, I left as it is.
+    add_for(xo, "5XY2/5XY3", {0x6011, 0x6122, 0x6233, 0xA300, 0x5022, 0x5203}, 6,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("memory[0x300]", c.get_memory_value(0x300), 0x11);
+            t.equal("memory[0x302]", c.get_memory_value(0x302), 0x33);
+            t.equal("I", c.get_index(), 0x300);
+            t.equal("V0", c.get_register(0), 0x33);
+            t.equal("V1", c.get_register(1), 0x22);
+            t.equal("V2", c.get_register(2), 0x11);
+        });
+
+    // F000 NNNN loads a 16-bit I, and skips step over the whole instruction.
+    add_for(xo, "F000", {0xF000, 0x2000, 0x6042, 0xF055}, 3, [](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+        t.equal("I", c.get_index(), q.load_store_moves_i ? 0x2001 : 0x2000);
+        t.equal("memory[0x2000]", c.get_memory_value(0x2000), 0x42);
+        t.equal("pc", c.get_pc(), 0x208);
+    });
+    add_for(xo, "skip F000", {0x6000, 0x3000, 0xF000, 0x1234, 0x6101}, 3,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("I", c.get_index(), 0);
+            t.equal("V1", c.get_register(1), 1);
+            t.equal("pc", c.get_pc(), 0x20A);
+        });
+
+    // FN01 selects the planes, each drawn from its own sprite after the previous one.
+    Setup planes = [](Chip8 &c) {
+        const uint8_t rows[] = {0x80, 0xC0};
+        c.write_memory(0x300, rows, sizeof(rows));
+    };
+    add_for(xo, "FN01", {0xF301, 0x6000, 0xA300, 0xD001}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pixel (0, 0)", pixel(c, 0, 0), 3);
+        t.equal("pixel (1, 0)", pixel(c, 1, 0), 2);
+        t.equal("pixel (2, 0)", pixel(c, 2, 0), 0);
+    }, planes);
+    add_for(xo, "FN01 00E0", {0xF301, 0x6000, 0xA300, 0xD001, 0xF101, 0x00E0}, 6,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("pixel (0, 0)", pixel(c, 0, 0), 2);
+            t.equal("pixel (1, 0)", pixel(c, 1, 0), 2);
+        }, planes);
+
+    // F002, FX3A: audio pattern and pitch.
+    add_for(xo, "F002/FX3A", {0xA300, 0xF002, 0x6080, 0xF03A}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pattern[0]", c.get_audio_pattern()[0], 0x80);
+        t.equal("pattern[15]", c.get_audio_pattern()[15], 0x01);
+        t.equal("pitch", c.get_pitch(), 0x80);
+    }, [](Chip8 &c) {
+        uint8_t pattern[16] = {0x80};
+        pattern[15] = 0x01;
+        c.write_memory(0x300, pattern, sizeof(pattern));
+    });
+}
+
+static void add_cases() {
+    // 6XNN, 7XNN: loads, and adds wrapping around without touching V[F].
+    add("6XNN/7XNN", {0x6F05, 0x60FF, 0x7002, 0x6133}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x01);
+        t.equal("V1", c.get_register(1), 0x33);
+        t.equal("VF", c.get_register(0xF), 0x05);
+    });
+    add("8XY0", {0x6142, 0x8010}, 2, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x42);
+    });
+
+    // 8XY1 to 8XY3, V[F] is cleared only with the logic_resets_vf quirk.
+    const uint16_t logic[3] = {0x8011, 0x8012, 0x8013};
+    const int results[3] = {0xF5, 0x50, 0xA5};
+    for (int i = 0; i < 3; i++) {
+        int result = results[i];
+        add("8XY" + std::to_string(i + 1), {0x60F0, 0x6155, 0x6F07, logic[i]}, 4,
+            [result](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+                t.equal("V0", c.get_register(0), result);
+                t.equal("VF", c.get_register(0xF), q.logic_resets_vf ? 0 : 7);
+            });
+    }
+
+    // 8XY4: carry in V[F], also when V[F] is an operand, the flag being written last.
+    add("8XY4 carry", {0x60FF, 0x6102, 0x8014}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x01);
+        t.equal("VF", c.get_register(0xF), 1);
+    });
+    add("8XY4 no carry", {0x6010, 0x6120, 0x6F07, 0x8014}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x30);
+        t.equal("VF", c.get_register(0xF), 0);
+    });
+    add("8FY4", {0x6FFF, 0x6102, 0x8F14}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("VF", c.get_register(0xF), 1);
+    });
+
+    // 8XY5, 8XY7: V[F] is 1 without borrow, equal operands included.
+    add("8XY5 borrow", {0x6010, 0x6120, 0x8015}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0xF0);
+        t.equal("VF", c.get_register(0xF), 0);
+    });
+    add("8XY5 equal", {0x6020, 0x6120, 0x8015}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x00);
+        t.equal("VF", c.get_register(0xF), 1);
+    });
+    add("8XY7", {0x6010, 0x6130, 0x8017}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x20);
+        t.equal("VF", c.get_register(0xF), 1);
+    });
+    add("8XY7 borrow", {0x6030, 0x6110, 0x8017}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0xE0);
+        t.equal("VF", c.get_register(0xF), 0);
+    });
+    add("8FY5", {0x6F10, 0x6120, 0x8F15}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("VF", c.get_register(0xF), 0);
+    });
+
+    // 8XY6, 8XYE: shift V[Y] with the shift_reads_vy quirk, V[X] otherwise, the bit shifted out
+    // ending up in V[F].
+    add("8XY6", {0x6005, 0x6182, 0x8016}, 3, [](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+        t.equal("V0", c.get_register(0), q.shift_reads_vy ? 0x41 : 0x02);
+        t.equal("VF", c.get_register(0xF), q.shift_reads_vy ? 0 : 1);
+    });
+    add("8XYE", {0x6081, 0x6140, 0x801E}, 3, [](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+        t.equal("V0", c.get_register(0), q.shift_reads_vy ? 0x80 : 0x02);
+        t.equal("VF", c.get_register(0xF), q.shift_reads_vy ? 0 : 1);
+    });
+    add("8FY6", {0x6F03, 0x6103, 0x8F16}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("VF", c.get_register(0xF), 1);
+    });
+
+    // Skips: 3XNN, 4XNN, 5XY0, 9XY0, each one taken and not taken. V2 counts executed adds.
+    add("3XNN/4XNN", {0x6007, 0x3007, 0x7201, 0x3008, 0x7201, 0x4007, 0x7201, 0x4008, 0x7201}, 7,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("V2", c.get_register(2), 2);
+            t.equal("pc", c.get_pc(), 0x212);
+        });
+    add("5XY0/9XY0", {0x6007, 0x6107, 0x5010, 0x7201, 0x9010, 0x7201, 0x7101, 0x5010, 0x7201, 0x9010, 0x7201}, 9,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("V2", c.get_register(2), 2);
+            t.equal("pc", c.get_pc(), 0x216);
+        });
+
+    // 1NNN, 2NNN, 00EE.
+    add("1NNN", {0x1206, 0x6001, 0x6001, 0x6102}, 2, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0);
+        t.equal("V1", c.get_register(1), 2);
+    });
+    add("2NNN/00EE", {0x2206, 0x7001, 0x1204, 0x7010, 0x00EE}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x11);
+        t.equal("sp", c.get_stack_pointer(), 0);
+        t.equal("pc", c.get_pc(), 0x204);
+    });
+    add("2NNN nested", {0x2204, 0x0000, 0x2208, 0x0000, 0x6001}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 1);
+        t.equal("sp", c.get_stack_pointer(), 2);
+    });
+
+    // BNNN adds V[0] to NNN, or V[X] to XNN with the jump_adds_vx quirk.
+    add("BNNN", {0x6004, 0x6208, 0xB208}, 3, [](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+        t.equal("pc", c.get_pc(), q.jump_adds_vx ? 0x210 : 0x20C);
+    });
+
+    // ANNN, FX1E, FX29.
+    add("ANNN/FX1E", {0xA123, 0x6010, 0xF01E}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("I", c.get_index(), 0x133);
+    });
+    add("FX29", {0x610A, 0xF129}, 2, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("I", c.get_index(), 50);
+        t.equal("glyph", c.get_memory_value(c.get_index()), 0xF0);
+    });
+
+    // CXNN never sets bits outside of NN.
+    add("CXNN mask", {0xC00F, 0x8104, 0xC0F0, 0x8201, 0x1200}, 200, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("low bits of V2", c.get_register(2) & 0x0F, 0);
+    });
+
+    // FX33: BCD of V[X] at I, I unchanged.
+    add("FX33", {0x60FE, 0xA300, 0xF033}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("memory[I]", c.get_memory_value(0x300), 2);
+        t.equal("memory[I + 1]", c.get_memory_value(0x301), 5);
+        t.equal("memory[I + 2]", c.get_memory_value(0x302), 4);
+        t.equal("I", c.get_index(), 0x300);
+    });
+    add("FX33 small", {0x6007, 0xA300, 0xF033}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("memory[I]", c.get_memory_value(0x300), 0);
+        t.equal("memory[I + 1]", c.get_memory_value(0x301), 0);
+        t.equal("memory[I + 2]", c.get_memory_value(0x302), 7);
+    });
+
+    // FX55, FX65: registers V0 to V[X] only, I moving past them with the load_store_moves_i quirk.
+    add("FX55", {0x6011, 0x6122, 0x6233, 0xA300, 0xF155}, 5, [](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+        t.equal("memory[I]", c.get_memory_value(0x300), 0x11);
+        t.equal("memory[I + 1]", c.get_memory_value(0x301), 0x22);
+        t.equal("memory[I + 2]", c.get_memory_value(0x302), 0);
+        t.equal("I", c.get_index(), q.load_store_moves_i ? 0x302 : 0x300);
+    });
+    add("FX65", {0xA20A, 0xF165, 0x1208, 0x0000, 0x0000, 0xABCD, 0xEF00}, 2,
+        [](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+            t.equal("V0", c.get_register(0), 0xAB);
+            t.equal("V1", c.get_register(1), 0xCD);
+            t.equal("V2", c.get_register(2), 0);
+            t.equal("I", c.get_index(), q.load_store_moves_i ? 0x20C : 0x20A);
+        });
+    add("FX55/FX65 round trip", {0x6A5A, 0xA300, 0xFA55, 0x6A00, 0xA300, 0xFA65}, 6,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("VA", c.get_register(0xA), 0x5A);
+        });
+
+    // DXYN: XOR drawing with collision in V[F], starting coordinates wrapping around the screen,
+    // sprites crossing the edge wrapping with sprites_wrap and clipped otherwise.
+    add("DXYN draw", {0x6000, 0xF029, 0x6102, 0x6203, 0xD125}, 5, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pixel (2, 3)", pixel(c, 2, 3), 1);
+        t.equal("pixel (5, 3)", pixel(c, 5, 3), 1);
+        t.equal("pixel (6, 3)", pixel(c, 6, 3), 0);
+        t.equal("pixel (3, 4)", pixel(c, 3, 4), 0);
+        t.equal("VF", c.get_register(0xF), 0);
+        t.equal("draw flag", c.get_draw_flag(), 1);
+    });
+    add("DXYN collision", {0x6000, 0xF029, 0xD005, 0xD005}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pixel (0, 0)", pixel(c, 0, 0), 0);
+        t.equal("VF", c.get_register(0xF), 1);
+    });
+    add("DXYN start wraps", {0x6000, 0xF029, 0x6146, 0x6223, 0xD121}, 5, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pixel (6, 3)", pixel(c, 6, 3), 1);
+        t.equal("pixel (9, 3)", pixel(c, 9, 3), 1);
+    });
+    add("DXYN edges", {0x6000, 0xF029, 0x613E, 0x621E, 0xD125}, 5, [](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+        int wraps = q.sprites_wrap ? 1 : 0;
+        t.equal("pixel (63, 30)", pixel(c, 63, 30), 1);
+        t.equal("pixel (0, 30)", pixel(c, 0, 30), wraps);
+        t.equal("pixel (62, 0)", pixel(c, 62, 0), wraps);
+        t.equal("pixel (1, 0)", pixel(c, 1, 0), wraps);
+    });
+    add("00E0", {0x6000, 0xF029, 0xD005, 0x00E0}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pixel (0, 0)", pixel(c, 0, 0), 0);
+    });
+
+    // EX9E, EXA1 against the keypad.
+    add("EX9E/EXA1", {0x6005, 0xE09E, 0x7201, 0xE0A1, 0x7201, 0x6006, 0xE09E, 0x7210, 0xE0A1, 0x7210}, 8,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            t.equal("V2", c.get_register(2), 0x11);
+        },
+        [](Chip8 &c) { c.set_keypad_value(5, 1); });
+
+    // FX0A waits without a key, and takes the highest pressed key otherwise.
+    add("FX0A waiting", {0xF30A, 0x6101}, 50, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pc", c.get_pc(), 0x200);
+        t.equal("V1", c.get_register(1), 0);
+    });
+    add("FX0A pressed", {0xF30A, 0x6101}, 2, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V3", c.get_register(3), 0xC);
+        t.equal("V1", c.get_register(1), 1);
+        t.equal("pc", c.get_pc(), 0x204);
+    },
+    [](Chip8 &c) { c.set_keypad_value(0xC, 1); });
+
+    // Faults: a return on an empty stack and a call on a full one stop the machine on them.
+    add("00EE underflow", {0x6001, 0x00EE, 0x6002}, 10, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("fault", (int)c.get_fault(), (int)Chip8Fault::StackUnderflow);
+        t.equal("pc", c.get_pc(), 0x202);
+        t.equal("sp", c.get_stack_pointer(), 0);
+        t.equal("V0", c.get_register(0), 1);
+    });
+    add("2NNN overflow", {0x7001, 0x2200}, 40, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("fault", (int)c.get_fault(), (int)Chip8Fault::StackOverflow);
+        t.equal("pc", c.get_pc(), 0x202);
+        t.equal("sp", c.get_stack_pointer(), 16);
+        t.equal("V0", c.get_register(0), 17);
+    });
+    add("invalid opcode", {0x6001, 0xFFFF, 0x6002}, 10, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("fault", (int)c.get_fault(), (int)Chip8Fault::InvalidOpcode);
+        t.equal("pc", c.get_pc(), 0x202);
+    });
+    // Loading a ROM into a faulted machine starts it over: the next ROM runs as on a fresh one.
+    add("reload after fault", {0x7001, 0xA000, 0x6502, 0xF515, 0xD011, 0x2200}, 200, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("fault", (int)c.get_fault(), (int)Chip8Fault::StackOverflow);
+        Rom next = assemble({0x6107, 0x2206, 0x1204, 0x00EE});
+        t.equal("reloaded", c.load_rom(next.data(), next.size(), c.get_variant()), 1);
+        t.equal("fault after reload", (int)c.get_fault(), (int)Chip8Fault::None);
+        t.equal("pc after reload", c.get_pc(), 0x200);
+        c.run(5);
+        t.equal("fault", (int)c.get_fault(), (int)Chip8Fault::None);
+        t.equal("pc", c.get_pc(), 0x204);
+        t.equal("sp", c.get_stack_pointer(), 0);
+        t.equal("V0", c.get_register(0), 0);
+        t.equal("V1", c.get_register(1), 7);
+        t.equal("I", c.get_index(), 0);
+        t.equal("delay timer", c.get_delay_timer(), 0);
+        t.equal("pixel (1, 1)", pixel(c, 1, 1), 0);
+    });
+
+    // Guest addresses wrap around the end of memory: pc, opcodes straddling it, BNNN and every
+    // access at I, even once FX1E took I past 0xFFF, which sets V[F] on the 64x32 machines. Accesses
+    // at I reach 64 KB of memory on XO-CHIP. Key numbers use the low nibble of V[X].
+    add("pc wraps", {0x1FFE, 0x0000, 0x7101}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x42);
+        t.equal("V1", c.get_register(1), 1);
+        t.equal("pc", c.get_pc(), 0x206);
+        t.equal("fault", (int)c.get_fault(), (int)Chip8Fault::None);
+    },
+    [](Chip8 &c) {
+        const uint8_t code[] = {0x60, 0x42};
+        const uint8_t jump[] = {0x12, 0x04};
+        c.write_memory(0xFFE, code, sizeof(code));
+        c.write_memory(0x000, jump, sizeof(jump));
+    });
+    add("opcode at 0xFFF", {0x1FFF}, 2, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x42);
+        t.equal("pc", c.get_pc(), 0x001);
+    },
+    [](Chip8 &c) {
+        const uint8_t high[] = {0x60};
+        const uint8_t low[] = {0x42};
+        c.write_memory(0xFFF, high, sizeof(high));
+        c.write_memory(0x000, low, sizeof(low));
+    });
+    add("BNNN wraps", {0x60FF, 0xBFFF}, 2, [](Chip8 &c, const Chip8Quirks &q, Checker &t) {
+        t.equal("pc", c.get_pc(), q.jump_adds_vx ? 0xFFF : 0x0FE);
+    });
+    add("FX55 wraps", {0xAFFE, 0x6011, 0x6122, 0x6233, 0xF255}, 5, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("memory[0xFFE]", c.get_memory_value(0xFFE), 0x11);
+        t.equal("memory[0xFFF]", c.get_memory_value(0xFFF), 0x22);
+        t.equal("memory[0x1000]", c.get_memory_value(wrap(c, 0x1000)), 0x33);
+    });
+    add("FX65 wraps", {0xAFFF, 0xF165}, 2, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V0", c.get_register(0), 0x77);
+        t.equal("V1", c.get_register(1), c.get_variant() == Chip8Variant::XoChip ? 0 : 0xF0);
+    },
+    [](Chip8 &c) {
+        const uint8_t value[] = {0x77};
+        c.write_memory(0xFFF, value, sizeof(value));
+    });
+    add("FX33 past 0xFFF", {0xAFFF, 0x6002, 0xF01E, 0x60FE, 0xF033}, 5, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("I", c.get_index(), 0x1001);
+        t.equal("VF", c.get_register(0xF), is_extended_variant(c.get_variant()) ? 0 : 1);
+        t.equal("memory[0x1001]", c.get_memory_value(wrap(c, 0x1001)), 2);
+        t.equal("memory[0x1002]", c.get_memory_value(wrap(c, 0x1002)), 5);
+        t.equal("memory[0x1003]", c.get_memory_value(wrap(c, 0x1003)), 4);
+    });
+    add("DXYN wraps", {0x6000, 0xAFFF, 0xD002}, 3, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("pixel (0, 0)", pixel(c, 0, 0), 1);
+        t.equal("pixel (7, 0)", pixel(c, 7, 0), 0);
+        t.equal("pixel (0, 1)", pixel(c, 0, 1), c.get_variant() == Chip8Variant::XoChip ? 0 : 1);
+        t.equal("pixel (4, 1)", pixel(c, 4, 1), 0);
+    },
+    [](Chip8 &c) {
+        const uint8_t row[] = {0x80};
+        c.write_memory(0xFFF, row, sizeof(row));
+    });
+    add("EX9E key nibble", {0x6015, 0xE09E, 0x7201, 0xE0A1, 0x7210}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V2", c.get_register(2), 0x10);
+    },
+    [](Chip8 &c) { c.set_keypad_value(5, 1); });
+
+    // FX15, FX07, FX18, timers counting down once per tick and stopping at zero.
+    add("FX15/FX07/FX18", {0x6003, 0xF015, 0xF018, 0xF107}, 4, [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+        t.equal("V1", c.get_register(1), 3);
+        c.tick_timers();
+        t.equal("delay timer", c.get_delay_timer(), 2);
+        t.equal("sound timer", c.get_sound_timer(), 2);
+        for (int i = 0; i < 5; i++) {
+            c.tick_timers();
+        }
+        t.equal("delay timer", c.get_delay_timer(), 0);
+        t.equal("sound timer", c.get_sound_timer(), 0);
+    });
+
+    // A delay timer spin loop waits exactly as long as the timer runs, however many instructions
+    // a frame has (the engines skip such loops).
+    add("delay loop", {0x6005, 0xF015, 0xF107, 0x3100, 0x1204, 0x7201, 0x120A}, 2,
+        [](Chip8 &c, const Chip8Quirks &, Checker &t) {
+            int frames = 0;
+            while (c.get_register(2) == 0 && frames < 100) {
+                c.run_frame(997);
+                frames++;
+            }
+            t.equal("frames waited", frames, 6);
+        });
+
+    add_extended_cases();
+}
+
+// Runs a case on one variant and engine, returns the number of failed checks.
+static int run_case(const Case &test, Chip8Variant variant, Chip8Engine engine) {
+    Rom rom = assemble(test.program);
+    Chip8 chip8;
+    Checker checker;
+    checker.run = test.name + " (" + variant_name(variant) + ", " +
+                  (engine == Chip8Engine::Jit ? "jit" : "interpreter") + ")";
+    if (not chip8.load_rom(rom.data(), rom.size(), variant)) {
+        std::cerr << checker.run << ": ROM could not be loaded\n";
+        return 1;
+    }
+    if (not chip8.set_engine(engine)) {
+        return 0;
+    }
+    if (test.setup) {
+        test.setup(chip8);
+    }
+    chip8.run(test.cycles);
+    test.check(chip8, get_quirks(variant), checker);
+    return checker.failures;
+}
+
+int main() {
+    add_cases();
+    const Chip8Variant variants[] = {Chip8Variant::Classic, Chip8Variant::Cosmac, Chip8Variant::SuperChipQuirks,
+                                     Chip8Variant::XoChipQuirks, Chip8Variant::SuperChip, Chip8Variant::XoChip};
+    const Chip8Engine engines[] = {Chip8Engine::Interpreter, Chip8Engine::Jit};
+    Chip8 probe;
+    if (not probe.set_engine(Chip8Engine::Jit)) {
+        std::cout << "JIT not supported, testing the interpreter only\n";
+    }
+
+    int runs = 0;
+
+    // Without a quirk profile, ROMs run with the classic quirks, as this emulator always ran them:
+    // shifts in place and sprites wrapping around the screen edges.
+    const uint8_t defaults[] = {0x60, 0x05, 0x61, 0x82, 0x80, 0x16, 0x62, 0x3E, 0x63, 0x00, 0xD2, 0x31};
+    Chip8 classic;
+    Checker checker;
+    checker.run = "default quirk profile";
+    classic.load_rom(defaults, sizeof(defaults));
+    classic.run(6);
+    checker.equal("profile", (int)classic.get_variant(), (int)Chip8Variant::Classic);
+    checker.equal("V0", classic.get_register(0), 0x02);
+    checker.equal("pixel (63, 0)", classic.get_display_value(63), 1);
+    checker.equal("pixel (1, 0)", classic.get_display_value(1), 1);
+    failures += checker.failures;
+    for (const Case &test : cases) {
+        for (Chip8Variant variant : variants) {
+            if (not test.variants.empty() &&
+                std::find(test.variants.begin(), test.variants.end(), variant) == test.variants.end()) {
+                continue;
+            }
+            for (Chip8Engine engine : engines) {
+                failures += run_case(test, variant, engine);
+                runs++;
+            }
+        }
+    }
+    std::cout << cases.size() << " cases, " << runs << " runs, " << failures << " failed checks\n";
+    return failures == 0 ? 0 : 1;
+}
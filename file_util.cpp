@@ -0,0 +1,90 @@
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include "file_util.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8_FILE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define CHIP8_FILE_MMAP 0
+#endif
+
+// Mapping of an empty file, which mmap() refuses.
+static const uint8_t no_bytes[1] = {0};
+
+#if CHIP8_FILE_MMAP
+
+// Maps a whole regular file read-only. Fails on anything larger than max_size, leaving its size
+// in size so the caller can tell.
+const uint8_t *chip8_map_file(const std::string &path, size_t max_size, size_t &size) {
+    size = 0;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || not S_ISREG(info.st_mode)) {
+        close(fd);
+        return nullptr;
+    }
+    size = (size_t)info.st_size;
+    if (size == 0 || size > max_size) {
+        close(fd);
+        return size == 0 ? no_bytes : nullptr;
+    }
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return mapped == MAP_FAILED ? nullptr : static_cast<const uint8_t *>(mapped);
+}
+
+void chip8_unmap_file(const void *data, size_t size) {
+    if (data != no_bytes) {
+        munmap(const_cast<void *>(data), size);
+    }
+}
+
+#else
+
+// Reads a whole file in a single read, where it cannot be mapped.
+const uint8_t *chip8_map_file(const std::string &path, size_t max_size, size_t &size) {
+    size = 0;
+    std::ifstream f(path, std::ios::binary | std::ios::in | std::ios::ate);
+    if (!f.is_open()) {
+        return nullptr;
+    }
+    size = (size_t)f.tellg();
+    if (size == 0 || size > max_size) {
+        return size == 0 ? no_bytes : nullptr;
+    }
+    std::unique_ptr<uint8_t[]> data(new uint8_t[size]);
+    f.seekg(0);
+    if (!f.read(reinterpret_cast<char *>(data.get()), size)) {
+        return nullptr;
+    }
+    return data.release();
+}
+
+void chip8_unmap_file(const void *data, size_t) {
+    if (data != no_bytes) {
+        delete[] static_cast<const uint8_t *>(data);
+    }
+}
+
+#endif
+
+// Reads a whole file, such as a ROM, into bytes: mapped and copied where files can be mapped, in a
+// single read otherwise.
+bool chip8_read_file(const std::string &path, std::vector<uint8_t> &bytes) {
+    size_t size;
+    const uint8_t *data = chip8_map_file(path, SIZE_MAX, size);
+    if (data == nullptr) {
+        return false;
+    }
+    bytes.assign(data, data + size);
+    chip8_unmap_file(data, size);
+    return true;
+}
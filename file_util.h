@@ -0,0 +1,21 @@
+#ifndef CHIP8_FILE_UTIL_H
+#define CHIP8_FILE_UTIL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Whole-file access shared by the ROM cache, the tools and the tests.
+ * - chip8_map_file(), chip8_unmap_file(): A regular file mapped read-only where files can be
+ *                                         mapped, read in a single read otherwise. Files larger
+ *                                         than max_size are refused, their size is still returned.
+ * - chip8_read_file(): A whole file, such as a ROM, copied into a vector.
+ */
+
+const uint8_t *chip8_map_file(const std::string &, size_t, size_t &);
+void chip8_unmap_file(const void *, size_t);
+bool chip8_read_file(const std::string &, std::vector<uint8_t> &);
+
+#endif //CHIP8_FILE_UTIL_H
@@ -0,0 +1,162 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "checkpoint.h"
+#include "chip8.h"
+#include "file_util.h"
+
+/**
+ * Fuzzing harness in the libFuzzer style: LLVMFuzzerTestOneInput() runs one input.
+ * - Input: A program, written to 0x200 of a machine reset to a checkpoint of the empty machine,
+ *          then run for FRAMES frames of IPF instructions.
+ * - Oracle: The program runs on the interpreter and on the JIT, and the complete states must
+ *           match afterwards; a mismatch aborts. Crashes and sanitizer reports are findings too.
+ * - Resets: Both machines go back to their checkpoint before every input, copying only the
+ *           memory pages and display rows the previous input wrote, see checkpoint.h.
+ * Built with -DCHIP8_LIBFUZZER=ON (clang only), libFuzzer provides main() and drives it.
+ * Otherwise main() below runs every file given, then -runs random mutations of them.
+ *
+ * Usage: chip8_fuzz [-runs N] [-seed N] [file]...
+ * Prints the number of inputs run, resets per second and the average bytes a reset restored.
+ */
+
+static const int FRAMES = 8;
+static const int IPF = 200;
+
+struct Harness {
+    Chip8 interpreter;
+    Chip8 jit;
+    bool has_jit = false;
+    Chip8Checkpoint interpreter_start;
+    Chip8Checkpoint jit_start;
+    std::unique_ptr<Chip8State> interpreter_state{new Chip8State()};
+    std::unique_ptr<Chip8State> jit_state{new Chip8State()};
+    uint64_t inputs = 0;
+    uint64_t reset_bytes = 0;
+
+    Harness() {
+        has_jit = jit.set_engine(Chip8Engine::Jit);
+        interpreter.seed_random(1);
+        jit.seed_random(1);
+        interpreter_start.save(interpreter);
+        jit_start.save(jit);
+    }
+};
+
+static Harness &harness() {
+    static Harness instance;
+    return instance;
+}
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***) {
+    // Random programs are full of invalid opcodes, each of which the interpreter reports.
+    std::cerr.setstate(std::ios::badbit);
+    harness();
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    Harness &h = harness();
+    h.interpreter_start.reset(h.interpreter);
+    h.reset_bytes += h.interpreter_start.get_reset_bytes();
+    h.inputs++;
+
+    h.interpreter.write_memory(0x200, data, size);
+    for (int frame = 0; frame < FRAMES; frame++) {
+        h.interpreter.run_frame(IPF);
+    }
+    if (not h.has_jit) {
+        return 0;
+    }
+
+    h.jit_start.reset(h.jit);
+    h.jit.write_memory(0x200, data, size);
+    for (int frame = 0; frame < FRAMES; frame++) {
+        h.jit.run_frame(IPF);
+    }
+    h.interpreter.save_state(*h.interpreter_state);
+    h.jit.save_state(*h.jit_state);
+    if (memcmp(h.interpreter_state.get(), h.jit_state.get(), sizeof(Chip8State)) != 0) {
+        fprintf(stderr, "Interpreter and JIT disagree on an input of %zu bytes\n", size);
+        abort();
+    }
+    return 0;
+}
+
+#ifndef CHIP8_LIBFUZZER
+
+// Changes a few random bytes or opcodes of input, or appends some, as a crude stand-in for the
+// mutators of a real fuzzer.
+static void mutate(std::vector<uint8_t> &input, std::mt19937_64 &random) {
+    int changes = 1 + (int)(random() % 8);
+    for (int i = 0; i < changes; i++) {
+        if (input.size() < 2 || random() % 4 == 0) {
+            if (input.size() < 4096 - 0x200 - 2) {
+                input.push_back((uint8_t)random());
+                input.push_back((uint8_t)random());
+            }
+            continue;
+        }
+        size_t at = random() % (input.size() - 1);
+        if (random() % 2 == 0) {
+            input[at] = (uint8_t)random();
+        } else {
+            // A whole opcode, aligned, with a random operand.
+            at &= ~(size_t)1;
+            uint16_t opcode = (uint16_t)random();
+            input[at] = (uint8_t)(opcode >> 8);
+            input[at + 1] = (uint8_t)opcode;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long long runs = 10000;
+    uint64_t seed = 1;
+    std::vector<std::vector<uint8_t>> corpus;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-runs") == 0 && i + 1 < argc) {
+            runs = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 0);
+        } else {
+            std::vector<uint8_t> data;
+            if (not chip8_read_file(argv[i], data)) {
+                fprintf(stderr, "Input could not be loaded: %s\n", argv[i]);
+                return 1;
+            }
+            corpus.push_back(data);
+        }
+    }
+
+    LLVMFuzzerInitialize(&argc, &argv);
+    auto start = std::chrono::steady_clock::now();
+    for (const std::vector<uint8_t> &data : corpus) {
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    std::mt19937_64 random(seed);
+    std::vector<uint8_t> input;
+    for (long long run = 0; run < runs; run++) {
+        if (corpus.empty() || random() % 2 == 0) {
+            input.clear();
+        } else {
+            input = corpus[random() % corpus.size()];
+        }
+        mutate(input, random);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    const Harness &h = harness();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    printf("%llu inputs, %.0f inputs/s, %.1f bytes per reset\n", (unsigned long long)h.inputs,
+           h.inputs / seconds, h.inputs > 0 ? (double)h.reset_bytes / h.inputs : 0.0);
+    return 0;
+}
+
+#endif
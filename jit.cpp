@@ -0,0 +1,648 @@
+#include <cstring>
+#include "chip8.h"
+#include "jit.h"
+#include "quirks.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define CHIP8_JIT_SUPPORTED 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define CHIP8_JIT_SUPPORTED 0
+#endif
+
+/**
+ * Register usage of translated code:
+ * - rbx: Chip8 object, every register and memory access is [rbx + offset of the member].
+ * - r12: Remaining instruction budget, kept in Context::remaining while outside native code.
+ * - r13: Context, holds the budget and the block entry table used by dynamic exits.
+ * - rax, rcx, rdx: Scratch.
+ * rbx, r12 and r13 are callee-saved, so they survive calls into the interpreter.
+ */
+
+// Size of the executable code cache.
+static const size_t CODE_CACHE_SIZE = 4 * 1024 * 1024;
+
+// Upper bound of the native code size of a single block, a block only gets compiled if this fits.
+static const size_t MAX_BLOCK_BYTES = 8192;
+
+bool Chip8Jit::supported() {
+    return CHIP8_JIT_SUPPORTED;
+}
+
+Chip8Jit::Chip8Jit(Chip8 &chip) : chip8(chip) {
+    const uint8_t *base = reinterpret_cast<const uint8_t *>(&chip8);
+    off_V = reinterpret_cast<const uint8_t *>(chip8.V) - base;
+    off_I = reinterpret_cast<const uint8_t *>(&chip8.I) - base;
+    off_pc = reinterpret_cast<const uint8_t *>(&chip8.pc) - base;
+    off_sp = reinterpret_cast<const uint8_t *>(&chip8.sp) - base;
+    off_stack = reinterpret_cast<const uint8_t *>(chip8.stack) - base;
+    off_delay_timer = reinterpret_cast<const uint8_t *>(&chip8.delay_timer) - base;
+    off_sound_timer = reinterpret_cast<const uint8_t *>(&chip8.sound_timer) - base;
+    off_keypad = reinterpret_cast<const uint8_t *>(chip8.keypad) - base;
+
+#if CHIP8_JIT_SUPPORTED
+    // The code cache is an anonymous file mapped twice, executable to run and writable to translate
+    // into, so no page is ever both, and translating needs no protection changes.
+    int fd = memfd_create("chip8-jit", MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, CODE_CACHE_SIZE) == 0) {
+        void *code = mmap(nullptr, CODE_CACHE_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        void *view = mmap(nullptr, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (code != MAP_FAILED && view != MAP_FAILED) {
+            code_buffer = static_cast<uint8_t *>(code);
+            write_offset = static_cast<uint8_t *>(view) - code_buffer;
+            code_size = CODE_CACHE_SIZE;
+            cursor = code_buffer;
+            emit_stubs();
+            flush();
+        } else {
+            if (code != MAP_FAILED) {
+                munmap(code, CODE_CACHE_SIZE);
+            }
+            if (view != MAP_FAILED) {
+                munmap(view, CODE_CACHE_SIZE);
+            }
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+}
+
+Chip8Jit::~Chip8Jit() {
+#if CHIP8_JIT_SUPPORTED
+    if (code_buffer != nullptr) {
+        munmap(code_buffer, code_size);
+        munmap(code_buffer + write_offset, code_size);
+    }
+#endif
+}
+
+// Returns whether the code cache could be allocated.
+bool Chip8Jit::ok() {
+    return code_buffer != nullptr;
+}
+
+// Drops every translated block. The stubs at the start of the code cache are kept.
+void Chip8Jit::flush() {
+    if (code_buffer == nullptr) {
+        return;
+    }
+    cursor = exit_stub + 16;
+    blocks.clear();
+    unlinked.clear();
+    memset(block_at, 0, sizeof(block_at));
+    for (int i = 0; i < 4096; i++) {
+        context.entry[i] = exit_stub;
+    }
+    code_pages = 0;
+    dirty_pages = 0;
+}
+
+// Called by Chip8 for every byte written to memory.
+// Writes into pages holding translated code are remembered, the blocks are dropped by run()
+// once translated code is no longer executing.
+void Chip8Jit::on_write(uint16_t addr) {
+    int page = addr >> 8;
+    if (page < PAGE_COUNT && (code_pages & (1 << page)) != 0) {
+        dirty_pages |= 1 << page;
+    }
+}
+
+// Executes exactly the given number of instructions.
+void Chip8Jit::run(int cycles) {
+    int64_t remaining = cycles;
+    while (remaining > 0) {
+        if (dirty_pages != 0) {
+            invalidate_dirty_pages();
+        }
+
+        // Exits past the end of memory continue at its start, like in the interpreter.
+        chip8.pc &= 0xFFF;
+        Block *block = block_at[chip8.pc];
+        if (block == nullptr) {
+            block = compile(chip8.pc);
+        }
+
+        // No translation possible here, let the interpreter take one step.
+        if (block == nullptr) {
+            chip8.interpret(1);
+            remaining--;
+            continue;
+        }
+        // Too little budget left to run the whole block.
+        if (block->length > remaining) {
+            chip8.interpret(remaining);
+            return;
+        }
+
+#if CHIP8_JIT_SUPPORTED
+        context.remaining = remaining;
+        auto enter = reinterpret_cast<void (*)(Chip8 *, Context *, uint8_t *)>(enter_stub);
+        enter(&chip8, &context, block->code);
+        remaining = context.remaining;
+#endif
+    }
+}
+
+// Executes a single instruction through the interpreter, called from translated code.
+// Returns non-zero if the instruction wrote into translated code.
+int Chip8Jit::step(Chip8 *chip) {
+    chip->interpret(1);
+    return chip->jit->dirty_pages != 0;
+}
+
+// Skips iterations of the idle loop closed by the jump at addr, called from translated code with
+// pc at the loop head. Returns the number of instructions executed or skipped. If the loop turned
+// out not to be idle, its page is marked dirty so the block is translated again without the call.
+int64_t Chip8Jit::skip_idle(Chip8 *chip, int64_t budget, int64_t addr) {
+    int consumed = chip->skip_idle((int)budget, (uint16_t)addr);
+    if (not chip->decoded[addr].idle_loop) {
+        chip->jit->on_write((uint16_t)addr);
+    }
+    return consumed;
+}
+
+// Drops every block which overlaps a page written to since the last call.
+// Direct jumps into a dropped block are pointed back at the exit stub, and get linked again
+// once the block is recompiled.
+void Chip8Jit::invalidate_dirty_pages() {
+    std::vector<std::unique_ptr<Block>> live;
+    code_pages = 0;
+    for (std::unique_ptr<Block> &block : blocks) {
+        uint16_t pages = 0;
+        for (int page = block->start >> 8; page <= (block->end - 1) >> 8; page++) {
+            pages |= 1 << page;
+        }
+        if ((pages & dirty_pages) == 0) {
+            code_pages |= pages;
+            live.push_back(std::move(block));
+            continue;
+        }
+        for (uint8_t *site : block->incoming) {
+            patch(site, exit_stub);
+            unlinked[block->start].push_back(site);
+        }
+        block_at[block->start] = nullptr;
+        context.entry[block->start] = exit_stub;
+    }
+    blocks = std::move(live);
+    dirty_pages = 0;
+}
+
+// Points the jump whose rel32 operand ends at site + 4 at target.
+void Chip8Jit::patch(uint8_t *site, uint8_t *target) {
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(site + write_offset, &rel, sizeof(rel));
+}
+
+// Links a chained exit to the block at target, or to the exit stub until that block exists.
+void Chip8Jit::link(uint8_t *site, uint16_t target) {
+    Block *block = block_at[target];
+    if (block != nullptr) {
+        patch(site, block->code);
+        block->incoming.push_back(site);
+    } else {
+        patch(site, exit_stub);
+        unlinked[target].push_back(site);
+    }
+}
+
+void Chip8Jit::emit(std::initializer_list<uint8_t> bytes) {
+    for (uint8_t b : bytes) {
+        cursor[write_offset] = b;
+        cursor++;
+    }
+}
+
+void Chip8Jit::emit32(uint32_t value) {
+    memcpy(cursor + write_offset, &value, sizeof(value));
+    cursor += sizeof(value);
+}
+
+// Emits an instruction addressing [rbx + disp32], bytes must end with the ModRM byte.
+void Chip8Jit::emit_rbx(std::initializer_list<uint8_t> bytes, int32_t disp) {
+    emit(bytes);
+    emit32((uint32_t)disp);
+}
+
+// jmp rel32 to target.
+void Chip8Jit::emit_jump(uint8_t *target) {
+    emit({0xE9});
+    emit32(0);
+    patch(cursor - 4, target);
+}
+
+// Emits jcc rel32 (0x0F, cc) and returns the location of its operand, to be patched later.
+uint8_t *Chip8Jit::emit_jcc(uint8_t cc) {
+    emit({0x0F, cc});
+    emit32(0);
+    return cursor - 4;
+}
+
+// mov word [pc], addr
+void Chip8Jit::emit_store_pc(uint16_t addr) {
+    emit_rbx({0x66, 0xC7, 0x83}, off_pc);
+    emit({(uint8_t)(addr & 0xFF), (uint8_t)(addr >> 8)});
+}
+
+// Continues at a known address, pc must already be stored.
+void Chip8Jit::emit_chain(uint16_t target) {
+    if (target > 4096 - 2) {
+        emit_jump(exit_stub);
+        return;
+    }
+    emit({0xE9});
+    emit32(0);
+    link(cursor - 4, target);
+}
+
+// Continues at the address held in pc, through the block entry table.
+void Chip8Jit::emit_dynamic_exit() {
+    emit_rbx({0x0F, 0xB7, 0x83}, off_pc);          // movzx eax, word [pc]
+    emit({0x3D});                                  // cmp eax, 4095
+    emit32(4095);
+    patch(emit_jcc(0x87), exit_stub);              // ja exit
+    emit({0x41, 0xFF, 0x64, 0xC5, 0x08});          // jmp [r13 + rax * 8 + 8]
+}
+
+// Runs the instruction at pc through the interpreter, leaves its return value in eax.
+void Chip8Jit::emit_helper_call() {
+    int (*helper)(Chip8 *) = &Chip8Jit::step;
+    emit({0x48, 0x89, 0xDF});                      // mov rdi, rbx
+    emit_call(reinterpret_cast<uint64_t>(helper));
+}
+
+// Runs the instruction at addr, which faults, through the interpreter. The machine stays on it
+// and spends the whole budget, like in the interpreter.
+void Chip8Jit::emit_fault(uint16_t addr) {
+    emit_store_pc(addr);
+    emit_helper_call();
+    emit({0x45, 0x31, 0xE4});                      // xor r12d, r12d
+    emit_dynamic_exit();
+}
+
+// Skips iterations of the idle loop closed by the jump at addr, pc must hold the loop head.
+// The skipped instructions are taken off the budget.
+void Chip8Jit::emit_idle_skip(uint16_t addr) {
+    int64_t (*helper)(Chip8 *, int64_t, int64_t) = &Chip8Jit::skip_idle;
+    emit({0x48, 0x89, 0xDF});                      // mov rdi, rbx
+    emit({0x4C, 0x89, 0xE6});                      // mov rsi, r12
+    emit({0xBA});                                  // mov edx, addr
+    emit32(addr);
+    emit_call(reinterpret_cast<uint64_t>(helper));
+    emit({0x49, 0x29, 0xC4});                      // sub r12, rax
+}
+
+// Calls a C++ function, the stack is 16-byte aligned throughout translated code.
+void Chip8Jit::emit_call(uint64_t address) {
+    emit({0x48, 0xB8});                            // mov rax, address
+    memcpy(cursor + write_offset, &address, sizeof(address));
+    cursor += sizeof(address);
+    emit({0xFF, 0xD0});                            // call rax
+}
+
+// Emits the shared entry and exit code at the start of the code cache.
+// enter(chip8, context, code) saves the callee-saved registers, loads the budget and jumps to code.
+// The exit stub stores the budget back and returns to run().
+void Chip8Jit::emit_stubs() {
+    enter_stub = cursor;
+    emit({0x53});                                  // push rbx
+    emit({0x41, 0x54});                            // push r12
+    emit({0x41, 0x55});                            // push r13
+    emit({0x48, 0x89, 0xFB});                      // mov rbx, rdi
+    emit({0x49, 0x89, 0xF5});                      // mov r13, rsi
+    emit({0x4D, 0x8B, 0x65, 0x00});                // mov r12, [r13]
+    emit({0xFF, 0xE2});                            // jmp rdx
+
+    exit_stub = cursor;
+    emit({0x4D, 0x89, 0x65, 0x00});                // mov [r13], r12
+    emit({0x41, 0x5D});                            // pop r13
+    emit({0x41, 0x5C});                            // pop r12
+    emit({0x5B});                                  // pop rbx
+    emit({0xC3});                                  // ret
+}
+
+// Returns whether the instruction ends a block.
+static bool ends_block(uint8_t op) {
+    switch (op) {
+        case OP_RET:
+        case OP_JP:
+        case OP_CALL:
+        case OP_SE_IMM:
+        case OP_SNE_IMM:
+        case OP_SE_REG:
+        case OP_SNE_REG:
+        case OP_JP_V0:
+        case OP_SKP:
+        case OP_SKNP:
+        case OP_LD_KEY:
+        case OP_INVALID:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Translates the block starting at start, returns nullptr if no block can start there.
+Chip8Jit::Block *Chip8Jit::compile(uint16_t start) {
+    if (code_buffer == nullptr || start > 4096 - 2) {
+        return nullptr;
+    }
+    if (cursor + MAX_BLOCK_BYTES > code_buffer + code_size) {
+        flush();
+    }
+
+    // Find the extent of the block.
+    Instruction program[MAX_BLOCK_LENGTH];
+    int length = 0;
+    uint16_t addr = start;
+    bool terminated = false;
+    while (length < MAX_BLOCK_LENGTH && addr <= 4096 - 2) {
+        // Through the decode cache, which remembers idle loops found not to be idle.
+        Instruction &entry = chip8.decoded[addr];
+        if (entry.op == OP_DECODE) {
+            entry = chip8.decode(addr);
+        }
+        program[length] = entry;
+        addr += 2;
+        if (ends_block(program[length++].op)) {
+            terminated = true;
+            break;
+        }
+    }
+
+    std::unique_ptr<Block> block(new Block());
+    block->start = start;
+    block->end = addr;
+    block->length = length;
+    block->code = cursor;
+
+    // Only run the block if the budget covers all of it, then take it from the budget upfront.
+    emit({0x49, 0x83, 0xFC, (uint8_t)length});     // cmp r12, length
+    patch(emit_jcc(0x8C), exit_stub);              // jl exit
+    emit({0x49, 0x83, 0xEC, (uint8_t)length});     // sub r12, length
+
+    // Quirks of the variant are resolved here, translated code never tests them.
+    const Chip8Quirks &quirks = get_quirks(chip8.variant);
+    for (int i = 0; i < length; i++) {
+        const Instruction &in = program[i];
+        uint16_t here = start + 2 * i;
+        int32_t vx = off_V + in.x;
+        int32_t vy = off_V + in.y;
+        int32_t vf = off_V + 0xF;
+        int32_t shifted = quirks.shift_reads_vy ? vy : vx;
+
+        switch (in.op) {
+            case OP_LD_IMM:
+                emit_rbx({0xC6, 0x83}, vx);        // mov byte [Vx], nn
+                emit({in.nn});
+                break;
+            case OP_ADD_IMM:
+                emit_rbx({0x80, 0x83}, vx);        // add byte [Vx], nn
+                emit({in.nn});
+                break;
+            case OP_LD_REG:
+                emit_rbx({0x8A, 0x83}, vy);        // mov al, [Vy]
+                emit_rbx({0x88, 0x83}, vx);        // mov [Vx], al
+                break;
+            case OP_OR:
+            case OP_AND:
+            case OP_XOR: {
+                uint8_t alu = in.op == OP_OR ? 0x0A : in.op == OP_AND ? 0x22 : 0x32;
+                emit_rbx({0x8A, 0x83}, vx);        // mov al, [Vx]
+                emit_rbx({alu, 0x83}, vy);         // or/and/xor al, [Vy]
+                emit_rbx({0x88, 0x83}, vx);        // mov [Vx], al
+                if (quirks.logic_resets_vf) {
+                    emit_rbx({0xC6, 0x83}, vf);    // mov byte [VF], 0
+                    emit({0x00});
+                }
+                break;
+            }
+            // The flag is written after the result, like the interpreter does, so it wins if X is F.
+            case OP_ADD_REG:
+                emit_rbx({0x8A, 0x83}, vx);        // mov al, [Vx]
+                emit_rbx({0x02, 0x83}, vy);        // add al, [Vy]
+                emit({0x0F, 0x92, 0xC2});          // setc dl
+                emit_rbx({0x88, 0x83}, vx);        // mov [Vx], al
+                emit_rbx({0x88, 0x93}, vf);        // mov [VF], dl
+                break;
+            case OP_SUB:
+                emit_rbx({0x8A, 0x83}, vx);        // mov al, [Vx]
+                emit_rbx({0x3A, 0x83}, vy);        // cmp al, [Vy]
+                emit({0x0F, 0x93, 0xC2});          // setae dl
+                emit_rbx({0x2A, 0x83}, vy);        // sub al, [Vy]
+                emit_rbx({0x88, 0x83}, vx);        // mov [Vx], al
+                emit_rbx({0x88, 0x93}, vf);        // mov [VF], dl
+                break;
+            case OP_SUBN:
+                emit_rbx({0x8A, 0x83}, vy);        // mov al, [Vy]
+                emit_rbx({0x3A, 0x83}, vx);        // cmp al, [Vx]
+                emit({0x0F, 0x93, 0xC2});          // setae dl
+                emit_rbx({0x2A, 0x83}, vx);        // sub al, [Vx]
+                emit_rbx({0x88, 0x83}, vx);        // mov [Vx], al
+                emit_rbx({0x88, 0x93}, vf);        // mov [VF], dl
+                break;
+            // Shifts read V[Y] or V[X], depending on the variant.
+            case OP_SHR:
+                emit_rbx({0x8A, 0x83}, shifted);   // mov al, [Vx or Vy]
+                emit({0x88, 0xC2});                // mov dl, al
+                emit({0x80, 0xE2, 0x01});          // and dl, 1
+                emit({0xD0, 0xE8});                // shr al, 1
+                emit_rbx({0x88, 0x83}, vx);        // mov [Vx], al
+                emit_rbx({0x88, 0x93}, vf);        // mov [VF], dl
+                break;
+            case OP_SHL:
+                emit_rbx({0x8A, 0x83}, shifted);   // mov al, [Vx or Vy]
+                emit({0x88, 0xC2});                // mov dl, al
+                emit({0xC0, 0xEA, 0x07});          // shr dl, 7
+                emit({0xD0, 0xE0});                // shl al, 1
+                emit_rbx({0x88, 0x83}, vx);        // mov [Vx], al
+                emit_rbx({0x88, 0x93}, vf);        // mov [VF], dl
+                break;
+            case OP_LD_I:
+                emit_rbx({0x66, 0xC7, 0x83}, off_I); // mov word [I], nnn
+                emit({(uint8_t)(in.nnn & 0xFF), (uint8_t)(in.nnn >> 8)});
+                break;
+            case OP_ADD_I:
+                emit_rbx({0x0F, 0xB7, 0x83}, off_I); // movzx eax, word [I]
+                emit_rbx({0x0F, 0xB6, 0x8B}, vx);  // movzx ecx, byte [Vx]
+                emit({0x01, 0xC8});                // add eax, ecx
+                emit({0x3D});                      // cmp eax, 0xFFF
+                emit32(0xFFF);
+                emit({0x0F, 0x97, 0xC2});          // seta dl
+                emit_rbx({0x66, 0x89, 0x83}, off_I); // mov [I], ax
+                emit_rbx({0x88, 0x93}, vf);        // mov [VF], dl
+                break;
+            case OP_LD_F:
+                emit_rbx({0x0F, 0xB6, 0x83}, vx);  // movzx eax, byte [Vx]
+                emit({0x8D, 0x04, 0x80});          // lea eax, [rax + rax * 4]
+                emit_rbx({0x66, 0x89, 0x83}, off_I); // mov [I], ax
+                break;
+            case OP_LD_VX_DT:
+                emit_rbx({0x8A, 0x83}, off_delay_timer); // mov al, [delay_timer]
+                emit_rbx({0x88, 0x83}, vx);        // mov [Vx], al
+                break;
+            case OP_LD_DT:
+                emit_rbx({0x8A, 0x83}, vx);        // mov al, [Vx]
+                emit_rbx({0x88, 0x83}, off_delay_timer); // mov [delay_timer], al
+                break;
+            case OP_LD_ST:
+                emit_rbx({0x8A, 0x83}, vx);        // mov al, [Vx]
+                emit_rbx({0x88, 0x83}, off_sound_timer); // mov [sound_timer], al
+                break;
+
+            // Executed by the interpreter. Memory writes may hit code, including the rest of this
+            // block, so leave as soon as one does. pc already points past the instruction.
+            case OP_CLS:
+            case OP_DRW:
+            case OP_RND:
+            case OP_LD_REGS:
+            case OP_LD_B:
+            case OP_LD_MEM:
+                emit_store_pc(here);
+                emit_helper_call();
+                if (in.op == OP_LD_B || in.op == OP_LD_MEM) {
+                    emit({0x85, 0xC0});            // test eax, eax
+                    uint8_t *no_write = emit_jcc(0x84); // jz continue
+                    int unexecuted = length - i - 1;
+                    if (unexecuted > 0) {
+                        emit({0x49, 0x83, 0xC4, (uint8_t)unexecuted}); // add r12, unexecuted
+                    }
+                    emit_jump(exit_stub);
+                    patch(no_write, cursor);
+                }
+                break;
+
+            // Control flow, always the last instruction of the block.
+            case OP_JP:
+                emit_store_pc(in.nnn);
+                if (in.idle_loop) {
+                    // The loop may also have been left while checking it, go wherever pc is.
+                    emit_idle_skip(here);
+                    emit_dynamic_exit();
+                } else {
+                    emit_chain(in.nnn);
+                }
+                break;
+            // A full stack on a call or an empty one on a return faults, in the interpreter.
+            case OP_CALL: {
+                emit_rbx({0x0F, 0xB6, 0x83}, off_sp); // movzx eax, byte [sp]
+                emit({0x83, 0xF8, 0x10});          // cmp eax, 16
+                uint8_t *overflow = emit_jcc(0x83); // jae fault
+                emit({0x66, 0xC7, 0x84, 0x43});    // mov word [rbx + rax * 2 + stack], here
+                emit32((uint32_t)off_stack);
+                emit({(uint8_t)(here & 0xFF), (uint8_t)(here >> 8)});
+                emit({0xFF, 0xC0});                // inc eax
+                emit_rbx({0x88, 0x83}, off_sp);    // mov [sp], al
+                emit_store_pc(in.nnn);
+                emit_chain(in.nnn);
+                patch(overflow, cursor);
+                emit_fault(here);
+                break;
+            }
+            case OP_RET: {
+                emit_rbx({0x0F, 0xB6, 0x83}, off_sp); // movzx eax, byte [sp]
+                emit({0x83, 0xE8, 0x01});          // sub eax, 1
+                uint8_t *underflow = emit_jcc(0x82); // jb fault
+                emit_rbx({0x88, 0x83}, off_sp);    // mov [sp], al
+                emit({0x0F, 0xB7, 0x8C, 0x43});    // movzx ecx, word [rbx + rax * 2 + stack]
+                emit32((uint32_t)off_stack);
+                emit({0x83, 0xC1, 0x02});          // add ecx, 2
+                emit_rbx({0x66, 0x89, 0x8B}, off_pc); // mov [pc], cx
+                emit_dynamic_exit();
+                patch(underflow, cursor);
+                emit_fault(here);
+                break;
+            }
+            case OP_JP_V0: {
+                int32_t offset = quirks.jump_adds_vx ? vx : off_V;
+                emit_rbx({0x0F, 0xB6, 0x83}, offset); // movzx eax, byte [V0 or Vx]
+                emit({0x05});                      // add eax, nnn
+                emit32(in.nnn);
+                emit({0x25});                      // and eax, 0xFFF
+                emit32(0xFFF);
+                emit_rbx({0x66, 0x89, 0x83}, off_pc); // mov [pc], ax
+                emit_dynamic_exit();
+                break;
+            }
+            case OP_SE_IMM:
+            case OP_SNE_IMM:
+            case OP_SE_REG:
+            case OP_SNE_REG:
+            case OP_SKP:
+            case OP_SKNP: {
+                // Set flags so that "equal" means "key pressed" / "values equal".
+                uint8_t skip_if;
+                if (in.op == OP_SE_IMM || in.op == OP_SNE_IMM) {
+                    emit_rbx({0x80, 0xBB}, vx);    // cmp byte [Vx], nn
+                    emit({in.nn});
+                    skip_if = in.op == OP_SE_IMM ? 0x84 : 0x85;
+                } else if (in.op == OP_SE_REG || in.op == OP_SNE_REG) {
+                    emit_rbx({0x8A, 0x83}, vx);    // mov al, [Vx]
+                    emit_rbx({0x3A, 0x83}, vy);    // cmp al, [Vy]
+                    skip_if = in.op == OP_SE_REG ? 0x84 : 0x85;
+                } else {
+                    emit_rbx({0x0F, 0xB6, 0x83}, vx); // movzx eax, byte [Vx]
+                    emit({0x83, 0xE0, 0x0F});      // and eax, 0xF
+                    emit({0x83, 0xBC, 0x83});      // cmp dword [rbx + rax * 4 + keypad], 0
+                    emit32((uint32_t)off_keypad);
+                    emit({0x00});
+                    skip_if = in.op == OP_SKP ? 0x85 : 0x84;
+                }
+                uint8_t *skip = emit_jcc(skip_if);
+                emit_store_pc(here + 2);
+                emit_chain(here + 2);
+                patch(skip, cursor);
+                emit_store_pc(here + 4);
+                emit_chain(here + 4);
+                break;
+            }
+            case OP_INVALID:
+                emit_fault(here);
+                break;
+            // FX0A may or may not advance pc.
+            // A blocked FX0A stays blocked until run() returns, so it spends the whole budget.
+            case OP_LD_KEY:
+            default:
+                emit_store_pc(here);
+                emit_helper_call();
+                if (in.op == OP_LD_KEY) {
+                    emit_rbx({0x66, 0x81, 0xBB}, off_pc); // cmp word [pc], here
+                    emit({(uint8_t)(here & 0xFF), (uint8_t)(here >> 8)});
+                    uint8_t *advanced = emit_jcc(0x85); // jne continue
+                    emit({0x45, 0x31, 0xE4});      // xor r12d, r12d
+                    patch(advanced, cursor);
+                }
+                emit_dynamic_exit();
+                break;
+        }
+    }
+
+    // Fell off the end of a maximum length block.
+    if (not terminated) {
+        emit_store_pc(addr);
+        emit_chain(addr);
+    }
+
+    Block *result = block.get();
+    block_at[start] = result;
+    context.entry[start] = result->code;
+    for (int page = start >> 8; page <= (addr - 1) >> 8; page++) {
+        code_pages |= 1 << page;
+    }
+
+    // Link the exits which were waiting for this block.
+    auto waiting = unlinked.find(start);
+    if (waiting != unlinked.end()) {
+        for (uint8_t *site : waiting->second) {
+            patch(site, result->code);
+            result->incoming.push_back(site);
+        }
+        unlinked.erase(waiting);
+    }
+
+    blocks.push_back(std::move(block));
+    return result;
+}
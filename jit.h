@@ -0,0 +1,104 @@
+#ifndef CHIP8_JIT_H
+#define CHIP8_JIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Chip8;
+
+/**
+ * Basic-block recompiler translating CHIP-8 code into native x86-64 code.
+ * - Blocks: Straight-line runs of instructions starting at some pc and ending at the first
+ *           control flow instruction (or after MAX_BLOCK_LENGTH instructions). Each block is
+ *           translated once into the code cache and looked up through its start address.
+ * - Chaining: Exits with a known target (1NNN, 2NNN, skips, falling off the end) are patched into
+ *             direct jumps to the translated successor, so hot loops never leave native code.
+ * - Budget: Translated code counts executed instructions down in a register, a block is only
+ *           entered when it can run to completion. Leftovers are handed to the interpreter, so
+ *           run(n) executes exactly n instructions, just like the interpreter.
+ * - Invalidation: Writes into a 256-byte page holding translated code drop every block on it.
+ * - Code cache: Mapped twice, executable at code_buffer, where blocks run and are addressed, and
+ *               writable write_offset bytes further, where they are emitted and patched. No
+ *               mapping is both writable and executable.
+ * - Idle loops: Jumps closing an idle loop call into Chip8::skip_idle(), which takes the skipped
+ *               iterations off the budget. A blocked FX0A spends the whole budget.
+ * Quirks of the machine's variant are resolved while translating, a change of variant flushes
+ * the code cache. The SUPER-CHIP and XO-CHIP machines are never translated, Chip8::run() keeps them
+ * on the interpreter.
+ * Instructions without a native translation (DXYN, CXNN, FX33, ...) call back into the
+ * interpreter for that single instruction, so both engines produce identical state.
+ */
+class Chip8Jit {
+public:
+    static bool supported();
+    explicit Chip8Jit(Chip8 &);
+    ~Chip8Jit();
+    bool ok();
+    void run(int);
+    void on_write(uint16_t);
+    void flush();
+private:
+    struct Block {
+        uint16_t start;
+        uint16_t end;
+        int length;
+        uint8_t *code;
+        std::vector<uint8_t *> incoming;
+    };
+
+    // State shared with translated code, addressed through r13.
+    // remaining must stay the first member, entry[pc] is the native entry point of the block at pc.
+    struct Context {
+        int64_t remaining;
+        uint8_t *entry[4096];
+    };
+
+    static const int MAX_BLOCK_LENGTH = 64;
+    static const int PAGE_COUNT = 16;
+
+    Chip8 &chip8;
+    Context context;
+    uint8_t *code_buffer = nullptr;
+    ptrdiff_t write_offset = 0;
+    size_t code_size = 0;
+    uint8_t *cursor = nullptr;
+    uint8_t *enter_stub = nullptr;
+    uint8_t *exit_stub = nullptr;
+
+    std::vector<std::unique_ptr<Block>> blocks;
+    Block *block_at[4096];
+    std::unordered_map<uint16_t, std::vector<uint8_t *>> unlinked;
+    uint16_t code_pages = 0;
+    uint16_t dirty_pages = 0;
+
+    // Offsets of the Chip8 members accessed by translated code, relative to the object.
+    int32_t off_V, off_I, off_pc, off_sp, off_stack, off_delay_timer, off_sound_timer, off_keypad;
+
+    static int step(Chip8 *);
+    static int64_t skip_idle(Chip8 *, int64_t, int64_t);
+    void emit_stubs();
+    Block *compile(uint16_t);
+    void invalidate_dirty_pages();
+    void link(uint8_t *, uint16_t);
+    void patch(uint8_t *, uint8_t *);
+
+    // Emitters
+    void emit(std::initializer_list<uint8_t>);
+    void emit32(uint32_t);
+    void emit_rbx(std::initializer_list<uint8_t>, int32_t);
+    void emit_jump(uint8_t *);
+    uint8_t *emit_jcc(uint8_t);
+    void emit_store_pc(uint16_t);
+    void emit_chain(uint16_t);
+    void emit_dynamic_exit();
+    void emit_helper_call();
+    void emit_fault(uint16_t);
+    void emit_idle_skip(uint16_t);
+    void emit_call(uint64_t);
+};
+
+#endif //CHIP8_JIT_H
@@ -0,0 +1,228 @@
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "quirks.h"
+#include "test_util.h"
+
+/**
+ * Differential test of the JIT against the interpreter.
+ * Runs the same ROM on both engines in randomly sized slices with random keypad input in between,
+ * and compares the complete machine state after every slice. Every ROM is tested with each quirk profile,
+ * whose quirks the JIT translates differently.
+ *
+ * Usage: chip8_jit_test [rom]...
+ * ROMs given as arguments are tested in addition to the built-in programs.
+ */
+
+// Returns a description of the first difference between both machines, or an empty string.
+static std::string compare(Chip8 &a, Chip8 &b) {
+    for (int i = 0; i < 16; i++) {
+        if (a.get_register(i) != b.get_register(i)) {
+            return "V" + std::to_string(i);
+        }
+    }
+    if (a.get_index() != b.get_index()) {
+        return "I";
+    }
+    if (a.get_pc() != b.get_pc()) {
+        return "pc";
+    }
+    if (a.get_stack_pointer() != b.get_stack_pointer()) {
+        return "sp";
+    }
+    if (a.get_delay_timer() != b.get_delay_timer()) {
+        return "delay_timer";
+    }
+    if (a.get_sound_timer() != b.get_sound_timer()) {
+        return "sound_timer";
+    }
+    for (int i = 0; i < 4096; i++) {
+        if (a.get_memory_value(i) != b.get_memory_value(i)) {
+            return "memory[" + std::to_string(i) + "]";
+        }
+    }
+    for (int i = 0; i < 64 * 32; i++) {
+        if (a.get_display_value(i) != b.get_display_value(i)) {
+            return "display[" + std::to_string(i) + "]";
+        }
+    }
+    return "";
+}
+
+// Runs a ROM on both engines and compares them, returns false on the first mismatch.
+static bool run_differential(const std::string &rom_name, Chip8Variant variant, const Rom &rom, int rounds) {
+    std::string name = rom_name + " (" + variant_name(variant) + ")";
+    Chip8 interpreter;
+    Chip8 jit;
+    if (not interpreter.load_rom(rom.data(), rom.size(), variant) || not jit.load_rom(rom.data(), rom.size(), variant)) {
+        std::cerr << name << ": ROM could not be loaded\n";
+        return false;
+    }
+    if (not jit.set_engine(Chip8Engine::Jit)) {
+        std::cerr << name << ": JIT not supported, skipping\n";
+        return true;
+    }
+
+    std::mt19937 rng(1234);
+    long long cycles = 0;
+    for (int round = 0; round < rounds; round++) {
+        // Each slice is a frame of random length, so the timers tick in between.
+        // Both machines start with the same CXNN seed and so draw the same numbers.
+        int slice = 1 + rng() % 200;
+        interpreter.run_frame(slice);
+        jit.run_frame(slice);
+        cycles += slice;
+
+        std::string difference = compare(interpreter, jit);
+        if (not difference.empty()) {
+            std::cerr << name << ": " << difference << " differs after " << cycles << " cycles\n";
+            return false;
+        }
+
+        int key = rng() % 16;
+        int value = rng() % 2;
+        interpreter.set_keypad_value(key, value);
+        jit.set_keypad_value(key, value);
+    }
+    std::cout << name << ": ok (" << cycles << " cycles)\n";
+    return true;
+}
+
+// Appends an opcode to a ROM.
+static void op(Rom &rom, uint16_t opcode) {
+    rom.push_back(opcode >> 8);
+    rom.push_back(opcode & 0xFF);
+}
+
+// Rewrites an instruction later in the same block on every iteration of a loop.
+static Rom self_modifying_rom() {
+    Rom rom;
+    op(rom, 0x6065); // 0x200: V0 = 0x65
+    op(rom, 0x6100); // 0x202: V1 = 0
+    op(rom, 0x7101); // 0x204: V1 += 1
+    op(rom, 0xA20C); // 0x206: I = 0x20C
+    op(rom, 0xF155); // 0x208: memory[0x20C] = 0x65, memory[0x20D] = V1
+    op(rom, 0x8450); // 0x20A: V4 = V5
+    op(rom, 0x6500); // 0x20C: V5 = V1, rewritten above
+    op(rom, 0x8450); // 0x20E: V4 = V5
+    op(rom, 0xA280); // 0x210: I = 0x280, data on the same page as the code
+    op(rom, 0xF233); // 0x212: BCD of V2 at 0x280
+    op(rom, 0x7207); // 0x214: V2 += 7
+    op(rom, 0x1204); // 0x216: loop
+    return rom;
+}
+
+// Subroutine calls, computed jumps, key waits and timers.
+static Rom control_flow_rom() {
+    Rom rom;
+    op(rom, 0x2210); // 0x200: call 0x210
+    op(rom, 0x7001); // 0x202: V0 += 1
+    op(rom, 0x6004); // 0x204: V0 = 4
+    op(rom, 0xB208); // 0x206: jump to 0x208 + V0
+    op(rom, 0x0000); // 0x208: never executed
+    op(rom, 0x0000); // 0x20A: never executed
+    op(rom, 0xF30A); // 0x20C: wait for a key into V3
+    op(rom, 0x1200); // 0x20E: loop
+    op(rom, 0x6A20); // 0x210: VA = 0x20
+    op(rom, 0xFA15); // 0x212: delay_timer = VA
+    op(rom, 0xFB07); // 0x214: VB = delay_timer
+    op(rom, 0x3B00); // 0x216: skip if VB == 0
+    op(rom, 0x1214); // 0x218: spin on the timer
+    op(rom, 0x00EE); // 0x21A: return
+    return rom;
+}
+
+// Random straight-line code and jumps, built from groups which keep I and sp in bounds.
+// Skips are always followed by a single instruction, so they never split a group.
+static Rom random_rom(unsigned int seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint16_t> groups;
+    Rom rom;
+    auto reg = [&]() { return (uint16_t)(rng() % 16); };
+    auto byte = [&]() { return (uint16_t)(rng() % 256); };
+    auto alu = [&]() -> uint16_t {
+        static const uint16_t ops[] = {0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE};
+        switch (rng() % 4) {
+            case 0: return 0x6000 | reg() << 8 | byte();
+            case 1: return 0x7000 | reg() << 8 | byte();
+            case 2: return 0xC000 | reg() << 8 | byte();
+            default: return 0x8000 | reg() << 8 | reg() << 4 | ops[rng() % 9];
+        }
+    };
+
+    for (int group = 0; group < 60; group++) {
+        groups.push_back(0x200 + rom.size());
+        uint16_t data = 0x400 + (rng() % 0x800);
+        switch (rng() % 10) {
+            case 0:
+            case 1:
+            case 2:
+                op(rom, alu());
+                break;
+            case 3: {
+                static const uint16_t skips[] = {0x3000, 0x4000, 0x5000, 0x9000};
+                uint16_t skip = skips[rng() % 4];
+                op(rom, skip | reg() << 8 | (skip == 0x3000 || skip == 0x4000 ? byte() : reg() << 4));
+                op(rom, alu());
+                break;
+            }
+            case 4: {
+                static const uint16_t memory_ops[] = {0x1E, 0x33, 0x55, 0x65, 0x29};
+                op(rom, 0xA000 | data);
+                op(rom, 0xF000 | reg() << 8 | memory_ops[rng() % 5]);
+                break;
+            }
+            case 5:
+                op(rom, 0xA000 | data);
+                op(rom, 0xD000 | reg() << 8 | reg() << 4 | (rng() % 16));
+                break;
+            case 6: {
+                static const uint16_t timer_ops[] = {0x07, 0x15, 0x18};
+                op(rom, 0xF000 | reg() << 8 | timer_ops[rng() % 3]);
+                break;
+            }
+            case 7: {
+                uint16_t x = reg();
+                op(rom, 0x6000 | x << 8 | (rng() % 16));
+                op(rom, (rng() % 2 ? 0xE09E : 0xE0A1) | x << 8);
+                op(rom, alu());
+                break;
+            }
+            case 8:
+                op(rom, rng() % 8 == 0 ? 0x00E0 : (0xF00A | reg() << 8));
+                break;
+            case 9:
+                op(rom, 0x1000 | groups[rng() % groups.size()]);
+                break;
+        }
+    }
+    op(rom, 0x1200);
+    return rom;
+}
+
+int main(int argc, char *argv[]) {
+    const Chip8Variant variants[] = {Chip8Variant::Classic, Chip8Variant::Cosmac, Chip8Variant::SuperChipQuirks, Chip8Variant::XoChipQuirks};
+    bool ok = true;
+    for (Chip8Variant variant : variants) {
+        ok &= run_differential("self_modifying", variant, self_modifying_rom(), 2000);
+        ok &= run_differential("control_flow", variant, control_flow_rom(), 2000);
+        for (unsigned int seed = 1; seed <= 50; seed++) {
+            ok &= run_differential("random_" + std::to_string(seed), variant, random_rom(seed), 500);
+        }
+    }
+    for (int i = 1; i < argc; i++) {
+        Rom rom;
+        if (not chip8_read_file(argv[i], rom)) {
+            std::cerr << argv[i] << ": ROM could not be loaded\n";
+            ok = false;
+            continue;
+        }
+        for (Chip8Variant variant : variants) {
+            ok &= run_differential(argv[i], variant, rom, 5000);
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#include <cstring>
+#include <new>
+#include "chip8.h"
+#include "libchip8.h"
+
+struct chip8_machine {
+    // The getters of Chip8 are not const, the C API ones are.
+    mutable Chip8 chip8;
+    uint16_t keypad = 0;
+    uint64_t frame_counter = 0;
+    // The picture at the last advance of frame_counter, both planes of it.
+    uint64_t counted_rows[2][128] = {};
+};
+
+// Advances the frame counter if a run drew something and the picture differs from the one
+// counted last. Runs which did not draw cost a flag test.
+static void count_frame(chip8_machine *machine) {
+    Chip8 &chip8 = machine->chip8;
+    if (not chip8.get_draw_flag()) {
+        return;
+    }
+    chip8.set_draw_flag(false);
+    size_t bytes = (size_t)chip8.get_display_width() / 64 * chip8.get_display_height() * sizeof(uint64_t);
+    bool changed = false;
+    for (int plane = 0; plane < 2; plane++) {
+        const uint64_t *rows = chip8.get_display_plane(plane);
+        if (rows != nullptr && memcmp(machine->counted_rows[plane], rows, bytes) != 0) {
+            memcpy(machine->counted_rows[plane], rows, bytes);
+            changed = true;
+        }
+    }
+    if (changed) {
+        machine->frame_counter++;
+    }
+}
+
+int chip8_api_version(void) {
+    return CHIP8_API_VERSION;
+}
+
+// Returns a new machine with no ROM loaded, or NULL if out of memory.
+chip8_machine *chip8_create(void) {
+    return new (std::nothrow) chip8_machine();
+}
+
+void chip8_destroy(chip8_machine *machine) {
+    delete machine;
+}
+
+// Copies a ROM into memory at 0x200 to run as the given CHIP8_VARIANT_*. Fails on an unknown
+// variant or a ROM which does not fit.
+int chip8_load_rom(chip8_machine *machine, const uint8_t *data, size_t size, int variant) {
+    if (variant < CHIP8_VARIANT_CHIP8 || variant > CHIP8_VARIANT_XOCHIP) {
+        return 0;
+    }
+    return machine->chip8.load_rom(data, size, (Chip8Variant)variant) ? 1 : 0;
+}
+
+// Selects a CHIP8_ENGINE_*, fails if it is unknown or not supported on this platform.
+int chip8_set_engine(chip8_machine *machine, int engine) {
+    if (engine == CHIP8_ENGINE_INTERPRETER) {
+        return machine->chip8.set_engine(Chip8Engine::Interpreter) ? 1 : 0;
+    }
+    if (engine == CHIP8_ENGINE_JIT) {
+        return machine->chip8.set_engine(Chip8Engine::Jit) ? 1 : 0;
+    }
+    return 0;
+}
+
+void chip8_seed(chip8_machine *machine, uint64_t seed) {
+    machine->chip8.seed_random(seed);
+}
+
+// Runs the given number of instructions without ticking the timers.
+void chip8_run(chip8_machine *machine, int cycles) {
+    machine->chip8.run(cycles);
+    count_frame(machine);
+}
+
+// Runs one 60 Hz frame, ipf instructions followed by a timer tick.
+void chip8_run_frame(chip8_machine *machine, int ipf) {
+    machine->chip8.run_frame(ipf);
+    count_frame(machine);
+}
+
+// Sets all 16 keys, bit n being key n. Only keys which changed are passed on, so a recording
+// attached to the machine sees the same events as with per-key calls.
+void chip8_set_keypad(chip8_machine *machine, uint16_t mask) {
+    uint16_t changed = machine->keypad ^ mask;
+    for (int key = 0; changed != 0; key++, changed >>= 1) {
+        if (changed & 1) {
+            machine->chip8.set_keypad_value(key, (mask >> key) & 1);
+        }
+    }
+    machine->keypad = mask;
+}
+
+uint16_t chip8_get_keypad(const chip8_machine *machine) {
+    return machine->keypad;
+}
+
+const uint64_t *chip8_framebuffer(const chip8_machine *machine) {
+    return machine->chip8.get_display_rows();
+}
+
+// Plane 0 or 1 of the display, NULL for plane 1 of the 64x32 machines, which have only one.
+const uint64_t *chip8_framebuffer_plane(const chip8_machine *machine, int plane) {
+    if (plane < 0 || plane > 1) {
+        return nullptr;
+    }
+    return machine->chip8.get_display_plane(plane);
+}
+
+int chip8_display_width(const chip8_machine *machine) {
+    return machine->chip8.get_display_width();
+}
+
+int chip8_display_height(const chip8_machine *machine) {
+    return machine->chip8.get_display_height();
+}
+
+uint64_t chip8_frame_counter(const chip8_machine *machine) {
+    return machine->frame_counter;
+}
+
+uint64_t chip8_cycle_count(const chip8_machine *machine) {
+    return machine->chip8.get_cycle_count();
+}
+
+// Whether the beeper should sound, see the frontend: the sound timer is still running.
+int chip8_sound_active(const chip8_machine *machine) {
+    return machine->chip8.get_sound_timer() > 0 ? 1 : 0;
+}
+
+// The CHIP8_FAULT_* the machine stopped on, or the one of the last failed chip8_load_rom().
+int chip8_fault(const chip8_machine *machine) {
+    return (int)machine->chip8.get_fault();
+}
@@ -0,0 +1,97 @@
+#ifndef CHIP8_LIBCHIP8_H
+#define CHIP8_LIBCHIP8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Flat C API of the emulator core, built as libchip8 (shared and static), for embedding it in
+ * harnesses and other runtimes without C++ linkage.
+ * - Machines: Opaque handles from chip8_create(), each one a separate Chip8. A machine must only
+ *             be used by one thread at a time, different machines are independent.
+ * - Framebuffer: chip8_framebuffer() points straight into the machine, 32 rows of 64 pixels, one
+ *                uint64_t per row with the leftmost pixel in the most significant bit. The pointer
+ *                stays valid until chip8_destroy(), so it is fetched once and read after each run.
+ *                The SUPER-CHIP and XO-CHIP machines have a display of chip8_display_width() by
+ *                chip8_display_height() pixels, 128x64, two uint64_t per row, on two planes:
+ *                chip8_framebuffer() is the first one, chip8_framebuffer_plane() gets either.
+ *                Loading a ROM as a machine with another display size moves the framebuffer,
+ *                fetch it again then.
+ * - Frame counter: Advances by one after every run which left the picture different from the one
+ *                  at the previous advance, so callers copy or redraw only when it moved.
+ * - Keypad: All 16 keys at once as a mask, bit n being key n.
+ * Functions returning int return 1 on success and 0 on failure. CHIP8_API_VERSION changes
+ * whenever an existing function changes, new functions leave it alone.
+ */
+
+#define CHIP8_API_VERSION 1
+
+#if defined(_WIN32) && defined(CHIP8_BUILDING_SHARED)
+#define CHIP8_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define CHIP8_API __attribute__((visibility("default")))
+#else
+#define CHIP8_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chip8_machine chip8_machine;
+
+// Variants for chip8_load_rom(), see Chip8Variant in chip8.h and quirks.h. The first four only
+// differ in the quirks of the shared opcodes, CLASSIC is what the emulator uses by default. The
+// _QUIRKS profiles do not add the SUPER-CHIP or XO-CHIP instructions, SCHIP and XOCHIP are those
+// machines.
+enum {
+    CHIP8_VARIANT_CHIP8 = 0,
+    CHIP8_VARIANT_SCHIP_QUIRKS = 1,
+    CHIP8_VARIANT_XOCHIP_QUIRKS = 2,
+    CHIP8_VARIANT_CLASSIC = 3,
+    CHIP8_VARIANT_SCHIP = 4,
+    CHIP8_VARIANT_XOCHIP = 5
+};
+
+// Faults returned by chip8_fault(), see Chip8Fault in chip8.h. A machine which faulted while
+// running stays on the faulting instruction until a ROM is loaded. EXITED is the 00FD of the
+// SUPER-CHIP and XO-CHIP machines.
+enum {
+    CHIP8_FAULT_NONE = 0,
+    CHIP8_FAULT_STACK_OVERFLOW = 1,
+    CHIP8_FAULT_STACK_UNDERFLOW = 2,
+    CHIP8_FAULT_INVALID_OPCODE = 3,
+    CHIP8_FAULT_ROM_TOO_LARGE = 4,
+    CHIP8_FAULT_EXITED = 5
+};
+
+// Engines for chip8_set_engine().
+enum {
+    CHIP8_ENGINE_INTERPRETER = 0,
+    CHIP8_ENGINE_JIT = 1
+};
+
+CHIP8_API int chip8_api_version(void);
+CHIP8_API chip8_machine *chip8_create(void);
+CHIP8_API void chip8_destroy(chip8_machine *machine);
+CHIP8_API int chip8_load_rom(chip8_machine *machine, const uint8_t *data, size_t size, int variant);
+CHIP8_API int chip8_set_engine(chip8_machine *machine, int engine);
+CHIP8_API void chip8_seed(chip8_machine *machine, uint64_t seed);
+CHIP8_API void chip8_run(chip8_machine *machine, int cycles);
+CHIP8_API void chip8_run_frame(chip8_machine *machine, int ipf);
+CHIP8_API void chip8_set_keypad(chip8_machine *machine, uint16_t mask);
+CHIP8_API uint16_t chip8_get_keypad(const chip8_machine *machine);
+CHIP8_API const uint64_t *chip8_framebuffer(const chip8_machine *machine);
+CHIP8_API const uint64_t *chip8_framebuffer_plane(const chip8_machine *machine, int plane);
+CHIP8_API int chip8_display_width(const chip8_machine *machine);
+CHIP8_API int chip8_display_height(const chip8_machine *machine);
+CHIP8_API uint64_t chip8_frame_counter(const chip8_machine *machine);
+CHIP8_API uint64_t chip8_cycle_count(const chip8_machine *machine);
+CHIP8_API int chip8_sound_active(const chip8_machine *machine);
+CHIP8_API int chip8_fault(const chip8_machine *machine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHIP8_LIBCHIP8_H
@@ -0,0 +1,558 @@
+#include <cstdlib>
+#include <cstring>
+#include "lockstep.h"
+#include "quirks.h"
+
+// The vector kernel is written with GCC vector extensions, and compiled twice on x86-64:
+// once for AVX2 and once for the baseline (SSE2). The best version is picked at load time.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CHIP8_SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define CHIP8_SIMD_CLONES
+#endif
+
+// The helpers below pass 32-byte vectors by value. They are always inlined into the kernel,
+// so the ABI difference GCC warns about for non-AVX callers never matters.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+typedef uint8_t u8x32 __attribute__((vector_size(32)));
+typedef uint8_t u8x16 __attribute__((vector_size(16)));
+typedef int8_t i8x16 __attribute__((vector_size(16)));
+typedef uint16_t u16x16 __attribute__((vector_size(32)));
+typedef int16_t i16x16 __attribute__((vector_size(32)));
+
+// Vectors with every lane set to value.
+static inline u8x32 splat8(uint8_t value) {
+    u8x32 v = {};
+    return v + value;
+}
+
+static inline u16x16 splat16(uint16_t value) {
+    u16x16 v = {};
+    return v + value;
+}
+
+// Loads and stores of whole lane arrays. 16-bit arrays of 32 lanes take two vectors.
+static inline u8x32 load8(const uint8_t *p) {
+    u8x32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store8(uint8_t *p, u8x32 value, u8x32 mask) {
+    u8x32 result = (value & mask) | (load8(p) & ~mask);
+    memcpy(p, &result, sizeof(result));
+}
+
+static inline u16x16 load16(const uint16_t *p) {
+    u16x16 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store16(uint16_t *p, u16x16 value, u16x16 mask) {
+    u16x16 result = (value & mask) | (load16(p) & ~mask);
+    memcpy(p, &result, sizeof(result));
+}
+
+// Splits 32 byte-sized masks (0x00 / 0xFF) into two vectors of 16-bit masks.
+static inline void widen_mask(u8x32 mask, u16x16 out[2]) {
+    i8x16 half[2];
+    memcpy(half, &mask, sizeof(half));
+    out[0] = (u16x16)__builtin_convertvector(half[0], i16x16);
+    out[1] = (u16x16)__builtin_convertvector(half[1], i16x16);
+}
+
+// Zero-extends 32 bytes into two vectors of 16-bit values.
+static inline void widen_value(u8x32 value, u16x16 out[2]) {
+    u8x16 half[2];
+    memcpy(half, &value, sizeof(half));
+    out[0] = __builtin_convertvector(half[0], u16x16);
+    out[1] = __builtin_convertvector(half[1], u16x16);
+}
+
+Chip8Lockstep::Chip8Lockstep() {
+    memset(V, 0, sizeof(V));
+    memset(stack, 0, sizeof(stack));
+    memset(sp, 0, sizeof(sp));
+    memset(delay_timer, 0, sizeof(delay_timer));
+    memset(sound_timer, 0, sizeof(sound_timer));
+    memset(decoded, 0, sizeof(decoded));
+    memset(written, 0, sizeof(written));
+    for (int lane = 0; lane < LANES; lane++) {
+        I[lane] = 0;
+        pc[lane] = 0x0200;
+    }
+}
+
+// Loads the same ROM into every lane, to be run as the given variant.
+bool Chip8Lockstep::load_rom(const uint8_t *rom, size_t size, Chip8Variant rom_variant) {
+    if (is_extended_variant(rom_variant)) {
+        return false;
+    }
+    for (int lane = 0; lane < LANES; lane++) {
+        if (not machines[lane].load_rom(rom, size, rom_variant)) {
+            return false;
+        }
+    }
+    variant = rom_variant;
+    memset(decoded, 0, sizeof(decoded));
+    memset(written, 0, sizeof(written));
+    return true;
+}
+
+// Every lane executes one instruction.
+void Chip8Lockstep::step() {
+    uint32_t pending = 0xFFFFFFFF;
+    while (pending != 0) {
+        int lead = __builtin_ctz(pending);
+        uint16_t target = pc[lead];
+
+        uint32_t group = 0;
+        for (int lane = 0; lane < LANES; lane++) {
+            group |= (uint32_t)(pc[lane] == target) << lane;
+        }
+        group &= pending;
+        pending &= ~group;
+
+        if (__builtin_popcount(group) < MIN_VECTOR_LANES || target > 4096 - 2 || not same_code(target, group)) {
+            for (uint32_t lanes = group; lanes != 0; lanes &= lanes - 1) {
+                execute_scalar(__builtin_ctz(lanes));
+            }
+            scalar_steps += __builtin_popcount(group);
+            continue;
+        }
+
+        if (decoded[target].op == OP_DECODE) {
+            decoded[target] = machines[lead].decode(target);
+        }
+        execute_vector(decoded[target], group);
+        vector_steps += __builtin_popcount(group);
+    }
+    cycle_count++;
+}
+
+void Chip8Lockstep::run(int cycles) {
+    for (int i = 0; i < cycles; i++) {
+        step();
+    }
+}
+
+// Runs one 60 Hz frame of ipf steps for every lane, followed by one timer tick.
+void Chip8Lockstep::run_frame(int ipf) {
+    run(ipf);
+    tick_timers();
+}
+
+// Counts the timers of every lane down by one, see Chip8::tick_timers().
+void Chip8Lockstep::tick_timers() {
+    for (int lane = 0; lane < LANES; lane++) {
+        delay_timer[lane] -= delay_timer[lane] != 0;
+        sound_timer[lane] -= sound_timer[lane] != 0;
+    }
+}
+
+// Returns whether every lane of the group holds the same opcode at addr.
+bool Chip8Lockstep::same_code(uint16_t addr, uint32_t group) {
+    if (written[addr] == 0 && written[addr + 1] == 0) {
+        return true;
+    }
+    int lead = __builtin_ctz(group);
+    const uint8_t *code = machines[lead].memory + addr;
+    for (uint32_t lanes = group; lanes != 0; lanes &= lanes - 1) {
+        const uint8_t *other = machines[__builtin_ctz(lanes)].memory + addr;
+        if (other[0] != code[0] || other[1] != code[1]) {
+            return false;
+        }
+    }
+    // Cached decodes of this address may predate the write.
+    decoded[addr].op = OP_DECODE;
+    return true;
+}
+
+// Writes a byte of a lane's memory, keeping its machine's decode cache up to date.
+// addr wraps around the end of memory.
+void Chip8Lockstep::write_memory(int lane, uint16_t addr, uint8_t value) {
+    addr &= 0xFFF;
+    machines[lane].memory[addr] = value;
+    machines[lane].invalidate(addr);
+    written[addr] = 1;
+    decoded[(addr - 1) & 0xFFF].op = OP_DECODE;
+    decoded[addr].op = OP_DECODE;
+}
+
+// Copies the registers of a lane into its Chip8, which only holds them while the lane takes the
+// scalar path.
+void Chip8Lockstep::sync_machine(int lane) {
+    Chip8 &machine = machines[lane];
+    for (int i = 0; i < 16; i++) {
+        machine.V[i] = V[i][lane];
+        machine.stack[i] = stack[i][lane];
+    }
+    machine.I = I[lane];
+    machine.pc = pc[lane];
+    machine.sp = sp[lane];
+    machine.delay_timer = delay_timer[lane];
+    machine.sound_timer = sound_timer[lane];
+    machine.cycle_count = cycle_count;
+}
+
+// Runs one instruction of a lane on its Chip8, copying the registers over and back.
+void Chip8Lockstep::execute_scalar(int lane) {
+    Chip8 &machine = machines[lane];
+    sync_machine(lane);
+
+    // Memory is only ever written at I to I + 15, wrapping around, remember what changed there.
+    uint16_t start = machine.I;
+    uint8_t before[16];
+    for (int i = 0; i < 16; i++) {
+        before[i] = machine.memory[(start + i) & 0xFFF];
+    }
+    machine.single_cycle();
+    for (int i = 0; i < 16; i++) {
+        uint16_t addr = (start + i) & 0xFFF;
+        if (machine.memory[addr] != before[i]) {
+            written[addr] = 1;
+            decoded[addr].op = OP_DECODE;
+            decoded[(addr - 1) & 0xFFF].op = OP_DECODE;
+        }
+    }
+
+    for (int i = 0; i < 16; i++) {
+        V[i][lane] = machine.V[i];
+        stack[i][lane] = machine.stack[i];
+    }
+    I[lane] = machine.I;
+    pc[lane] = machine.pc;
+    sp[lane] = machine.sp;
+    delay_timer[lane] = machine.delay_timer;
+    sound_timer[lane] = machine.sound_timer;
+}
+
+// Executes one instruction of a lane in a vector group whose effect depends on per-lane
+// memory, display, keypad, stack or random numbers. Stack faults are left to the interpreter.
+void Chip8Lockstep::execute_lane(const Instruction &in, int lane) {
+    const Chip8Quirks &quirks = get_quirks(variant);
+    Chip8 &machine = machines[lane];
+    uint8_t &vx = V[in.x][lane];
+    if ((in.op == OP_RET && sp[lane] == 0) || (in.op == OP_CALL && sp[lane] >= 16)) {
+        execute_scalar(lane);
+        return;
+    }
+    switch (in.op) {
+        case OP_CLS:
+            memset(machine.display, 0, sizeof(machine.display));
+            machine.dirty_rows = 0xFFFFFFFF;
+            machine.draw_flag = true;
+            pc[lane] += 2;
+            break;
+        case OP_RET:
+            sp[lane]--;
+            pc[lane] = stack[sp[lane]][lane] + 2;
+            break;
+        case OP_CALL:
+            stack[sp[lane]][lane] = pc[lane];
+            sp[lane]++;
+            pc[lane] = in.nnn;
+            break;
+        case OP_RND:
+            vx = machine.next_random() & in.nn;
+            pc[lane] += 2;
+            break;
+        case OP_DRW:
+            machine.I = I[lane];
+            if (quirks.sprites_wrap) {
+                V[0xF][lane] = machine.draw_sprite<true>(vx, V[in.y][lane], in.n);
+            } else {
+                V[0xF][lane] = machine.draw_sprite<false>(vx, V[in.y][lane], in.n);
+            }
+            pc[lane] += 2;
+            break;
+        case OP_SKP:
+            pc[lane] += (machine.keypad[vx & 0xF] != 0) ? 4 : 2;
+            break;
+        case OP_SKNP:
+            pc[lane] += (machine.keypad[vx & 0xF] == 0) ? 4 : 2;
+            break;
+        case OP_LD_KEY: {
+            bool key_pressed = false;
+            for (int i = 0; i < 16; i++) {
+                if (machine.keypad[i] != 0) {
+                    key_pressed = true;
+                    vx = (uint8_t)i;
+                }
+            }
+            if (key_pressed) {
+                pc[lane] += 2;
+            }
+            break;
+        }
+        case OP_LD_B: {
+            uint8_t value = vx;
+            write_memory(lane, I[lane], value / 100);
+            write_memory(lane, I[lane] + 1, (value / 10) % 10);
+            write_memory(lane, I[lane] + 2, value % 10);
+            pc[lane] += 2;
+            break;
+        }
+        case OP_LD_MEM:
+            for (int i = 0; i <= in.x; i++) {
+                write_memory(lane, I[lane] + i, V[i][lane]);
+            }
+            if (quirks.load_store_moves_i) {
+                I[lane] += in.x + 1;
+            }
+            pc[lane] += 2;
+            break;
+        case OP_LD_REGS:
+            for (int i = 0; i <= in.x; i++) {
+                V[i][lane] = machine.memory[(I[lane] + i) & 0xFFF];
+            }
+            if (quirks.load_store_moves_i) {
+                I[lane] += in.x + 1;
+            }
+            pc[lane] += 2;
+            break;
+    }
+    pc[lane] &= 0xFFF;
+}
+
+// Executes one instruction for every lane of the group, which all share the same pc.
+// Flags are written after results, like the interpreter does, so they win in case X is F.
+CHIP8_SIMD_CLONES
+void Chip8Lockstep::execute_vector(const Instruction &in, uint32_t group) {
+    alignas(32) uint8_t lane_mask[LANES];
+    for (int lane = 0; lane < LANES; lane++) {
+        lane_mask[lane] = ((group >> lane) & 1) ? 0xFF : 0x00;
+    }
+    const u8x32 mask = load8(lane_mask);
+    u16x16 mask16[2];
+    widen_mask(mask, mask16);
+
+    const u8x32 one = splat8(1);
+    const Chip8Quirks &quirks = get_quirks(variant);
+    uint8_t *vx = V[in.x];
+    uint8_t *vy = V[in.y];
+    uint8_t *vf = V[0xF];
+    uint8_t *shifted = quirks.shift_reads_vy ? vy : vx;
+
+    // Adds 2 to pc, or 4 where cond is set. pc wraps around the end of memory, like in Chip8.
+    auto skip_if = [&](u8x32 cond) {
+        u16x16 cond16[2];
+        widen_mask(cond & mask, cond16);
+        for (int h = 0; h < 2; h++) {
+            u16x16 next = (load16(pc + 16 * h) + 2 + (cond16[h] & 2)) & 0xFFF;
+            store16(pc + 16 * h, next, mask16[h]);
+        }
+    };
+    auto advance = [&]() {
+        for (int h = 0; h < 2; h++) {
+            store16(pc + 16 * h, (load16(pc + 16 * h) + 2) & 0xFFF, mask16[h]);
+        }
+    };
+    auto set_pc = [&](const u16x16 value[2]) {
+        for (int h = 0; h < 2; h++) {
+            store16(pc + 16 * h, value[h] & 0xFFF, mask16[h]);
+        }
+    };
+
+    switch (in.op) {
+        case OP_JP: {
+            u16x16 target[2] = {splat16(in.nnn), splat16(in.nnn)};
+            set_pc(target);
+            break;
+        }
+        case OP_SE_IMM:
+            skip_if((u8x32)(load8(vx) == in.nn));
+            break;
+        case OP_SNE_IMM:
+            skip_if((u8x32)(load8(vx) != in.nn));
+            break;
+        case OP_SE_REG:
+            skip_if((u8x32)(load8(vx) == load8(vy)));
+            break;
+        case OP_SNE_REG:
+            skip_if((u8x32)(load8(vx) != load8(vy)));
+            break;
+        case OP_LD_IMM:
+            store8(vx, splat8(in.nn), mask);
+            advance();
+            break;
+        case OP_ADD_IMM:
+            store8(vx, load8(vx) + in.nn, mask);
+            advance();
+            break;
+        case OP_LD_REG:
+            store8(vx, load8(vy), mask);
+            advance();
+            break;
+        case OP_OR:
+            store8(vx, load8(vx) | load8(vy), mask);
+            if (quirks.logic_resets_vf) {
+                store8(vf, splat8(0), mask);
+            }
+            advance();
+            break;
+        case OP_AND:
+            store8(vx, load8(vx) & load8(vy), mask);
+            if (quirks.logic_resets_vf) {
+                store8(vf, splat8(0), mask);
+            }
+            advance();
+            break;
+        case OP_XOR:
+            store8(vx, load8(vx) ^ load8(vy), mask);
+            if (quirks.logic_resets_vf) {
+                store8(vf, splat8(0), mask);
+            }
+            advance();
+            break;
+        case OP_ADD_REG: {
+            u8x32 sum = load8(vx) + load8(vy);
+            u8x32 carry = (u8x32)(sum < load8(vx)) & one;
+            store8(vx, sum, mask);
+            store8(vf, carry, mask);
+            advance();
+            break;
+        }
+        case OP_SUB: {
+            u8x32 flag = (u8x32)(load8(vx) >= load8(vy)) & one;
+            store8(vx, load8(vx) - load8(vy), mask);
+            store8(vf, flag, mask);
+            advance();
+            break;
+        }
+        case OP_SUBN: {
+            u8x32 flag = (u8x32)(load8(vy) >= load8(vx)) & one;
+            store8(vx, load8(vy) - load8(vx), mask);
+            store8(vf, flag, mask);
+            advance();
+            break;
+        }
+        case OP_SHR: {
+            u8x32 value = load8(shifted);
+            store8(vx, value >> 1, mask);
+            store8(vf, value & one, mask);
+            advance();
+            break;
+        }
+        case OP_SHL: {
+            u8x32 value = load8(shifted);
+            store8(vx, value << 1, mask);
+            store8(vf, value >> 7, mask);
+            advance();
+            break;
+        }
+        case OP_LD_I:
+            for (int h = 0; h < 2; h++) {
+                store16(I + 16 * h, splat16(in.nnn), mask16[h]);
+            }
+            advance();
+            break;
+        case OP_JP_V0: {
+            u16x16 target[2];
+            widen_value(load8(V[quirks.jump_adds_vx ? in.x : 0]), target);
+            target[0] += in.nnn;
+            target[1] += in.nnn;
+            set_pc(target);
+            break;
+        }
+        case OP_ADD_I: {
+            u16x16 value[2];
+            widen_value(load8(vx), value);
+            // The sum of I and V[X] goes past 0xFFF exactly when I > 0xFFF - V[X], which unlike the
+            // sum cannot wrap around 16 bits when I is already near 0xFFFF.
+            u16x16 carry[2];
+            for (int h = 0; h < 2; h++) {
+                carry[h] = (u16x16)(load16(I + 16 * h) > splat16(0xFFF) - value[h]);
+            }
+            // Narrow the carry masks back into bytes of lane order.
+            alignas(32) uint8_t flags[LANES];
+            for (int lane = 0; lane < LANES; lane++) {
+                flags[lane] = carry[lane / 16][lane % 16] & 1;
+            }
+            for (int h = 0; h < 2; h++) {
+                store16(I + 16 * h, load16(I + 16 * h) + value[h], mask16[h]);
+            }
+            store8(vf, load8(flags), mask);
+            advance();
+            break;
+        }
+        case OP_LD_F: {
+            u16x16 value[2];
+            widen_value(load8(vx), value);
+            for (int h = 0; h < 2; h++) {
+                store16(I + 16 * h, value[h] * 5, mask16[h]);
+            }
+            advance();
+            break;
+        }
+        case OP_LD_VX_DT:
+            store8(vx, load8(delay_timer), mask);
+            advance();
+            break;
+        case OP_LD_DT:
+            store8(delay_timer, load8(vx), mask);
+            advance();
+            break;
+        case OP_LD_ST:
+            store8(sound_timer, load8(vx), mask);
+            advance();
+            break;
+        case OP_INVALID:
+            // Let the interpreter report it.
+            for (uint32_t lanes = group; lanes != 0; lanes &= lanes - 1) {
+                execute_scalar(__builtin_ctz(lanes));
+            }
+            return;
+        default:
+            for (uint32_t lanes = group; lanes != 0; lanes &= lanes - 1) {
+                execute_lane(in, __builtin_ctz(lanes));
+            }
+            break;
+    }
+}
+
+// Takes a snapshot of a lane, as Chip8::save_state() of a machine which ran alone.
+void Chip8Lockstep::save_state(int lane, Chip8State &state) {
+    sync_machine(lane);
+    machines[lane].save_state(state);
+}
+
+void Chip8Lockstep::seed_random(int lane, uint64_t seed) {
+    machines[lane].seed_random(seed);
+}
+
+void Chip8Lockstep::set_keypad_value(int lane, int index, int val) {
+    machines[lane].set_keypad_value(index, val);
+}
+
+uint8_t Chip8Lockstep::get_register(int lane, int index) {
+    return V[index][lane];
+}
+
+uint16_t Chip8Lockstep::get_index(int lane) {
+    return I[lane];
+}
+
+uint16_t Chip8Lockstep::get_pc(int lane) {
+    return pc[lane];
+}
+
+uint8_t Chip8Lockstep::get_delay_timer(int lane) {
+    return delay_timer[lane];
+}
+
+uint64_t Chip8Lockstep::get_cycle_count() {
+    return cycle_count;
+}
+
+long long Chip8Lockstep::get_vector_steps() {
+    return vector_steps;
+}
+
+long long Chip8Lockstep::get_scalar_steps() {
+    return scalar_steps;
+}
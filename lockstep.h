@@ -0,0 +1,74 @@
+#ifndef CHIP8_LOCKSTEP_H
+#define CHIP8_LOCKSTEP_H
+
+#include <cstddef>
+#include <cstdint>
+#include "chip8.h"
+
+/**
+ * Runs LANES machines in lockstep, executing each opcode for all machines sharing a pc at once.
+ * - Registers: V, I, pc, sp, stack and the timers are stored as lane-indexed arrays (structure
+ *              of arrays), so register V[X] of all lanes is one 32-byte vector.
+ * - machines: One Chip8 per lane, holding the lane's memory, display and keypad. Registers of a
+ *             machine are only up to date while that lane takes the scalar path, so the machines
+ *             are not handed out: save_state() copies the registers back before taking a snapshot,
+ *             and lanes are changed through the setters, which keep the tracking below intact.
+ * - cycle_count: Steps since construction. Every lane takes one per step, so all share it.
+ * - Groups: Every step, lanes are grouped by pc. Groups of at least MIN_VECTOR_LANES lanes run
+ *           the opcode with vector code (AVX2 when available). Smaller groups, i.e. lanes which
+ *           diverged, run Chip8::single_cycle() on their machine instead, and simply rejoin the
+ *           vector path once their pc matches the others again.
+ * - variant: Quirk profile of the loaded ROM, the vector code follows its quirks. The vector code
+ *            only knows the 64x32 machine, load_rom() refuses the SUPER-CHIP and XO-CHIP ones.
+ * - written: Addresses written since loading. Lanes may hold different data there, so before
+ *            running an opcode from such an address for a group, the group's bytes are compared.
+ */
+class Chip8Lockstep {
+public:
+    static const int LANES = 32;
+    static const int MIN_VECTOR_LANES = 4;
+
+    Chip8Lockstep();
+    bool load_rom(const uint8_t *, size_t, Chip8Variant = Chip8Variant::Classic);
+    void step();
+    void run(int);
+    void run_frame(int);
+    void tick_timers();
+    void save_state(int, Chip8State &);
+    void seed_random(int, uint64_t);
+    void set_keypad_value(int, int, int);
+    uint8_t get_register(int, int);
+    uint16_t get_index(int);
+    uint16_t get_pc(int);
+    uint8_t get_delay_timer(int);
+    uint64_t get_cycle_count();
+    long long get_vector_steps();
+    long long get_scalar_steps();
+private:
+    alignas(32) uint8_t V[16][LANES];
+    alignas(32) uint16_t I[LANES];
+    alignas(32) uint16_t pc[LANES];
+    alignas(32) uint16_t stack[16][LANES];
+    alignas(32) uint8_t sp[LANES];
+    alignas(32) uint8_t delay_timer[LANES];
+    alignas(32) uint8_t sound_timer[LANES];
+
+    Chip8 machines[LANES];
+    Chip8Variant variant = Chip8Variant::Classic;
+    Instruction decoded[4096];
+    uint8_t written[4096];
+    uint64_t cycle_count = 0;
+
+    // Machine-steps taken through the vector and the scalar path.
+    long long vector_steps = 0;
+    long long scalar_steps = 0;
+
+    bool same_code(uint16_t, uint32_t);
+    void execute_vector(const Instruction &, uint32_t);
+    void execute_lane(const Instruction &, int);
+    void execute_scalar(int);
+    void sync_machine(int);
+    void write_memory(int, uint16_t, uint8_t);
+};
+
+#endif //CHIP8_LOCKSTEP_H
@@ -0,0 +1,221 @@
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "lockstep.h"
+#include "quirks.h"
+#include "test_util.h"
+
+/**
+ * Differential test of Chip8Lockstep against separate Chip8 machines.
+ * Each embedded program runs on LANES lockstep lanes and on LANES scalar machines, every lane
+ * seeded with its own random numbers and pressing its own keys, so lanes work on different data
+ * and take different branches. After every step the snapshot of each lane must match its scalar
+ * machine byte for byte, registers and cycle count included. Every program runs with each quirk
+ * profile.
+ * - alu: 8XYN arithmetic and logic with VF as operand and as destination, and skips on the results.
+ * - add_i: FX1E carrying I past 0xFFF and on around 16 bits.
+ * - sprites: DXYN at random coordinates, clipping or wrapping at the edges, with collisions.
+ * - branches: key skips, calls, BNNN and FX0A, with lanes pressing different keys.
+ * - self_modifying: lanes writing different opcodes into code they run next.
+ *
+ * Usage: chip8_lockstep_test
+ * Prints the first mismatch of each run and a summary, exits with 1 on any mismatch.
+ */
+
+static const int LANES = Chip8Lockstep::LANES;
+static const int STEPS = 1000;
+
+struct Program {
+    std::string name;
+    std::vector<uint16_t> code;
+};
+
+static const Program programs[] = {
+    {"alu", {
+        0xC0FF,         // 0x200: V0 = random
+        0xC1FF,         // 0x202: V1 = random
+        0xC20F,         // 0x204: V2 = random & 0xF
+        0x8014,         // 0x206: V0 += V1
+        0x8015,         // 0x208: V0 -= V1
+        0x8017,         // 0x20A: V0 = V1 - V0
+        0x8016,         // 0x20C: V0 >>= 1
+        0x801E,         // 0x20E: V0 <<= 1
+        0x8011,         // 0x210: V0 |= V1
+        0x8012,         // 0x212: V0 &= V1
+        0x8013,         // 0x214: V0 ^= V1
+        0x8F14,         // 0x216: VF += V1
+        0x81F5,         // 0x218: V1 -= VF
+        0x7F33,         // 0x21A: VF += 0x33
+        0x8F06,         // 0x21C: VF = V0 >> 1
+        0x9010,         // 0x21E: skip if V0 != V1
+        0x5120,         // 0x220: skip if V1 = V2
+        0x4003,         // 0x222: skip if V0 != 3
+        0x3155,         // 0x224: skip if V1 = 0x55
+        0x1200,         // 0x226: again
+    }},
+    {"add_i", {
+        0xAFFF,         // 0x200: I = 0xFFF
+        0xC0FF,         // 0x202: V0 = random
+        0xF01E,         // 0x204: I += V0
+        0xF01E,         // 0x206: I += V0
+        0xF01E,         // 0x208: I += V0
+        0xF01E,         // 0x20A: I += V0
+        0x8F04,         // 0x20C: V0 += VF
+        0x1202,         // 0x20E: again, I grows on past 0xFFFF within the run
+    }},
+    {"sprites", {
+        0xC0FF,         // 0x200: V0 = random x
+        0xC1FF,         // 0x202: V1 = random y
+        0xC20F,         // 0x204: V2 = random digit
+        0xF229,         // 0x206: I = glyph of V2
+        0xD015,         // 0x208: draw it
+        0xD01F,         // 0x20A: draw 15 rows from there
+        0x3F00,         // 0x20C: skip unless it collided
+        0xC307,         // 0x20E: V3 = random & 7
+        0x3300,         // 0x210: skip unless V3 = 0
+        0x1200,         // 0x212: again
+        0x00E0,         // 0x214: clear now and then
+        0x1200,         // 0x216: again
+    }},
+    {"branches", {
+        0xC003,         // 0x200: V0 = random & 3
+        0xE09E,         // 0x202: skip if key V0 is pressed
+        0x1208,         // 0x204: to 0x208
+        0x7101,         // 0x206: V1 += 1
+        0xE1A1,         // 0x208: skip if key V1 is not pressed
+        0x2220,         // 0x20A: call 0x220
+        0x8004,         // 0x20C: V0 += V0
+        0xB212,         // 0x20E: to 0x212 + V0
+        0x0000,         // 0x210: never reached
+        0x7201,         // 0x212: V2 += 1
+        0x7202,         // 0x214: V2 += 2
+        0x7203,         // 0x216: V2 += 3
+        0x4207,         // 0x218: skip unless V2 = 7
+        0xF30A,         // 0x21A: wait for a key
+        0x1200,         // 0x21C: again
+        0x0000,         // 0x21E: never reached
+        0x8326,         // 0x220: V3 = V2 >> 1
+        0x00EE,         // 0x222: return
+    }},
+    {"self_modifying", {
+        0x6071,         // 0x200: V0 = 0x71
+        0xC101,         // 0x202: V1 = random & 1
+        0xA20C,         // 0x204: I = 0x20C
+        0xF155,         // 0x206: store V0, V1 at 0x20C, making it 71 0x or 71 01
+        0xC201,         // 0x208: V2 = random & 1
+        0x3200,         // 0x20A: skip if V2 = 0
+        0x0000,         // 0x20C: replaced by V1 += 0 or 1
+        0x1200,         // 0x20E: again
+    }},
+};
+
+// Returns a description of the first difference between a lane and its scalar machine, or an
+// empty string.
+static std::string compare(Chip8Lockstep &lockstep, int lane, Chip8 &scalar, Chip8State &a, Chip8State &b) {
+    for (int i = 0; i < 16; i++) {
+        if (lockstep.get_register(lane, i) != scalar.get_register(i)) {
+            return "V" + std::to_string(i);
+        }
+    }
+    if (lockstep.get_index(lane) != scalar.get_index()) {
+        return "I";
+    }
+    if (lockstep.get_pc(lane) != scalar.get_pc()) {
+        return "pc";
+    }
+    if (lockstep.get_delay_timer(lane) != scalar.get_delay_timer()) {
+        return "delay_timer";
+    }
+    lockstep.save_state(lane, a);
+    scalar.save_state(b);
+    if (memcmp(a.memory, b.memory, sizeof(a.memory)) != 0) {
+        return "memory";
+    }
+    if (memcmp(a.display, b.display, sizeof(a.display)) != 0) {
+        return "display";
+    }
+    if (memcmp(&a, &b, sizeof(Chip8State)) != 0) {
+        return "snapshot";
+    }
+    return "";
+}
+
+// Runs a program in lockstep and on scalar machines, returns false on the first mismatch.
+static bool run_program(const Program &program, Chip8Variant variant, long long &vector_steps) {
+    Rom rom = assemble(program.code);
+    std::string name = program.name + " (" + variant_name(variant) + ")";
+
+    std::unique_ptr<Chip8Lockstep> lockstep(new Chip8Lockstep());
+    std::unique_ptr<Chip8[]> scalar(new Chip8[LANES]);
+    if (not lockstep->load_rom(rom.data(), rom.size(), variant)) {
+        std::cerr << name << ": ROM could not be loaded\n";
+        return false;
+    }
+    for (int lane = 0; lane < LANES; lane++) {
+        scalar[lane].load_rom(rom.data(), rom.size(), variant);
+        // Half the lanes share a seed, so groups of lanes stay together for a while.
+        uint64_t seed = lane % 2 == 0 ? 1 : lane;
+        lockstep->seed_random(lane, seed);
+        scalar[lane].seed_random(seed);
+    }
+
+    std::unique_ptr<Chip8State> a(new Chip8State());
+    std::unique_ptr<Chip8State> b(new Chip8State());
+    for (int step = 0; step < STEPS; step++) {
+        if (step % 100 == 0) {
+            for (int lane = 0; lane < LANES; lane++) {
+                int key = (lane + step / 100) % 4;
+                int value = (lane / 4 + step / 100) % 2;
+                lockstep->set_keypad_value(lane, key, value);
+                scalar[lane].set_keypad_value(key, value);
+            }
+        }
+        if (step % 50 == 49) {
+            lockstep->tick_timers();
+            for (int lane = 0; lane < LANES; lane++) {
+                scalar[lane].tick_timers();
+            }
+        }
+
+        lockstep->step();
+        for (int lane = 0; lane < LANES; lane++) {
+            scalar[lane].single_cycle();
+            std::string difference = compare(*lockstep, lane, scalar[lane], *a, *b);
+            if (not difference.empty()) {
+                std::cerr << name << ": " << difference << " of lane " << lane << " differs after step "
+                          << step + 1 << "\n";
+                return false;
+            }
+        }
+    }
+    vector_steps += lockstep->get_vector_steps();
+    return true;
+}
+
+int main() {
+    const Chip8Variant variants[] = {Chip8Variant::Classic, Chip8Variant::Cosmac, Chip8Variant::SuperChipQuirks, Chip8Variant::XoChipQuirks};
+    // Random programs hit invalid opcodes, each of which the interpreter reports.
+    std::cerr.setstate(std::ios::badbit);
+
+    int runs = 0;
+    long long vector_steps = 0;
+    for (const Program &program : programs) {
+        for (Chip8Variant variant : variants) {
+            std::cerr.clear();
+            if (not run_program(program, variant, vector_steps)) {
+                failures++;
+            }
+            runs++;
+        }
+    }
+    if (vector_steps == 0) {
+        std::cout << "No step took the vector path\n";
+        failures++;
+    }
+    std::cout << runs << " runs, " << vector_steps << " vector machine-steps, " << failures << " failed\n";
+    return failures == 0 ? 0 : 1;
+}
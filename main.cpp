@@ -1,38 +1,291 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
-#include <zconf.h>
+#include <random>
+#include <thread>
 #include <SDL_video.h>
 #include <SDL_render.h>
 #include <SDL_events.h>
 #include <SDL.h>
+#include "beeper.h"
 #include "chip8.h"
+#include "profiler.h"
+#include "quirks.h"
+#include "recording.h"
+#include "rewind.h"
+#include "spsc_queue.h"
+#include "triple_buffer.h"
+#include "upscale.h"
 
-uint8_t keymap[16] = {
-    SDLK_x, SDLK_1, SDLK_2, SDLK_3,
-    SDLK_q, SDLK_w, SDLK_e, SDLK_a,
-    SDLK_s, SDLK_d, SDLK_z, SDLK_c,
-    SDLK_4, SDLK_r, SDLK_f, SDLK_v
+// Host keys of the 16 Chip8 keys, by position on the keyboard so other layouts get the same grid.
+static const SDL_Scancode key_scancodes[16] = {
+    SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,
+    SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,
+    SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V
 };
 
+// Chip8 key of every scancode, -1 for keys not mapped, so an event costs a single lookup.
+static int8_t keymap[SDL_NUM_SCANCODES];
+
+static void build_keymap() {
+    memset(keymap, -1, sizeof(keymap));
+    for (int i = 0; i < 16; i++) {
+        keymap[key_scancodes[i]] = (int8_t)i;
+    }
+}
+
+// A completed frame, handed from the emulation thread to the render thread. The rows are laid out
+// as Chip8::get_display_rows(), pixels set on either plane of the extended machines set.
+struct Frame {
+    uint64_t rows[128];
+};
+
+// A key press or release, handed from the render thread to the emulation thread, stamped with
+// the time the render thread received it.
+struct KeyEvent {
+    std::chrono::steady_clock::time_point time;
+    uint8_t key;
+    uint8_t value;
+};
+
+// Runs the emulation at 60 frames per second until running is cleared. Every frame which drew
+// something is published for the render thread.
+// Key events received while the previous frame was due are applied during this frame, each one
+// at the cycle matching its time within that interval. Input thus lags by one frame but keeps its
+// timing within the frame, whatever the speed, and the recording stores those exact cycles.
+// While rewinding is set, each frame steps one frame back through the history instead.
+// The beeper sounds while the sound timer is still running at the end of a frame. As on the
+// COSMAC VIP a sound timer of 1 is not heard, it runs out in the tick ending the frame.
+static void emulate(Chip8 &chip8, TripleBuffer<Frame> &frames, SpscQueue<KeyEvent, 256> &keys, Beeper &beeper,
+                    const std::atomic<int> &ipf, const std::atomic<bool> &rewinding, const std::atomic<bool> &running) {
+    Chip8Rewind history;
+    uint8_t held[16] = {};
+    // Frame n is due at frame_origin + n / 60 seconds. Deadlines are computed from the frame
+    // count rather than by adding up sleeps, so oversleeping in one frame is made up in the next
+    // and the rate never drifts.
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point frame_origin = Clock::now();
+    long long frame_count = 0;
+    Clock::time_point previous_start = frame_origin;
+
+    while (running.load(std::memory_order_relaxed)) {
+        Clock::time_point start = Clock::now();
+        double cycles_per_ns = 0.0;
+        int frame_ipf = ipf.load(std::memory_order_relaxed);
+        bool rewind = rewinding.load(std::memory_order_relaxed);
+        int done = 0;
+        if (start > previous_start) {
+            cycles_per_ns = (double)frame_ipf / (double)std::chrono::nanoseconds(start - previous_start).count();
+        }
+
+        KeyEvent key;
+        while (keys.pop(key)) {
+            held[key.key] = key.value;
+            if (not rewind) {
+                int cycle = frame_ipf;
+                if (key.time < start) {
+                    cycle = (int)(std::chrono::nanoseconds(key.time - previous_start).count() * cycles_per_ns);
+                    cycle = std::max(0, std::min(cycle, frame_ipf));
+                }
+                if (cycle > done) {
+                    chip8.run(cycle - done);
+                    done = cycle;
+                }
+            }
+            chip8.set_keypad_value(key.key, key.value);
+        }
+        previous_start = start;
+
+        if (not rewind) {
+            chip8.run(frame_ipf - done);
+            chip8.tick_timers();
+            history.push(chip8);
+            beeper.set_on(chip8.get_sound_timer() > 0);
+        } else {
+            if (history.rewind(chip8) > 0) {
+                // The restored state has the keys held back then, keep the ones held now.
+                for (int i = 0; i < 16; i++) {
+                    chip8.set_keypad_value(i, held[i]);
+                }
+                chip8.set_draw_flag(true);
+            }
+            beeper.set_on(false);
+        }
+
+        if (chip8.get_draw_flag()) {
+            chip8.set_draw_flag(false);
+            chip8.copy_display_rows(frames.back().rows);
+            frames.publish();
+        }
+
+        // Sleep until the next frame is due. After a long stall start counting afresh
+        // instead of running the missed frames back to back.
+        frame_count++;
+        Clock::time_point due = frame_origin + std::chrono::nanoseconds(frame_count * 1000000000LL / 60);
+        Clock::time_point now = Clock::now();
+        if (now - due > std::chrono::milliseconds(250)) {
+            frame_origin = now;
+            frame_count = 0;
+            continue;
+        }
+        std::this_thread::sleep_until(due);
+    }
+    beeper.set_on(false);
+}
+
+// Called by SDL on its audio thread whenever the device needs another buffer.
+static void audio_callback(void *userdata, Uint8 *stream, int len) {
+    static_cast<Beeper *>(userdata)->render(reinterpret_cast<int16_t *>(stream), len / (int)sizeof(int16_t));
+}
+
+// Uploads the display rows which changed since the last upload into the streaming texture, which
+// has the final window size. Each run of consecutive changed rows (widened by the reach of the
+// filter) is locked, upscaled and unlocked on its own, so an unchanged frame costs a compare per
+// row. The display has lines rows of words 64-bit words each.
+// presented holds the rows currently in the texture, valid says whether it holds anything yet.
+// Rows of a run which could not be locked keep their old presented value and are retried on the
+// next call, valid is only set once a full upload went through. pending says whether rows were
+// left over, so the caller retries them even when no new frame comes.
+// Returns whether anything was uploaded.
+static bool update_texture(SDL_Texture *texture, Chip8Upscaler &upscaler, int words, int lines, const uint64_t *rows,
+                           uint64_t *presented, bool &valid, bool &pending) {
+    auto changed = [&](int y) {
+        return not valid || memcmp(rows + y * words, presented + y * words, words * sizeof(uint64_t)) != 0;
+    };
+    bool updated = false;
+    bool failed = false;
+    int y = 0;
+    while (y < lines) {
+        if (not changed(y)) {
+            y++;
+            continue;
+        }
+        int first = y;
+        while (y < lines && changed(y)) {
+            y++;
+        }
+
+        int from = std::max(0, first - upscaler.get_reach());
+        int to = std::min(lines, y + upscaler.get_reach());
+        int scale = upscaler.get_scale();
+        SDL_Rect rect = {0, from * scale, upscaler.get_width(), (to - from) * scale};
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(texture, &rect, &pixels, &pitch) < 0) {
+            std::cerr << "Error in locking texture " << SDL_GetError() << std::endl;
+            failed = true;
+            continue;
+        }
+        upscaler.render_rows(rows, from, to - from, static_cast<uint32_t *>(pixels), pitch);
+        SDL_UnlockTexture(texture);
+        memcpy(presented + first * words, rows + first * words, (y - first) * words * sizeof(uint64_t));
+        updated = true;
+    }
+    if (not failed) {
+        valid = true;
+    }
+    pending = failed;
+    return updated;
+}
+
 int main(int argc, char *argv[]) {
     if (argc <= 1) {
         std::cerr << "Path to ROM to be loaded must be given as argument\nType -help to see usage\n";
         exit(1);
     }
 
+    // ROMs run with the classic quirks unless --quirks picks another variant.
+    Chip8Variant variant = Chip8Variant::Classic;
+    for (int i = 2; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--quirks") == 0 && not parse_variant(argv[i + 1], variant)) {
+            std::cerr << "Unknown variant " << argv[i + 1]
+                      << ", expected classic, chip8, schip, xochip, schip-quirks or xochip-quirks\n";
+            exit(1);
+        }
+    }
+
     // Loading ROM provided as argument
     Chip8 chip8;
-    if (not chip8.load_rom(argv[1])) {
+    if (not chip8.load_rom(argv[1], variant)) {
+        if (chip8.get_fault() == Chip8Fault::RomTooLarge) {
+            std::cerr << "ROM is too large, at most " << Chip8::get_max_rom_size(variant) << " bytes fit in memory\n";
+            exit(1);
+        }
         std::cerr << "ROM could not be loaded. Possibly invalid path given\n";
         exit(1);
     }
 
+    // Optional flags after the ROM path
+    const char *record_path = nullptr;
+    const char *profile_path = nullptr;
+    bool seeded = false;
+    bool muted = false;
+    int audio_buffer = 512; // Samples per audio buffer, about 11 ms at 48 kHz
+    // Both display sizes get a 640x320 window by default.
+    int scale = 640 / chip8.get_display_width();
+    Chip8Filter filter = Chip8Filter::Nearest;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--jit") == 0 && not chip8.set_engine(Chip8Engine::Jit)) {
+            std::cerr << "JIT is not supported on this platform, using the interpreter\n";
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+            if (not chip8.set_profiling(true)) {
+                std::cerr << "Profiling is not available in this build\n";
+                profile_path = nullptr;
+            }
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            ++i;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            chip8.seed_random(strtoull(argv[++i], nullptr, 0));
+            seeded = true;
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            if (not parse_filter(argv[++i], filter)) {
+                std::cerr << "Unknown filter " << argv[i] << ", expected nearest, scale2x, scanlines or crt\n";
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--mute") == 0) {
+            muted = true;
+        } else if (strcmp(argv[i], "--audio-buffer") == 0 && i + 1 < argc) {
+            audio_buffer = atoi(argv[++i]);
+            if (audio_buffer < 64 || audio_buffer > 8192 || (audio_buffer & (audio_buffer - 1)) != 0) {
+                std::cerr << "Audio buffer must be a power of two from 64 to 8192 samples, using 512\n";
+                audio_buffer = 512;
+            }
+        }
+    }
+
+    // Random numbers differ from session to session unless a seed is given.
+    if (not seeded) {
+        chip8.seed_random(std::random_device()());
+    }
+
+    // The recording starts from the state after loading, seed included, and is written on exit.
+    Chip8Recording recording;
+    if (record_path != nullptr) {
+        recording.start(chip8);
+    }
+
     // Set up SDL
     SDL_Window *window;
     SDL_Renderer *renderer;
     SDL_Texture *texture;
-    const int ht = 320, wt = 640;
+    // The display is scaled up on the CPU into a texture of the window size, the renderer only copies it.
+    // The planes of the extended machines are shown merged, in the one color of the 64x32 display.
+    const int display_words = chip8.get_display_width() / 64;
+    const int display_lines = chip8.get_display_height();
+    Chip8Upscaler upscaler(scale, filter, 0xFFFFFFFF, 0xFF000000, chip8.get_display_width(), display_lines);
+    const int ht = upscaler.get_height(), wt = upscaler.get_width();
 
-    if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS) < 0) {
         std::cerr << "Error in initializing SDL " << SDL_GetError() << std::endl;
         SDL_Quit();
         exit(1);
@@ -54,74 +307,126 @@ int main(int argc, char *argv[]) {
 
     SDL_RenderSetLogicalSize(renderer, wt, ht);
 
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 64, 32);
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, wt, ht);
     if (texture == nullptr) {
         std::cerr << "Error in setting up texture " << SDL_GetError() << std::endl;
         SDL_Quit();
         exit(1);
     }
 
-    // Set initial emulation speed (delay in microseconds)
-    unsigned int cycle_delay = 1500;
+    // Audio is optional, without a device the emulator just stays silent. The device is opened
+    // with exactly the format the beeper renders, SDL converts if the hardware wants another one.
+    const int sample_rate = 48000;
+    Beeper beeper(sample_rate);
+    SDL_AudioDeviceID audio = 0;
+    if (not muted && SDL_InitSubSystem(SDL_INIT_AUDIO) == 0) {
+        SDL_AudioSpec want = {};
+        want.freq = sample_rate;
+        want.format = AUDIO_S16SYS;
+        want.channels = 1;
+        want.samples = (Uint16)audio_buffer;
+        want.callback = audio_callback;
+        want.userdata = &beeper;
+        audio = SDL_OpenAudioDevice(nullptr, 0, &want, nullptr, 0);
+    }
+    if (not muted && audio == 0) {
+        std::cerr << "No audio device, running without sound " << SDL_GetError() << std::endl;
+    }
+    if (audio != 0) {
+        SDL_PauseAudioDevice(audio, 0);
+    }
+
+    // Display rows currently held by the texture
+    uint64_t presented_rows[128];
+    bool texture_valid = false;
+    bool upload_pending = false;
 
-    while (true) {
-        chip8.single_cycle();
+    // From here on chip8 belongs to the emulation thread. This thread only handles events
+    // and presents, so a present blocking on vsync never holds up the emulation.
+    build_keymap();
+    TripleBuffer<Frame> frames;
+    SpscQueue<KeyEvent, 256> keys;
+    std::atomic<int> ipf(10); // Emulation speed in instructions per 60 Hz frame
+    std::atomic<bool> rewinding(false);
+    std::atomic<bool> running(true);
+    std::thread emulator(emulate, std::ref(chip8), std::ref(frames), std::ref(keys), std::ref(beeper), std::cref(ipf), std::cref(rewinding),
+                         std::cref(running));
 
+    while (running) {
+        // Wait for input, but at most a millisecond so new frames are picked up promptly.
         SDL_Event event;
-        while (SDL_PollEvent(&event)) {
+        bool has_event = SDL_WaitEventTimeout(&event, 1) != 0;
+        while (has_event) {
             if (event.type == SDL_QUIT) {
-                exit(0);
+                running = false;
             }
             if (event.type == SDL_KEYDOWN) {
                 // Allow ESC to quit
                 if (event.key.keysym.sym == SDLK_ESCAPE) {
-                    exit(0);
+                    running = false;
                 }
                 // Adjust speed with UP and DOWN arrow keys.
                 if (event.key.keysym.sym == SDLK_UP) {
-                    if (cycle_delay > 100) { // Avoid negative or too low delay
-                        cycle_delay -= 100;
-                        std::cout << "Speeding up, delay = " << cycle_delay << " microseconds" << std::endl;
-                    }
+                    std::cout << "Speeding up, " << ++ipf << " instructions per frame" << std::endl;
                 }
                 if (event.key.keysym.sym == SDLK_DOWN) {
-                    cycle_delay += 100;
-                    std::cout << "Slowing down, delay = " << cycle_delay << " microseconds" << std::endl;
-                }
-                // Set Chip8 keypad values for game controls.
-                for (int i = 0; i < 16; ++i) {
-                    if (event.key.keysym.sym == keymap[i]) {
-                        chip8.set_keypad_value(i, 1);
+                    if (ipf > 1) { // Keep executing at least one instruction per frame
+                        std::cout << "Slowing down, " << --ipf << " instructions per frame" << std::endl;
                     }
                 }
             }
-            if (event.type == SDL_KEYUP) {
-                for (int i = 0; i < 16; ++i) {
-                    if (event.key.keysym.sym == keymap[i]) {
-                        chip8.set_keypad_value(i, 0);
-                    }
-                }
+            // Step back through the history for as long as BACKSPACE is held. Not while recording,
+            // a recording only ever moves forward.
+            if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && event.key.keysym.sym == SDLK_BACKSPACE &&
+                record_path == nullptr) {
+                rewinding = event.type == SDL_KEYDOWN;
+            }
+            // Forward Chip8 keypad presses and releases to the emulation thread. With the queue full
+            // the emulation has stalled anyway, so dropping the event is harmless.
+            if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && not event.key.repeat &&
+                keymap[event.key.keysym.scancode] >= 0) {
+                keys.push(KeyEvent{std::chrono::steady_clock::now(), (uint8_t)keymap[event.key.keysym.scancode],
+                                   (uint8_t)(event.type == SDL_KEYDOWN ? 1 : 0)});
             }
+            has_event = SDL_PollEvent(&event) != 0;
         }
 
-        if (chip8.get_draw_flag()) {
-            chip8.set_draw_flag(false);
-            uint32_t pixels[32 * 64];
-            for (int i = 0; i < 32 * 64; i++) {
-                if (chip8.get_display_value(i) == 0) {
-                    pixels[i] = 0xFF000000;
-                } else {
-                    pixels[i] = 0xFFFFFFFF;
-                }
-            }
-            SDL_UpdateTexture(texture, NULL, pixels, 64 * sizeof(uint32_t));
+        // Only present when the picture actually changed, sprites erased and redrawn
+        // at the same place between two presents cost nothing. Rows a failed upload left over are
+        // retried on every pass, a paused or idle game publishes no new frame to trigger it.
+        bool new_frame = frames.update();
+        if ((new_frame || upload_pending) &&
+            update_texture(texture, upscaler, display_words, display_lines, frames.front().rows, presented_rows,
+                           texture_valid, upload_pending)) {
             SDL_RenderClear(renderer);
             SDL_RenderCopy(renderer, texture, NULL, NULL);
             SDL_RenderPresent(renderer);
         }
-
-        usleep(cycle_delay);
     }
 
+    emulator.join();
+    if (audio != 0) {
+        SDL_CloseAudioDevice(audio);
+    }
+    if (record_path != nullptr) {
+        recording.stop(chip8);
+        if (not recording.save(record_path)) {
+            std::cerr << "Recording could not be written to " << record_path << std::endl;
+        }
+    }
+    // The JSON report goes to the given file, the hot spots to the console.
+    if (profile_path != nullptr) {
+        std::ofstream report(profile_path);
+        if (report.is_open()) {
+            chip8.get_profile()->write_json(report, chip8);
+        } else {
+            std::cerr << "Profile could not be written to " << profile_path << std::endl;
+        }
+        chip8.get_profile()->write_hotspots(std::cout, chip8);
+    }
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
     return 0;
 }
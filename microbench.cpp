@@ -0,0 +1,305 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "file_util.h"
+#include "romcache.h"
+#include "upscale.h"
+
+/**
+ * Microbenchmarks of both engines, complementing the whole-ROM numbers of chip8_bench.
+ * - opcode: ns per instruction of a loop repeating one opcode (or a short sequence), i.e. the
+ *           dispatch and handler cost of that opcode. 2NNN+00EE calls a subroutine which returns.
+ * - sprite: ns per DXYN of height 1, 5 and 15.
+ * - frame: µs per run_frame() of an embedded program clearing the screen, drawing a row of
+ *          sprites and polling a key, and of any ROMs given, at 1000 instructions per frame.
+ * - upscale: µs per full frame of every Chip8Upscaler filter at 640x320 and 1024x512.
+ * - startup: µs per session started on a reused machine, i.e. loading the embedded program or a
+ *            ROM given and running its first frame, from the ROM itself or from its cached
+ *            analysis (see romcache.h), which spares decoding what the frame reaches.
+ * Prints one JSON object per measurement on stdout, the best of three runs. Every value is a time,
+ * so lower is faster.
+ *
+ * Usage: chip8_microbench [--quick] [rom]...
+ * - --quick: Short runs, for a smoke test under ctest rather than for numbers.
+ */
+
+typedef std::vector<uint16_t> Program;
+
+// Marks a jump to the instruction following it in a loop body.
+static const uint16_t JUMP_NEXT = 0x1FFF;
+// Marks a call of a subroutine which only returns, placed after the loop.
+static const uint16_t CALL_RETURN = 0x2FFF;
+
+struct OpBench {
+    const char *name;
+    Program setup;
+    Program body;
+};
+
+// Runs before each loop body: V0 to V3 hold small values, VA and VB larger ones, I points to
+// scratch memory far from the code.
+static const Program common_setup = {0x6001, 0x6102, 0x6203, 0x6304, 0x6A5A, 0x6B3C, 0xA800};
+
+static const OpBench op_benches[] = {
+    {"6XNN", {}, {0x6A12}},
+    {"7XNN", {}, {0x7A01}},
+    {"8XY0", {}, {0x8AB0}},
+    {"8XY4", {}, {0x8AB4}},
+    {"8XY5", {}, {0x8AB5}},
+    {"8XY6", {}, {0x8AB6}},
+    {"3XNN", {}, {0x3AFF}},
+    {"ANNN", {}, {0xA800}},
+    {"FX1E", {0x6A00}, {0xFA1E}},
+    {"FX29", {}, {0xFA29}},
+    {"CXNN", {}, {0xCAFF}},
+    {"EX9E", {}, {0xE09E}},
+    {"FX07", {}, {0xFA07}},
+    {"FX33", {}, {0xFA33}},
+    {"ANNN+FX55", {}, {0xA800, 0xF355}},
+    {"ANNN+FX65", {}, {0xA800, 0xF365}},
+    {"1NNN", {}, {JUMP_NEXT}},
+    {"2NNN+00EE", {}, {CALL_RETURN}},
+};
+
+// Copies of the body in one pass of the loop, so the closing jump costs little.
+static const int BODY_REPEATS = 64;
+
+// Assembles setup, then the body repeated, then a jump back to the first body and the
+// subroutine of CALL_RETURN.
+static std::vector<uint8_t> loop_rom(const Program &setup, const Program &body) {
+    Program program = setup;
+    uint16_t loop = (uint16_t)(0x200 + 2 * program.size());
+    uint16_t subroutine = (uint16_t)(loop + 2 * (BODY_REPEATS * body.size() + 1));
+    for (int i = 0; i < BODY_REPEATS; i++) {
+        for (uint16_t opcode : body) {
+            uint16_t addr = (uint16_t)(0x200 + 2 * program.size());
+            if (opcode == JUMP_NEXT) {
+                opcode = (uint16_t)(0x1000 | (addr + 2));
+            } else if (opcode == CALL_RETURN) {
+                opcode = (uint16_t)(0x2000 | subroutine);
+            }
+            program.push_back(opcode);
+        }
+    }
+    program.push_back((uint16_t)(0x1000 | loop));
+    program.push_back(0x00EE);
+
+    std::vector<uint8_t> rom;
+    for (uint16_t opcode : program) {
+        rom.push_back(opcode >> 8);
+        rom.push_back(opcode & 0xFF);
+    }
+    return rom;
+}
+
+// Runs a freshly loaded ROM for cycles instructions with frames ticks in between, returns the
+// best elapsed seconds of three runs, or a negative value if the engine is not available.
+static double time_rom(const std::vector<uint8_t> &rom, Chip8Engine engine, long long frames, int ipf) {
+    double best = -1.0;
+    for (int run = 0; run < 3; run++) {
+        Chip8 chip8;
+        if (not chip8.load_rom(rom.data(), rom.size()) || not chip8.set_engine(engine)) {
+            return -1.0;
+        }
+        // Warm up the decode cache and the JIT.
+        chip8.run(ipf);
+
+        auto start = std::chrono::steady_clock::now();
+        for (long long frame = 0; frame < frames; frame++) {
+            chip8.run_frame(ipf);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        if (best < 0.0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+static const char *engine_name(Chip8Engine engine) {
+    return engine == Chip8Engine::Jit ? "jit" : "interpreter";
+}
+
+static std::string json_string(const std::string &value) {
+    std::string escaped = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+int main(int argc, char *argv[]) {
+    bool quick = false;
+    std::vector<std::string> roms;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else if (strcmp(argv[i], "-help") == 0 || strcmp(argv[i], "--help") == 0) {
+            std::cerr << "Usage: chip8_microbench [--quick] [rom]...\n";
+            return 0;
+        } else {
+            roms.push_back(argv[i]);
+        }
+    }
+
+    // Opcode loops run as frames of 100000 instructions, so timer ticks hardly count.
+    const int loop_ipf = 100000;
+    const long long loop_frames = quick ? 10 : 300;
+    const Chip8Engine engines[] = {Chip8Engine::Interpreter, Chip8Engine::Jit};
+
+    for (const OpBench &bench : op_benches) {
+        Program setup = common_setup;
+        setup.insert(setup.end(), bench.setup.begin(), bench.setup.end());
+        std::vector<uint8_t> rom = loop_rom(setup, bench.body);
+        for (Chip8Engine engine : engines) {
+            double seconds = time_rom(rom, engine, loop_frames, loop_ipf);
+            if (seconds < 0.0) {
+                continue;
+            }
+            std::cout << "{\"bench\": \"opcode\", \"name\": \"" << bench.name << "\""
+                      << ", \"engine\": \"" << engine_name(engine) << "\""
+                      << ", \"ns_per_instruction\": " << seconds * 1e9 / (loop_frames * loop_ipf)
+                      << "}" << std::endl;
+        }
+    }
+
+    // Sprites drawn from the font at I = 0, walking across the screen as V0 wraps around.
+    const int heights[] = {1, 5, 15};
+    for (int height : heights) {
+        Program setup = {0x6000, 0x6100, 0xA000};
+        Program body = {(uint16_t)(0xD010 | height), 0x7003};
+        std::vector<uint8_t> rom = loop_rom(setup, body);
+        for (Chip8Engine engine : engines) {
+            double seconds = time_rom(rom, engine, loop_frames, loop_ipf);
+            if (seconds < 0.0) {
+                continue;
+            }
+            // Half of the instructions are draws, the adds are cheap next to them.
+            std::cout << "{\"bench\": \"sprite\", \"height\": " << height
+                      << ", \"engine\": \"" << engine_name(engine) << "\""
+                      << ", \"ns_per_draw\": " << seconds * 1e9 / (loop_frames * loop_ipf / 2)
+                      << "}" << std::endl;
+        }
+    }
+
+    // A frame of a typical game: clear, draw a diagonal row of eight sprites, poll a key.
+    const Program game = {
+        0x00E0,         // 0x200: CLS
+        0x6000,         // 0x202: V0 = 0
+        0x6100,         // 0x204: V1 = 0
+        0xA000,         // 0x206: I = glyph 0
+        0xD015,         // 0x208: draw at (V0, V1)
+        0x7008,         // 0x20A: V0 += 8
+        0x7103,         // 0x20C: V1 += 3
+        0x3040,         // 0x20E: skip once V0 = 64
+        0x1208,         // 0x210: next sprite
+        0xE59E,         // 0x212: skip if key 5 is pressed
+        0x7201,         // 0x214: V2 += 1
+        0x1200,         // 0x216: next round
+    };
+    std::vector<uint8_t> game_rom;
+    for (uint16_t opcode : game) {
+        game_rom.push_back(opcode >> 8);
+        game_rom.push_back(opcode & 0xFF);
+    }
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> frame_roms = {{"embedded", game_rom}};
+    for (const std::string &path : roms) {
+        std::vector<uint8_t> rom;
+        if (not chip8_read_file(path, rom)) {
+            std::cerr << "ROM could not be loaded: " << path << "\n";
+            return 1;
+        }
+        frame_roms.push_back({path, rom});
+    }
+
+    // Upscaling a frame of the embedded program, as the frontend does for every changed frame.
+    Chip8 scene;
+    scene.load_rom(game_rom.data(), game_rom.size());
+    scene.run(2000);
+    const char *filter_names[] = {"nearest", "scale2x", "scanlines", "crt"};
+    const int scales[] = {10, 16};
+    const long long renders = quick ? 20 : 2000;
+    for (int f = 0; f < 4; f++) {
+        for (int scale : scales) {
+            Chip8Upscaler upscaler(scale, (Chip8Filter)f);
+            std::vector<uint32_t> pixels((size_t)upscaler.get_width() * upscaler.get_height());
+            double best = -1.0;
+            for (int run = 0; run < 3; run++) {
+                auto start = std::chrono::steady_clock::now();
+                for (long long i = 0; i < renders; i++) {
+                    upscaler.render(scene.get_display_rows(), pixels.data(), upscaler.get_width() * 4);
+                }
+                auto end = std::chrono::steady_clock::now();
+                double seconds = std::chrono::duration<double>(end - start).count();
+                if (best < 0.0 || seconds < best) {
+                    best = seconds;
+                }
+            }
+            std::cout << "{\"bench\": \"upscale\", \"filter\": \"" << filter_names[f] << "\""
+                      << ", \"width\": " << upscaler.get_width() << ", \"height\": " << upscaler.get_height()
+                      << ", \"us_per_frame\": " << best * 1e6 / renders
+                      << "}" << std::endl;
+        }
+    }
+
+    const int frame_ipf = 1000;
+    Chip8RomCache rom_cache("");
+    const long long sessions = quick ? 20 : 5000;
+    for (const auto &entry : frame_roms) {
+        const Chip8RomAnalysis *analysis = rom_cache.lookup(entry.second.data(), entry.second.size());
+        for (Chip8Engine engine : engines) {
+            for (bool cached : {false, true}) {
+                Chip8 chip8;
+                if (not chip8.set_engine(engine)) {
+                    continue;
+                }
+                double best = -1.0;
+                for (int run = 0; run < 3; run++) {
+                    auto start = std::chrono::steady_clock::now();
+                    for (long long session = 0; session < sessions; session++) {
+                        if (cached) {
+                            chip8.load_rom(*analysis, Chip8Variant::Classic);
+                        } else {
+                            chip8.load_rom(entry.second.data(), entry.second.size());
+                        }
+                        chip8.run_frame(frame_ipf);
+                    }
+                    auto end = std::chrono::steady_clock::now();
+                    double seconds = std::chrono::duration<double>(end - start).count();
+                    if (best < 0.0 || seconds < best) {
+                        best = seconds;
+                    }
+                }
+                std::cout << "{\"bench\": \"startup\", \"rom\": " << json_string(entry.first)
+                          << ", \"engine\": \"" << engine_name(engine) << "\""
+                          << ", \"from\": \"" << (cached ? "analysis" : "rom") << "\""
+                          << ", \"us_per_session\": " << best * 1e6 / sessions
+                          << "}" << std::endl;
+            }
+        }
+    }
+
+    const long long frames = quick ? 200 : 20000;
+    for (const auto &entry : frame_roms) {
+        for (Chip8Engine engine : engines) {
+            double seconds = time_rom(entry.second, engine, frames, frame_ipf);
+            if (seconds < 0.0) {
+                continue;
+            }
+            std::cout << "{\"bench\": \"frame\", \"rom\": " << json_string(entry.first)
+                      << ", \"engine\": \"" << engine_name(engine) << "\""
+                      << ", \"ipf\": " << frame_ipf
+                      << ", \"us_per_frame\": " << seconds * 1e6 / frames
+                      << "}" << std::endl;
+        }
+    }
+    return 0;
+}
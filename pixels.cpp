@@ -0,0 +1,93 @@
+#include "pixels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHIP8_PIXELS_X86 1
+#include <immintrin.h>
+#else
+#define CHIP8_PIXELS_X86 0
+#endif
+
+void blend_bits_scalar(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels) {
+    for (int x = 0; x < 64 * words; x++) {
+        uint32_t mask = 0 - (uint32_t)((bits[x / 64] >> (63 - x % 64)) & 1);
+        pixels[x] = (on[x] & mask) | (off[x] & ~mask);
+    }
+}
+
+#if CHIP8_PIXELS_X86
+
+// Each byte of a row holds 8 pixels, the leftmost one in the most significant bit.
+// The byte is broadcast to every lane, each lane keeps the bit of its own pixel and
+// the comparison turns that into an all-ones mask to select between on and off.
+
+__attribute__((target("sse2")))
+static void blend_sse2(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels) {
+    const __m128i high_bits = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+    const __m128i low_bits = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+
+    for (int b = 0; b < 8 * words; b++) {
+        __m128i byte = _mm_set1_epi32((int)((bits[b / 8] >> (56 - 8 * (b % 8))) & 0xFF));
+        __m128i high = _mm_cmpeq_epi32(_mm_and_si128(byte, high_bits), high_bits);
+        __m128i low = _mm_cmpeq_epi32(_mm_and_si128(byte, low_bits), low_bits);
+        const __m128i *on_pixels = reinterpret_cast<const __m128i *>(on + 8 * b);
+        const __m128i *off_pixels = reinterpret_cast<const __m128i *>(off + 8 * b);
+        __m128i *out = reinterpret_cast<__m128i *>(pixels + 8 * b);
+        _mm_storeu_si128(out, _mm_or_si128(_mm_and_si128(high, _mm_loadu_si128(on_pixels)),
+                                           _mm_andnot_si128(high, _mm_loadu_si128(off_pixels))));
+        _mm_storeu_si128(out + 1, _mm_or_si128(_mm_and_si128(low, _mm_loadu_si128(on_pixels + 1)),
+                                               _mm_andnot_si128(low, _mm_loadu_si128(off_pixels + 1))));
+    }
+}
+
+__attribute__((target("avx2")))
+static void blend_avx2(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels) {
+    const __m256i bit_masks = _mm256_set_epi32(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+
+    for (int b = 0; b < 8 * words; b++) {
+        __m256i byte = _mm256_set1_epi32((int)((bits[b / 8] >> (56 - 8 * (b % 8))) & 0xFF));
+        __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(byte, bit_masks), bit_masks);
+        __m256i on_pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(on + 8 * b));
+        __m256i off_pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(off + 8 * b));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels + 8 * b), _mm256_blendv_epi8(off_pixels, on_pixels, mask));
+    }
+}
+
+#endif
+
+void blend_bits(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels) {
+#if CHIP8_PIXELS_X86
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    static const bool has_sse2 = __builtin_cpu_supports("sse2");
+    if (has_avx2) {
+        blend_avx2(bits, words, on, off, pixels);
+        return;
+    }
+    if (has_sse2) {
+        blend_sse2(bits, words, on, off, pixels);
+        return;
+    }
+#endif
+    blend_bits_scalar(bits, words, on, off, pixels);
+}
+
+// The SIMD paths of blend_bits() on their own, for testing them against blend_bits_scalar().
+// Return false without writing anything when the CPU or the build lacks the instructions.
+bool blend_bits_sse2(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels) {
+#if CHIP8_PIXELS_X86
+    if (__builtin_cpu_supports("sse2")) {
+        blend_sse2(bits, words, on, off, pixels);
+        return true;
+    }
+#endif
+    return false;
+}
+
+bool blend_bits_avx2(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels) {
+#if CHIP8_PIXELS_X86
+    if (__builtin_cpu_supports("avx2")) {
+        blend_avx2(bits, words, on, off, pixels);
+        return true;
+    }
+#endif
+    return false;
+}
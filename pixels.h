@@ -0,0 +1,20 @@
+#ifndef CHIP8_PIXELS_H
+#define CHIP8_PIXELS_H
+
+#include <cstdint>
+
+/**
+ * Conversion of the packed 1-bit display rows into 32-bit pixels (e.g. ARGB8888).
+ * - blend_bits: Expands one row of `words` * 64 pixels, where pixel x takes on[x] if its bit is set
+ *               and off[x] otherwise, so every column can have colors of its own (see upscale.h).
+ *               Uses AVX2 or SSE2 when the CPU supports it, plain C++ otherwise.
+ * - blend_bits_scalar: Portable version of blend_bits, also used as reference for the SIMD kernels.
+ * - blend_bits_sse2, blend_bits_avx2: The SIMD kernels of blend_bits on their own. Return false
+ *                                     without writing anything if the CPU lacks the instructions.
+ */
+void blend_bits(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels);
+void blend_bits_scalar(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels);
+bool blend_bits_sse2(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels);
+bool blend_bits_avx2(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels);
+
+#endif //CHIP8_PIXELS_H
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "pixels.h"
+#include "test_util.h"
+
+/**
+ * Tests of the SIMD kernels of blend_bits() against blend_bits_scalar().
+ * Every kernel the CPU supports, and blend_bits() itself, expands the same bits and colors as the
+ * scalar version: rows of 1 to 16 words (every upscaling factor), all pixels off, all on, single
+ * pixels at each position of a byte and random patterns, from buffers at every alignment of a
+ * pixel. Pixels past the row must stay untouched.
+ *
+ * Usage: chip8_pixels_test
+ * Prints one line per failed check and a summary, exits with 1 if any check failed. Kernels the
+ * CPU lacks are reported and skipped.
+ */
+
+typedef bool (*Kernel)(const uint64_t *, int, const uint32_t *, const uint32_t *, uint32_t *);
+
+static const uint32_t GUARD = 0xDEADBEEF;
+
+static bool blend_bits_dispatched(const uint64_t *bits, int words, const uint32_t *on, const uint32_t *off, uint32_t *pixels) {
+    blend_bits(bits, words, on, off, pixels);
+    return true;
+}
+
+// Returns bit patterns for a row of the given number of words.
+static std::vector<std::vector<uint64_t>> patterns(int words, std::mt19937_64 &random) {
+    std::vector<std::vector<uint64_t>> all;
+    all.emplace_back(words, 0);
+    all.emplace_back(words, ~0ULL);
+    all.emplace_back(words, 0xAAAAAAAAAAAAAAAAULL);
+    for (int bit = 0; bit < 64; bit += 7) {
+        std::vector<uint64_t> single(words, 0);
+        single[bit % words] = 1ULL << bit;
+        all.push_back(single);
+    }
+    for (int i = 0; i < 8; i++) {
+        std::vector<uint64_t> bits(words);
+        for (uint64_t &word : bits) {
+            word = random();
+        }
+        all.push_back(bits);
+    }
+    return all;
+}
+
+static void test_kernel(const std::string &name, Kernel kernel) {
+    std::mt19937_64 random(17);
+    for (int words = 1; words <= 16; words++) {
+        int width = 64 * words;
+        // One spare pixel in front for misalignment and a few behind to catch overruns.
+        std::vector<uint32_t> on(width + 1), off(width + 1), expected(width + 8), actual(width + 9);
+        for (int offset = 0; offset < 4; offset++) {
+            for (const std::vector<uint64_t> &bits : patterns(words, random)) {
+                for (int x = 0; x <= width; x++) {
+                    on[x] = (uint32_t)random();
+                    off[x] = (uint32_t)random();
+                }
+                const uint32_t *on_row = on.data() + offset % 2;
+                const uint32_t *off_row = off.data() + offset / 2;
+                uint32_t *out = actual.data() + offset % 2;
+                std::fill(expected.begin(), expected.end(), GUARD);
+                std::fill(actual.begin(), actual.end(), GUARD);
+                blend_bits_scalar(bits.data(), words, on_row, off_row, expected.data());
+                if (not kernel(bits.data(), words, on_row, off_row, out)) {
+                    std::cout << name << " is not supported here, skipped\n";
+                    return;
+                }
+                bool same = true;
+                for (int x = 0; x < width + 8; x++) {
+                    same = same && out[x] == expected[x];
+                }
+                check(same, name + " matches blend_bits_scalar on " + std::to_string(words) + " words at offset " +
+                            std::to_string(offset));
+            }
+        }
+    }
+}
+
+int main() {
+    test_kernel("blend_bits_sse2", blend_bits_sse2);
+    test_kernel("blend_bits_avx2", blend_bits_avx2);
+    test_kernel("blend_bits", blend_bits_dispatched);
+
+    return report();
+}
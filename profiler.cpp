@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include "profiler.h"
+#include "quirks.h"
+
+static const char *const op_names[] = {
+#define CHIP8_OP_NAME(name) #name,
+    CHIP8_OPS(CHIP8_OP_NAME)
+#undef CHIP8_OP_NAME
+};
+
+// Closes the running frame, called with every timer tick.
+void Chip8Profile::end_frame() {
+    frames++;
+    max_frame_draws = std::max(max_frame_draws, frame_draws);
+    max_frame_pixels = std::max(max_frame_pixels, frame_pixels);
+    frame_draws = 0;
+    frame_pixels = 0;
+}
+
+// Returns the addresses executed at all, the most executed ones first, at most limit of them.
+static std::vector<int> hottest(const Chip8Profile &profile, int limit) {
+    std::vector<int> addrs;
+    for (int addr = 0; addr < 4096; addr++) {
+        if (profile.pc_counts[addr] != 0) {
+            addrs.push_back(addr);
+        }
+    }
+    std::stable_sort(addrs.begin(), addrs.end(), [&profile](int a, int b) {
+        return profile.pc_counts[a] > profile.pc_counts[b];
+    });
+    if ((int)addrs.size() > limit) {
+        addrs.resize(limit);
+    }
+    return addrs;
+}
+
+static uint16_t opcode_at(Chip8 &chip8, int addr) {
+    return (uint16_t)((chip8.get_memory_value(addr) << 8) | chip8.get_memory_value((addr + 1) & 0xFFF));
+}
+
+// Quotes a string for JSON, disassembly only needs quotes escaped.
+static std::string json_string(const std::string &value) {
+    std::string escaped = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+// Writes the profile as one JSON object, with the top hottest addresses disassembled from the
+// current memory of chip8.
+void Chip8Profile::write_json(std::ostream &out, Chip8 &chip8, int top) const {
+    double frame_count = frames > 0 ? (double)frames : 1.0;
+    out << "{\"instructions\": " << instructions
+        << ", \"frames\": " << frames
+        << ", \"ops\": {";
+    bool first = true;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (op == OP_DECODE || op_counts[op] == 0) {
+            continue;
+        }
+        out << (first ? "" : ", ") << "\"" << op_names[op] << "\": " << op_counts[op];
+        first = false;
+    }
+    out << "}, \"draws\": {\"total\": " << draws
+        << ", \"pixels\": " << pixels
+        << ", \"per_frame\": " << draws / frame_count
+        << ", \"pixels_per_frame\": " << pixels / frame_count
+        << ", \"max_per_frame\": " << max_frame_draws
+        << ", \"max_pixels_per_frame\": " << max_frame_pixels
+        << "}, \"hotspots\": [";
+    first = true;
+    for (int addr : hottest(*this, top)) {
+        char pc[8];
+        snprintf(pc, sizeof(pc), "0x%03X", addr);
+        out << (first ? "" : ", ")
+            << "{\"pc\": \"" << pc << "\""
+            << ", \"count\": " << pc_counts[addr]
+            << ", \"share\": " << (double)pc_counts[addr] / (instructions > 0 ? instructions : 1)
+            << ", \"instruction\": " << json_string(disassemble(opcode_at(chip8, addr), chip8.get_variant()))
+            << "}";
+        first = false;
+    }
+    out << "]}" << std::endl;
+}
+
+// Writes the top hottest addresses as a table, with share of all instructions and disassembly.
+void Chip8Profile::write_hotspots(std::ostream &out, Chip8 &chip8, int top) const {
+    char line[96];
+    out << "  addr  opcode        count   share  instruction\n";
+    for (int addr : hottest(*this, top)) {
+        uint16_t opcode = opcode_at(chip8, addr);
+        double share = 100.0 * pc_counts[addr] / (instructions > 0 ? instructions : 1);
+        snprintf(line, sizeof(line), " 0x%03X    %04X %12llu  %5.1f%%  ", addr, opcode,
+                 (unsigned long long)pc_counts[addr], share);
+        out << line << disassemble(opcode, chip8.get_variant()) << "\n";
+    }
+}
+
+// Returns the assembly of an opcode in the usual CHIP-8 mnemonics, e.g. "LD V1, 0x2A", as the
+// given variant executes it. The extended machines have the SUPER-CHIP and XO-CHIP mnemonics of
+// their opcodes, the long F000 NNNN reading "LD I, LONG" without the address that follows it.
+std::string disassemble(uint16_t opcode, Chip8Variant variant) {
+    bool extended = is_extended_variant(variant);
+    bool xo = variant == Chip8Variant::XoChip;
+    int x = (opcode >> 8) & 0xF;
+    int y = (opcode >> 4) & 0xF;
+    int n = opcode & 0xF;
+    int nn = opcode & 0xFF;
+    int nnn = opcode & 0xFFF;
+    char text[32];
+
+    switch (opcode >> 12) {
+        case 0x0:
+            if (opcode == 0x00E0) return "CLS";
+            if (opcode == 0x00EE) return "RET";
+            if (extended && (opcode & 0xFFF0) == 0x00C0) {
+                snprintf(text, sizeof(text), "SCD %d", n);
+                break;
+            }
+            if (xo && (opcode & 0xFFF0) == 0x00D0) {
+                snprintf(text, sizeof(text), "SCU %d", n);
+                break;
+            }
+            if (extended && opcode >= 0x00FB) {
+                static const char *const controls[] = {"SCR", "SCL", "EXIT", "LOW", "HIGH"};
+                return controls[opcode - 0x00FB];
+            }
+            snprintf(text, sizeof(text), "SYS 0x%03X", nnn);
+            break;
+        case 0x1: snprintf(text, sizeof(text), "JP 0x%03X", nnn); break;
+        case 0x2: snprintf(text, sizeof(text), "CALL 0x%03X", nnn); break;
+        case 0x3: snprintf(text, sizeof(text), "SE V%X, 0x%02X", x, nn); break;
+        case 0x4: snprintf(text, sizeof(text), "SNE V%X, 0x%02X", x, nn); break;
+        case 0x5:
+            if (xo && n == 0x2) {
+                snprintf(text, sizeof(text), "SAVE V%X - V%X", x, y);
+            } else if (xo && n == 0x3) {
+                snprintf(text, sizeof(text), "LOAD V%X - V%X", x, y);
+            } else {
+                snprintf(text, sizeof(text), "SE V%X, V%X", x, y);
+            }
+            break;
+        case 0x6: snprintf(text, sizeof(text), "LD V%X, 0x%02X", x, nn); break;
+        case 0x7: snprintf(text, sizeof(text), "ADD V%X, 0x%02X", x, nn); break;
+        case 0x8: {
+            static const char *const alu[16] = {
+                "LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN",
+                nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, "SHL", nullptr
+            };
+            if (alu[n] == nullptr) {
+                snprintf(text, sizeof(text), "DW 0x%04X", opcode);
+            } else {
+                snprintf(text, sizeof(text), "%s V%X, V%X", alu[n], x, y);
+            }
+            break;
+        }
+        case 0x9: snprintf(text, sizeof(text), "SNE V%X, V%X", x, y); break;
+        case 0xA: snprintf(text, sizeof(text), "LD I, 0x%03X", nnn); break;
+        case 0xB:
+            if (get_quirks(variant).jump_adds_vx) {
+                snprintf(text, sizeof(text), "JP V%X, 0x%03X", x, nnn);
+            } else {
+                snprintf(text, sizeof(text), "JP V0, 0x%03X", nnn);
+            }
+            break;
+        case 0xC: snprintf(text, sizeof(text), "RND V%X, 0x%02X", x, nn); break;
+        case 0xD: snprintf(text, sizeof(text), "DRW V%X, V%X, %d", x, y, n); break;
+        case 0xE:
+            if (nn == 0x9E) {
+                snprintf(text, sizeof(text), "SKP V%X", x);
+            } else if (nn == 0xA1) {
+                snprintf(text, sizeof(text), "SKNP V%X", x);
+            } else {
+                snprintf(text, sizeof(text), "DW 0x%04X", opcode);
+            }
+            break;
+        default:
+            switch (nn) {
+                case 0x07: snprintf(text, sizeof(text), "LD V%X, DT", x); break;
+                case 0x0A: snprintf(text, sizeof(text), "LD V%X, K", x); break;
+                case 0x15: snprintf(text, sizeof(text), "LD DT, V%X", x); break;
+                case 0x18: snprintf(text, sizeof(text), "LD ST, V%X", x); break;
+                case 0x1E: snprintf(text, sizeof(text), "ADD I, V%X", x); break;
+                case 0x29: snprintf(text, sizeof(text), "LD F, V%X", x); break;
+                case 0x33: snprintf(text, sizeof(text), "LD B, V%X", x); break;
+                case 0x55: snprintf(text, sizeof(text), "LD [I], V%X", x); break;
+                case 0x65: snprintf(text, sizeof(text), "LD V%X, [I]", x); break;
+                default:
+                    if (extended && nn == 0x30) {
+                        snprintf(text, sizeof(text), "LD HF, V%X", x);
+                    } else if (extended && nn == 0x75) {
+                        snprintf(text, sizeof(text), "LD R, V%X", x);
+                    } else if (extended && nn == 0x85) {
+                        snprintf(text, sizeof(text), "LD V%X, R", x);
+                    } else if (xo && opcode == 0xF000) {
+                        return "LD I, LONG";
+                    } else if (xo && nn == 0x01) {
+                        snprintf(text, sizeof(text), "PLANE %d", x);
+                    } else if (xo && opcode == 0xF002) {
+                        return "AUDIO";
+                    } else if (xo && nn == 0x3A) {
+                        snprintf(text, sizeof(text), "PITCH V%X", x);
+                    } else {
+                        snprintf(text, sizeof(text), "DW 0x%04X", opcode);
+                    }
+                    break;
+            }
+            break;
+    }
+    return text;
+}
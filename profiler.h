@@ -0,0 +1,40 @@
+#ifndef CHIP8_PROFILER_H
+#define CHIP8_PROFILER_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include "chip8.h"
+
+/**
+ * Execution profile of a Chip8, filled by the profiling build of the interpreter.
+ * - op_counts: Executed instructions per handler (opcode class), indexed by Op.
+ * - pc_counts: Executed instructions per address. Code runs from the low 4 KB on every machine.
+ * - draws, pixels: DXYN executions and sprite pixels they flipped, in total and in the frame
+ *                  running now. Sprite bits clipped off the screen are not counted. A frame
+ *                  ends with every timer tick.
+ * - max_frame_draws, max_frame_pixels: The largest per-frame values seen so far.
+ * Reports are written as JSON and as a plain text listing of the hottest addresses with their
+ * disassembly, taken from the current memory of the machine and read the way its quirk profile
+ * executes it, e.g. BXNN as JP VX, XNN where the jump adds V[X].
+ */
+struct Chip8Profile {
+    uint64_t op_counts[OP_COUNT] = {};
+    uint64_t pc_counts[4096] = {};
+    uint64_t instructions = 0;
+    uint64_t frames = 0;
+    uint64_t draws = 0;
+    uint64_t pixels = 0;
+    uint64_t frame_draws = 0;
+    uint64_t frame_pixels = 0;
+    uint64_t max_frame_draws = 0;
+    uint64_t max_frame_pixels = 0;
+
+    void end_frame();
+    void write_json(std::ostream &, Chip8 &, int = 32) const;
+    void write_hotspots(std::ostream &, Chip8 &, int = 32) const;
+};
+
+std::string disassemble(uint16_t, Chip8Variant = Chip8Variant::Classic);
+
+#endif //CHIP8_PROFILER_H
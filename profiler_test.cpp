@@ -0,0 +1,148 @@
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "profiler.h"
+#include "quirks.h"
+#include "test_util.h"
+
+/**
+ * Tests of the opcode profiler against counts worked out by hand.
+ * - Counts: an embedded program with a counted loop and sprite draws runs a known number of
+ *           instructions, so every per-handler and per-address count, the draws, the flipped
+ *           pixels and the per-frame maxima are known exactly. A sprite drawn across the corner
+ *           counts only its pixels on the screen where sprites are clipped.
+ * - Reports: the hotspot listing and the JSON report name the hottest address and its disassembly.
+ * - Disassembly: opcodes read as the variant executes them, BXNN and the extension opcodes in particular.
+ *
+ * Usage: chip8_profiler_test
+ * Prints one line per failed check and a summary, exits with 1 if any check failed. Without
+ * CHIP8_PROFILER only the disassembly is checked.
+ */
+
+template <typename T>
+static void check_equal(T actual, T expected, const std::string &what) {
+    if (actual != expected) {
+        std::cerr << "FAILED: " << what << ": " << actual << " instead of " << expected << "\n";
+        failures++;
+    }
+}
+
+static std::string hex(uint64_t value) {
+    std::ostringstream text;
+    text << "0x" << std::hex << std::uppercase << value;
+    return text.str();
+}
+
+static void test_counts() {
+    const Rom program = assemble({
+        0x6003,         // 0x200: V0 = 3                                  1 time
+        0xA000,         // 0x202: I = glyph 0, 14 pixels set              1 time
+        0x6100,         // 0x204: V1 = 0                                  1 time
+        0x7101,         // 0x206: V1 += 1                                 3 times
+        0xD115,         // 0x208: draw glyph 0 at (V1, V1)                3 times
+        0x3103,         // 0x20A: skip unless V1 = 3                      3 times
+        0x1206,         // 0x20C: loop                                    2 times
+        0x120E,         // 0x20E: stay here                               every instruction after
+    });
+    Chip8 chip8;
+    chip8.load_rom(program.data(), program.size());
+    if (not chip8.set_profiling(true)) {
+        std::cout << "Built without CHIP8_PROFILER, counts skipped\n";
+        return;
+    }
+    // 14 instructions up to 0x20E, then 6 jumps in place, in a first frame.
+    chip8.run(20);
+    chip8.tick_timers();
+    // A second frame without draws.
+    chip8.run(30);
+    chip8.tick_timers();
+
+    const Chip8Profile *profile = chip8.get_profile();
+    check_equal<uint64_t>(profile->instructions, 50, "instructions");
+    check_equal<uint64_t>(profile->frames, 2, "frames");
+    const uint64_t pcs[][2] = {{0x200, 1}, {0x202, 1}, {0x204, 1}, {0x206, 3}, {0x208, 3}, {0x20A, 3},
+                               {0x20C, 2}, {0x20E, 36}, {0x210, 0}, {0x1FE, 0}};
+    for (const auto &pc : pcs) {
+        check_equal<uint64_t>(profile->pc_counts[pc[0]], pc[1], "count of " + hex(pc[0]));
+    }
+    const uint64_t ops[][2] = {{OP_LD_IMM, 2}, {OP_LD_I, 1}, {OP_ADD_IMM, 3}, {OP_DRW, 3}, {OP_SE_IMM, 3},
+                               {OP_JP, 38}, {OP_CLS, 0}, {OP_DECODE, 0}};
+    for (const auto &op : ops) {
+        check_equal<uint64_t>(profile->op_counts[op[0]], op[1], "count of handler " + std::to_string(op[0]));
+    }
+    check_equal<uint64_t>(profile->draws, 3, "draws");
+    check_equal<uint64_t>(profile->pixels, 42, "pixels");
+    check_equal<uint64_t>(profile->max_frame_draws, 3, "max draws in a frame");
+    check_equal<uint64_t>(profile->max_frame_pixels, 42, "max pixels in a frame");
+    check_equal<uint64_t>(profile->frame_draws, 0, "draws in the running frame");
+
+    std::ostringstream hotspots;
+    profile->write_hotspots(hotspots, chip8);
+    std::string listing = hotspots.str();
+    check(listing.find("JP 0x20E") != std::string::npos, "hotspots list the idle jump");
+    check(listing.find("JP 0x20E") < listing.find("ADD V1, 0x01"), "hotspots list the hottest address first");
+    std::ostringstream json;
+    profile->write_json(json, chip8);
+    check(json.str().find("\"instruction\": \"DRW V1, V1, 5\"") != std::string::npos, "JSON disassembles the draw");
+
+    // Counting starts over when profiling is turned on again.
+    chip8.set_profiling(false);
+    chip8.set_profiling(true);
+    chip8.run(5);
+    check_equal<uint64_t>(chip8.get_profile()->instructions, 5, "instructions after restarting");
+}
+
+// Only sprite bits landing on the screen count: glyph 0 drawn at (62, 30) is clipped to 3 of
+// its 14 pixels on a clipping profile, and wraps around whole on the default one.
+static void test_clipped_pixels() {
+    const Rom program = assemble({0x603E, 0x611E, 0xA000, 0xD015});
+    const Chip8Variant variants[] = {Chip8Variant::Cosmac, Chip8Variant::Classic};
+    const uint64_t expected[] = {3, 14};
+    for (int i = 0; i < 2; i++) {
+        Chip8 chip8;
+        chip8.load_rom(program.data(), program.size(), variants[i]);
+        if (not chip8.set_profiling(true)) {
+            return;
+        }
+        chip8.run(4);
+        check_equal<uint64_t>(chip8.get_profile()->pixels, expected[i],
+                              std::string("pixels of a sprite at the corner, ") + variant_name(variants[i]));
+    }
+}
+
+static void test_disassembly() {
+    check_equal<std::string>(disassemble(0x00E0), "CLS", "00E0");
+    check_equal<std::string>(disassemble(0x8AB6), "SHR VA, VB", "8XY6");
+    check_equal<std::string>(disassemble(0xF265), "LD V2, [I]", "FX65");
+    check_equal<std::string>(disassemble(0xB345), "JP V0, 0x345", "BNNN by default");
+    check_equal<std::string>(disassemble(0xB345, Chip8Variant::Cosmac), "JP V0, 0x345", "BNNN on the COSMAC VIP");
+    check_equal<std::string>(disassemble(0xB345, Chip8Variant::SuperChipQuirks), "JP V3, 0x345", "BXNN on SUPER-CHIP");
+    check_equal<std::string>(disassemble(0x00C4, Chip8Variant::SuperChip), "SCD 4", "00CN on SUPER-CHIP");
+    check_equal<std::string>(disassemble(0x00FF, Chip8Variant::SuperChip), "HIGH", "00FF on SUPER-CHIP");
+    check_equal<std::string>(disassemble(0x00FF, Chip8Variant::SuperChipQuirks), "SYS 0x0FF", "00FF on the quirk profile");
+    check_equal<std::string>(disassemble(0x5123, Chip8Variant::XoChip), "LOAD V1 - V2", "5XY3 on XO-CHIP");
+    check_equal<std::string>(disassemble(0x5123, Chip8Variant::SuperChip), "SE V1, V2", "5XY3 on SUPER-CHIP");
+    check_equal<std::string>(disassemble(0xF201, Chip8Variant::XoChip), "PLANE 2", "FN01 on XO-CHIP");
+
+    // The reports follow the quirk profile of the machine.
+    const Rom jump = assemble({0x6200, 0xB202});
+    Chip8 chip8;
+    chip8.load_rom(jump.data(), jump.size(), Chip8Variant::SuperChipQuirks);
+    if (chip8.set_profiling(true)) {
+        chip8.run(10);
+        std::ostringstream hotspots;
+        chip8.get_profile()->write_hotspots(hotspots, chip8);
+        check(hotspots.str().find("JP V2, 0x202") != std::string::npos, "SUPER-CHIP hotspots disassemble BXNN");
+    }
+}
+
+int main() {
+    test_counts();
+    test_clipped_pixels();
+    test_disassembly();
+
+    return report();
+}
@@ -0,0 +1,20 @@
+#include "quirks.h"
+
+static const char *const variant_names[] = {"chip8", "schip-quirks", "xochip-quirks", "classic", "schip", "xochip"};
+
+// Short name of a variant, as accepted by parse_variant().
+const char *variant_name(Chip8Variant variant) {
+    return variant_names[(int)variant];
+}
+
+// Parses a variant name ("classic", "chip8", "schip", "xochip", "schip-quirks" or "xochip-quirks"),
+// returns false on anything else.
+bool parse_variant(const std::string &name, Chip8Variant &variant) {
+    for (int i = 0; i < (int)(sizeof(variant_names) / sizeof(variant_names[0])); i++) {
+        if (name == variant_names[i]) {
+            variant = (Chip8Variant)i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,69 @@
+#ifndef CHIP8_QUIRKS_H
+#define CHIP8_QUIRKS_H
+
+#include <string>
+#include "chip8.h"
+
+/**
+ * Behaviors in which CHIP-8 interpreters differ on the opcodes they share, making up the quirk
+ * profiles of Chip8Variant. The extended machines have the quirks of their quirk-only profile.
+ * - logic_resets_vf: 8XY1, 8XY2 and 8XY3 clear V[F].
+ * - shift_reads_vy: 8XY6 and 8XYE shift V[Y] into V[X], instead of shifting V[X] in place.
+ * - load_store_moves_i: FX55 and FX65 leave I pointing past the last register transferred.
+ * - jump_adds_vx: BXNN jumps to XNN + V[X] instead of NNN + V[0].
+ * - sprites_wrap: DXYN wraps pixels around the screen edges instead of clipping them. The start
+ *                 coordinates wrap either way.
+ * The quirks of a profile are a compile-time constant, variant_quirks<VARIANT>. The interpreter
+ * is instantiated once per variant and the JIT bakes them into translated code, so no engine
+ * tests them while running.
+ */
+struct Chip8Quirks {
+    bool logic_resets_vf;
+    bool shift_reads_vy;
+    bool load_store_moves_i;
+    bool jump_adds_vx;
+    bool sprites_wrap;
+};
+
+template <Chip8Variant VARIANT>
+constexpr Chip8Quirks variant_quirks = {};
+
+// The original COSMAC VIP interpreter.
+template <>
+constexpr Chip8Quirks variant_quirks<Chip8Variant::Cosmac> = {true, true, true, false, false};
+
+// The quirks of SUPER-CHIP 1.1 on the HP 48.
+template <>
+constexpr Chip8Quirks variant_quirks<Chip8Variant::SuperChipQuirks> = {false, false, false, true, false};
+
+// The quirks of XO-CHIP as implemented by Octo.
+template <>
+constexpr Chip8Quirks variant_quirks<Chip8Variant::XoChipQuirks> = {false, true, true, false, true};
+
+// This emulator's own behavior from before quirk profiles existed, and the default: the COSMAC
+// VIP's VF reset and I increment, but shifts in place and sprites wrapping around the screen.
+template <>
+constexpr Chip8Quirks variant_quirks<Chip8Variant::Classic> = {true, false, true, false, true};
+
+template <>
+constexpr Chip8Quirks variant_quirks<Chip8Variant::SuperChip> = variant_quirks<Chip8Variant::SuperChipQuirks>;
+
+template <>
+constexpr Chip8Quirks variant_quirks<Chip8Variant::XoChip> = variant_quirks<Chip8Variant::XoChipQuirks>;
+
+// The quirks of a variant only known at run time, for code generators.
+inline const Chip8Quirks &get_quirks(Chip8Variant variant) {
+    switch (variant) {
+        case Chip8Variant::SuperChipQuirks: return variant_quirks<Chip8Variant::SuperChipQuirks>;
+        case Chip8Variant::XoChipQuirks: return variant_quirks<Chip8Variant::XoChipQuirks>;
+        case Chip8Variant::Classic: return variant_quirks<Chip8Variant::Classic>;
+        case Chip8Variant::SuperChip: return variant_quirks<Chip8Variant::SuperChip>;
+        case Chip8Variant::XoChip: return variant_quirks<Chip8Variant::XoChip>;
+        default: return variant_quirks<Chip8Variant::Cosmac>;
+    }
+}
+
+const char *variant_name(Chip8Variant);
+bool parse_variant(const std::string &, Chip8Variant &);
+
+#endif //CHIP8_QUIRKS_H
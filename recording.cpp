@@ -0,0 +1,195 @@
+#include <cstring>
+#include <fstream>
+#include "recording.h"
+
+Chip8Recording::Chip8Recording() : initial(new Chip8State()) {
+    memset(initial.get(), 0, sizeof(Chip8State));
+}
+
+// Starts a new recording of chip8 from its current state, dropping any previous one.
+void Chip8Recording::start(Chip8 &chip8) {
+    chip8.save_state(*initial);
+    events.clear();
+    last_cycle = chip8.get_cycle_count();
+    end_cycle = last_cycle;
+    chip8.set_recording(this);
+}
+
+// Stops recording chip8, the recording then ends at its current cycle.
+void Chip8Recording::stop(Chip8 &chip8) {
+    chip8.set_recording(nullptr);
+    end_cycle = chip8.get_cycle_count();
+}
+
+// Writes the recording to a file, see the class comment for the layout.
+bool Chip8Recording::save(const std::string &path) {
+    Header header;
+    memcpy(header.magic, "C8IR", sizeof(header.magic));
+    header.version = VERSION;
+    header.end_cycle = end_cycle;
+    header.event_bytes = events.size();
+
+    std::ofstream f(path, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!f.is_open()) {
+        return false;
+    }
+    f.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    f.write(reinterpret_cast<const char *>(initial.get()), sizeof(Chip8State));
+    f.write(reinterpret_cast<const char *>(events.data()), (std::streamsize)events.size());
+    return f.good();
+}
+
+// Reads a recording written by save(). Fails on anything but a complete recording of this version.
+bool Chip8Recording::load(const std::string &path) {
+    std::ifstream f(path, std::ios::binary | std::ios::in);
+    if (!f.is_open()) {
+        return false;
+    }
+    Header header;
+    if (!f.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        return false;
+    }
+    if (memcmp(header.magic, "C8IR", sizeof(header.magic)) != 0 || header.version != VERSION) {
+        return false;
+    }
+    // The event count comes from the file, so it must fit in what is left of it before anything
+    // is allocated for it.
+    std::streamoff start = f.tellg();
+    f.seekg(0, std::ios::end);
+    std::streamoff left = f.tellg() - start;
+    f.seekg(start);
+    if (start < 0 || left < (std::streamoff)sizeof(Chip8State) ||
+        header.event_bytes != (uint64_t)(left - (std::streamoff)sizeof(Chip8State))) {
+        return false;
+    }
+    std::unique_ptr<Chip8State> state(new Chip8State());
+    std::vector<uint8_t> bytes(header.event_bytes);
+    if (!f.read(reinterpret_cast<char *>(state.get()), sizeof(Chip8State)) ||
+        !f.read(reinterpret_cast<char *>(bytes.data()), (std::streamsize)bytes.size())) {
+        return false;
+    }
+    // A recording cannot end before it starts, nor hold an event replay() would refuse.
+    if (header.end_cycle < state->cycle_count) {
+        return false;
+    }
+    Chip8Recording loaded;
+    loaded.initial = std::move(state);
+    loaded.events = std::move(bytes);
+    loaded.end_cycle = header.end_cycle;
+    uint64_t cycle = loaded.initial->cycle_count;
+    size_t pos = 0;
+    Kind kind;
+    int key;
+    while (pos < loaded.events.size()) {
+        if (not loaded.next_event(pos, cycle, kind, key)) {
+            return false;
+        }
+    }
+    initial = std::move(loaded.initial);
+    events = std::move(loaded.events);
+    end_cycle = loaded.end_cycle;
+    return true;
+}
+
+// Restores the initial state into chip8 and runs it to the end of the recording, injecting every
+// recorded event at its cycle. on_frame, if given, is called after every timer tick.
+// Returns false if the initial state could not be restored or the events are corrupt.
+bool Chip8Recording::replay(Chip8 &chip8, const std::function<void(Chip8 &)> &on_frame) {
+    if (initial->cycle_count > end_cycle || not chip8.load_state(*initial)) {
+        return false;
+    }
+
+    // Runs chip8 up to the given cycle, run() taking an int.
+    auto run_until = [&chip8](uint64_t cycle) {
+        while (chip8.get_cycle_count() < cycle) {
+            uint64_t left = cycle - chip8.get_cycle_count();
+            chip8.run(left > (1 << 30) ? (1 << 30) : (int)left);
+        }
+    };
+
+    uint64_t cycle = initial->cycle_count;
+    size_t pos = 0;
+    Kind kind;
+    int key;
+    while (pos < events.size()) {
+        if (not next_event(pos, cycle, kind, key)) {
+            return false;
+        }
+        run_until(cycle);
+        if (kind == TICK) {
+            chip8.tick_timers();
+            if (on_frame) {
+                on_frame(chip8);
+            }
+        } else {
+            chip8.set_keypad_value(key, kind == KEY_DOWN ? 1 : 0);
+        }
+    }
+    run_until(end_cycle);
+    return true;
+}
+
+// Decodes the event at pos, advancing pos past it and cycle to the cycle of the event.
+// Returns false on a truncated varint, a cycle past end_cycle, an unknown kind or key.
+bool Chip8Recording::next_event(size_t &pos, uint64_t &cycle, Kind &kind, int &key) {
+    uint64_t value = 0;
+    int shift = 0;
+    for (;;) {
+        if (pos >= events.size() || shift > 63) {
+            return false;
+        }
+        uint8_t byte = events[pos++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    if ((value >> 2) > end_cycle - cycle) {
+        return false;
+    }
+    cycle += value >> 2;
+    kind = (Kind)(value & 3);
+    key = 0;
+    if (kind == TICK) {
+        return true;
+    }
+    if (kind != KEY_UP && kind != KEY_DOWN) {
+        return false;
+    }
+    if (pos >= events.size() || events[pos] > 0xF) {
+        return false;
+    }
+    key = events[pos++];
+    return true;
+}
+
+// Number of cycles the recording spans.
+uint64_t Chip8Recording::get_cycle_count() {
+    return end_cycle - initial->cycle_count;
+}
+
+// Size of the encoded events.
+size_t Chip8Recording::get_event_bytes() {
+    return events.size();
+}
+
+void Chip8Recording::on_key(uint64_t cycle, int key, bool pressed) {
+    add_event(cycle, pressed ? KEY_DOWN : KEY_UP);
+    events.push_back((uint8_t)key);
+}
+
+void Chip8Recording::on_tick(uint64_t cycle) {
+    add_event(cycle, TICK);
+}
+
+// Appends the varint of an event: cycles since the previous event, shifted left by two, plus its kind.
+void Chip8Recording::add_event(uint64_t cycle, Kind kind) {
+    uint64_t value = ((cycle - last_cycle) << 2) | kind;
+    last_cycle = cycle;
+    while (value >= 0x80) {
+        events.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    events.push_back((uint8_t)value);
+}
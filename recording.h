@@ -0,0 +1,62 @@
+#ifndef CHIP8_RECORDING_H
+#define CHIP8_RECORDING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+/**
+ * Input recording of a Chip8 session, replayable headless at full speed with identical results.
+ * - initial: State of the machine when recording started, including memory (so the ROM) and the
+ *            CXNN generator. Replaying starts by restoring it, no ROM file is needed.
+ * - events: Keypad changes and timer ticks in the order they happened, each one stored as the
+ *           number of cycles since the previous event plus its kind in a varint, key changes
+ *           followed by the key. A tick at 10 instructions per frame takes a single byte.
+ * - end_cycle: Cycle count of the machine when recording stopped, replays run up to it.
+ * File layout: "C8IR", VERSION, end_cycle and the event byte count (all little-endian as in
+ * memory), the initial Chip8State, then the event bytes.
+ */
+class Chip8Recording {
+public:
+    static const uint32_t VERSION = 3;
+
+    Chip8Recording();
+    void start(Chip8 &);
+    void stop(Chip8 &);
+    bool save(const std::string &);
+    bool load(const std::string &);
+    bool replay(Chip8 &, const std::function<void(Chip8 &)> & = nullptr);
+    uint64_t get_cycle_count();
+    size_t get_event_bytes();
+private:
+    friend class Chip8;
+
+    enum Kind : uint8_t {
+        TICK = 0,
+        KEY_UP = 1,
+        KEY_DOWN = 2
+    };
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint64_t end_cycle;
+        uint64_t event_bytes;
+    };
+
+    std::unique_ptr<Chip8State> initial;
+    std::vector<uint8_t> events;
+    uint64_t last_cycle = 0;
+    uint64_t end_cycle = 0;
+
+    void on_key(uint64_t, int, bool);
+    void on_tick(uint64_t);
+    void add_event(uint64_t, Kind);
+    bool next_event(size_t &, uint64_t &, Kind &, int &);
+};
+
+#endif //CHIP8_RECORDING_H
@@ -0,0 +1,199 @@
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "recording.h"
+#include "test_util.h"
+
+/**
+ * Tests of input recordings.
+ * - Round trip: a session with key changes between and within frames is recorded, saved, loaded
+ *               back and replayed into a fresh machine, which must end in exactly the state the
+ *               recorded machine stopped in, having seen the same frames.
+ * - Rejection: files with a bad magic or version, truncated events, a byte count larger than
+ *              the file, trailing bytes, an end before the start, events past the end, unknown
+ *              event kinds or keys do not load, and leave the loaded recording alone.
+ *
+ * Usage: chip8_recording_test <scratch directory> [rom]...
+ * Without a ROM an embedded program is recorded. Prints one line per failed check and a summary,
+ * exits with 1 if any check failed.
+ */
+
+// FNV-1a over the display, one value per frame.
+static uint64_t display_hash(Chip8 &chip8) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 64 * 32; i++) {
+        hash = (hash ^ (uint64_t)chip8.get_display_value(i)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void test_round_trip(const std::string &name, const Rom &rom, const std::string &path) {
+    Chip8 recorded;
+    recorded.load_rom(rom.data(), rom.size());
+    recorded.seed_random(11);
+    // Some frames run before recording starts, so the initial state is not the loaded one.
+    for (int frame = 0; frame < 30; frame++) {
+        recorded.run_frame(10);
+    }
+
+    Chip8Recording recording;
+    recording.start(recorded);
+    std::vector<uint64_t> frames;
+    std::mt19937 random(5);
+    for (int frame = 0; frame < 600; frame++) {
+        if (random() % 8 == 0) {
+            recorded.set_keypad_value(random() % 16, random() % 2);
+        }
+        // Key changes also land within frames, at odd cycles.
+        int split = random() % 11;
+        recorded.run(split);
+        if (random() % 4 == 0) {
+            recorded.set_keypad_value(random() % 16, random() % 2);
+        }
+        recorded.run(10 - split);
+        recorded.tick_timers();
+        frames.push_back(display_hash(recorded));
+    }
+    recorded.run(7);
+    recording.stop(recorded);
+    check(recording.get_cycle_count() == 600 * 10 + 7, name + ": recording spans every cycle run");
+
+    check(recording.save(path), name + ": recording is saved");
+    Chip8Recording loaded;
+    check(loaded.load(path), name + ": recording is loaded");
+    check(loaded.get_cycle_count() == recording.get_cycle_count() &&
+          loaded.get_event_bytes() == recording.get_event_bytes(), name + ": loaded recording has the same size");
+
+    Chip8 replayed;
+    size_t frame = 0;
+    bool frames_match = true;
+    check(loaded.replay(replayed, [&](Chip8 &chip8) {
+        frames_match = frames_match && frame < frames.size() && frames[frame] == display_hash(chip8);
+        frame++;
+    }), name + ": replay succeeds");
+    check(frames_match && frame == frames.size(), name + ": replay shows the recorded frames");
+    check(same_state(recorded, replayed), name + ": replay ends in the recorded state");
+
+    // Replaying again restores the initial state first, so it ends alike.
+    replayed.run(100);
+    check(loaded.replay(replayed) && same_state(recorded, replayed), name + ": second replay ends alike");
+}
+
+static void test_rejection(const std::string &path, const std::string &bad_path) {
+    std::vector<uint8_t> file;
+    check(chip8_read_file(path, file) && file.size() > 24, "recording file is readable");
+    if (file.size() <= 24) {
+        return;
+    }
+    Chip8Recording good;
+    check(good.load(path), "unchanged file loads");
+    uint64_t cycles = good.get_cycle_count();
+    size_t event_bytes = good.get_event_bytes();
+
+    auto rejected = [&](const std::vector<uint8_t> &bytes, const std::string &what) {
+        write_file(bad_path, bytes.data(), bytes.size());
+        Chip8Recording recording;
+        check(not recording.load(bad_path), what + " is rejected");
+        check(not good.load(bad_path) && good.get_cycle_count() == cycles && good.get_event_bytes() == event_bytes,
+              what + " leaves the loaded recording alone");
+    };
+
+    std::vector<uint8_t> bytes = file;
+    bytes[0] = 'X';
+    rejected(bytes, "bad magic");
+
+    bytes = file;
+    bytes[4]++;
+    rejected(bytes, "other version");
+
+    bytes = file;
+    bytes.pop_back();
+    rejected(bytes, "truncated events");
+
+    bytes = file;
+    bytes.push_back(0);
+    rejected(bytes, "trailing byte");
+
+    // The byte count at offset 16, far larger than any file, must fail before it is allocated.
+    bytes = file;
+    uint64_t huge = 1ULL << 62;
+    memcpy(&bytes[16], &huge, sizeof(huge));
+    rejected(bytes, "huge event count");
+
+    rejected(std::vector<uint8_t>(file.begin(), file.begin() + 24), "header only");
+
+    // Files with the header and initial state kept and other events in place of the recorded ones.
+    const size_t events_at = 24 + sizeof(Chip8State);
+    uint64_t end_cycle;
+    memcpy(&end_cycle, &file[8], sizeof(end_cycle));
+    Chip8State initial;
+    memcpy(&initial, &file[24], sizeof(initial));
+    auto with_events = [&](const std::vector<uint8_t> &events) {
+        std::vector<uint8_t> changed(file.begin(), file.begin() + events_at);
+        changed.insert(changed.end(), events.begin(), events.end());
+        uint64_t count = events.size();
+        memcpy(&changed[16], &count, sizeof(count));
+        return changed;
+    };
+    // A varint of the given cycles and kind, as Chip8Recording writes them.
+    auto event = [](uint64_t cycles, uint8_t kind) {
+        std::vector<uint8_t> bytes;
+        for (uint64_t value = (cycles << 2) | kind; ; value >>= 7) {
+            bytes.push_back((uint8_t)(value < 0x80 ? value : (value & 0x7F) | 0x80));
+            if (value < 0x80) {
+                return bytes;
+            }
+        }
+    };
+    uint64_t span = end_cycle - initial.cycle_count;
+    bytes = with_events(event(span, 0));
+    write_file(bad_path, bytes.data(), bytes.size());
+    check(Chip8Recording().load(bad_path), "tick at the last cycle loads");
+    rejected(with_events(event(span + 1, 0)), "tick past the end");
+    rejected(with_events(event(1ULL << 60, 0)), "huge cycle delta");
+    std::vector<uint8_t> keys = event(1, 2);
+    keys.push_back(3);
+    std::vector<uint8_t> unknown = event(1, 3);
+    unknown.push_back(3);
+    rejected(with_events(unknown), "unknown event kind");
+    keys.back() = 16;
+    rejected(with_events(keys), "key past F");
+
+    bytes = file;
+    initial.cycle_count = end_cycle + 1;
+    memcpy(&bytes[24], &initial, sizeof(initial));
+    rejected(bytes, "end before the start");
+
+    Chip8Recording recording;
+    check(not recording.load(bad_path + ".missing"), "missing file is rejected");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: chip8_recording_test <scratch directory> [rom]...\n";
+        return 1;
+    }
+    std::string path = std::string(argv[1]) + "/recording_test.c8ir";
+    std::string bad_path = std::string(argv[1]) + "/recording_test_bad.c8ir";
+
+    // Waits for a key, draws its glyph and waits out the delay timer set to it, then starts over
+    // while the key is still held, or waits for the next one.
+    test_round_trip("embedded", assemble({0x00E0, 0xF00A, 0xF029, 0x6100, 0xD115, 0xF015, 0x7201,
+                                          0xF107, 0x3100, 0x120E, 0xE09E, 0x1202, 0x1200}), path);
+    for (int i = 2; i < argc; i++) {
+        Rom rom;
+        if (not chip8_read_file(argv[i], rom)) {
+            std::cerr << "ROM could not be loaded: " << argv[i] << "\n";
+            return 1;
+        }
+        test_round_trip(argv[i], rom, path);
+    }
+    test_rejection(path, bad_path);
+
+    return report();
+}
@@ -0,0 +1,207 @@
+#include <cstring>
+#include "rewind.h"
+
+// Encoded entries are a sequence of runs, each one made of
+// - skip: uint16, number of bytes equal in both states,
+// - length: uint16, number of bytes which differ, followed by their XOR.
+// The runs cover the whole state, the last one may have a length of 0. A run covers at most
+// MAX_RUN bytes of either kind, so long stretches of equal bytes, like the unused high memory
+// of most machines, take several runs of nothing but skip.
+static const size_t STATE_SIZE = sizeof(Chip8State);
+static const size_t MAX_RUN = 0xFFFF;
+
+static uint64_t load64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static void store16(uint8_t *p, uint16_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+static uint16_t load16(const uint8_t *p) {
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Keeps at most the given number of bytes of encoded entries and the given number of frames.
+Chip8Rewind::Chip8Rewind(size_t bytes, int frames)
+    : data(bytes), entries(frames > 0 ? frames : 1), current(new Chip8State()), next(new Chip8State()),
+      zero(new Chip8State()), scratch(2 * STATE_SIZE + 16) {
+    memset(zero.get(), 0, STATE_SIZE);
+}
+
+// Records the state of chip8, to be called once per frame.
+void Chip8Rewind::push(Chip8 &chip8) {
+    chip8.save_state(*next);
+    if (has_current) {
+        // current becomes an entry, as a delta against the new state or as a keyframe.
+        bool keyframe = pushed % KEYFRAME_INTERVAL == 0;
+        const uint8_t *base = reinterpret_cast<const uint8_t *>(keyframe ? zero.get() : next.get());
+        size_t size = encode(reinterpret_cast<const uint8_t *>(current.get()), base, scratch.data());
+        append(scratch.data(), size, keyframe);
+        pushed++;
+    }
+    std::swap(current, next);
+    has_current = true;
+}
+
+// Restores the state from the given number of pushes ago, as far back as the history goes, and
+// forgets everything newer. Returns the number of frames actually stepped back.
+int Chip8Rewind::rewind(Chip8 &chip8, int frames) {
+    if (frames > count) {
+        frames = count;
+    }
+    if (frames <= 0) {
+        return 0;
+    }
+    int target = count - frames;
+
+    // Start from the keyframe closest to the target, or from current if there is none in between.
+    int start = count;
+    for (int i = target; i < count; i++) {
+        if (entry(i).keyframe) {
+            start = i;
+            break;
+        }
+    }
+    uint8_t *state = reinterpret_cast<uint8_t *>(current.get());
+    if (start < count) {
+        memset(state, 0, STATE_SIZE);
+        apply(data.data() + entry(start).offset, state);
+    }
+    for (int i = start - 1; i >= target; i--) {
+        apply(data.data() + entry(i).offset, state);
+    }
+
+    // The target entry is now current, its space and everything after it is free again.
+    write = entry(target).offset;
+    count = target;
+    pushed -= frames;
+    chip8.load_state(*current);
+    return frames;
+}
+
+// Forgets the whole history, e.g. after loading another ROM.
+void Chip8Rewind::clear() {
+    write = 0;
+    first = 0;
+    count = 0;
+    pushed = 0;
+    has_current = false;
+}
+
+// Number of frames rewind() can step back.
+int Chip8Rewind::get_frame_count() {
+    return count;
+}
+
+// Bytes taken by encoded entries.
+size_t Chip8Rewind::get_bytes_used() {
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+        bytes += entry(i).size;
+    }
+    return bytes;
+}
+
+// Returns entry i, counting from the oldest one.
+Chip8Rewind::Entry &Chip8Rewind::entry(int i) {
+    return entries[(first + i) % entries.size()];
+}
+
+// Stores an encoded entry as the newest one, dropping the oldest entries it needs room from.
+void Chip8Rewind::append(const uint8_t *encoded, size_t size, bool keyframe) {
+    if (size > data.size()) {
+        clear();
+        return;
+    }
+
+    // Entries are contiguous, so wrap around when the rest of the ring is too short.
+    // The skipped end of the ring is freed along with the start.
+    size_t offset = write;
+    size_t freed_end = write + size;
+    if (offset + size > data.size()) {
+        offset = 0;
+        freed_end = data.size();
+    }
+    while (count > 0) {
+        Entry &oldest = entry(0);
+        bool overlaps_end = oldest.offset < freed_end && oldest.offset + oldest.size > write;
+        bool overlaps_start = offset == 0 && oldest.offset < size;
+        if (not overlaps_end && not overlaps_start && count < (int)entries.size()) {
+            break;
+        }
+        first = (first + 1) % (int)entries.size();
+        count--;
+    }
+
+    memcpy(data.data() + offset, encoded, size);
+    Entry &added = entry(count);
+    added.offset = (uint32_t)offset;
+    added.size = (uint32_t)size;
+    added.keyframe = keyframe;
+    count++;
+    write = offset + size;
+}
+
+// Encodes state as runs of bytes differing from base, returns the encoded size.
+size_t Chip8Rewind::encode(const uint8_t *state, const uint8_t *base, uint8_t *out) {
+    uint8_t *begin = out;
+    size_t pos = 0;
+    while (pos < STATE_SIZE) {
+        // Equal bytes, a word at a time while possible.
+        size_t skip_start = pos;
+        while (pos + 8 <= STATE_SIZE && pos + 8 - skip_start <= MAX_RUN && load64(state + pos) == load64(base + pos)) {
+            pos += 8;
+        }
+        while (pos < STATE_SIZE && pos - skip_start < MAX_RUN && state[pos] == base[pos]) {
+            pos++;
+        }
+        size_t skip = pos - skip_start;
+
+        // Differing bytes, including short equal gaps, which are cheaper inline than as a new run.
+        size_t literal_start = pos;
+        while (pos < STATE_SIZE && pos - literal_start < MAX_RUN) {
+            if (state[pos] != base[pos]) {
+                pos++;
+                continue;
+            }
+            size_t gap = 0;
+            while (gap < 4 && pos + gap < STATE_SIZE && state[pos + gap] == base[pos + gap]) {
+                gap++;
+            }
+            if (gap == 4 || pos + gap == STATE_SIZE || pos + gap - literal_start > MAX_RUN) {
+                break;
+            }
+            pos += gap;
+        }
+        size_t length = pos - literal_start;
+
+        store16(out, (uint16_t)skip);
+        store16(out + 2, (uint16_t)length);
+        out += 4;
+        for (size_t i = 0; i < length; i++) {
+            out[i] = state[literal_start + i] ^ base[literal_start + i];
+        }
+        out += length;
+    }
+    return (size_t)(out - begin);
+}
+
+// XORs an encoded entry into state.
+void Chip8Rewind::apply(const uint8_t *encoded, uint8_t *state) {
+    size_t pos = 0;
+    while (pos < STATE_SIZE) {
+        pos += load16(encoded);
+        size_t length = load16(encoded + 2);
+        encoded += 4;
+        for (size_t i = 0; i < length; i++) {
+            state[pos + i] ^= encoded[i];
+        }
+        pos += length;
+        encoded += length;
+    }
+}
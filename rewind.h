@@ -0,0 +1,62 @@
+#ifndef CHIP8_REWIND_H
+#define CHIP8_REWIND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "chip8.h"
+
+/**
+ * History of Chip8 states, one per frame, to step back through.
+ * - current: The most recently pushed state, kept uncompressed.
+ * - Entries: Every older state, run-length encoded. Most are XOR deltas against the next newer
+ *            state, so stepping back one frame is a single delta applied to current. Every
+ *            KEYFRAME_INTERVAL-th entry holds its full state instead, so going back many frames
+ *            at once starts from the closest keyframe rather than walking all the way from current.
+ * - data: Fixed-size ring holding the encoded entries. When it (or the entry list) is full, the
+ *         oldest entries are dropped. Any entry can be decoded from newer ones, so dropping the
+ *         oldest never breaks the rest.
+ * Encoding skips unchanged 8-byte words, so a frame which only touched a few registers and
+ * display rows costs a few dozen bytes and a few microseconds, mostly spent comparing the unchanged
+ * bitplanes and high memory of the state.
+ */
+class Chip8Rewind {
+public:
+    static const int KEYFRAME_INTERVAL = 60;
+
+    explicit Chip8Rewind(size_t = 4 << 20, int = 60 * 60 * 10);
+    void push(Chip8 &);
+    int rewind(Chip8 &, int = 1);
+    void clear();
+    int get_frame_count();
+    size_t get_bytes_used();
+private:
+    struct Entry {
+        uint32_t offset;
+        uint32_t size;
+        bool keyframe;
+    };
+
+    std::vector<uint8_t> data;
+    size_t write = 0;
+
+    // Ring of entries, oldest first.
+    std::vector<Entry> entries;
+    int first = 0;
+    int count = 0;
+    long long pushed = 0;
+
+    bool has_current = false;
+    std::unique_ptr<Chip8State> current;
+    std::unique_ptr<Chip8State> next;
+    std::unique_ptr<Chip8State> zero;
+    std::vector<uint8_t> scratch;
+
+    Entry &entry(int);
+    void append(const uint8_t *, size_t, bool);
+    static size_t encode(const uint8_t *, const uint8_t *, uint8_t *);
+    static void apply(const uint8_t *, uint8_t *);
+};
+
+#endif //CHIP8_REWIND_H
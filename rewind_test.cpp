@@ -0,0 +1,120 @@
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "rewind.h"
+#include "test_util.h"
+
+/**
+ * Tests of the rewind history against a copy of every pushed state.
+ * A ROM runs with random key presses, pushing each frame into a Chip8Rewind much smaller than
+ * the run, so the oldest entries are dropped, once for lack of entries and once for lack of
+ * bytes in the ring. Rewinding then has to restore exactly the saved states:
+ * - single frames back, each one a delta against the state after it,
+ * - a jump back across at least one keyframe,
+ * - single frames and jumps again after running on from a rewound state,
+ * - all the way back to the oldest state kept, and no further.
+ *
+ * Usage: chip8_rewind_test [rom]...
+ * Without a ROM only the embedded program runs. Prints one line per failed check and a summary,
+ * exits with 1 if any check failed.
+ */
+
+// A machine with its history and a copy of every state pushed into it, newest last.
+struct Session {
+    Chip8 chip8;
+    Chip8Rewind history;
+    std::vector<std::unique_ptr<Chip8State>> states;
+    std::mt19937 random{3};
+
+    Session(const Rom &rom, size_t bytes, int frames) : history(bytes, frames) {
+        chip8.load_rom(rom.data(), rom.size());
+        chip8.seed_random(9);
+        push();
+    }
+
+    void push() {
+        history.push(chip8);
+        states.emplace_back(new Chip8State());
+        chip8.save_state(*states.back());
+    }
+
+    void advance(int frames) {
+        for (int frame = 0; frame < frames; frame++) {
+            if (random() % 6 == 0) {
+                chip8.set_keypad_value(random() % 16, random() % 2);
+            }
+            chip8.run_frame(10);
+            push();
+        }
+    }
+
+    // Rewinds and checks that the machine is back in the state saved that many pushes ago.
+    void rewind(int frames, const std::string &what) {
+        int expected = frames < history.get_frame_count() ? frames : history.get_frame_count();
+        int stepped = history.rewind(chip8, frames);
+        check(stepped == expected, what + ": steps back " + std::to_string(expected) + " frames");
+        states.resize(states.size() - stepped);
+        std::unique_ptr<Chip8State> state(new Chip8State());
+        chip8.save_state(*state);
+        check(memcmp(state.get(), states.back().get(), sizeof(Chip8State)) == 0, what + ": restores the saved state");
+    }
+};
+
+static void test_history(const std::string &name, const Rom &rom, size_t bytes, int frames) {
+    const int keyframes = Chip8Rewind::KEYFRAME_INTERVAL;
+    Session session(rom, bytes, frames);
+    session.advance(1000);
+    int kept = session.history.get_frame_count();
+    check(kept < 1000, name + ": oldest frames are dropped");
+    check(kept >= 3 * keyframes, name + ": at least three keyframe intervals are kept");
+    check(session.history.get_bytes_used() <= bytes, name + ": ring stays within its bytes");
+    if (kept < 3 * keyframes) {
+        return;
+    }
+
+    for (int i = 0; i < 5; i++) {
+        session.rewind(1, name + ": single frame");
+    }
+    session.rewind(keyframes + 7, name + ": jump across a keyframe");
+    session.rewind(1, name + ": single frame after a jump");
+
+    session.advance(keyframes * 2 + 11);
+    session.rewind(1, name + ": single frame after running on");
+    session.rewind(keyframes + 3, name + ": jump after running on");
+
+    check(session.history.rewind(session.chip8, 0) == 0, name + ": rewinding no frames does nothing");
+    session.rewind(1 << 30, name + ": all the way back");
+    check(session.history.get_frame_count() == 0, name + ": nothing is left to rewind");
+    session.rewind(1, name + ": past the oldest frame");
+
+    // The history keeps working after it was emptied.
+    session.advance(keyframes + 1);
+    session.rewind(keyframes, name + ": after emptying");
+}
+
+int main(int argc, char *argv[]) {
+    // Draws a random glyph at a random place every frame and clears the screen every 64th,
+    // so deltas vary in size and keyframes are much larger than them.
+    const Rom embedded = assemble({0xC0FF, 0xC1FF, 0xC20F, 0xF229, 0xD015, 0x7301, 0x3340, 0x1214,
+                                   0x00E0, 0x6300, 0x6401, 0xF415, 0xF407, 0x3400, 0x1218, 0x1200});
+    std::vector<std::pair<std::string, Rom>> roms = {{"embedded", embedded}};
+    for (int i = 1; i < argc; i++) {
+        Rom rom;
+        if (not chip8_read_file(argv[i], rom)) {
+            std::cerr << "ROM could not be loaded: " << argv[i] << "\n";
+            return 1;
+        }
+        roms.emplace_back(argv[i], rom);
+    }
+    for (const auto &rom : roms) {
+        test_history(rom.first + " (entry limit)", rom.second, 4 << 20, 300);
+        test_history(rom.first + " (byte limit)", rom.second, 24 << 10, 1 << 20);
+    }
+
+    return report();
+}
@@ -0,0 +1,322 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include "file_util.h"
+#include "romcache.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8_ROMCACHE_POSIX 1
+#include <unistd.h>
+#else
+#define CHIP8_ROMCACHE_POSIX 0
+#endif
+
+// Largest ROM a machine takes, from 0x200 to the end of memory.
+static const size_t MAX_ROM_SIZE = sizeof(Chip8RomAnalysis::rom);
+
+// 64-bit content hash of a ROM, eight bytes at a time in the FNV-1a style with a fold of the
+// high bits after every word. Words are read in host byte order, like the rest of the cache file.
+uint64_t chip8_rom_hash(const uint8_t *data, size_t size) {
+    const uint64_t prime = 0x100000001B3ULL;
+    uint64_t hash = 0xCBF29CE484222325ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    if (i < size) {
+        uint64_t tail = 0;
+        memcpy(&tail, data + i, size - i);
+        hash = (hash ^ tail) * prime;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Opcodes only defined by SUPER-CHIP: scroll down and right/left, exit, lo-res and hi-res,
+// 16x16 sprites, big font and the RPL flags.
+static bool is_superchip_opcode(int opcode) {
+    return (opcode & 0xFFF0) == 0x00C0 || (opcode >= 0x00FB && opcode <= 0x00FF) ||
+           (opcode & 0xF00F) == 0xD000 || (opcode & 0xF0FF) == 0xF030 ||
+           (opcode & 0xF0FF) == 0xF075 || (opcode & 0xF0FF) == 0xF085;
+}
+
+// Opcodes only defined by XO-CHIP: scroll up, register ranges, long I, planes, audio and pitch.
+static bool is_xochip_opcode(int opcode) {
+    return (opcode & 0xFFF0) == 0x00D0 || (opcode & 0xF00E) == 0x5002 || opcode == 0xF000 ||
+           (opcode & 0xF0FF) == 0xF001 || opcode == 0xF002 || (opcode & 0xF0FF) == 0xF03A;
+}
+
+// Bit of Chip8RomAnalysis::quirk_opcodes for the quirk an op depends on, 0 if none.
+static uint8_t quirk_bit(uint8_t op) {
+    switch (op) {
+        case OP_OR: case OP_AND: case OP_XOR: return 1 << 0;
+        case OP_SHR: case OP_SHL: return 1 << 1;
+        case OP_LD_MEM: case OP_LD_REGS: return 1 << 2;
+        case OP_JP_V0: return 1 << 3;
+        case OP_DRW: return 1 << 4;
+        default: return 0;
+    }
+}
+
+// Analyzes a ROM from scratch, see Chip8RomAnalysis. Fails if it does not fit in memory.
+bool Chip8RomCache::analyze(const uint8_t *rom, size_t size, Chip8RomAnalysis &analysis) {
+    // A fresh machine with the ROM loaded decodes exactly as any machine loading it does.
+    std::unique_ptr<Chip8> chip8(new Chip8());
+    if (size > MAX_ROM_SIZE || not chip8->load_rom(rom, size)) {
+        return false;
+    }
+
+    memset(&analysis, 0, sizeof(analysis));
+    memcpy(analysis.magic, "C8RA", sizeof(analysis.magic));
+    analysis.version = Chip8RomAnalysis::VERSION;
+    analysis.op_count = OP_COUNT;
+    analysis.hash = chip8_rom_hash(rom, size);
+    analysis.size = (uint16_t)size;
+    if (size > 0) {
+        memcpy(analysis.rom, rom, size);
+    }
+
+    // Every address is queued at most once, when it is first found reachable.
+    uint16_t pending[4096];
+    int count = 0;
+    auto visit = [&](int addr, bool block_start) {
+        addr &= 0xFFF;
+        uint64_t bit = 1ULL << (addr % 64);
+        if (block_start) {
+            analysis.block_starts[addr / 64] |= bit;
+        }
+        if (not (analysis.reachable[addr / 64] & bit)) {
+            analysis.reachable[addr / 64] |= bit;
+            pending[count++] = (uint16_t)addr;
+        }
+    };
+
+    bool superchip = false;
+    bool xochip = false;
+    visit(0x200, true);
+    while (count > 0) {
+        uint16_t addr = pending[--count];
+        int opcode = (chip8->memory[addr] << 8) | chip8->memory[(addr + 1) & 0xFFF];
+        Instruction in = chip8->decode(addr);
+        analysis.quirk_opcodes |= quirk_bit(in.op);
+
+        // Entries decoded from bytes outside the ROM, an idle loop body included, depend on what
+        // the machine had in memory before, so those are left to decode at run time.
+        bool in_rom = addr >= 0x200 && addr + 2u <= 0x200 + size;
+        if (in_rom and not (in.op == OP_JP && in.idle_loop && in.nnn < 0x200)) {
+            analysis.decoded[addr] = in;
+        }
+
+        // Extension opcodes do not run here, but their variant would carry on past them.
+        bool extension = true;
+        if (is_xochip_opcode(opcode)) {
+            xochip = true;
+        } else if (is_superchip_opcode(opcode)) {
+            superchip = true;
+        } else {
+            extension = false;
+        }
+        if (in.op == OP_INVALID) {
+            if (extension && opcode != 0x00FD) {
+                visit(addr + (opcode == 0xF000 ? 4 : 2), false);
+            }
+            continue;
+        }
+
+        switch (in.op) {
+            case OP_JP:
+                visit(in.nnn, true);
+                break;
+            case OP_CALL:
+                visit(in.nnn, true);
+                visit(addr + 2, true);
+                break;
+            case OP_RET:
+            case OP_JP_V0:
+                break;
+            case OP_SE_IMM: case OP_SNE_IMM: case OP_SE_REG: case OP_SNE_REG:
+            case OP_SKP: case OP_SKNP:
+                visit(addr + 2, true);
+                visit(addr + 4, true);
+                break;
+            default:
+                visit(addr + 2, false);
+                break;
+        }
+    }
+
+    analysis.extensions = (uint8_t)((superchip ? 1 : 0) | (xochip ? 2 : 0));
+    return true;
+}
+
+// Whether a mapped file holds a valid analysis of exactly this ROM. Decoded entries are checked
+// to stay within the handlers and operand ranges, as the interpreter runs them unchecked.
+static bool is_valid(const Chip8RomAnalysis &analysis, uint64_t hash, const uint8_t *rom, size_t size) {
+    if (memcmp(analysis.magic, "C8RA", sizeof(analysis.magic)) != 0 ||
+        analysis.version != Chip8RomAnalysis::VERSION || analysis.op_count != OP_COUNT ||
+        analysis.hash != hash || analysis.size != size ||
+        analysis.extensions > 3 || memcmp(analysis.rom, rom, size) != 0) {
+        return false;
+    }
+    for (const Instruction &in : analysis.decoded) {
+        if (in.op >= OP_COUNT || in.op == OP_WRAP || in.x > 0xF || in.y > 0xF || in.n > 0xF ||
+            in.nnn > 0xFFF || reinterpret_cast<const uint8_t &>(in.idle_loop) > 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Creates a cache on the given directory, creating it if needed. An empty path keeps
+// analyses in memory only.
+Chip8RomCache::Chip8RomCache(const std::string &directory) : directory(directory) {
+    if (not directory.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+    }
+}
+
+Chip8RomCache::~Chip8RomCache() {
+    for (auto &entry : entries) {
+        if (entry.second.mapped != nullptr) {
+            chip8_unmap_file(entry.second.mapped, sizeof(Chip8RomAnalysis));
+        }
+    }
+}
+
+// Returns the analysis of a ROM in memory, from the cache or computed and added to it.
+// Returns nullptr if the ROM does not fit in memory.
+const Chip8RomAnalysis *Chip8RomCache::lookup(const uint8_t *rom, size_t size) {
+    if (size > MAX_ROM_SIZE) {
+        return nullptr;
+    }
+    return lookup(rom, size, chip8_rom_hash(rom, size));
+}
+
+// Returns the analysis of a ROM file, which is mapped rather than read. Returns nullptr if it
+// cannot be opened or does not fit in memory.
+const Chip8RomAnalysis *Chip8RomCache::lookup(const std::string &path) {
+    size_t size;
+    const uint8_t *rom = chip8_map_file(path, MAX_ROM_SIZE, size);
+    if (rom == nullptr) {
+        return nullptr;
+    }
+    const Chip8RomAnalysis *analysis = lookup(rom, size, chip8_rom_hash(rom, size));
+    chip8_unmap_file(rom, size);
+    return analysis;
+}
+
+const Chip8RomAnalysis *Chip8RomCache::lookup(const uint8_t *rom, size_t size, uint64_t hash) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto range = entries.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        const Chip8RomAnalysis &analysis = *it->second.analysis;
+        if (analysis.size == size && memcmp(analysis.rom, rom, size) == 0) {
+            hits++;
+            return &analysis;
+        }
+    }
+
+    // The file of a hash is only looked at the first time, later ROMs sharing it stay in memory.
+    bool known = range.first != range.second;
+    if (not known and not directory.empty()) {
+        size_t file_size;
+        const uint8_t *mapped = chip8_map_file(file_for(hash), sizeof(Chip8RomAnalysis), file_size);
+        if (mapped != nullptr && file_size == sizeof(Chip8RomAnalysis) &&
+            is_valid(*reinterpret_cast<const Chip8RomAnalysis *>(mapped), hash, rom, size)) {
+            hits++;
+            const Chip8RomAnalysis *analysis = reinterpret_cast<const Chip8RomAnalysis *>(mapped);
+            entries.emplace(hash, Entry{analysis, mapped, nullptr});
+            return analysis;
+        }
+        if (mapped != nullptr) {
+            chip8_unmap_file(mapped, file_size);
+        }
+    }
+
+    misses++;
+    std::unique_ptr<Chip8RomAnalysis> owned(new Chip8RomAnalysis());
+    analyze(rom, size, *owned);
+    if (not known and not directory.empty()) {
+        write_file(*owned);
+    }
+    const Chip8RomAnalysis *analysis = owned.get();
+    entries.emplace(hash, Entry{analysis, nullptr, std::move(owned)});
+    return analysis;
+}
+
+// Loads a ROM file through the cache, to be run as the machine its opcodes were written for: XO-CHIP
+// or SUPER-CHIP when it uses their extensions, the default quirk profile otherwise.
+bool Chip8RomCache::load_rom(Chip8 &chip8, const std::string &path) {
+    const Chip8RomAnalysis *analysis = lookup(path);
+    if (analysis == nullptr) {
+        return chip8.load_rom(path, Chip8Variant::Classic);
+    }
+    Chip8Variant variant = Chip8Variant::Classic;
+    if (analysis->extensions & 2) {
+        variant = Chip8Variant::XoChip;
+    } else if (analysis->extensions & 1) {
+        variant = Chip8Variant::SuperChip;
+    }
+    return chip8.load_rom(*analysis, variant);
+}
+
+// Loads a ROM file through the cache, to be run with the given quirk profile. Files the cache cannot
+// take, such as oversized ones, go through Chip8::load_rom() for its fault.
+bool Chip8RomCache::load_rom(Chip8 &chip8, const std::string &path, Chip8Variant variant) {
+    const Chip8RomAnalysis *analysis = lookup(path);
+    if (analysis == nullptr) {
+        return chip8.load_rom(path, variant);
+    }
+    return chip8.load_rom(*analysis, variant);
+}
+
+// Lookups answered from memory or from a file.
+uint64_t Chip8RomCache::get_hits() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hits;
+}
+
+// Lookups which had to analyze the ROM.
+uint64_t Chip8RomCache::get_misses() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return misses;
+}
+
+std::string Chip8RomCache::file_for(uint64_t hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.c8ra", (unsigned long long)hash);
+    return (std::filesystem::path(directory) / name).string();
+}
+
+// Writes an analysis to its file in a single write, under a temporary name renamed into place.
+bool Chip8RomCache::write_file(const Chip8RomAnalysis &analysis) {
+    std::string path = file_for(analysis.hash);
+#if CHIP8_ROMCACHE_POSIX
+    std::string temporary = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string((uintptr_t)this);
+#else
+    std::string temporary = path + ".tmp";
+#endif
+    {
+        std::ofstream f(temporary, std::ios::binary | std::ios::out | std::ios::trunc);
+        if (!f.is_open()) {
+            return false;
+        }
+        f.write(reinterpret_cast<const char *>(&analysis), sizeof(Chip8RomAnalysis));
+        if (!f.good()) {
+            f.close();
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef CHIP8_ROMCACHE_H
+#define CHIP8_ROMCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "chip8.h"
+
+/**
+ * What is known about a ROM before running it, in a fixed binary layout which is also the file
+ * format of Chip8RomCache. Computed once per distinct ROM content by Chip8RomCache::analyze().
+ * - magic, version: "C8RA" and VERSION, checked on lookup. VERSION changes whenever the layout or
+ *                   the analysis does. op_count is OP_COUNT, so a build with other handler
+ *                   numbers never picks up decoded entries it would misread.
+ * - hash, size: Content hash of the ROM (see chip8_rom_hash()) and its length in bytes.
+ * - extensions: Instruction set extensions the reachable code uses, bit 0 for opcodes only
+ *               SUPER-CHIP defines and bit 1 for those only XO-CHIP defines. Such a ROM faults on
+ *               the 64x32 variants once it reaches one, Chip8RomCache::load_rom() without a variant
+ *               runs it as the XO-CHIP machine if bit 1 is set and as the SUPER-CHIP one otherwise.
+ * - quirk_opcodes: Bit n set when reachable code has an opcode the nth quirk of Chip8Quirks
+ *                  changes, in declaration order. Zero means every quirk profile runs the ROM alike.
+ * - reachable: One bit per address, set on every instruction a walk from 0x200 along jumps,
+ *              calls, skips and fallthrough reaches. BNNN and returns end a path.
+ * - block_starts: One bit per address, set where a basic block begins: 0x200, every jump or call
+ *                 target, and both instructions a skip or call can continue at.
+ * - decoded: The Chip8 decode cache as it fills up when the reachable code runs, but only for
+ *            instructions lying entirely inside the ROM, zero (not decoded) everywhere else. It
+ *            holds the opcodes of the 64x32 variants, the extended machines decode on their own.
+ * - rom: The ROM itself, compared on lookup so two ROMs sharing a hash never mix up.
+ * Fields are naturally aligned without any padding, in host byte order. A cache file is mapped
+ * and used in place, and loading a machine from it is two memcpys.
+ */
+struct Chip8RomAnalysis {
+    static const uint32_t VERSION = 2;
+
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;
+    uint16_t size;
+    uint8_t extensions;
+    uint8_t quirk_opcodes;
+    uint8_t op_count;
+    uint8_t reserved[3];
+    uint64_t reachable[64];
+    uint64_t block_starts[64];
+    Instruction decoded[4096];
+    uint8_t rom[4096 - 0x200];
+};
+
+static_assert(sizeof(Chip8RomAnalysis) == 37400, "Chip8RomAnalysis must not contain padding");
+
+uint64_t chip8_rom_hash(const uint8_t *, size_t);
+
+/**
+ * Content-addressed cache of ROM analyses, in memory and in a directory on disk, for launching
+ * many sessions of the same few ROMs.
+ * - Files: One per ROM content, <directory>/<hash as 16 hex digits>.c8ra holding a
+ *          Chip8RomAnalysis. A miss writes it under a temporary name and renames it into place,
+ *          so processes sharing the directory never see a partial file.
+ * - Lookups: A ROM is identified by hashing its bytes, files are mapped rather than read.
+ *            Analyses found or computed stay mapped until the cache is destroyed, so every further
+ *            lookup of the same ROM is a hash and a compare. Returned analyses never change.
+ * - Threads: Lookups lock, so one cache can serve several launcher threads.
+ * Files which fail to validate, from older builds or damaged, are analyzed again and replaced.
+ * Without a directory (an empty string) analyses are only kept in memory.
+ */
+class Chip8RomCache {
+public:
+    explicit Chip8RomCache(const std::string &);
+    ~Chip8RomCache();
+    const Chip8RomAnalysis *lookup(const uint8_t *, size_t);
+    const Chip8RomAnalysis *lookup(const std::string &);
+    bool load_rom(Chip8 &, const std::string &);
+    bool load_rom(Chip8 &, const std::string &, Chip8Variant);
+    uint64_t get_hits();
+    uint64_t get_misses();
+    static bool analyze(const uint8_t *, size_t, Chip8RomAnalysis &);
+private:
+    // An analysis mapped from its file, or computed into owned.
+    struct Entry {
+        const Chip8RomAnalysis *analysis;
+        const void *mapped;
+        std::unique_ptr<Chip8RomAnalysis> owned;
+    };
+
+    std::string directory;
+    std::mutex mutex;
+    std::unordered_multimap<uint64_t, Entry> entries;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    std::string file_for(uint64_t);
+    const Chip8RomAnalysis *lookup(const uint8_t *, size_t, uint64_t);
+    bool write_file(const Chip8RomAnalysis &);
+};
+
+#endif //CHIP8_ROMCACHE_H
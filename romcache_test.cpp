@@ -0,0 +1,253 @@
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "quirks.h"
+#include "romcache.h"
+#include "test_util.h"
+
+/**
+ * Tests of the ROM analysis cache.
+ * - Analysis: embedded programs whose reachable code, blocks, extensions and quirk opcodes are known.
+ * - Cache: a first lookup analyzes and writes the file, later ones are answered from memory, a
+ *          new cache on the same directory answers from the file, a damaged file is replaced.
+ *          ROMs using SUPER-CHIP or XO-CHIP opcodes load as that machine.
+ * - Loading: machines loaded from an analysis run exactly like machines loading the ROM itself,
+ *            with every variant and engine, also when reused after running another ROM.
+ *
+ * Usage: chip8_romcache_test <cache directory> [rom]...
+ * The directory is emptied of cache files first. Prints one line per failed check and a
+ * summary, exits with 1 if any check failed.
+ */
+
+static bool is_set(const uint64_t *bits, int addr) {
+    return (bits[addr / 64] >> (addr % 64)) & 1;
+}
+
+static void test_analysis() {
+    Chip8RomAnalysis analysis;
+    const Rom program = assemble({
+        0x6005,         // 0x200: V0 = 5
+        0x2208,         // 0x202: call 0x208
+        0x3000,         // 0x204: skip if V0 = 0
+        0x1204,         // 0x206: loop
+        0x8016,         // 0x208: V0 >>= 1
+        0x00EE,         // 0x20A: return
+        0xA000,         // 0x20C: never reached
+    });
+    check(Chip8RomCache::analyze(program.data(), program.size(), analysis), "analyze a small program");
+    check(memcmp(analysis.magic, "C8RA", 4) == 0 && analysis.version == Chip8RomAnalysis::VERSION,
+          "analysis header");
+    check(analysis.hash == chip8_rom_hash(program.data(), program.size()) && analysis.size == program.size(),
+          "analysis hash and size");
+    for (int addr = 0x200; addr <= 0x20A; addr += 2) {
+        check(is_set(analysis.reachable, addr), "0x" + std::to_string(addr) + " is reachable");
+        check(analysis.decoded[addr].op != OP_DECODE, "0x" + std::to_string(addr) + " is decoded");
+    }
+    check(not is_set(analysis.reachable, 0x20C) && analysis.decoded[0x20C].op == OP_DECODE,
+          "code after a return is not reachable");
+    check(is_set(analysis.reachable, 0x208) and not is_set(analysis.reachable, 0x209),
+          "only instruction addresses are reachable");
+    const int starts[] = {0x200, 0x204, 0x206, 0x208};
+    for (int addr : starts) {
+        check(is_set(analysis.block_starts, addr), "block starts at 0x" + std::to_string(addr));
+    }
+    check(not is_set(analysis.block_starts, 0x202) && not is_set(analysis.block_starts, 0x20A),
+          "no block starts within a block");
+    check(analysis.extensions == 0, "plain program uses no extensions");
+    check(analysis.quirk_opcodes == 1 << 1, "only the shift quirk matters");
+
+    // An idle loop decodes with its flag, as it would at run time.
+    const Rom idle = assemble({0xF007, 0x3000, 0x1200, 0x00E0});
+    check(Chip8RomCache::analyze(idle.data(), idle.size(), analysis), "analyze an idle loop");
+    check(analysis.decoded[0x204].op == OP_JP && analysis.decoded[0x204].idle_loop, "idle loop flag");
+
+    // An opcode straddling the end of the ROM is reachable, but depends on the byte after it.
+    const Rom odd = {0x60, 0x01, 0x70};
+    check(Chip8RomCache::analyze(odd.data(), odd.size(), analysis), "analyze an odd sized ROM");
+    check(is_set(analysis.reachable, 0x202) && analysis.decoded[0x202].op == OP_DECODE,
+          "opcode past the end of the ROM is left to decode at run time");
+
+    const Rom superchip = assemble({0x00FF, 0x6000, 0xD015, 0x1202});
+    check(Chip8RomCache::analyze(superchip.data(), superchip.size(), analysis), "analyze SUPER-CHIP code");
+    check(analysis.extensions == 1, "00FF is a SUPER-CHIP extension");
+    check(is_set(analysis.reachable, 0x206), "the walk carries on past 00FF");
+
+    const Rom xochip = assemble({0x5012, 0x00FF, 0x1202});
+    check(Chip8RomCache::analyze(xochip.data(), xochip.size(), analysis), "analyze XO-CHIP code");
+    check(analysis.extensions == 3, "5XY2 is an XO-CHIP extension, 00FF a SUPER-CHIP one");
+
+    Rom large(4096 - 0x200 + 1, 0);
+    check(not Chip8RomCache::analyze(large.data(), large.size(), analysis), "oversized ROM is refused");
+}
+
+// Runs both machines through the same frames and key presses, returns whether their states match
+// all along.
+static bool run_alike(Chip8 &a, Chip8 &b) {
+    std::unique_ptr<Chip8State> state_a(new Chip8State());
+    std::unique_ptr<Chip8State> state_b(new Chip8State());
+    std::mt19937 random(7);
+    for (int frame = 0; frame < 300; frame++) {
+        if (frame % 20 == 0) {
+            int key = random() % 16;
+            int value = random() % 2;
+            a.set_keypad_value(key, value);
+            b.set_keypad_value(key, value);
+        }
+        a.run_frame(200);
+        b.run_frame(200);
+        a.save_state(*state_a);
+        b.save_state(*state_b);
+        if (memcmp(state_a.get(), state_b.get(), sizeof(Chip8State)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_loading(const std::string &name, const Rom &rom, Chip8RomCache &cache) {
+    const Chip8RomAnalysis *analysis = cache.lookup(rom.data(), rom.size());
+    check(analysis != nullptr, name + " is analyzed");
+    if (analysis == nullptr) {
+        return;
+    }
+    // Stores V0 and V1 right past the end of the ROM.
+    const Rom other = assemble({(uint16_t)(0xA000 | ((0x200 + rom.size()) & 0xFFF)), 0x6011, 0x6122, 0xF155, 0x1208});
+    const Chip8Variant variants[] = {Chip8Variant::Classic, Chip8Variant::Cosmac, Chip8Variant::SuperChipQuirks,
+                                     Chip8Variant::XoChipQuirks, Chip8Variant::SuperChip, Chip8Variant::XoChip};
+    const Chip8Engine engines[] = {Chip8Engine::Interpreter, Chip8Engine::Jit};
+    for (Chip8Variant variant : variants) {
+        for (Chip8Engine engine : engines) {
+            for (bool reused : {false, true}) {
+                Chip8 plain;
+                Chip8 cached;
+                if (not plain.set_engine(engine) || not cached.set_engine(engine)) {
+                    continue;
+                }
+                if (reused) {
+                    // Left over memory past the ROM must not leak into the decoded entries.
+                    plain.load_rom(other.data(), other.size());
+                    cached.load_rom(other.data(), other.size());
+                    plain.run(100);
+                    cached.run(100);
+                }
+                plain.load_rom(rom.data(), rom.size(), variant);
+                check(cached.load_rom(*analysis, variant), name + " loads from its analysis");
+                std::string run = name + " (" + variant_name(variant) + ", " +
+                                  (engine == Chip8Engine::Jit ? "jit" : "interpreter") +
+                                  (reused ? ", reused)" : ")");
+                check(run_alike(plain, cached), run + " runs alike loaded from its analysis");
+            }
+        }
+    }
+}
+
+static void test_cache(const std::string &directory, const std::string &rom_path, const Rom &rom) {
+    {
+        Chip8RomCache cache(directory);
+        const Chip8RomAnalysis *first = cache.lookup(rom_path);
+        check(first != nullptr && cache.get_misses() == 1 && cache.get_hits() == 0, "first lookup analyzes");
+        const Chip8RomAnalysis *second = cache.lookup(rom.data(), rom.size());
+        check(second == first && cache.get_hits() == 1, "second lookup is answered from memory");
+
+        Chip8 chip8;
+        check(cache.load_rom(chip8, rom_path) && chip8.get_variant() == Chip8Variant::Classic,
+              "load through the cache");
+    }
+    {
+        // ROMs using extensions load as their machine, kept in memory only to leave the directory alone.
+        Chip8RomCache cache("");
+        const Chip8Variant expected[] = {Chip8Variant::SuperChip, Chip8Variant::XoChip};
+        const Rom extended[] = {assemble({0x00FF, 0xF130, 0x1204}), assemble({0x00FF, 0xF000, 0x1234, 0x1206})};
+        std::string extended_path = directory + "/extended.ch8";
+        for (int i = 0; i < 2; i++) {
+            write_file(extended_path, extended[i].data(), extended[i].size());
+            Chip8 chip8;
+            check(cache.load_rom(chip8, extended_path) && chip8.get_variant() == expected[i],
+                  std::string("load through the cache as ") + variant_name(expected[i]));
+        }
+        std::filesystem::remove(extended_path);
+    }
+
+    std::string file;
+    for (const auto &entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() == ".c8ra") {
+            file = entry.path().string();
+        }
+    }
+    check(file.size() > 5 && file.substr(file.size() - 5) == ".c8ra", "cache file is written");
+    {
+        Chip8RomCache cache(directory);
+        check(cache.lookup(rom_path) != nullptr && cache.get_misses() == 0 && cache.get_hits() == 1,
+              "new cache is answered from the file");
+    }
+
+    // A decoded entry pointing past the handlers must never reach the interpreter.
+    {
+        std::fstream f(file, std::ios::binary | std::ios::in | std::ios::out);
+        f.seekp(offsetof(Chip8RomAnalysis, decoded) + 0x200 * sizeof(Instruction));
+        f.put((char)0xFF);
+    }
+    {
+        Chip8RomCache cache(directory);
+        const Chip8RomAnalysis *analysis = cache.lookup(rom_path);
+        check(analysis != nullptr && cache.get_misses() == 1 && analysis->decoded[0x200].op < OP_COUNT,
+              "damaged file is analyzed again");
+    }
+    {
+        Chip8RomCache cache(directory);
+        check(cache.lookup(rom_path) != nullptr && cache.get_misses() == 0, "damaged file is replaced");
+    }
+
+    std::string large_path = directory + "/large.ch8";
+    {
+        std::ofstream f(large_path, std::ios::binary | std::ios::out | std::ios::trunc);
+        f << std::string(4096 - 0x200 + 1, '\0');
+    }
+    Chip8RomCache cache(directory);
+    Chip8 chip8;
+    check(cache.lookup(large_path) == nullptr, "oversized ROM file has no analysis");
+    check(not cache.load_rom(chip8, large_path) && chip8.get_fault() == Chip8Fault::RomTooLarge,
+          "oversized ROM file faults through the cache");
+    std::filesystem::remove(large_path);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: chip8_romcache_test <cache directory> [rom]...\n";
+        return 1;
+    }
+    std::string directory = argv[1];
+    std::filesystem::create_directories(directory);
+    for (const auto &entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() == ".c8ra") {
+            std::filesystem::remove(entry.path());
+        }
+    }
+
+    test_analysis();
+
+    Chip8RomCache memory_only("");
+    test_loading("embedded", assemble({0x00E0, 0xA000, 0x6000, 0x6100, 0xD015, 0x7008, 0x3040,
+                                       0x1208, 0xE59E, 0x7201, 0xF007, 0x3000, 0x1214, 0x1200}),
+                 memory_only);
+    for (int i = 2; i < argc; i++) {
+        Rom rom;
+        if (not chip8_read_file(argv[i], rom)) {
+            std::cerr << "ROM could not be loaded: " << argv[i] << "\n";
+            return 1;
+        }
+        test_loading(argv[i], rom, memory_only);
+        if (i == 2) {
+            test_cache(directory, argv[i], rom);
+        }
+    }
+
+    return report();
+}
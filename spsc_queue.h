@@ -0,0 +1,58 @@
+#ifndef CHIP8_SPSC_QUEUE_H
+#define CHIP8_SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Lock-free bounded queue passing values of T from one producer thread to one consumer thread.
+ * - Slots: A ring of CAPACITY values, CAPACITY being a power of two so positions wrap with a mask.
+ * - head, tail: Positions of the next value to pop and to push, only ever increasing. Each one is
+ *               written by a single side, on a cache line of its own.
+ * - cached_head, cached_tail: Each side's last seen copy of the other side's position, so the
+ *                             shared line is only read again once the queue looks full or empty.
+ */
+template <typename T, size_t CAPACITY>
+class SpscQueue {
+    static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+public:
+    // Producer side. Returns false without pushing if the queue is full.
+    bool push(const T &value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position - cached_head == CAPACITY) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (position - cached_head == CAPACITY) {
+                return false;
+            }
+        }
+        slots[position & (CAPACITY - 1)] = value;
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false without touching value if the queue is empty.
+    bool pop(T &value) {
+        size_t position = head.load(std::memory_order_relaxed);
+        if (position == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (position == cached_tail) {
+                return false;
+            }
+        }
+        value = slots[position & (CAPACITY - 1)];
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+private:
+    T slots[CAPACITY];
+
+    // Consumer side
+    alignas(64) std::atomic<size_t> head{0};
+    size_t cached_tail = 0;
+
+    // Producer side
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t cached_head = 0;
+};
+
+#endif //CHIP8_SPSC_QUEUE_H
@@ -0,0 +1,193 @@
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "test_util.h"
+
+/**
+ * Tests of machine snapshots, save_state() and load_state().
+ * - Round trip: a snapshot taken mid-run restores into a fresh machine and into one which ran
+ *               another ROM, with either engine, and both run on exactly like the original. An
+ *               XO-CHIP program takes its planes, high memory, flags and audio pattern along.
+ * - Rejection: snapshots with a bad magic or version, pc past 0xFFF, sp past 16, a stack entry
+ *              past 0xFFF, or a variant, fault, hires flag or plane mask out of range are refused,
+ *              and the machine is left as it was.
+ * - Files: the same through a snapshot file, and files which are missing, short, too long or
+ *          hold a refused snapshot.
+ *
+ * Usage: chip8_state_test <scratch directory> [rom]...
+ * Without a ROM an embedded program runs. Prints one line per failed check and a summary, exits
+ * with 1 if any check failed.
+ */
+
+// Runs both machines through the same frames and key presses, returns whether their states match
+// all along.
+static bool run_alike(Chip8 &a, Chip8 &b) {
+    std::mt19937 random(13);
+    for (int frame = 0; frame < 200; frame++) {
+        if (frame % 15 == 0) {
+            int key = random() % 16;
+            int value = random() % 2;
+            a.set_keypad_value(key, value);
+            b.set_keypad_value(key, value);
+        }
+        a.run_frame(20);
+        b.run_frame(20);
+        if (not same_state(a, b)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs a ROM for a while with keys held, so the snapshot has a bit of everything in it.
+static void run_some(Chip8 &chip8, const Rom &rom, Chip8Variant variant = Chip8Variant::Classic) {
+    chip8.load_rom(rom.data(), rom.size(), variant);
+    chip8.seed_random(21);
+    chip8.set_keypad_value(5, 1);
+    for (int frame = 0; frame < 90; frame++) {
+        chip8.run_frame(20);
+    }
+}
+
+static void test_round_trip(const std::string &name, const Rom &rom, const std::string &path,
+                            Chip8Variant variant = Chip8Variant::Classic) {
+    const Rom other = assemble({0xA300, 0x60AA, 0xF065, 0x7001, 0xF055, 0x1202});
+    const Chip8Engine engines[] = {Chip8Engine::Interpreter, Chip8Engine::Jit};
+    for (Chip8Engine engine : engines) {
+        std::string run = name + (engine == Chip8Engine::Jit ? " (jit)" : " (interpreter)");
+        for (bool from_file : {false, true}) {
+            for (bool reused : {false, true}) {
+                Chip8 original;
+                Chip8 restored;
+                if (not original.set_engine(engine) || not restored.set_engine(engine)) {
+                    continue;
+                }
+                run_some(original, rom, variant);
+                if (reused) {
+                    // Decoded instructions and blocks of the other ROM must not survive the restore.
+                    restored.load_rom(other.data(), other.size());
+                    restored.run(500);
+                }
+                std::string what = run + (from_file ? " from a file" : "") + (reused ? " into a used machine" : "");
+                bool loaded;
+                if (from_file) {
+                    check(original.save_state(path), what + ": snapshot is written");
+                    loaded = restored.load_state(path);
+                } else {
+                    std::unique_ptr<Chip8State> state(new Chip8State());
+                    original.save_state(*state);
+                    loaded = restored.load_state(*state);
+                }
+                check(loaded, what + ": snapshot is restored");
+                check(same_state(original, restored), what + ": restored machine has the snapshot state");
+                check(run_alike(original, restored), what + ": restored machine runs alike");
+            }
+        }
+    }
+}
+
+static void test_rejection(const Rom &rom, const std::string &path, const std::string &bad_path) {
+    Chip8 source;
+    run_some(source, rom);
+    std::unique_ptr<Chip8State> good(new Chip8State());
+    source.save_state(*good);
+
+    // The target holds another state, which a refused snapshot must leave alone.
+    Chip8 target;
+    Chip8 reference;
+    const Rom other = assemble({0x6123, 0xA456, 0x2208, 0x1206, 0x00EE});
+    for (Chip8 *chip8 : {&target, &reference}) {
+        chip8->load_rom(other.data(), other.size());
+        chip8->run(3);
+    }
+    std::unique_ptr<Chip8State> before(new Chip8State());
+    reference.save_state(*before);
+    // Puts the target back after a snapshot it should have refused got through.
+    auto refused = [&](bool loaded) {
+        bool alone = same_state(target, reference);
+        target.load_state(*before);
+        return not loaded && alone;
+    };
+
+    const std::vector<std::pair<std::string, std::function<void(Chip8State &)>>> damages = {
+        {"bad magic", [](Chip8State &state) { state.magic[3] = 'X'; }},
+        {"other version", [](Chip8State &state) { state.version = Chip8State::VERSION + 1; }},
+        {"pc past 0xFFF", [](Chip8State &state) { state.pc = 0x1000; }},
+        {"sp past 16", [](Chip8State &state) { state.sp = 17; }},
+        {"stack entry past 0xFFF", [](Chip8State &state) { state.stack[7] = 0x1200; }},
+        {"variant out of range", [](Chip8State &state) { state.variant = (uint8_t)Chip8Variant::XoChip + 1; }},
+        {"fault out of range", [](Chip8State &state) { state.fault = (uint8_t)Chip8Fault::Exited + 1; }},
+        {"hires out of range", [](Chip8State &state) { state.hires = 2; }},
+        {"plane mask out of range", [](Chip8State &state) { state.plane_mask = 4; }},
+    };
+    for (const auto &damage : damages) {
+        std::unique_ptr<Chip8State> state(new Chip8State());
+        *state = *good;
+        damage.second(*state);
+        check(refused(target.load_state(*state)), damage.first + " is refused, leaving the machine alone");
+        write_file(bad_path, reinterpret_cast<const uint8_t *>(state.get()), sizeof(Chip8State));
+        check(refused(target.load_state(bad_path)), damage.first + " is refused from a file");
+    }
+
+    // The limits themselves are states a machine can be in.
+    std::unique_ptr<Chip8State> state(new Chip8State());
+    *state = *good;
+    state->pc = 0xFFF;
+    state->sp = 16;
+    state->stack[15] = 0xFFF;
+    state->variant = (uint8_t)Chip8Variant::XoChip;
+    state->fault = (uint8_t)Chip8Fault::Exited;
+    state->hires = 1;
+    state->plane_mask = 3;
+    Chip8 limits;
+    check(limits.load_state(*state), "snapshot at every limit is restored");
+
+    std::vector<uint8_t> file;
+    check(source.save_state(path) && chip8_read_file(path, file) && file.size() == sizeof(Chip8State),
+          "snapshot file holds exactly one state");
+    if (file.size() != sizeof(Chip8State)) {
+        return;
+    }
+    write_file(bad_path, file.data(), file.size() - 1);
+    check(refused(target.load_state(bad_path)), "short file is refused");
+    file.push_back(0);
+    write_file(bad_path, file.data(), file.size());
+    check(refused(target.load_state(bad_path)), "file too long is refused");
+    check(refused(target.load_state(bad_path + ".missing")), "missing file is refused");
+    check(not source.save_state(path + ".missing/state"), "snapshot into a missing directory fails");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: chip8_state_test <scratch directory> [rom]...\n";
+        return 1;
+    }
+    std::string path = std::string(argv[1]) + "/state_test.c8st";
+    std::string bad_path = std::string(argv[1]) + "/state_test_bad.c8st";
+
+    // Calls a subroutine drawing random glyphs, writes to memory and sets both timers.
+    const Rom embedded = assemble({0x2210, 0xF015, 0xF018, 0xA300, 0xF355, 0x7301, 0x1200, 0x0000,
+                                   0xC0FF, 0xC13F, 0xC20F, 0xF229, 0xD015, 0x00EE});
+    test_round_trip("embedded", embedded, path);
+    // Hi-res on both planes, saves random registers above 4 KB and draws and plays them.
+    const Rom xochip = assemble({0x00FF, 0xF301, 0xF000, 0x1234, 0xC0FF, 0xC13F, 0x5012, 0xF075,
+                                 0xF002, 0xF03A, 0xD013, 0x00C1, 0x1208});
+    test_round_trip("embedded XO-CHIP", xochip, path, Chip8Variant::XoChip);
+    test_rejection(embedded, path, bad_path);
+    for (int i = 2; i < argc; i++) {
+        Rom rom;
+        if (not chip8_read_file(argv[i], rom)) {
+            std::cerr << "ROM could not be loaded: " << argv[i] << "\n";
+            return 1;
+        }
+        test_round_trip(argv[i], rom, path);
+    }
+
+    return report();
+}
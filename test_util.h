@@ -0,0 +1,61 @@
+#ifndef CHIP8_TEST_UTIL_H
+#define CHIP8_TEST_UTIL_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "file_util.h"
+
+/**
+ * Helpers shared by the test programs.
+ * - failures, check(): Count and report failed checks, one line on stderr each.
+ * - report(): Prints the summary line and returns the exit status of the test.
+ * - assemble(): Turns a list of opcodes into a ROM.
+ * - write_file(): Writes a whole file in one write, chip8_read_file() (see file_util.h) reads one.
+ * - same_state(): Whether two machines have identical snapshots.
+ */
+
+typedef std::vector<uint8_t> Rom;
+
+inline int failures = 0;
+
+inline void check(bool condition, const std::string &what) {
+    if (not condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+inline int report() {
+    std::cout << failures << " failed checks\n";
+    return failures == 0 ? 0 : 1;
+}
+
+inline Rom assemble(const std::vector<uint16_t> &program) {
+    Rom rom;
+    for (uint16_t opcode : program) {
+        rom.push_back(opcode >> 8);
+        rom.push_back(opcode & 0xFF);
+    }
+    return rom;
+}
+
+inline void write_file(const std::string &path, const uint8_t *bytes, size_t size) {
+    std::ofstream f(path, std::ios::binary | std::ios::out | std::ios::trunc);
+    f.write(reinterpret_cast<const char *>(bytes), (std::streamsize)size);
+}
+
+inline bool same_state(Chip8 &a, Chip8 &b) {
+    std::unique_ptr<Chip8State> state_a(new Chip8State());
+    std::unique_ptr<Chip8State> state_b(new Chip8State());
+    a.save_state(*state_a);
+    b.save_state(*state_b);
+    return memcmp(state_a.get(), state_b.get(), sizeof(Chip8State)) == 0;
+}
+
+#endif //CHIP8_TEST_UTIL_H
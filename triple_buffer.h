@@ -0,0 +1,60 @@
+#ifndef CHIP8_TRIPLE_BUFFER_H
+#define CHIP8_TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Lock-free triple buffer handing the latest value of T from one writer thread to one reader thread.
+ * - Buffers: Three copies of T. The writer owns one (back), the reader owns one (front) and the
+ *            third one (middle) is the one handed over. Neither side ever waits for the other.
+ * - middle: Index of the middle buffer in the low bits, plus FRESH once the writer published into
+ *           it and the reader has not taken it yet. Publishing and taking swap the own buffer with
+ *           the middle one in a single atomic exchange.
+ * Values published while the reader was busy are overwritten, the reader always gets the latest one.
+ */
+template <typename T>
+class TripleBuffer {
+public:
+    // Buffer to be filled by the writer before calling publish().
+    T &back() {
+        return buffers[back_index].value;
+    }
+
+    // Makes the back buffer the latest value and takes over the previous middle buffer.
+    void publish() {
+        uint8_t previous = middle.exchange(back_index | FRESH, std::memory_order_acq_rel);
+        back_index = previous & INDEX;
+    }
+
+    // Takes the latest published value if there is one the reader has not seen yet.
+    // Returns whether front() changed.
+    bool update() {
+        if ((middle.load(std::memory_order_relaxed) & FRESH) == 0) {
+            return false;
+        }
+        uint8_t previous = middle.exchange(front_index, std::memory_order_acq_rel);
+        front_index = previous & INDEX;
+        return true;
+    }
+
+    // Latest value taken by update().
+    const T &front() {
+        return buffers[front_index].value;
+    }
+private:
+    static const uint8_t INDEX = 0x3;
+    static const uint8_t FRESH = 0x4;
+
+    // Each buffer on cache lines of its own, so the threads never share one while copying.
+    struct alignas(64) Buffer {
+        T value;
+    };
+
+    Buffer buffers[3] = {};
+    alignas(64) std::atomic<uint8_t> middle{1};
+    alignas(64) uint8_t back_index = 0;
+    alignas(64) uint8_t front_index = 2;
+};
+
+#endif //CHIP8_TRIPLE_BUFFER_H
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <cstring>
+#include "pixels.h"
+#include "upscale.h"
+
+// Scales the channels of an ARGB color by r, g and b in 256ths, keeping alpha.
+static uint32_t shade(uint32_t color, uint32_t r, uint32_t g, uint32_t b) {
+    uint32_t red = ((color >> 16) & 0xFF) * r >> 8;
+    uint32_t green = ((color >> 8) & 0xFF) * g >> 8;
+    uint32_t blue = (color & 0xFF) * b >> 8;
+    return (color & 0xFF000000) | red << 16 | green << 8 | blue;
+}
+
+// Moves bit i of the low 32 bits to bit 2i, clearing the others.
+static uint64_t spread_bits(uint64_t x) {
+    x &= 0xFFFFFFFFULL;
+    x = (x | x << 16) & 0x0000FFFF0000FFFFULL;
+    x = (x | x << 8) & 0x00FF00FF00FF00FFULL;
+    x = (x | x << 4) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | x << 2) & 0x3333333333333333ULL;
+    x = (x | x << 1) & 0x5555555555555555ULL;
+    return x;
+}
+
+// Interleaves the pixels of two rows, left from a and right from b, into a row twice as wide.
+static void interleave(uint64_t a, uint64_t b, uint64_t *out) {
+    out[0] = spread_bits(a >> 32) << 1 | spread_bits(b >> 32);
+    out[1] = spread_bits(a) << 1 | spread_bits(b);
+}
+
+// Scale factor of an output pixel, 1 to 16. Scale2x needs an even one. The display is columns
+// pixels wide, a multiple of 64, and lines rows high.
+Chip8Upscaler::Chip8Upscaler(int scale, Chip8Filter filter, uint32_t on, uint32_t off, int columns, int lines)
+    : filter(filter), words(std::max(1, std::min(columns / 64, 2))), lines(std::max(1, lines)) {
+    scale = std::max(1, std::min(scale, 16));
+    if (filter == Chip8Filter::Scale2x) {
+        scale = std::max(2, scale & ~1);
+    }
+    this->scale = scale;
+    stretch_factor = filter == Chip8Filter::Scale2x ? scale / 2 : scale;
+
+    stretch_table.assign(256 * stretch_factor, 0);
+    for (int value = 0; value < 256; value++) {
+        for (int k = 0; k < 8 * stretch_factor; k++) {
+            if ((value >> (7 - k / stretch_factor)) & 1) {
+                stretch_table[value * stretch_factor + k / 8] |= (uint8_t)(0x80 >> (k % 8));
+            }
+        }
+    }
+
+    int width = get_width();
+    on_rows.resize((size_t)scale * width);
+    off_rows.resize((size_t)scale * width);
+    repeats_colors.resize(scale);
+    bool scanlines = filter == Chip8Filter::Scanlines || filter == Chip8Filter::Crt;
+    for (int j = 0; j < scale; j++) {
+        uint32_t brightness = scanlines && scale >= 2 && j == scale - 1 ? 128 : 256;
+        for (int x = 0; x < width; x++) {
+            uint32_t r = brightness, g = brightness, b = brightness;
+            if (filter == Chip8Filter::Crt) {
+                // Each column lets its own channel through and dims the other two.
+                int phase = x % 3;
+                r = phase == 0 ? r : r * 5 / 8;
+                g = phase == 1 ? g : g * 5 / 8;
+                b = phase == 2 ? b : b * 5 / 8;
+            }
+            on_rows[(size_t)j * width + x] = shade(on, r, g, b);
+            off_rows[(size_t)j * width + x] = shade(off, r, g, b);
+        }
+        repeats_colors[j] = j > 0 &&
+                            std::equal(&on_rows[(size_t)j * width], &on_rows[(size_t)(j + 1) * width], &on_rows[(size_t)(j - 1) * width]) &&
+                            std::equal(&off_rows[(size_t)j * width], &off_rows[(size_t)(j + 1) * width], &off_rows[(size_t)(j - 1) * width]);
+    }
+    bits.resize((size_t)2 * words * scale);
+}
+
+int Chip8Upscaler::get_scale() {
+    return scale;
+}
+
+int Chip8Upscaler::get_width() {
+    return 64 * words * scale;
+}
+
+int Chip8Upscaler::get_height() {
+    return lines * scale;
+}
+
+// Rows of the display on either side of a changed row whose output changes too.
+int Chip8Upscaler::get_reach() {
+    return filter == Chip8Filter::Scale2x ? 1 : 0;
+}
+
+// Renders the whole display, pixels being the first of get_height() rows pitch bytes apart.
+void Chip8Upscaler::render(const uint64_t *rows, uint32_t *pixels, int pitch) {
+    render_rows(rows, 0, lines, pixels, pitch);
+}
+
+// Renders the output of display rows first to first + count - 1 only, pixels being the first
+// output row of display row first. rows is the whole display, Scale2x looks at the neighbours.
+void Chip8Upscaler::render_rows(const uint64_t *rows, int first, int count, uint32_t *pixels, int pitch) {
+    int width = get_width();
+    for (int y = first; y < first + count; y++) {
+        // The bits of the output rows, the top and the bottom half after Scale2x.
+        uint64_t *top = bits.data();
+        uint64_t *bottom = top;
+        if (filter == Chip8Filter::Scale2x) {
+            // EPX: with E the pixel and B, D, F, H its neighbours above, left, right and below,
+            // each quarter takes the color of the two neighbours touching it when they agree,
+            // unless the pixel sits in a straight line. Edges repeat the border pixels, neighbours
+            // within a row are shifted in across its words.
+            const uint64_t *row = &rows[y * words];
+            uint64_t doubled[2][4];
+            for (int w = 0; w < words; w++) {
+                uint64_t e = row[w];
+                uint64_t b = y > 0 ? row[w - words] : e;
+                uint64_t h = y < lines - 1 ? row[w + words] : e;
+                uint64_t d = e >> 1 | (w > 0 ? row[w - 1] << 63 : e & 0x8000000000000000ULL);
+                uint64_t f = e << 1 | (w < words - 1 ? row[w + 1] >> 63 : e & 1);
+                uint64_t corner = (b ^ h) & (d ^ f);
+                uint64_t c0 = corner & ~(d ^ b);
+                uint64_t c1 = corner & ~(b ^ f);
+                uint64_t c2 = corner & ~(d ^ h);
+                uint64_t c3 = corner & ~(h ^ f);
+                interleave((e & ~c0) | (d & c0), (e & ~c1) | (f & c1), &doubled[0][2 * w]);
+                interleave((e & ~c2) | (d & c2), (e & ~c3) | (f & c3), &doubled[1][2 * w]);
+            }
+            bottom = top + words * scale;
+            stretch(doubled[0], 2 * words, top);
+            stretch(doubled[1], 2 * words, bottom);
+        } else {
+            stretch(&rows[y * words], words, top);
+        }
+
+        uint32_t *previous = nullptr;
+        for (int j = 0; j < scale; j++) {
+            uint32_t *out = reinterpret_cast<uint32_t *>(reinterpret_cast<uint8_t *>(pixels) +
+                                                         (long)pitch * ((y - first) * scale + j));
+            bool same_bits = j != scale / 2 || top == bottom;
+            if (previous != nullptr && repeats_colors[j] && same_bits) {
+                memcpy(out, previous, (size_t)width * sizeof(uint32_t));
+            } else {
+                const uint64_t *row_bits = j < scale / 2 || top == bottom ? top : bottom;
+                blend_bits(row_bits, words * scale, &on_rows[(size_t)j * width], &off_rows[(size_t)j * width], out);
+            }
+            previous = out;
+        }
+    }
+}
+
+// Repeats every bit of words 64-bit words stretch_factor times into dst.
+void Chip8Upscaler::stretch(const uint64_t *src, int words, uint64_t *dst) {
+    uint64_t word = 0;
+    int bytes = 0;
+    for (int w = 0; w < words; w++) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            const uint8_t *entry = &stretch_table[((src[w] >> shift) & 0xFF) * stretch_factor];
+            for (int k = 0; k < stretch_factor; k++) {
+                word = word << 8 | entry[k];
+                if (++bytes == 8) {
+                    *dst++ = word;
+                    word = 0;
+                    bytes = 0;
+                }
+            }
+        }
+    }
+}
+
+// Parses a filter name ("nearest", "scale2x", "scanlines" or "crt"), returns false on anything else.
+bool parse_filter(const std::string &name, Chip8Filter &filter) {
+    static const char *const names[] = {"nearest", "scale2x", "scanlines", "crt"};
+    for (int i = 0; i < 4; i++) {
+        if (name == names[i]) {
+            filter = (Chip8Filter)i;
+            return true;
+        }
+    }
+    return false;
+}
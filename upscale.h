@@ -0,0 +1,62 @@
+#ifndef CHIP8_UPSCALE_H
+#define CHIP8_UPSCALE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Filters applied while scaling the display up, see Chip8Upscaler.
+enum class Chip8Filter {
+    Nearest,
+    Scale2x,
+    Scanlines,
+    Crt
+};
+
+/**
+ * Scales the display up by an integer factor into 32-bit pixels, on the CPU, so the renderer
+ * only copies a texture of the final size. The display is 64x32 unless given otherwise, like the
+ * 128x64 one of the extended machines, its rows being laid out as Chip8::get_display_rows().
+ * - Nearest: Every Chip8 pixel becomes a scale x scale block.
+ * - Scale2x: EPX doubling, which rounds off diagonal edges, followed by nearest scaling by
+ *            scale / 2. The scale is rounded down to an even one.
+ * - Scanlines: Nearest, with the last output row of every Chip8 row at half brightness.
+ * - Crt: Scanlines plus an aperture grille, columns cycling through red, green and blue.
+ * Everything but the final expansion works on packed bits, 64 pixels per operation: Scale2x is
+ * a handful of shifts and masks per row and stretching goes through a table per byte. Filters
+ * only decide which colors every output pixel takes for on and off, precomputed as one row of
+ * each per output row of a Chip8 row, so the expansion is a single blend_bits() per distinct
+ * output row and copies of the rows before it otherwise.
+ */
+class Chip8Upscaler {
+public:
+    Chip8Upscaler(int, Chip8Filter, uint32_t = 0xFFFFFFFF, uint32_t = 0xFF000000, int = 64, int = 32);
+    int get_scale();
+    int get_width();
+    int get_height();
+    int get_reach();
+    void render(const uint64_t *, uint32_t *, int);
+    void render_rows(const uint64_t *, int, int, uint32_t *, int);
+private:
+    Chip8Filter filter;
+    int scale;
+    // Size of the display, in 64-bit words per row and rows.
+    int words;
+    int lines;
+    // Scaling applied after Scale2x, scale otherwise.
+    int stretch_factor;
+    // The bits of every input byte repeated stretch_factor times, stretch_factor bytes per entry.
+    std::vector<uint8_t> stretch_table;
+    // Colors of the scale output rows of a Chip8 row, width pixels each.
+    std::vector<uint32_t> on_rows;
+    std::vector<uint32_t> off_rows;
+    // Whether an output row has the same colors as the one before it.
+    std::vector<bool> repeats_colors;
+    std::vector<uint64_t> bits;
+
+    void stretch(const uint64_t *, int, uint64_t *);
+};
+
+bool parse_filter(const std::string &, Chip8Filter &);
+
+#endif //CHIP8_UPSCALE_H
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "test_util.h"
+#include "upscale.h"
+
+/**
+ * Tests of Chip8Upscaler against a naive reference which works out every output pixel on its own.
+ * - Filters: nearest, Scale2x, scanlines and CRT at every scale from 1 to 16, on an empty, a full,
+ *            a checkered and random displays, with colors that show every channel. Bytes past the
+ *            width of an output row, up to the pitch, must stay untouched. The same on the 128x64
+ *            display of the extended machines, where rows span two words.
+ * - Row ranges: render_rows() over a range of display rows writes exactly the output rows a full
+ *               render() has there, and nothing else, as the dirty-row texture updates rely on.
+ *
+ * Usage: chip8_upscale_test
+ * Prints one line per failed check and a summary, exits with 1 if any check failed.
+ */
+
+static const uint32_t ON = 0xFFE0B040;
+static const uint32_t OFF = 0xFF203850;
+static const uint32_t GUARD = 0xDEADBEEF;
+// Pixels past the width of every output row.
+static const int PADDING = 5;
+
+static const char *const filter_names[] = {"nearest", "scale2x", "scanlines", "crt"};
+
+// Size of the display under test, 64x32 or 128x64.
+static int columns = 64;
+static int lines = 32;
+
+// Pixel (x, y) of the display, coordinates past the edges clamped to them.
+static int pixel(const uint64_t *rows, int x, int y) {
+    x = x < 0 ? 0 : (x > columns - 1 ? columns - 1 : x);
+    y = y < 0 ? 0 : (y > lines - 1 ? lines - 1 : y);
+    return (rows[y * (columns / 64) + x / 64] >> (63 - x % 64)) & 1;
+}
+
+// Output pixel (x, y) of the display scaled up with the given filter, computed directly.
+static uint32_t reference(const uint64_t *rows, Chip8Filter filter, int scale, int x, int y) {
+    int on;
+    if (filter == Chip8Filter::Scale2x) {
+        // AdvMAME2x on the display doubled, then each doubled pixel repeated scale / 2 times.
+        int dx = x / (scale / 2), dy = y / (scale / 2);
+        int sx = dx / 2, sy = dy / 2;
+        int e = pixel(rows, sx, sy);
+        int b = pixel(rows, sx, sy - 1), h = pixel(rows, sx, sy + 1);
+        int d = pixel(rows, sx - 1, sy), f = pixel(rows, sx + 1, sy);
+        bool left = dx % 2 == 0, top = dy % 2 == 0;
+        on = e;
+        if (top && left && d == b && b != f && d != h) {
+            on = d;
+        } else if (top && not left && b == f && b != d && f != h) {
+            on = f;
+        } else if (not top && left && d == h && d != b && h != f) {
+            on = d;
+        } else if (not top && not left && h == f && h != d && f != b) {
+            on = f;
+        }
+    } else {
+        on = pixel(rows, x / scale, y / scale);
+    }
+
+    bool scanlines = filter == Chip8Filter::Scanlines || filter == Chip8Filter::Crt;
+    int brightness = scanlines && scale >= 2 && y % scale == scale - 1 ? 128 : 256;
+    int factor[3] = {brightness, brightness, brightness};
+    if (filter == Chip8Filter::Crt) {
+        for (int channel = 0; channel < 3; channel++) {
+            if (x % 3 != channel) {
+                factor[channel] = brightness * 5 / 8;
+            }
+        }
+    }
+    uint32_t color = on ? ON : OFF;
+    uint32_t result = color & 0xFF000000;
+    for (int channel = 0; channel < 3; channel++) {
+        uint32_t value = (color >> (16 - 8 * channel)) & 0xFF;
+        result |= (value * factor[channel] >> 8) << (16 - 8 * channel);
+    }
+    return result;
+}
+
+static std::vector<std::vector<uint64_t>> displays() {
+    int words = columns / 64 * lines;
+    std::vector<std::vector<uint64_t>> all;
+    all.emplace_back(words, 0);
+    all.emplace_back(words, ~0ULL);
+    std::vector<uint64_t> checkered(words);
+    for (int i = 0; i < words; i++) {
+        checkered[i] = i / (columns / 64) % 2 == 0 ? 0xAAAAAAAAAAAAAAAAULL : 0x5555555555555555ULL;
+    }
+    all.push_back(checkered);
+    std::mt19937_64 random(3);
+    for (int i = 0; i < 2; i++) {
+        std::vector<uint64_t> rows(words);
+        for (uint64_t &row : rows) {
+            // Sparse as well as dense rows, so EPX finds both lines and corners.
+            row = i == 0 ? random() & random() : random();
+        }
+        all.push_back(rows);
+    }
+    return all;
+}
+
+static void test_filter(Chip8Filter filter, int requested_scale) {
+    Chip8Upscaler upscaler(requested_scale, filter, ON, OFF, columns, lines);
+    int scale = upscaler.get_scale();
+    int expected_scale = filter == Chip8Filter::Scale2x ? std::max(2, requested_scale & ~1) : requested_scale;
+    std::string name = std::string(filter_names[(int)filter]) + " x" + std::to_string(requested_scale) + " " +
+                       std::to_string(columns) + "x" + std::to_string(lines);
+    check(scale == expected_scale && upscaler.get_width() == columns * scale && upscaler.get_height() == lines * scale,
+          name + ": output size");
+    if (scale != expected_scale) {
+        return;
+    }
+
+    int width = upscaler.get_width();
+    int height = upscaler.get_height();
+    int stride = width + PADDING;
+    int pitch = stride * (int)sizeof(uint32_t);
+    std::vector<uint32_t> full((size_t)stride * height);
+    std::vector<uint32_t> part((size_t)stride * height);
+    std::mt19937 random(requested_scale);
+    for (const std::vector<uint64_t> &rows : displays()) {
+        std::fill(full.begin(), full.end(), GUARD);
+        upscaler.render(rows.data(), full.data(), pitch);
+        bool same = true;
+        bool padding = true;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                same = same && full[(size_t)y * stride + x] == reference(rows.data(), filter, scale, x, y);
+            }
+            for (int x = width; x < stride; x++) {
+                padding = padding && full[(size_t)y * stride + x] == GUARD;
+            }
+        }
+        check(same, name + ": render matches the reference");
+        check(padding, name + ": render stays within the width");
+
+        for (int i = 0; i < 4; i++) {
+            int first = random() % lines;
+            int count = 1 + random() % (lines - first);
+            std::fill(part.begin(), part.end(), GUARD);
+            upscaler.render_rows(rows.data(), first, count, &part[(size_t)first * scale * stride], pitch);
+            bool rows_match = true;
+            bool others_untouched = true;
+            for (int y = 0; y < height; y++) {
+                bool inside = y >= first * scale && y < (first + count) * scale;
+                for (int x = 0; x < stride; x++) {
+                    size_t at = (size_t)y * stride + x;
+                    if (inside && x < width) {
+                        rows_match = rows_match && part[at] == full[at];
+                    } else {
+                        others_untouched = others_untouched && part[at] == GUARD;
+                    }
+                }
+            }
+            std::string range = " rows " + std::to_string(first) + " to " + std::to_string(first + count - 1);
+            check(rows_match, name + ":" + range + " match a full render");
+            check(others_untouched, name + ":" + range + " leave the other rows alone");
+        }
+    }
+}
+
+int main() {
+    for (Chip8Filter filter : {Chip8Filter::Nearest, Chip8Filter::Scale2x, Chip8Filter::Scanlines, Chip8Filter::Crt}) {
+        for (int scale = 1; scale <= 16; scale++) {
+            test_filter(filter, scale);
+        }
+    }
+    columns = 128;
+    lines = 64;
+    for (Chip8Filter filter : {Chip8Filter::Nearest, Chip8Filter::Scale2x, Chip8Filter::Scanlines, Chip8Filter::Crt}) {
+        for (int scale = 1; scale <= 8; scale++) {
+            test_filter(filter, scale);
+        }
+    }
+
+    Chip8Filter filter;
+    check(parse_filter("scale2x", filter) && filter == Chip8Filter::Scale2x, "parse_filter reads scale2x");
+    check(not parse_filter("bilinear", filter), "parse_filter rejects unknown filters");
+
+    return report();
+}